@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include "admission.h"
+
+void admission_init(struct admission *adm, unsigned int max_sessions, unsigned long long max_inflight_bytes, unsigned int retry_after_ms)
+{
+    pthread_mutex_init(&adm->lock, NULL);
+    pthread_cond_init(&adm->idle, NULL);
+    adm->max_sessions = max_sessions;
+    adm->max_inflight_bytes = max_inflight_bytes;
+    adm->retry_after_ms = retry_after_ms;
+    adm->active_sessions = 0;
+    adm->inflight_bytes = 0;
+}
+
+bool admission_enter_session(struct admission *adm)
+{
+    bool admitted = false;
+
+    pthread_mutex_lock(&adm->lock);
+    if (adm->max_sessions == 0 || adm->active_sessions < adm->max_sessions) {
+        adm->active_sessions++;
+        admitted = true;
+    }
+    pthread_mutex_unlock(&adm->lock);
+
+    return admitted;
+}
+
+void admission_leave_session(struct admission *adm)
+{
+    pthread_mutex_lock(&adm->lock);
+    if (adm->active_sessions > 0) {
+        adm->active_sessions--;
+    }
+    if (adm->active_sessions == 0) {
+        pthread_cond_broadcast(&adm->idle);
+    }
+    pthread_mutex_unlock(&adm->lock);
+}
+
+void admission_wait_idle(struct admission *adm) // 処理中のセッションがすべて終了するまで待つ
+{
+    pthread_mutex_lock(&adm->lock);
+    while (adm->active_sessions > 0) {
+        pthread_cond_wait(&adm->idle, &adm->lock);
+    }
+    pthread_mutex_unlock(&adm->lock);
+}
+
+bool admission_reserve_bytes(struct admission *adm, unsigned long long bytes)
+{
+    bool reserved = false;
+
+    pthread_mutex_lock(&adm->lock);
+    // 上限が設定されていても、他に受信中のセッションがなければ1件は受け付ける（巨大なファイルが永久に拒否されないように）
+    if (adm->max_inflight_bytes == 0 || adm->inflight_bytes == 0 ||
+        adm->inflight_bytes + bytes <= adm->max_inflight_bytes) {
+        adm->inflight_bytes += bytes;
+        reserved = true;
+    }
+    pthread_mutex_unlock(&adm->lock);
+
+    return reserved;
+}
+
+void admission_release_bytes(struct admission *adm, unsigned long long bytes)
+{
+    pthread_mutex_lock(&adm->lock);
+    if (adm->inflight_bytes >= bytes) {
+        adm->inflight_bytes -= bytes;
+    } else {
+        adm->inflight_bytes = 0;
+    }
+    pthread_mutex_unlock(&adm->lock);
+}
@@ -0,0 +1,32 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define DEFAULT_RETRY_AFTER_MS 500 // busy応答で通知する再試行までの待ち時間（ミリ秒）
+
+struct admission
+{
+    pthread_mutex_t lock;
+    pthread_cond_t idle; // active_sessionsが0になったことの通知
+    unsigned int max_sessions;              // 同時セッション数の上限（0の場合は無制限）
+    unsigned long long max_inflight_bytes;  // 受信中のセッションがバッファに保持するバイト数の合計の上限（0の場合は無制限）
+    unsigned int retry_after_ms;
+    unsigned int active_sessions;
+    unsigned long long inflight_bytes;
+};
+
+void admission_init(struct admission *adm, unsigned int max_sessions, unsigned long long max_inflight_bytes, unsigned int retry_after_ms);
+
+bool admission_enter_session(struct admission *adm);
+
+void admission_leave_session(struct admission *adm);
+
+void admission_wait_idle(struct admission *adm);
+
+bool admission_reserve_bytes(struct admission *adm, unsigned long long bytes);
+
+void admission_release_bytes(struct admission *adm, unsigned long long bytes);
+
+#endif // ADMISSION_H
@@ -0,0 +1,11 @@
+#ifndef API_H
+#define API_H
+
+/*
+ * libtransfer.aから公開する関数と変数の印
+ * ライブラリは-fvisibility=hiddenでコンパイルし、1つのオブジェクトにまとめた後で印のないシンボルをローカルにする
+ * 内部の関数（sendn()やset_error()など）は組み込み先のプログラムの名前と衝突しない
+ */
+#define TRANSFER_API __attribute__((visibility("default")))
+
+#endif // API_H
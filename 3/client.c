@@ -0,0 +1,1170 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "ratelimit.h"
+#include "wfq.h"
+#include "tuning.h"
+#include "transport.h"
+#include "rudp.h"
+#include "tls.h"
+#include "crc32c.h"
+#include "merkle.h"
+#include "client.h"
+
+void client_option_init(struct client_option *opt)
+{
+    memset(opt, 0, sizeof(struct client_option));
+    opt->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    opt->reply_timeout_ms = DEFAULT_REPLY_TIMEOUT_MS;
+    opt->priority = DEFAULT_PRIORITY_CLASS;
+    opt->keepalive = false;
+    opt->bucket = NULL;
+    opt->tuning = NULL;
+    opt->optimistic = false;
+    opt->transport = NULL;
+    opt->verify = false;
+    opt->repair = false;
+}
+
+enum error_code get_file_size(const char *file_name, unsigned long long *file_size)
+{
+    struct stat stat_buf;
+
+    if (stat(file_name, &stat_buf) == 0) {
+        *file_size = stat_buf.st_size;
+        return NORMAL;
+    }
+
+    set_error(ERROR_SYSTEM, errno);
+    return ERROR_SYSTEM;
+}
+
+enum error_code close_file_descriptor(int fd)
+{
+    if (transport_close(fd) == -1) { // 転送路を割り当てたソケットは登録も外す
+        set_error(ERROR_SYSTEM, errno);
+        return ERROR_SYSTEM;
+    }
+    return NORMAL;
+}
+
+enum error_code send_file(int socket, int fd, unsigned long long file_size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    ssize_t send_bytes = 0;
+    size_t send_size = SEND_CHUNK_SIZE;
+    unsigned long long total_send_bytes = 0;
+
+    for (;;) {
+        if (opt->keepalive) { // 接続を維持する場合はf_msgで通知したサイズちょうどで送信を終える
+            if (file_size - total_send_bytes < SEND_CHUNK_SIZE) {
+                send_size = file_size - total_send_bytes;
+            }
+            if (send_size == 0) {
+                break;
+            }
+        }
+        // 転送路がsendfileに対応していればファイルの内容をユーザー空間にコピーしない
+        send_bytes = transport_sendfile(socket, fd, NULL, send_size);
+        if (send_bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (send_bytes <= 0) {
+            break;
+        }
+        if (opt->bucket != NULL) { // --rate指定時は送信帯域を制限
+            token_bucket_consume(opt->bucket, send_bytes);
+        }
+        total_send_bytes += send_bytes;
+    }
+    if (send_bytes < 0) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    if (opt->keepalive && total_send_bytes != file_size) { // 送信中にファイルが縮んだ場合、サーバーは残りを待ち続けるため中断する
+        ret = ERROR_DIFF_FILESIZE;
+        set_error(ERROR_DIFF_FILESIZE, 0);
+        goto end;
+    }
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code send_buffer(int socket, const char *buffer, size_t size, const struct client_option *opt)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    size_t offset;
+    size_t chunk;
+
+    for (offset = 0; offset < size; offset += chunk) {
+        chunk = (size - offset < BUFFER_SIZE) ? size - offset : BUFFER_SIZE;
+        if (opt->bucket != NULL) {
+            token_bucket_consume(opt->bucket, chunk);
+        }
+        if (sendn(socket, buffer + offset, chunk) == -1) {
+            ret = ERROR_SEND;
+            set_error(ERROR_SEND, errno);
+            goto end;
+        }
+    }
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code send_shutdown(int cfd)
+{   
+	enum error_code ret = ERROR_SYSTEM;
+    if (transport_shutdown(cfd, SHUT_WR)) {
+        ret = ERROR_SYSTEM;
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+int start_connect(struct addrinfo *addr, const struct socket_tuning *tuning) // ノンブロッキングでconnect()を開始する（失敗時は-1）
+{
+    int fd;
+    int flags;
+
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd == -1) {
+        return -1;
+    }
+    if (tuning_apply_before_connect(fd, tuning, false)) {
+        close(fd);
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int sort_addresses(struct addrinfo *result, struct addrinfo **candidates, int max_num)
+{
+    struct addrinfo *inet6[MAX_CONNECT_CANDIDATES];
+    struct addrinfo *inet4[MAX_CONNECT_CANDIDATES];
+    struct addrinfo *rp;
+    int inet6_num = 0;
+    int inet4_num = 0;
+    int num = 0;
+    int i;
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if (rp->ai_family == AF_INET6 && inet6_num < MAX_CONNECT_CANDIDATES) {
+            inet6[inet6_num++] = rp;
+        } else if (rp->ai_family != AF_INET6 && inet4_num < MAX_CONNECT_CANDIDATES) {
+            inet4[inet4_num++] = rp;
+        }
+    }
+
+    // IPv6を先頭にして、IPv6とIPv4を交互に並べる(RFC 8305)
+    for (i = 0; num < max_num && (i < inet6_num || i < inet4_num); i++) {
+        if (i < inet6_num) {
+            candidates[num++] = inet6[i];
+        }
+        if (i < inet4_num && num < max_num) {
+            candidates[num++] = inet4[i];
+        }
+    }
+    return num;
+}
+
+long long remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)(deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+void add_ms(struct timespec *ts, long long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+enum error_code race_connect(struct addrinfo **candidates, int num, int *cfd, const struct client_option *opt)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct pollfd pfds[MAX_CONNECT_CANDIDATES];
+    int pending = 0;     // 接続中のソケット数
+    int next = 0;        // 次に接続を開始する候補
+    int last_errno = ECONNREFUSED;
+    int winner = -1;
+    int so_error;
+    socklen_t len;
+    long long timeout;
+    struct timespec deadline;
+    struct timespec next_start;
+    int i, n;
+
+    add_ms(&deadline, opt->connect_timeout_ms);
+    add_ms(&next_start, 0);
+
+    while (winner == -1) {
+        // 前の候補の開始から一定時間経過したか、接続中のものがなければ次の候補を開始する
+        while (next < num && (pending == 0 || remaining_ms(&next_start) <= 0)) {
+            pfds[pending].fd = start_connect(candidates[next], opt->tuning);
+            next++;
+            if (pfds[pending].fd == -1) {
+                last_errno = errno;
+                continue;
+            }
+            pfds[pending].events = POLLOUT;
+            pending++;
+            add_ms(&next_start, CONNECT_ATTEMPT_DELAY_MS);
+            DEBUG_MACRO(opt->debug_mode, false, "connect attempt %d/%d started", next, num);
+        }
+        if (pending == 0) { // すべての候補が失敗
+            ret = ERROR_CONNECT;
+            set_error(ret, last_errno);
+            goto end;
+        }
+
+        timeout = remaining_ms(&deadline);
+        if (timeout <= 0) {
+            ret = ERROR_CONNECT;
+            set_error(ret, ETIMEDOUT);
+            goto end;
+        }
+        if (next < num && remaining_ms(&next_start) < timeout) {
+            timeout = remaining_ms(&next_start);
+        }
+
+        n = poll(pfds, pending, timeout < 0 ? 0 : (int)timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+
+        for (i = 0; i < pending && n > 0; i++) {
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            n--;
+            len = sizeof(so_error);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) == 0 && so_error == 0) {
+                winner = pfds[i].fd; // 最初に接続が完了したものを採用
+                pfds[i].fd = -1;
+                break;
+            }
+            last_errno = (so_error != 0) ? so_error : errno;
+            close(pfds[i].fd); // 失敗した候補を閉じ、待たずに次の候補を開始できるようにする
+            pfds[i] = pfds[--pending];
+            i--;
+            next_start.tv_sec = 0;
+            next_start.tv_nsec = 0;
+        }
+    }
+
+    // 接続後は従来通りブロッキングモードで使用する
+    if (fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK) == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        close(winner);
+        goto end;
+    }
+    *cfd = winner;
+    ret = NORMAL;
+end:
+    for (i = 0; i < pending; i++) {
+        if (pfds[i].fd != -1) {
+            close(pfds[i].fd);
+        }
+    }
+    return ret;
+}
+
+enum error_code attach_transport(int cfd, const char *peer_name, const struct client_option *opt) // 接続したソケットに転送路を割り当てる（TLSのハンドシェイクなど）
+{
+    enum error_code ret;
+    char info[TLS_INFO_MAX_LEN];
+
+    if (opt->transport != NULL && transport_attach(cfd, opt->transport, false, peer_name)) {
+        ret = (errno == EAGAIN) ? ERROR_TIMEOUT : ERROR_CONNECT;
+        set_error(ret, errno);
+        return ret;
+    }
+    if (tls_info(cfd, info, sizeof(info)) == 0) {
+        DEBUG_MACRO(opt->debug_mode, false, "tls established %s", info);
+    }
+    return NORMAL;
+}
+
+static int set_reply_timeout(int fd, unsigned int timeout_ms) // 応答待ちの上限をSO_RCVTIMEOに設定する（0の場合は無制限）
+{
+    struct timeval timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+enum error_code connect_server(int *cfd, const char *server_ip, const char *port_num, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    struct addrinfo *candidates[MAX_CONNECT_CANDIDATES];
+    int candidate_num;
+    int nodelay = 1;
+
+    *cfd = -1;
+    // getaddrinfo()の準備
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    int status = getaddrinfo(server_ip, port_num, &hints, &result);
+    if (status != 0) {
+        set_error(ERROR_SYSTEM, status);
+        goto end;
+    }
+
+    candidate_num = sort_addresses(result, candidates, MAX_CONNECT_CANDIDATES);
+    DEBUG_MACRO(opt->debug_mode, false, " Resolved %d addresses %s:%s", candidate_num, server_ip, port_num);
+
+    if ((ret = race_connect(candidates, candidate_num, cfd, opt))) { // 解決した全アドレスに時間差で接続を試み、最初に成功したものを使う
+        goto end;
+    }
+
+    DEBUG_MACRO(opt->debug_mode, false, "connected to %s:%s", server_ip, port_num);
+
+    if (set_reply_timeout(*cfd, opt->reply_timeout_ms)) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    if (opt->keepalive) { // 接続を維持する場合、直前のデータのACK待ちで次のf_msgがNagleにより遅延しないようにする
+        if (setsockopt(*cfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay)) {
+            ret = ERROR_SOCKET;
+            set_error(ret, errno);
+            goto end;
+        }
+    }
+
+    if (tuning_apply_connected(*cfd, opt->tuning, true, opt->debug_mode, false)) {
+        ret = ERROR_SOCKET;
+        goto end;
+    }
+
+    DEBUG_MACRO(opt->debug_mode, false, "socket option configured %s:%s", server_ip, port_num);
+
+    if ((ret = attach_transport(*cfd, server_ip, opt))) {
+        goto end;
+    }
+
+    ret = NORMAL;
+end:
+    if (ret && *cfd != -1) { // 呼び出し元が再試行を繰り返してもディスクリプタを溜めない
+        transport_close(*cfd);
+        *cfd = -1;
+    }
+    if (result) {
+        freeaddrinfo(result);
+    }    
+    return ret;
+
+}
+
+enum error_code connect_unix_server(int *cfd, const char *unix_path, const struct client_option *opt) // 同一ホストのサーバーにTCP/IPを経由せずに接続する
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+    struct timeval timeout;
+
+    *cfd = -1;
+    if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
+        goto end;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, unix_path);
+
+    *cfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*cfd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    // バックログが埋まっている場合のconnect()はSO_SNDTIMEOまで待つ
+    timeout.tv_sec = opt->connect_timeout_ms / 1000;
+    timeout.tv_usec = (opt->connect_timeout_ms % 1000) * 1000;
+    if (setsockopt(*cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout)) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (connect(*cfd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ret = (errno == EAGAIN) ? ERROR_TIMEOUT : ERROR_CONNECT;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "connected to %s", unix_path);
+
+    timeout.tv_sec = 0; // データ送信はタイムアウトさせない
+    timeout.tv_usec = 0;
+    if (setsockopt(*cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout)) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (set_reply_timeout(*cfd, opt->reply_timeout_ms)) { // TCPの場合と同じ応答待ちの上限
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    if ((ret = attach_transport(*cfd, NULL, opt))) { // 同一ホストのため証明書の名前は検証しない
+        goto end;
+    }
+
+    ret = NORMAL;
+end:
+    if (ret && *cfd != -1) {
+        transport_close(*cfd);
+        *cfd = -1;
+    }
+    return ret;
+}
+
+enum error_code connect_udp_server(int *cfd, const char *server_ip, const char *port_num, const struct client_option *opt) // 損失の多い長距離回線向けに、信頼性のあるUDPの転送路で接続する
+{
+	enum error_code ret = ERROR_SYSTEM;
+
+    if (rudp_connect(server_ip, port_num, opt->connect_timeout_ms, cfd)) { // 応答待ちの上限はSO_RCVTIMEOではなく転送路の無応答検出で扱う
+        ret = (errno == ETIMEDOUT) ? ERROR_TIMEOUT : ERROR_CONNECT;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "connected to %s:%s over udp", server_ip, port_num);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code begin_session(char *file_name, const char *remote_name, int cfd, unsigned long long *file_size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+
+    if ((ret = get_file_size(file_name, file_size))) { // 送信するファイルサイズの確認
+        goto end;
+    }
+
+    ret = request_session(cfd, remote_name, *file_size, opt);
+end:
+    return ret;
+}
+
+bool is_optimistic(unsigned long long file_size, const struct client_option *opt) // 小さなファイルだけ③の応答を待たずに送る
+{
+    return opt->optimistic && file_size <= OPTIMISTIC_MAX_SIZE;
+}
+
+enum error_code request_session(int cfd, const char *remote_name, unsigned long long file_size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    unsigned char flags = 0;
+
+    if (opt->keepalive) {
+        flags |= F_FLAG_KEEPALIVE;
+    }
+    if (is_optimistic(file_size, opt)) {
+        flags |= F_FLAG_OPTIMISTIC;
+    }
+
+    if ((ret = send_f_msg(cfd, file_size, remote_name, opt->priority, flags))) { // f_msgとしてファイルのname+sizeを送信①
+        goto end;
+    }
+
+    DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s, file size = %llu", remote_name, file_size);
+
+    if (flags & F_FLAG_OPTIMISTIC) { // ③の応答はデータ送信後にまとめて受け取る
+        ret = NORMAL;
+        goto end;
+    }
+    ret = receive_begin_reply(cfd, opt);
+end:
+    return ret;
+}
+
+enum error_code request_session_fd(int cfd, const char *remote_name, int fd, unsigned long long file_size, const struct client_option *opt) // データの代わりにディスクリプタを渡す
+{
+	enum error_code ret = ERROR_SYSTEM;
+
+    if ((ret = send_f_msg_fd(cfd, file_size, remote_name, opt->priority, opt->keepalive ? F_FLAG_KEEPALIVE : 0, fd))) { // f_msgにディスクリプタを添付して送信①
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s with descriptor, file size = %llu", remote_name, file_size);
+
+    ret = receive_begin_reply(cfd, opt);
+end:
+    return ret;
+}
+
+static enum error_code e_msg_error(const struct e_message *e_msg, const struct client_option *opt) // e_msgの理由をエラーコードに変換する
+{
+    enum error_code ret;
+    int s_errno = 0;
+
+    switch (e_msg->reason) {
+    case E_REASON_LOCK_EXISTS:
+        ret = ERROR_LOCK_EXISTS;
+        s_errno = EEXIST;
+        break;
+    case E_REASON_LOCK_CREATE:
+        ret = ERROR_LOCK_CREATE;
+        break;
+    case E_REASON_NO_SPACE:
+        ret = ERROR_NO_SPACE;
+        s_errno = ENOSPC;
+        break;
+    case E_REASON_BAD_FD:
+        ret = ERROR_ARGUMENT;
+        break;
+    case E_REASON_SIZE_MISMATCH:
+    case E_REASON_OFFSET:
+        ret = ERROR_DIFF_FILESIZE;
+        break;
+    case E_REASON_CHECKSUM:
+        ret = ERROR_CHECKSUM;
+        break;
+    default:
+        ret = ERROR_SYSTEM;
+        break;
+    }
+    set_error(ret, s_errno);
+    DEBUG_MACRO(opt->debug_mode, false, "received e_msg : reason %u, %.*s", e_msg->reason, (int)sizeof(e_msg->error_message), e_msg->error_message);
+    return ret;
+}
+
+static enum error_code receive_reply(int cfd, struct e_message *e_msg, const struct client_option *opt) // ③の応答を受け取る（e_msgを受け取った場合はその内容も返す）
+{
+	enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+    char msg_type = {0}; // debug用
+
+    struct a_message a_msg = {0};
+    struct b_message b_msg = {0};
+
+    tuning_quickack(cfd, opt->tuning);
+    recv_bytes = recvn(cfd, &msg_type, sizeof(char), MSG_PEEK);
+
+    if (recv_bytes < 0) {
+        if (recv_bytes == -2) {
+            send_reset_packet(cfd);
+            set_error(ERROR_TIMEOUT, errno);
+            ret = ERROR_TIMEOUT;
+        } else {
+            set_error(ERROR_RECEIVED, errno);
+            ret = ERROR_RECEIVED;
+        }
+        goto end;
+    }
+
+    switch (msg_type) { // serverからの応答メッセージのタイプを確認⑥
+    case 'A':
+        if ((ret = receive_a_msg(cfd, &a_msg))) { // a_msgをserverから受信
+            goto end;
+        }
+        DEBUG_MACRO(opt->debug_mode, false, "received a_msg");
+        break;
+    case 'E':
+        if ((ret = receive_e_msg(cfd, e_msg))) { // e_msgをserverから受信
+            goto end;
+        }
+        ret = e_msg_error(e_msg, opt); // 空き容量不足などデータを送る前に分かる理由で拒否された
+        goto end;
+    case 'B':
+        if ((ret = receive_b_msg(cfd, &b_msg))) { // b_msgをserverから受信（過負荷による拒否）
+            goto end;
+        }
+        set_error(ERROR_BUSY, (int)b_msg.retry_after_ms);
+        ret = ERROR_BUSY;
+        DEBUG_MACRO(opt->debug_mode, false, "received b_msg : SERVER BUSY, retry after %u ms", b_msg.retry_after_ms);
+        goto end;
+    default:
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code receive_begin_reply(int cfd, const struct client_option *opt) // ③の応答を受け取る
+{
+    struct e_message e_msg = {0};
+
+    return receive_reply(cfd, &e_msg, opt);
+}
+
+enum error_code append_session(int cfd, int fd, const char *remote_name, unsigned long long offset, unsigned long long size, unsigned long long *server_size, const struct client_option *opt) // fdのoffsetからsize分をサーバー側のファイルの末尾に追記する
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct e_message e_msg = {0};
+
+    *server_size = ULLONG_MAX;
+    if ((ret = send_f_msg_append(cfd, offset, size, remote_name, opt->priority, opt->keepalive ? F_FLAG_KEEPALIVE : 0))) { // 追記の位置とサイズを送信①
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s, append %llu bytes at %llu", remote_name, size, offset);
+
+    ret = receive_reply(cfd, &e_msg, opt);
+    if (ret == ERROR_DIFF_FILESIZE && e_msg.reason == E_REASON_OFFSET) { // 送り直す位置として、サーバー側のサイズを返す
+        *server_size = e_msg.available_bytes;
+    }
+    if (ret) {
+        goto end;
+    }
+
+    if (lseek(fd, (off_t)offset, SEEK_SET) == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    ret = put_session_fd(cfd, fd, size, opt); // 接続維持の場合はsize分ちょうどを送る④
+end:
+    return ret;
+}
+
+struct extent // 穴を除いた転送で送るデータ領域
+{
+    unsigned long long offset;
+    unsigned long long length;
+};
+
+bool is_sparse_file(int fd) // 割り当てられたブロックがサイズより少ない（穴がある）ファイル
+{
+    struct stat stat_buf;
+
+    return fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) && (unsigned long long)stat_buf.st_blocks * 512 < (unsigned long long)stat_buf.st_size;
+}
+
+static int list_extents(int fd, unsigned long long file_size, struct extent **extents, size_t *num, unsigned long long *data_size) // SEEK_DATA/SEEK_HOLEでデータ領域を列挙する
+{
+    struct extent *list;
+    size_t capacity = 0;
+    off_t data;
+    off_t hole = 0;
+
+    *extents = NULL;
+    *num = 0;
+    *data_size = 0;
+    while ((unsigned long long)hole < file_size) {
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) { // 以降は末尾まで穴
+                break;
+            }
+            return -1;
+        }
+        if ((unsigned long long)data >= file_size) {
+            break;
+        }
+        hole = lseek(fd, data, SEEK_HOLE); // 穴に対応しないファイルシステムではファイルの末尾が返り、全体が1つのデータ領域になる
+        if (hole == -1) {
+            return -1;
+        }
+        if ((unsigned long long)hole > file_size) { // 列挙中に伸びた分は送らない
+            hole = (off_t)file_size;
+        }
+        if (*num == capacity) {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            list = realloc(*extents, capacity * sizeof(struct extent));
+            if (list == NULL) {
+                return -1;
+            }
+            *extents = list;
+        }
+        (*extents)[*num].offset = data;
+        (*extents)[*num].length = hole - data;
+        *data_size += hole - data;
+        (*num)++;
+    }
+    return 0;
+}
+
+static enum error_code send_extents(int cfd, int fd, const char *remote_name, unsigned long long file_size, const struct extent *extents, size_t num, unsigned long long data_size, unsigned char flags, const struct client_option *opt) // 領域だけを位置と共に送る
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct client_option extent_opt = *opt;
+    size_t i;
+
+    if (opt->keepalive) {
+        flags |= F_FLAG_KEEPALIVE;
+    }
+    if ((ret = send_f_msg_sparse(cfd, file_size, data_size, remote_name, opt->priority, flags))) { // f_msgで全体のサイズと送る領域の合計を送信①
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s, file size = %llu, %zu extents with %llu bytes", remote_name, file_size, num, data_size);
+    if ((ret = receive_begin_reply(cfd, opt))) {
+        goto end;
+    }
+
+    extent_opt.keepalive = true; // 領域ごとに長さちょうどを送る
+    tuning_cork(cfd, opt->tuning, true);
+    for (i = 0; i < num; i++) { // x_msgの後に領域のデータを送る④
+        if ((ret = send_x_msg(cfd, extents[i].offset, extents[i].length))) {
+            break;
+        }
+        if (lseek(fd, (off_t)extents[i].offset, SEEK_SET) == -1) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            break;
+        }
+        if ((ret = send_file(cfd, fd, extents[i].length, &extent_opt))) {
+            break;
+        }
+    }
+    if (ret == NORMAL) {
+        ret = send_x_msg(cfd, file_size, 0); // 終端
+    }
+    tuning_cork(cfd, opt->tuning, false);
+    if (ret) {
+        goto end;
+    }
+    ret = finish_session(cfd, false, opt);
+end:
+    return ret;
+}
+
+enum error_code sparse_session(int cfd, int fd, const char *remote_name, unsigned long long file_size, const struct client_option *opt) // 穴を除いたデータ領域だけを位置と共に送る
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct extent *extents = NULL;
+    unsigned long long data_size;
+    size_t num;
+
+    if (list_extents(fd, file_size, &extents, &num, &data_size)) { // 送る前に全ての領域を決め、f_msgで通知した合計と一致させる
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    ret = send_extents(cfd, fd, remote_name, file_size, extents, num, data_size, 0, opt);
+end:
+    free(extents);
+    return ret;
+}
+
+static enum error_code receive_tree(int cfd, struct m_message *m_msg, unsigned char (**leaves)[MERKLE_HASH_LEN], const struct client_option *opt) // サーバーのハッシュ木を受け取る
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct e_message e_msg = {0};
+    struct timeval timeout = {VERIFY_REPLY_TIMEOUT_S, 0};
+    struct timeval saved;
+    socklen_t len = sizeof(saved);
+    bool restore;
+    char type = 0;
+    ssize_t recv_bytes;
+
+    *leaves = NULL;
+    // サーバーがファイル全体を読み終えるまで応答がないため、その間だけ受信の上限を延ばす（無制限の場合はそのまま）
+    restore = getsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &saved, &len) == 0 && (saved.tv_sec != 0 || saved.tv_usec != 0) &&
+              saved.tv_sec < VERIFY_REPLY_TIMEOUT_S && setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0;
+    recv_bytes = recvn(cfd, &type, sizeof(type), MSG_PEEK);
+    if (restore) {
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &saved, sizeof(saved));
+    }
+    if (recv_bytes != sizeof(type)) {
+        ret = (recv_bytes == -2) ? ERROR_TIMEOUT : ERROR_RECEIVED;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (type != 'M') { // 照合を拒否された
+        if ((ret = receive_reply(cfd, &e_msg, opt)) == NORMAL) {
+            ret = ERROR_RECEIVED;
+            set_error(ret, 0);
+        }
+        goto end;
+    }
+    if ((ret = receive_m_msg(cfd, m_msg))) {
+        goto end;
+    }
+    if (m_msg->leaf_num > MERKLE_MAX_LEAVES) {
+        ret = ERROR_RECEIVED;
+        set_error(ret, EFBIG);
+        goto end;
+    }
+    if (m_msg->leaf_num > 0) {
+        *leaves = malloc(m_msg->leaf_num * MERKLE_HASH_LEN);
+        if (*leaves == NULL) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+        recv_bytes = recvn(cfd, *leaves, m_msg->leaf_num * MERKLE_HASH_LEN, 0);
+        if (recv_bytes != (ssize_t)(m_msg->leaf_num * MERKLE_HASH_LEN)) {
+            ret = (recv_bytes == -2) ? ERROR_TIMEOUT : ERROR_RECEIVED;
+            set_error(ret, errno);
+            goto end;
+        }
+    }
+    ret = NORMAL;
+end:
+    if (ret) {
+        free(*leaves);
+        *leaves = NULL;
+    }
+    return ret;
+}
+
+static struct extent *diff_leaves(const struct merkle_tree *local, const struct m_message *m_msg, unsigned char (*leaves)[MERKLE_HASH_LEN], size_t *num, unsigned long long *data_size) // 葉が異なるチャンクを隣り合うものはまとめて範囲にする
+{
+    struct extent *extents;
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long i;
+
+    *num = 0;
+    *data_size = 0;
+    extents = malloc((local->leaf_num + 1) * sizeof(struct extent));
+    if (extents == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < local->leaf_num; i++) {
+        if (i < m_msg->leaf_num && memcmp(local->leaves[i], leaves[i], MERKLE_HASH_LEN) == 0) {
+            continue;
+        }
+        offset = i * MERKLE_CHUNK_SIZE;
+        length = (local->file_size - offset < MERKLE_CHUNK_SIZE) ? local->file_size - offset : MERKLE_CHUNK_SIZE;
+        if (*num > 0 && extents[*num - 1].offset + extents[*num - 1].length == offset) {
+            extents[*num - 1].length += length;
+        } else {
+            extents[*num].offset = offset;
+            extents[*num].length = length;
+            (*num)++;
+        }
+        *data_size += length;
+    }
+    return extents;
+}
+
+enum error_code verify_session(int cfd, int fd, const char *remote_name, unsigned long long file_size, bool repair, const struct client_option *opt) // ハッシュ木の根を照合し、repairの場合は異なるチャンクだけを送り直してもう一度照合する
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct client_option session_opt = *opt;
+    struct merkle_tree local;
+    struct m_message m_msg;
+    unsigned char (*leaves)[MERKLE_HASH_LEN] = NULL;
+    struct extent *extents = NULL;
+    unsigned long long data_size;
+    size_t num;
+    int round;
+
+    merkle_init(&local);
+    session_opt.keepalive = true; // 照合と書き換えを同じ接続で続ける
+    for (round = 0; ; round++) {
+        if ((ret = send_f_msg(cfd, file_size, remote_name, opt->priority, F_FLAG_VERIFY | F_FLAG_KEEPALIVE))) {
+            goto end;
+        }
+        DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s, verify %llu bytes", remote_name, file_size);
+        if (round == 0 && merkle_build(&local, fd, file_size, merkle_default_threads())) { // サーバーが計算している間に手元のハッシュ木を計算する
+            ret = ERROR_FILE_OPEN;
+            set_error(ret, errno);
+            goto end;
+        }
+        if ((ret = receive_tree(cfd, &m_msg, &leaves, &session_opt))) {
+            goto end;
+        }
+        if (m_msg.file_size == file_size && memcmp(m_msg.root, local.root, MERKLE_HASH_LEN) == 0) {
+            DEBUG_MACRO(opt->debug_mode, false, "verified %s: %llu bytes, %llu leaves", remote_name, file_size, local.leaf_num);
+            break;
+        }
+        if (!repair || round > 0) {
+            ret = ERROR_VERIFY;
+            set_error(ret, 0);
+            goto end;
+        }
+
+        extents = diff_leaves(&local, &m_msg, leaves, &num, &data_size);
+        if (extents == NULL) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+        DEBUG_MACRO(opt->debug_mode, false, "repair %s: %zu ranges, %llu bytes (server has %llu bytes)", remote_name, num, data_size, m_msg.file_size);
+        if ((ret = send_extents(cfd, fd, remote_name, file_size, extents, num, data_size, F_FLAG_REPAIR, &session_opt))) {
+            goto end;
+        }
+        free(extents);
+        extents = NULL;
+        free(leaves);
+        leaves = NULL;
+    }
+    ret = NORMAL;
+end:
+    free(extents);
+    free(leaves);
+    merkle_free(&local);
+    return ret;
+}
+
+enum error_code put_session(int cfd, char *file_name, unsigned long long file_size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        ret = ERROR_FILE_OPEN;
+        set_error(ERROR_FILE_OPEN, errno);
+        return ret;
+    }
+
+    ret = put_session_fd(cfd, fd, file_size, opt);
+    if (ret == NORMAL) {
+        DEBUG_MACRO(opt->debug_mode, false, "sended file :%s", file_name);
+    }
+
+    if (close_file_descriptor(fd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+    }
+    return ret;
+}
+
+enum error_code pass_session(int cfd, char *file_name, const char *remote_name, const struct client_option *opt) // UNIXドメインソケットでファイルのディスクリプタを渡し、サーバーの複製完了を待つ
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct stat stat_buf;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        ret = ERROR_FILE_OPEN;
+        set_error(ERROR_FILE_OPEN, errno);
+        return ret;
+    }
+    if (fstat(fd, &stat_buf)) {
+        ret = ERROR_SYSTEM;
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+
+    if ((ret = request_session_fd(cfd, remote_name, fd, stat_buf.st_size, opt))) {
+        goto end;
+    }
+    if ((ret = finish_session(cfd, false, opt))) { // サーバーが複製を終えると⑦の応答が届く
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "passed file :%s", file_name);
+
+    ret = NORMAL;
+end:
+    if (close_file_descriptor(fd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+    }
+    return ret;
+}
+
+enum error_code put_session_fd(int cfd, int fd, unsigned long long file_size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    bool optimistic = is_optimistic(file_size, opt);
+
+    tuning_cork(cfd, opt->tuning, true); // データ転送中は小さなセグメントに分かれないようにまとめる
+    ret = send_file(cfd, fd, file_size, opt); // ファイル転送処理 ④
+    tuning_cork(cfd, opt->tuning, false);
+    if (ret) {
+        return optimistic ? optimistic_send_error(cfd, ret, opt) : ret;
+    }
+    return finish_session(cfd, optimistic, opt);
+}
+
+enum error_code put_session_buffer(int cfd, const void *buffer, size_t size, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    bool optimistic = is_optimistic(size, opt);
+
+    tuning_cork(cfd, opt->tuning, true);
+    ret = send_buffer(cfd, buffer, size, opt); // メモリ上のデータを転送 ④
+    tuning_cork(cfd, opt->tuning, false);
+    if (ret) {
+        return optimistic ? optimistic_send_error(cfd, ret, opt) : ret;
+    }
+    return finish_session(cfd, optimistic, opt);
+}
+
+enum error_code stream_session(int cfd, int fd, const char *remote_name, unsigned long long *total, const struct client_option *opt) // サイズの分からないパイプなどを読み終えるまでd_msgで送り、t_msgで終える
+{
+	enum error_code ret = ERROR_SYSTEM;
+    unsigned char flags = F_FLAG_STREAM;
+    unsigned int crc = 0;
+    char *buffer = NULL;
+    ssize_t read_bytes;
+
+    *total = 0;
+    if (opt->keepalive) {
+        flags |= F_FLAG_KEEPALIVE;
+    }
+    buffer = malloc(STREAM_CHUNK_MAX);
+    if (buffer == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+
+    if ((ret = send_f_msg(cfd, 0, remote_name, opt->priority, flags))) { // サイズは分からないため0で通知する①
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "sended f_msg %s, streaming", remote_name);
+    if ((ret = receive_begin_reply(cfd, opt))) {
+        goto end;
+    }
+
+    for (;;) { // 読めた分ずつd_msgで送る④
+        read_bytes = read(fd, buffer, STREAM_CHUNK_MAX);
+        if (read_bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes == -1) {
+            ret = ERROR_SYSTEM;
+            set_error(ERROR_SYSTEM, errno);
+            goto end;
+        }
+        if (read_bytes == 0) {
+            break;
+        }
+        crc = crc32c_update(crc, buffer, read_bytes);
+        if (opt->bucket != NULL) {
+            token_bucket_consume(opt->bucket, read_bytes);
+        }
+        if ((ret = send_d_msg(cfd, buffer, read_bytes))) {
+            goto end;
+        }
+        *total += read_bytes;
+    }
+
+    if ((ret = send_t_msg(cfd, *total, crc))) { // 送った総量とCRC-32Cで終端を通知する
+        goto end;
+    }
+    DEBUG_MACRO(opt->debug_mode, false, "sended t_msg : %llu bytes, crc32c %08x", *total, crc);
+
+    ret = finish_session(cfd, false, opt);
+end:
+    free(buffer);
+    return ret;
+}
+
+enum error_code optimistic_send_error(int cfd, enum error_code ret, const struct client_option *opt)
+{
+    int s_errno;
+    enum error_code reply;
+
+    // サーバーが受付を拒否して切断した場合は、届いているはずの③の応答を拒否理由として返す
+    get_error(&s_errno);
+    clear_error();
+    reply = receive_begin_reply(cfd, opt);
+    if (reply != NORMAL && reply != ERROR_RECEIVED && reply != ERROR_TIMEOUT) { // e_msgまたはb_msgを受け取れた
+        return reply;
+    }
+    clear_error(); // 応答が読めない場合は送信時のエラーを返す
+    set_error(ret, s_errno);
+    return ret;
+}
+
+enum error_code finish_session(int cfd, bool optimistic, const struct client_option *opt)
+{
+	enum error_code ret = ERROR_SYSTEM;
+    struct a_message a_msg = {0};
+    struct e_message e_msg = {0};
+    ssize_t recv_bytes;
+    char msg_type = {0}; // debug用
+
+    if (!opt->keepalive) { // 接続を維持する場合はSHUT_WRを送らず、サーバーはf_msgのサイズで終端を判断する
+        if ((ret = send_shutdown(cfd))) { // SHUT_WRをserverに送信 ⑤
+            goto end;
+        }
+        DEBUG_MACRO(opt->debug_mode, false, "sended shutdown packet");
+    }
+
+    if (optimistic && (ret = receive_begin_reply(cfd, opt))) { // データ送信前に省略した③の応答
+        goto end;
+    }
+
+    tuning_quickack(cfd, opt->tuning);
+    recv_bytes = recvn(cfd, &msg_type, sizeof(char), MSG_PEEK);
+
+    if (recv_bytes < 0) {
+        if (recv_bytes == -2) {
+            send_reset_packet(cfd);
+            set_error(ERROR_TIMEOUT, errno);
+            ret = ERROR_TIMEOUT;
+        } else {
+            set_error(ERROR_RECEIVED, errno);
+            ret = ERROR_RECEIVED;
+        }
+        goto end;
+    }
+
+    switch (msg_type) { // serverからの応答メッセージのタイプを確認⑥
+    case 'A':
+        if ((ret = receive_a_msg(cfd, &a_msg))) { // a_msgをserverから受信
+            goto end;
+        }
+        DEBUG_MACRO(opt->debug_mode, false, "received a_msg");
+        break;
+    case 'E':
+        if ((ret = receive_e_msg(cfd, &e_msg))) { // e_msgをserverから受信
+            goto end;
+        }
+        ret = e_msg_error(&e_msg, opt);
+        goto end;
+    default:
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+
+    ret = NORMAL;
+
+end:
+    return ret;
+}
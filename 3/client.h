@@ -0,0 +1,81 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "error.h"
+#include "ratelimit.h"
+#include "tuning.h"
+#include "transport.h"
+
+#define MAX_CONNECT_CANDIDATES 16       // 接続を試みるアドレスの最大数
+#define CONNECT_ATTEMPT_DELAY_MS 250     // 次のアドレスへの接続を開始するまでの間隔(RFC 8305)
+#define DEFAULT_CONNECT_TIMEOUT_MS 10000 // 接続全体のタイムアウト
+#define DEFAULT_REPLY_TIMEOUT_MS 20000   // サーバーから何も届かない状態で待つ上限（サーバーの--idle-timeoutの既定と同じ）
+#define SEND_CHUNK_SIZE (64 * 1024)      // ファイル送信で一度に転送路に渡す量
+#define VERIFY_REPLY_TIMEOUT_S 600       // 照合でサーバーがハッシュ木を計算し終えるまで待つ上限（秒）
+
+struct client_option
+{
+    bool debug_mode;
+    unsigned int connect_timeout_ms;
+    unsigned int reply_timeout_ms; // 受信1回あたりの待ちの上限（0の場合は無制限、UDPでは転送路の無応答検出を使う）
+    unsigned char priority;       // f_msgで通知する優先度クラス
+    bool keepalive;               // 接続を維持して複数のファイルを送信する
+    struct token_bucket *bucket;  // 送信帯域の制限（NULLの場合は無制限）
+    const struct socket_tuning *tuning; // ソケットの調整項目（NULLの場合は設定しない）
+    bool optimistic;              // ③の応答を待たずにデータを送る（OPTIMISTIC_MAX_SIZE以下のファイルのみ）
+    const struct transport_ops *transport; // 接続後に割り当てる転送路（NULLの場合はソケットをそのまま使う）
+    bool verify;                  // 送信後にハッシュ木の根を照合し、異なるチャンクだけを送り直す
+    bool repair;                  // 全体を送らず、照合して異なるチャンクだけを送る（中断した転送のやり直し）
+};
+
+typedef enum error_code (*client_connect_fn)(int *cfd, void *arg); // 送るファイルがある時だけ接続する（ディレクトリの監視や再帰的な送信で使う）
+
+void client_option_init(struct client_option *opt);
+
+enum error_code get_file_size(const char *file_name, unsigned long long *file_size);
+
+enum error_code close_file_descriptor(int fd);
+
+enum error_code attach_transport(int cfd, const char *peer_name, const struct client_option *opt);
+
+enum error_code connect_server(int *cfd, const char *server_ip, const char *port_num, const struct client_option *opt);
+
+enum error_code connect_unix_server(int *cfd, const char *unix_path, const struct client_option *opt);
+
+enum error_code connect_udp_server(int *cfd, const char *server_ip, const char *port_num, const struct client_option *opt);
+
+enum error_code begin_session(char *file_name, const char *remote_name, int cfd, unsigned long long *file_size, const struct client_option *opt);
+
+bool is_optimistic(unsigned long long file_size, const struct client_option *opt);
+
+enum error_code request_session(int cfd, const char *remote_name, unsigned long long file_size, const struct client_option *opt);
+
+enum error_code request_session_fd(int cfd, const char *remote_name, int fd, unsigned long long file_size, const struct client_option *opt);
+
+enum error_code receive_begin_reply(int cfd, const struct client_option *opt);
+
+enum error_code append_session(int cfd, int fd, const char *remote_name, unsigned long long offset, unsigned long long size, unsigned long long *server_size, const struct client_option *opt);
+
+bool is_sparse_file(int fd);
+
+enum error_code sparse_session(int cfd, int fd, const char *remote_name, unsigned long long file_size, const struct client_option *opt);
+
+enum error_code verify_session(int cfd, int fd, const char *remote_name, unsigned long long file_size, bool repair, const struct client_option *opt);
+
+enum error_code put_session(int cfd, char *file_name, unsigned long long file_size, const struct client_option *opt);
+
+enum error_code pass_session(int cfd, char *file_name, const char *remote_name, const struct client_option *opt);
+
+enum error_code put_session_fd(int cfd, int fd, unsigned long long file_size, const struct client_option *opt);
+
+enum error_code put_session_buffer(int cfd, const void *buffer, size_t size, const struct client_option *opt);
+
+enum error_code stream_session(int cfd, int fd, const char *remote_name, unsigned long long *total, const struct client_option *opt);
+
+enum error_code optimistic_send_error(int cfd, enum error_code ret, const struct client_option *opt);
+
+enum error_code finish_session(int cfd, bool optimistic, const struct client_option *opt);
+
+#endif // CLIENT_H
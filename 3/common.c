@@ -1,24 +1,22 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "common.h"
 #include "error.h"
+#include "transport.h"
 
 enum error_code send_reset_packet(int cfd)
 {
     enum error_code ret = ERROR_SYSTEM;
-    struct linger ling;
 
-    memset(&ling, 0, sizeof(ling));
-    ling.l_onoff = 1;
-    ling.l_linger = 0;
-
-    if (setsockopt(cfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling))) {
+    if (transport_reset(cfd)) { // close()時にRSTを送る
         ret = ERROR_SYSTEM;
         set_error(ERROR_SYSTEM, errno);
         goto end;
@@ -37,7 +35,7 @@ ssize_t recvn(int fd, void *buffer, size_t n, int flag)
 
     buf = buffer;
     for (total_recv_data = 0; total_recv_data < n;) {
-        num_recv = recv(fd, buf, n - total_recv_data, flag);
+        num_recv = transport_read(fd, buf, n - total_recv_data, flag);
 
         if (num_recv == 0) {
             return total_recv_data;
@@ -65,7 +63,7 @@ ssize_t sendn(int fd, const void *buffer, size_t n)
     buf = buffer;
 
     for (total_send_data = 0; total_send_data < n;) {
-        num_send_data = send(fd, buf, n - total_send_data, MSG_NOSIGNAL);
+        num_send_data = transport_write(fd, buf, n - total_send_data);
 
         if (num_send_data <= 0) {
             if (num_send_data == -1 && errno == EINTR) { // EINTR = システムコールがシグナルによって中断された際に返されるerrno
@@ -80,6 +78,48 @@ ssize_t sendn(int fd, const void *buffer, size_t n)
     return total_send_data;
 }
 
+int parse_size(const char *str, unsigned long long *size) // "64K", "10M", "1G"のような接尾辞付きのサイズを解析する
+{
+    char *end_ptr;
+    unsigned long long value;
+    int shift = 0;
+
+    errno = 0;
+    value = strtoull(str, &end_ptr, 10);
+    if (errno != 0 || end_ptr == str || *str == '-') { // strtoull()は負の値を符号なしに変換して受け付ける
+        return -1;
+    }
+
+    switch (*end_ptr) {
+    case '\0':
+        break;
+    case 'K': case 'k':
+        shift = 10;
+        end_ptr++;
+        break;
+    case 'M': case 'm':
+        shift = 20;
+        end_ptr++;
+        break;
+    case 'G': case 'g':
+        shift = 30;
+        end_ptr++;
+        break;
+    case 'T': case 't':
+        shift = 40;
+        end_ptr++;
+        break;
+    default:
+        return -1;
+    }
+    if (*end_ptr != '\0' || value > (ULLONG_MAX >> shift)) { // 桁あふれした値を小さな上限として受け付けない
+        return -1;
+    }
+
+    *size = value << shift;
+    return 0;
+}
+
 inline void get_time(char *buffer, int buf_size)
 {
     struct timeval tv;
@@ -96,3 +136,18 @@ inline void get_time(char *buffer, int buf_size)
 
 }
 
+char *join_path(const char *dir, const char *name) // 相対パスを連結する（dirが""の場合はnameのみ）
+{
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + strlen(name) + 2);
+
+    if (path == NULL) {
+        return NULL;
+    }
+    if (dir_len == 0) {
+        strcpy(path, name);
+    } else {
+        sprintf(path, "%s/%s", dir, name);
+    }
+    return path;
+}
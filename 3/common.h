@@ -15,6 +15,10 @@ ssize_t sendn(int fd, const void *buffer, size_t n);
 
 void get_time();
 
+int parse_size(const char *str, unsigned long long *size);
+
+char *join_path(const char *dir, const char *name);
+
 # define DEBUG_MACRO(debug_mode, is_server, format, ...)\
     if (debug_mode) { \
         char time_stamp[50]; \
@@ -24,7 +28,9 @@ void get_time();
         char formatted_header[MAX_HEADER_LEN + 1]; /* 90バイト + NULL終端 */  \
         snprintf(formatted_header, sizeof(formatted_header), "%-90.90s", raw_header); \
         char message_only_buffer[MAX_DEBUG_MSG_LEN - MAX_HEADER_LEN + 1]; /* ヘッダを除いたメッセージ部分の最大長 + NULL終端 */ \
-        snprintf(message_only_buffer, sizeof(message_only_buffer), format, ##__VA_ARGS__); \
+        if (snprintf(message_only_buffer, sizeof(message_only_buffer), format, ##__VA_ARGS__) >= (int)sizeof(message_only_buffer)) { /* 切り詰めたことが分かるように末尾を...にする */ \
+            memcpy(message_only_buffer + sizeof(message_only_buffer) - 4, "...", 4); \
+        } \
         char final_log_message[MAX_DEBUG_MSG_LEN + 1]; /* 全体で512バイト + NULL終端 */ \
         snprintf(final_log_message, sizeof(final_log_message), "%s%s", formatted_header, message_only_buffer); \
         if (is_server) { \
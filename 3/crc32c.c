@@ -0,0 +1,66 @@
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78u // 0x1edc6f41のビット反転
+
+static unsigned int table[256];
+static bool use_hardware = false;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_table(void)
+{
+    unsigned int crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    use_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int update_hardware(unsigned int crc, const unsigned char *p, size_t size)
+{
+    unsigned long long crc64 = crc;
+    unsigned long long word;
+
+    while (size >= sizeof(word)) { // 8バイトずつ処理する
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += sizeof(word);
+        size -= sizeof(word);
+    }
+    crc = (unsigned int)crc64;
+    while (size-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+unsigned int crc32c_update(unsigned int crc, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    pthread_once(&init_once, init_table);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (use_hardware) {
+        return ~update_hardware(crc, p, size);
+    }
+#endif
+    while (size-- > 0) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+/*
+ * CRC-32C（Castagnoli）。ストリーミング転送の終端で、届いたデータ全体を検証するために使う
+ * SSE4.2に対応したx86-64ではcrc32命令で計算し、それ以外は表引きで計算する
+ */
+
+unsigned int crc32c_update(unsigned int crc, const void *data, size_t size); // 最初は0を渡し、戻り値を次の呼び出しに渡す
+
+#endif // CRC32C_H
@@ -0,0 +1,171 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include "timerwheel.h"
+#include "transport.h"
+#include "deadline.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static void expire(struct session_deadline *d, enum deadline_reason reason)
+{
+    d->expired = reason;
+    transport_shutdown(d->cfd, SHUT_RDWR); // 受信待ちのスレッドを起こし、通常のエラー処理でロックファイルなどを片付けさせる
+    if (d->aux_fd != -1) { // 中継先への書き込みで止まっている場合も起こす
+        shutdown(d->aux_fd, SHUT_RDWR);
+    }
+}
+
+static unsigned long long check_deadline(struct wheel_timer *t, unsigned long long now) // ホイールのスレッドから呼ばれる
+{
+    struct session_deadline *d = (struct session_deadline *)t->arg;
+    const struct deadline_config *c = d->config;
+    unsigned long long next = ULLONG_MAX;
+    unsigned long long limit;
+    unsigned long long activity;
+    unsigned long long received;
+    unsigned long long active;
+    unsigned long long window = timer_wheel_ticks(d->wheel, MIN_RATE_WINDOW_MS);
+    bool throttled = LOAD(d->throttled) != 0;
+
+    if (throttled) { // サーバー都合で読み込みを止めている間は無通信とみなさない
+        STORE(d->activity_tick, now);
+    }
+
+    switch (d->phase) {
+    case PHASE_HANDSHAKE:
+        if (c->handshake_timeout_ms != 0) {
+            limit = d->phase_tick + timer_wheel_ticks(d->wheel, c->handshake_timeout_ms);
+            if (now >= limit) {
+                expire(d, EXPIRED_HANDSHAKE);
+                return 0;
+            }
+            next = limit;
+        }
+        break;
+    case PHASE_TRANSFER:
+        if (c->min_rate != 0) {
+            // 区間の経過時間からサーバー側で待った時間を除いたものをクライアントの送信時間とする
+            active = now - d->window_tick - (LOAD(d->throttled_ticks) - d->window_throttled);
+            if (throttled || (long long)active < 0) {
+                next = now + 1;
+            } else if (active >= window) { // 区間内の受信量が最低スループットに届かなければ切断する
+                received = LOAD(d->bytes) - d->window_bytes;
+                if (received * 1000 < c->min_rate * active * d->wheel->tick_ms) {
+                    expire(d, EXPIRED_MIN_RATE);
+                    return 0;
+                }
+                d->window_tick = now;
+                d->window_bytes = LOAD(d->bytes);
+                d->window_throttled = LOAD(d->throttled_ticks);
+                next = now + window;
+            } else {
+                next = now + (window - active);
+            }
+        }
+        /* fall through */
+    case PHASE_IDLE:
+        if (c->idle_timeout_ms != 0) {
+            activity = LOAD(d->activity_tick);
+            limit = activity + timer_wheel_ticks(d->wheel, c->idle_timeout_ms);
+            if (now >= limit) {
+                expire(d, EXPIRED_IDLE);
+                return 0;
+            }
+            if (limit < next) {
+                next = limit;
+            }
+        }
+        break;
+    }
+
+    return (next == ULLONG_MAX) ? 0 : next;
+}
+
+static void arm(struct session_deadline *d) // タイマーを外した状態でフェーズの状態を初期化して登録し直す
+{
+    unsigned long long now = timer_wheel_now(d->wheel);
+
+    d->phase_tick = now;
+    STORE(d->activity_tick, now);
+    d->window_tick = now;
+    d->window_bytes = LOAD(d->bytes);
+    d->window_throttled = LOAD(d->throttled_ticks);
+    if (d->config->handshake_timeout_ms == 0 && d->config->idle_timeout_ms == 0 && d->config->min_rate == 0) {
+        return;
+    }
+    timer_wheel_add(d->wheel, &d->timer, now + 1, check_deadline, d); // 次のティックで実際の期限を計算する
+}
+
+void deadline_begin(struct session_deadline *d, struct timer_wheel *wheel, const struct deadline_config *config, int cfd)
+{
+    d->timer.pending = false;
+    d->timer.prev = NULL;
+    d->timer.next = NULL;
+    d->wheel = wheel;
+    d->config = config;
+    d->cfd = cfd;
+    d->phase = PHASE_HANDSHAKE;
+    d->bytes = 0;
+    d->throttled = 0;
+    d->throttle_tick = 0;
+    d->throttled_ticks = 0;
+    d->aux_fd = -1;
+    d->expired = EXPIRED_NONE;
+    arm(d);
+}
+
+void deadline_set_phase(struct session_deadline *d, enum deadline_phase phase) // フェーズの切り替えはセッションごとに数回なので再登録する
+{
+    timer_wheel_del(d->wheel, &d->timer);
+    d->phase = phase;
+    arm(d);
+}
+
+void deadline_progress(struct session_deadline *d, size_t bytes) // 受信のたびに呼ばれるため、ロックを取らずに書き込むだけにする
+{
+    STORE(d->bytes, LOAD(d->bytes) + bytes);
+    STORE(d->activity_tick, timer_wheel_now(d->wheel));
+}
+
+void deadline_throttle(struct session_deadline *d, bool throttled)
+{
+    unsigned long long now = timer_wheel_now(d->wheel);
+
+    if (throttled) {
+        d->throttle_tick = now;
+        STORE(d->throttled, 1);
+    } else {
+        STORE(d->throttled_ticks, LOAD(d->throttled_ticks) + (now - d->throttle_tick));
+        STORE(d->activity_tick, now);
+        STORE(d->throttled, 0);
+    }
+}
+
+void deadline_watch_fd(struct session_deadline *d, int fd) // 期限切れの処理はホイールのロックを保持して行われるため、外した後に閉じてよい
+{
+    pthread_mutex_lock(&d->wheel->lock);
+    d->aux_fd = fd;
+    pthread_mutex_unlock(&d->wheel->lock);
+}
+
+void deadline_end(struct session_deadline *d)
+{
+    timer_wheel_del(d->wheel, &d->timer); // 戻った後はshutdown()が呼ばれないため、cfdを閉じてよい
+}
+
+const char *deadline_reason_string(enum deadline_reason reason)
+{
+    switch (reason) {
+    case EXPIRED_HANDSHAKE:
+        return "handshake timeout";
+    case EXPIRED_IDLE:
+        return "idle timeout";
+    case EXPIRED_MIN_RATE:
+        return "below minimum throughput";
+    default:
+        return "none";
+    }
+}
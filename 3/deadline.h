@@ -0,0 +1,70 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "timerwheel.h"
+
+#define DEFAULT_HANDSHAKE_TIMEOUT_MS 10000 // 接続から最初のf_msg受信までの期限
+#define DEFAULT_IDLE_TIMEOUT_MS 20000      // データや接続維持の次のf_msgが届かない状態の期限
+#define MIN_RATE_WINDOW_MS 10000           // 最低スループットを判定する区間
+
+enum deadline_phase {
+    PHASE_HANDSHAKE, // f_msg待ち
+    PHASE_TRANSFER,  // データ受信中
+    PHASE_IDLE       // 接続維持モードで次のf_msg待ち
+};
+
+enum deadline_reason {
+    EXPIRED_NONE,
+    EXPIRED_HANDSHAKE,
+    EXPIRED_IDLE,
+    EXPIRED_MIN_RATE
+};
+
+struct deadline_config
+{
+    unsigned long long handshake_timeout_ms; // 0の場合は無効
+    unsigned long long idle_timeout_ms;      // 0の場合は無効
+    unsigned long long min_rate;             // 受信の最低スループット（バイト/秒、0の場合は無効）
+};
+
+/*
+ * セッションごとの期限。受信処理は時刻とバイト数を書き込むだけで、ホイールへの再登録は行わない。
+ * タイマーが発火した時点で実際の期限を計算し直し、まだ先であれば登録し直す（遅延再登録）。
+ */
+struct session_deadline
+{
+    struct wheel_timer timer;
+    struct timer_wheel *wheel;
+    const struct deadline_config *config;
+    int cfd;
+    enum deadline_phase phase;
+    unsigned long long phase_tick;    // フェーズが始まったティック
+    unsigned long long activity_tick; // 最後にデータを受信したティック
+    unsigned long long bytes;         // 受信したバイト数の累計
+    unsigned long long window_tick;   // 最低スループット判定区間の開始ティック
+    unsigned long long window_bytes;  // 区間開始時点のbytes
+    unsigned int throttled;           // サーバー側の帯域制限やスケジューラで待っている間は0以外
+    unsigned long long throttle_tick;   // 現在の待ちが始まったティック
+    unsigned long long throttled_ticks; // サーバー側の都合で待った時間の累計
+    unsigned long long window_throttled; // 区間開始時点のthrottled_ticks（待った時間は判定から除く）
+    int aux_fd;                       // 期限切れの時にcfdと共にshutdown()する中継先（-1の場合はなし、ホイールのロックで保護する）
+    enum deadline_reason expired;
+};
+
+void deadline_begin(struct session_deadline *d, struct timer_wheel *wheel, const struct deadline_config *config, int cfd);
+
+void deadline_set_phase(struct session_deadline *d, enum deadline_phase phase);
+
+void deadline_progress(struct session_deadline *d, size_t bytes);
+
+void deadline_throttle(struct session_deadline *d, bool throttled);
+
+void deadline_watch_fd(struct session_deadline *d, int fd);
+
+void deadline_end(struct session_deadline *d);
+
+const char *deadline_reason_string(enum deadline_reason reason);
+
+#endif // DEADLINE_H
@@ -3,7 +3,7 @@
 #include <string.h>
 #include "error.h"
 
-static struct {
+static __thread struct { // エージェントなど複数の転送を並行して行う場合に混ざらないよう、スレッドごとに保持する
         enum error_code num;
         int s_errno;
 } error = { 0 };
@@ -16,6 +16,20 @@ void set_error(enum error_code ecode, int s_errno)
         }
 }
 
+enum error_code get_error(int *s_errno)
+{
+        if (s_errno != NULL) {
+                *s_errno = error.s_errno;
+        }
+        return error.num;
+}
+
+void clear_error(void)
+{
+        error.num = NORMAL;
+        error.s_errno = 0;
+}
+
 void print_error(void)
 {
         switch (error.num) {
@@ -69,6 +83,18 @@ void print_error(void)
         case ERROR_LOCK_REMOVE:
                 fprintf(stderr, " delete lock file failed. %s\n", strerror(error.s_errno));
                 break;
+        case ERROR_BUSY:
+                fprintf(stderr, " server busy. retry after %d ms\n", error.s_errno);
+                break;
+        case ERROR_NO_SPACE:
+                fprintf(stderr, " server storage full. %s\n", strerror(error.s_errno));
+                break;
+        case ERROR_CHECKSUM:
+                fprintf(stderr, " stream checksum mismatch.\n");
+                break;
+        case ERROR_VERIFY:
+                fprintf(stderr, " verification failed. server file differs.\n");
+                break;
 
         default:
                 break;
@@ -0,0 +1,29 @@
+#ifndef _ERROR_CODE_H_
+#define _ERROR_CODE_H_
+
+// 公開APIの戻り値（エラー状態を操作する関数はerror.hにあり、ライブラリの外には公開しない）
+enum error_code {
+        NORMAL,
+        ERROR_ARGUMENT,
+        ERROR_FILE_OPEN,
+        ERROR_SOCKET,
+        ERROR_BIND,
+        ERROR_CONNECT,
+        ERROR_SEND,
+        ERROR_RECEIVED,
+        ERROR_LISTEN,
+        ERROR_ACCEPT,
+        ERROR_SYSTEM,
+        ERROR_DIFF_FILESIZE,
+        ERROR_TIMEOUT,
+        ERROR_BUFFER_OVERFLOW,
+        ERROR_LOCK_EXISTS, // ロックファイルが既に存在する場合のエラーコード
+        ERROR_LOCK_CREATE, // ロックファイル作成失敗のエラーコード
+        ERROR_LOCK_REMOVE, // ロックファイル削除失敗のエラーコード
+        ERROR_BUSY,        // サーバー過負荷による受付拒否（s_errnoに再試行までのミリ秒を格納）
+        ERROR_NO_SPACE,    // 保存先の空き容量不足による受付拒否
+        ERROR_CHECKSUM,    // ストリーミング転送のチェックサム不一致
+        ERROR_VERIFY       // 照合でサーバー側のファイルのハッシュ木の根が一致しない
+};
+
+#endif
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <openssl/evp.h>
+#include "socket_msg.h"
+#include "merkle.h"
+
+#define MERKLE_READ_SIZE (1024 * 1024) // チャンクを読む単位
+
+struct merkle_job // スレッドで共有する、計算するチャンクの一覧
+{
+    int fd;
+    unsigned long long file_size;
+    unsigned long long next;  // 次に計算するチャンク（__atomic_fetch_addで取る）
+    unsigned char (*leaves)[MERKLE_HASH_LEN];
+    unsigned char zero_leaf[MERKLE_HASH_LEN]; // 全体が穴のチャンクの葉
+    int s_errno;              // 最初に起きたエラー（0の場合は成功）
+};
+
+static const unsigned char leaf_prefix = 0x00;
+static const unsigned char node_prefix = 0x01;
+
+unsigned int merkle_default_threads(void) // 使用可能なCPUの数
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+    return (cpus > MERKLE_MAX_THREADS) ? MERKLE_MAX_THREADS : (unsigned int)cpus;
+}
+
+void merkle_init(struct merkle_tree *tree)
+{
+    memset(tree, 0, sizeof(struct merkle_tree));
+}
+
+static int hash_chunk(EVP_MD_CTX *ctx, int fd, char *buffer, unsigned long long offset, unsigned long long size, unsigned char *hash) // fdがNULLの場合は0で埋まったチャンク
+{
+    ssize_t read_bytes;
+    size_t read_size;
+
+    if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1 || EVP_DigestUpdate(ctx, &leaf_prefix, 1) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (size > 0) {
+        read_size = (size < MERKLE_READ_SIZE) ? (size_t)size : MERKLE_READ_SIZE;
+        if (fd == -1) {
+            memset(buffer, 0, read_size);
+            read_bytes = read_size;
+        } else {
+            read_bytes = pread(fd, buffer, read_size, (off_t)offset);
+            if (read_bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            if (read_bytes <= 0) { // 計算中に縮んだ
+                if (read_bytes == 0) {
+                    errno = EIO;
+                }
+                return -1;
+            }
+        }
+        EVP_DigestUpdate(ctx, buffer, read_bytes);
+        offset += read_bytes;
+        size -= read_bytes;
+    }
+    return (EVP_DigestFinal_ex(ctx, hash, NULL) == 1) ? 0 : -1;
+}
+
+static bool is_hole(int fd, unsigned long long offset, unsigned long long size) // 範囲全体が穴か（穴に対応しないファイルシステムでは常にfalse）
+{
+    off_t data = lseek(fd, (off_t)offset, SEEK_DATA); // 位置は使わないため、他のスレッドと共有するディスクリプタでもよい
+
+    if (data == -1) {
+        return errno == ENXIO;
+    }
+    return (unsigned long long)data >= offset + size;
+}
+
+static void *hash_thread(void *arg)
+{
+    struct merkle_job *job = arg;
+    unsigned long long leaf_num = (job->file_size + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE;
+    unsigned long long i;
+    unsigned long long offset;
+    unsigned long long size;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+
+    ctx = EVP_MD_CTX_new();
+    buffer = malloc(MERKLE_READ_SIZE);
+    if (ctx == NULL || buffer == NULL) {
+        __atomic_compare_exchange_n(&job->s_errno, &(int){0}, ENOMEM, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        goto end;
+    }
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < leaf_num) {
+        if (__atomic_load_n(&job->s_errno, __ATOMIC_RELAXED) != 0) { // 他のスレッドが失敗した
+            break;
+        }
+        offset = i * MERKLE_CHUNK_SIZE;
+        size = (job->file_size - offset < MERKLE_CHUNK_SIZE) ? job->file_size - offset : MERKLE_CHUNK_SIZE;
+        if (size == MERKLE_CHUNK_SIZE && is_hole(job->fd, offset, size)) {
+            memcpy(job->leaves[i], job->zero_leaf, MERKLE_HASH_LEN);
+            continue;
+        }
+        if (hash_chunk(ctx, job->fd, buffer, offset, size, job->leaves[i])) {
+            __atomic_compare_exchange_n(&job->s_errno, &(int){0}, errno, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+end:
+    free(buffer);
+    EVP_MD_CTX_free(ctx);
+    return NULL;
+}
+
+static int hash_nodes(const unsigned char *left, const unsigned char *right, unsigned char *hash)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ret = -1;
+
+    if (ctx != NULL && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+        EVP_DigestUpdate(ctx, &node_prefix, 1) == 1 &&
+        EVP_DigestUpdate(ctx, left, MERKLE_HASH_LEN) == 1 &&
+        EVP_DigestUpdate(ctx, right, MERKLE_HASH_LEN) == 1 &&
+        EVP_DigestFinal_ex(ctx, hash, NULL) == 1) {
+        ret = 0;
+    }
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+static int compute_root(struct merkle_tree *tree) // 葉から根までを順に畳み込む（葉の数に比べて軽いため1つのスレッドで計算する）
+{
+    unsigned char (*level)[MERKLE_HASH_LEN];
+    unsigned long long num = tree->leaf_num;
+    unsigned long long i;
+    EVP_MD_CTX *ctx;
+    int ret = -1;
+
+    if (num == 0) { // 空のファイルは空の葉のハッシュを根とする
+        ctx = EVP_MD_CTX_new();
+        if (ctx != NULL && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+            EVP_DigestUpdate(ctx, &leaf_prefix, 1) == 1 && EVP_DigestFinal_ex(ctx, tree->root, NULL) == 1) {
+            ret = 0;
+        }
+        EVP_MD_CTX_free(ctx);
+        return ret;
+    }
+    level = malloc(num * MERKLE_HASH_LEN);
+    if (level == NULL) {
+        return -1;
+    }
+    memcpy(level, tree->leaves, num * MERKLE_HASH_LEN);
+    while (num > 1) {
+        for (i = 0; i + 1 < num; i += 2) {
+            if (hash_nodes(level[i], level[i + 1], level[i / 2])) {
+                goto end;
+            }
+        }
+        if (num % 2 == 1) { // 対になるノードがない場合はそのまま上に上げる
+            memcpy(level[num / 2], level[num - 1], MERKLE_HASH_LEN);
+        }
+        num = (num + 1) / 2;
+    }
+    memcpy(tree->root, level[0], MERKLE_HASH_LEN);
+    ret = 0;
+end:
+    free(level);
+    return ret;
+}
+
+int merkle_build(struct merkle_tree *tree, int fd, unsigned long long file_size, unsigned int threads) // fdのfile_size分のハッシュ木を計算する（失敗した場合は-1とerrno）
+{
+    pthread_t tids[MERKLE_MAX_THREADS];
+    struct merkle_job job;
+    unsigned int created = 0;
+    EVP_MD_CTX *ctx = NULL;
+    char *buffer = NULL;
+    int ret = -1;
+
+    merkle_init(tree);
+    tree->file_size = file_size;
+    tree->leaf_num = (file_size + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE;
+    if (tree->leaf_num > 0) {
+        tree->leaves = malloc(tree->leaf_num * MERKLE_HASH_LEN);
+        if (tree->leaves == NULL) {
+            goto end;
+        }
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.fd = fd;
+    job.file_size = file_size;
+    job.leaves = tree->leaves;
+    if (tree->leaf_num > 0) {
+        ctx = EVP_MD_CTX_new();
+        buffer = malloc(MERKLE_READ_SIZE);
+        if (ctx == NULL || buffer == NULL || hash_chunk(ctx, -1, buffer, 0, MERKLE_CHUNK_SIZE, job.zero_leaf)) {
+            errno = ENOMEM;
+            goto end;
+        }
+    }
+    if (threads == 0) {
+        threads = merkle_default_threads();
+    }
+    if (threads > MERKLE_MAX_THREADS) {
+        threads = MERKLE_MAX_THREADS;
+    }
+    if (threads > tree->leaf_num) {
+        threads = (tree->leaf_num == 0) ? 1 : (unsigned int)tree->leaf_num;
+    }
+    while (created + 1 < threads && pthread_create(&tids[created], NULL, hash_thread, &job) == 0) { // 呼び出したスレッドも1つとして数える
+        created++;
+    }
+    hash_thread(&job);
+    while (created > 0) {
+        pthread_join(tids[--created], NULL);
+    }
+    if (job.s_errno != 0) {
+        errno = job.s_errno;
+        goto end;
+    }
+    if (compute_root(tree)) {
+        errno = ENOMEM;
+        goto end;
+    }
+    ret = 0;
+end:
+    free(buffer);
+    EVP_MD_CTX_free(ctx);
+    if (ret) {
+        merkle_free(tree);
+    }
+    return ret;
+}
+
+void merkle_free(struct merkle_tree *tree)
+{
+    free(tree->leaves);
+    tree->leaves = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "socket_msg.h"
+
+#define MERKLE_MAX_THREADS 64     // ハッシュの計算に使うスレッドの上限
+#define MERKLE_MAX_LEAVES (1ULL << 22) // 受け取る葉の上限（MERKLE_CHUNK_SIZEでは16TiBのファイルまで）
+
+/*
+ * ファイルのハッシュ木。MERKLE_CHUNK_SIZEごとのチャンクのSHA-256を葉とし、隣り合う2つを連結したハッシュを親とする
+ * 葉は複数のスレッドでpread()して並行に計算する。全体が穴のチャンクは読まずに、0で埋まったチャンクのハッシュを使う
+ * 葉と内部のノードは先頭の1バイト（0x00と0x01）で区別する（RFC 6962と同じ）。対になるノードがない場合はそのまま上に上げる
+ */
+
+struct merkle_tree
+{
+    unsigned long long file_size;
+    unsigned long long leaf_num; // (file_size + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE
+    unsigned char (*leaves)[MERKLE_HASH_LEN];
+    unsigned char root[MERKLE_HASH_LEN];
+};
+
+unsigned int merkle_default_threads(void);
+
+void merkle_init(struct merkle_tree *tree);
+
+int merkle_build(struct merkle_tree *tree, int fd, unsigned long long file_size, unsigned int threads);
+
+void merkle_free(struct merkle_tree *tree);
+
+#endif // MERKLE_H
@@ -0,0 +1,11 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#define STORAGE_MAX_ROOTS 32          // 保存先ディレクトリの最大数
+
+enum placement {
+    PLACEMENT_HASH,  // ファイル名のコンシステントハッシュ（保存先を増減しても移動するファイルが少ない）
+    PLACEMENT_SPACE  // 空き容量が最も大きい保存先（既に同名のファイルがある場合はその保存先）
+};
+
+#endif // PLACEMENT_H
@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "ratelimit.h"
+
+static double elapsed_sec(const struct timespec *from, const struct timespec *to)
+{
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double burst_for_rate(double rate)
+{
+    double burst = rate / 10; // 100ms分のバーストを許可
+    return (burst < MIN_BURST_BYTES) ? MIN_BURST_BYTES : burst;
+}
+
+void token_bucket_init(struct token_bucket *tb, unsigned long long rate)
+{
+    pthread_mutex_init(&tb->lock, NULL);
+    tb->rate = (double)rate;
+    tb->burst = burst_for_rate(tb->rate);
+    tb->tokens = tb->burst;
+    clock_gettime(CLOCK_MONOTONIC, &tb->last);
+}
+
+void token_bucket_consume(struct token_bucket *tb, size_t bytes)
+{
+    struct timespec now;
+    struct timespec wait;
+    double deficit_sec = 0;
+
+    pthread_mutex_lock(&tb->lock);
+    if (tb->rate <= 0) { // 無制限
+        pthread_mutex_unlock(&tb->lock);
+        return;
+    }
+
+    // 経過時間分のトークンを補充してから消費する。不足分は負債として残し、その分だけ待つ
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tb->tokens += elapsed_sec(&tb->last, &now) * tb->rate;
+    if (tb->tokens > tb->burst) {
+        tb->tokens = tb->burst;
+    }
+    tb->last = now;
+    tb->tokens -= (double)bytes;
+    if (tb->tokens < 0) {
+        deficit_sec = -tb->tokens / tb->rate;
+    }
+    pthread_mutex_unlock(&tb->lock);
+
+    if (deficit_sec > 0) {
+        wait.tv_sec = (time_t)deficit_sec;
+        wait.tv_nsec = (long)((deficit_sec - (double)wait.tv_sec) * 1e9);
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+static unsigned int hash_addr(const char *addr)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+
+    for (; *addr != '\0'; addr++) {
+        hash ^= (unsigned char)*addr;
+        hash *= 16777619u;
+    }
+    return hash % PEER_TABLE_SIZE;
+}
+
+void rate_limiter_init(struct rate_limiter *rl, unsigned long long peer_rate, unsigned long long session_rate, unsigned long long total_rate)
+{
+    pthread_mutex_init(&rl->lock, NULL);
+    rl->peer_rate = peer_rate;
+    rl->session_rate = session_rate;
+    rl->total_rate = total_rate;
+    token_bucket_init(&rl->total, total_rate);
+    memset(rl->peers, 0, sizeof(rl->peers));
+}
+
+static struct peer_bucket *acquire_peer_bucket(struct rate_limiter *rl, const char *peer_addr)
+{
+    unsigned int index = hash_addr(peer_addr);
+    struct peer_bucket *peer;
+
+    for (peer = rl->peers[index]; peer != NULL; peer = peer->next) {
+        if (strcmp(peer->addr, peer_addr) == 0) {
+            peer->refcount++;
+            return peer;
+        }
+    }
+
+    peer = calloc(1, sizeof(struct peer_bucket));
+    if (peer == NULL) { // メモリ不足の場合は接続元単位の制限を諦める
+        return NULL;
+    }
+    strncpy(peer->addr, peer_addr, sizeof(peer->addr) - 1);
+    peer->refcount = 1;
+    token_bucket_init(&peer->bucket, rl->peer_rate);
+    peer->next = rl->peers[index];
+    rl->peers[index] = peer;
+    return peer;
+}
+
+static void release_peer_bucket(struct rate_limiter *rl, struct peer_bucket *peer)
+{
+    struct peer_bucket **link;
+
+    if (--peer->refcount > 0) {
+        return;
+    }
+    for (link = &rl->peers[hash_addr(peer->addr)]; *link != NULL; link = &(*link)->next) {
+        if (*link == peer) {
+            *link = peer->next;
+            break;
+        }
+    }
+    pthread_mutex_destroy(&peer->bucket.lock);
+    free(peer);
+}
+
+void rate_session_begin(struct rate_limiter *rl, struct rate_session *rs, const char *peer_addr)
+{
+    token_bucket_init(&rs->bucket, rl->session_rate);
+    rs->peer = NULL;
+
+    pthread_mutex_lock(&rl->lock);
+    if (rl->peer_rate > 0 && peer_addr != NULL) {
+        rs->peer = acquire_peer_bucket(rl, peer_addr);
+    }
+    pthread_mutex_unlock(&rl->lock);
+}
+
+void rate_session_consume(struct rate_limiter *rl, struct rate_session *rs, size_t bytes) // セッション、接続元、全体の順に消費し、不足した分だけ待つ
+{
+    token_bucket_consume(&rs->bucket, bytes);
+    if (rs->peer != NULL) {
+        token_bucket_consume(&rs->peer->bucket, bytes);
+    }
+    // 全体のバケットは受信しているセッションだけが消費するため、転送中のセッションが1つなら全体の上限まで使える
+    // 不足分は消費した順に負債として積まれるため、同時に受信しているセッションにはほぼ均等に配分される
+    token_bucket_consume(&rl->total, bytes);
+}
+
+void rate_session_end(struct rate_limiter *rl, struct rate_session *rs)
+{
+    pthread_mutex_lock(&rl->lock);
+    if (rs->peer != NULL) {
+        release_peer_bucket(rl, rs->peer);
+        rs->peer = NULL;
+    }
+    pthread_mutex_unlock(&rl->lock);
+    pthread_mutex_destroy(&rs->bucket.lock);
+}
@@ -0,0 +1,57 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#define PEER_TABLE_SIZE 256        // 接続元アドレスごとのバケットを管理するハッシュテーブルのサイズ
+#define PEER_ADDR_MAX_LEN 64       // INET6_ADDRSTRLENより大きい値
+#define MIN_BURST_BYTES (64 * 1024) // バーストサイズの下限
+
+struct token_bucket
+{
+    pthread_mutex_t lock;
+    double rate;   // 1秒あたりに補充するトークン（バイト）数（0の場合は無制限）
+    double burst;  // 貯められるトークンの最大値
+    double tokens; // 現在のトークン数（消費しすぎた場合は負の値になる）
+    struct timespec last;
+};
+
+struct peer_bucket
+{
+    char addr[PEER_ADDR_MAX_LEN];
+    unsigned int refcount;
+    struct token_bucket bucket;
+    struct peer_bucket *next;
+};
+
+struct rate_limiter
+{
+    pthread_mutex_t lock;
+    unsigned long long peer_rate;    // 接続元アドレスごとの上限（0の場合は無制限）
+    unsigned long long session_rate; // セッションごとの上限（0の場合は無制限）
+    unsigned long long total_rate;   // サーバー全体の上限（0の場合は無制限）
+    struct token_bucket total;       // 全セッションが受信した分だけ消費する共有のバケット（待機中の接続は帯域を取らない）
+    struct peer_bucket *peers[PEER_TABLE_SIZE];
+};
+
+struct rate_session
+{
+    struct token_bucket bucket;
+    struct peer_bucket *peer;
+};
+
+void token_bucket_init(struct token_bucket *tb, unsigned long long rate);
+
+void token_bucket_consume(struct token_bucket *tb, size_t bytes);
+
+void rate_limiter_init(struct rate_limiter *rl, unsigned long long peer_rate, unsigned long long session_rate, unsigned long long total_rate);
+
+void rate_session_begin(struct rate_limiter *rl, struct rate_session *rs, const char *peer_addr);
+
+void rate_session_consume(struct rate_limiter *rl, struct rate_session *rs, size_t bytes);
+
+void rate_session_end(struct rate_limiter *rl, struct rate_session *rs);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,1296 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "rudp.h"
+
+#define RUDP_SYN 'S'
+#define RUDP_SYNACK 'Y'
+#define RUDP_DATA 'D'
+#define RUDP_ACK 'K'
+#define RUDP_RST 'R'
+
+#define RUDP_FLAG_FIN 0x01
+
+#define RUDP_INIT_CWND 32         // 帯域の推定値がない間の送信量（パケット）
+#define RUDP_MIN_CWND 16
+#define RUDP_BURST 4              // 1回の起床で続けて送るパケット数の上限
+#define RUDP_ACK_DELAY_US 5000    // 確認応答を遅らせる上限
+#define RUDP_SACK_SCAN 1024       // 選択確認応答を作るために調べる範囲
+#define RUDP_MIN_RTT_WINDOW_US 10000000
+#define RUDP_STARTUP_GAIN 2.89
+#define RUDP_CWND_GAIN 2.0
+#define RUDP_RECV_BATCH 64
+
+#define SEQ_LT(a, b) ((int)((a) - (b)) < 0)
+#define SEQ_GE(a, b) ((int)((a) - (b)) >= 0)
+#define SLOT(seq) ((seq) & (RUDP_WINDOW - 1))
+
+#pragma pack(push, 1)
+
+struct rudp_header
+{
+    unsigned char type;
+    unsigned char flags;
+    unsigned short length;        // ペイロード長
+    unsigned int conn_id;         // クライアントが選ぶ接続番号
+    unsigned int seq;             // DATA: パケット番号 / ACK: 次に期待するパケット番号
+    unsigned int limit;           // ACK: 送信してよいパケット番号の上限（フロー制御）
+    unsigned long long timestamp; // SYN, DATA: 送信時刻（マイクロ秒） / SYNACK, ACK: 受信したパケットの送信時刻
+};
+
+struct rudp_sack // [start, end)のパケットを受信済み
+{
+    unsigned int start;
+    unsigned int end;
+};
+
+#pragma pack(pop)
+
+#define RUDP_PACKET_MAX (sizeof(struct rudp_header) + RUDP_PAYLOAD)
+
+struct send_slot
+{
+    unsigned short length;
+    bool fin;
+    bool sent;
+    bool acked;
+    bool lost;                     // 再送待ち
+    bool app_limited;              // 送信時に送るデータが尽きていた（帯域の推定に使わない）
+    unsigned long long sent_us;
+    unsigned long long delivered;    // 送信時点の配達済みバイト数
+    unsigned long long delivered_us; // 送信時点の最後の配達時刻
+    char data[RUDP_PAYLOAD];
+};
+
+struct recv_slot
+{
+    bool present;
+    bool fin;
+    unsigned short length;
+    char data[RUDP_PAYLOAD];
+};
+
+struct delayed_packet // 遅延注入のため送信を待っているパケット
+{
+    unsigned long long due_us;
+    size_t length;
+    struct delayed_packet *next;
+    char data[RUDP_PACKET_MAX];
+};
+
+enum rudp_state {
+    RUDP_STARTUP, // 帯域が伸びなくなるまで送信レートを上げる
+    RUDP_PROBE    // 推定した帯域を中心に定期的に増減させて探る
+};
+
+struct rudp_conn
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // read/writeの待ち
+    int fd;              // 相手とconnect()済みのUDPソケット
+    int wake_fd;         // ワーカーを起こすeventfd
+    unsigned int conn_id;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    unsigned long long syn_timestamp; // 接続要求の再送に同じSYNACKを返すため
+
+    /* 送信 */
+    struct send_slot *snd;
+    unsigned int snd_una;  // 最も古い未確認のパケット
+    unsigned int snd_nxt;  // 次に初めて送るパケット
+    unsigned int snd_end;  // 次にアプリのデータを詰めるパケット
+    unsigned int peer_limit;
+    unsigned int inflight; // 送信済みで確認も損失判定もされていないパケット数
+    unsigned int lost_count;
+    bool fin_queued;
+
+    /* 受信 */
+    struct recv_slot *rcv;
+    unsigned int rcv_nxt;     // 次に順番どおり届くべきパケット
+    unsigned int rcv_read;    // 次にアプリが読むパケット
+    size_t read_offset;
+    unsigned int rcv_highest; // 受信した最大のパケット番号+1
+    unsigned int advertised;  // 最後に通知したlimit
+    unsigned int ack_pending;
+    bool ack_now;
+    unsigned long long ack_deadline_us;
+    unsigned long long ack_echo;
+
+    /* 輻輳制御 */
+    enum rudp_state state;
+    unsigned long long srtt_us;
+    unsigned long long rttvar_us;
+    unsigned long long min_rtt_us;
+    unsigned long long min_rtt_stamp;
+    double bw_max[2];            // 現在と1つ前の区間の最大配達レート（バイト/マイクロ秒）
+    unsigned long long bw_stamp;
+    double full_bw;
+    int full_bw_rounds;
+    unsigned long long delivered;
+    unsigned long long delivered_us;
+    unsigned long long next_round_delivered;
+    int cycle_index;
+    unsigned long long cycle_stamp;
+    unsigned long long next_send_us;
+    unsigned int rto_backoff;
+    unsigned long long latest_acked_sent_us;
+
+    /* 状態 */
+    unsigned long long last_recv_us;
+    unsigned long long last_send_us;
+    unsigned long long closed_us;
+    int error;                // 0以外の場合はread/writeがこのerrnoで失敗する
+    bool read_closed;
+    bool app_closed;
+    bool reset_on_close;
+    bool peer_fin;            // 相手のFINまで読み終えられる
+    unsigned int rng;
+    struct delayed_packet *delay_head;
+    struct delayed_packet *delay_tail;
+    struct rudp_conn *next;   // 接続要求の重複を判定する表
+};
+
+static const double probe_gains[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+static struct {
+    double loss;             // 送信時に破棄する確率
+    unsigned long long delay_us; // 送信を遅らせる時間
+} inject = {0, 0};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rudp_conn *table = NULL; // サーバー側で受け付けた接続
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int random_seed(void)
+{
+    static unsigned int counter = 0;
+
+    return (unsigned int)now_us() ^ ((unsigned int)getpid() << 16) ^ __atomic_add_fetch(&counter, 0x9e3779b9, __ATOMIC_RELAXED);
+}
+
+static unsigned int next_random(struct rudp_conn *c) // xorshift
+{
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+    return c->rng;
+}
+
+int rudp_set_inject(const char *spec) // "loss=1.5,delay=40"（損失率%、遅延ミリ秒）
+{
+    char buffer[128];
+    char *token;
+    char *save_ptr;
+    char *value;
+    char *end_ptr;
+    double number;
+
+    if (strlen(spec) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, spec);
+    for (token = strtok_r(buffer, ",", &save_ptr); token != NULL; token = strtok_r(NULL, ",", &save_ptr)) {
+        value = strchr(token, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        number = strtod(value, &end_ptr);
+        if (*end_ptr != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(token, "loss") == 0 && number < 100) {
+            inject.loss = number / 100;
+        } else if (strcmp(token, "delay") == 0) {
+            inject.delay_us = (unsigned long long)(number * 1000);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* パケットの送信 */
+
+static void transmit(struct rudp_conn *c, const void *packet, size_t length, unsigned long long now)
+{
+    struct delayed_packet *d;
+
+    c->last_send_us = now;
+    if (inject.loss > 0 && next_random(c) < inject.loss * 4294967296.0) { // 損失の注入
+        return;
+    }
+    if (inject.delay_us > 0) { // 遅延の注入（遅延は一定のため順序は変わらない）
+        d = malloc(sizeof(struct delayed_packet));
+        if (d == NULL) {
+            return;
+        }
+        d->due_us = now + inject.delay_us;
+        d->length = length;
+        d->next = NULL;
+        memcpy(d->data, packet, length);
+        if (c->delay_tail != NULL) {
+            c->delay_tail->next = d;
+        } else {
+            c->delay_head = d;
+        }
+        c->delay_tail = d;
+        return;
+    }
+    send(c->fd, packet, length, MSG_NOSIGNAL | MSG_DONTWAIT); // 送信バッファが溢れた場合は損失として扱われる
+}
+
+static void flush_delayed(struct rudp_conn *c, unsigned long long now)
+{
+    struct delayed_packet *d;
+
+    while ((d = c->delay_head) != NULL && d->due_us <= now) {
+        send(c->fd, d->data, d->length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        c->delay_head = d->next;
+        if (c->delay_head == NULL) {
+            c->delay_tail = NULL;
+        }
+        free(d);
+    }
+}
+
+static void send_control(struct rudp_conn *c, unsigned char type, unsigned long long now)
+{
+    struct rudp_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    h.conn_id = c->conn_id;
+    transmit(c, &h, sizeof(h), now);
+}
+
+static void send_ack(struct rudp_conn *c, unsigned long long now)
+{
+    char packet[sizeof(struct rudp_header) + RUDP_MAX_SACK * sizeof(struct rudp_sack)];
+    struct rudp_header *h = (struct rudp_header *)packet;
+    struct rudp_sack *sack = (struct rudp_sack *)(packet + sizeof(struct rudp_header));
+    unsigned int seq;
+    unsigned int end;
+    int blocks = 0;
+
+    // 順番どおりに届いていない範囲を選択確認応答として載せる
+    end = c->rcv_highest;
+    if ((int)(end - c->rcv_nxt) > RUDP_SACK_SCAN) {
+        end = c->rcv_nxt + RUDP_SACK_SCAN;
+    }
+    for (seq = c->rcv_nxt; SEQ_LT(seq, end) && blocks < RUDP_MAX_SACK; seq++) {
+        if (!c->rcv[SLOT(seq)].present) {
+            continue;
+        }
+        sack[blocks].start = seq;
+        while (SEQ_LT(seq, end) && c->rcv[SLOT(seq)].present) {
+            seq++;
+        }
+        sack[blocks].end = seq;
+        blocks++;
+    }
+
+    memset(h, 0, sizeof(struct rudp_header));
+    h->type = RUDP_ACK;
+    h->conn_id = c->conn_id;
+    h->seq = c->rcv_nxt;
+    h->limit = c->rcv_read + RUDP_WINDOW;
+    h->timestamp = c->ack_echo;
+    h->length = blocks * sizeof(struct rudp_sack);
+    transmit(c, packet, sizeof(struct rudp_header) + h->length, now);
+
+    c->advertised = h->limit;
+    c->ack_pending = 0;
+    c->ack_now = false;
+}
+
+static void send_data(struct rudp_conn *c, unsigned int seq, unsigned long long now)
+{
+    char packet[RUDP_PACKET_MAX];
+    struct rudp_header *h = (struct rudp_header *)packet;
+    struct send_slot *s = &c->snd[SLOT(seq)];
+
+    memset(h, 0, sizeof(struct rudp_header));
+    h->type = RUDP_DATA;
+    h->flags = s->fin ? RUDP_FLAG_FIN : 0;
+    h->length = s->length;
+    h->conn_id = c->conn_id;
+    h->seq = seq;
+    h->timestamp = now;
+    memcpy(packet + sizeof(struct rudp_header), s->data, s->length);
+
+    s->sent = true;
+    s->sent_us = now;
+    s->delivered = c->delivered;
+    s->delivered_us = c->delivered_us;
+    s->app_limited = (c->snd_nxt == c->snd_end); // 後に続くデータがない
+    c->inflight++;
+    transmit(c, packet, sizeof(struct rudp_header) + s->length, now);
+}
+
+/* 輻輳制御 */
+
+static double bandwidth(struct rudp_conn *c)
+{
+    return (c->bw_max[0] > c->bw_max[1]) ? c->bw_max[0] : c->bw_max[1];
+}
+
+static double pacing_gain(struct rudp_conn *c)
+{
+    return (c->state == RUDP_STARTUP) ? RUDP_STARTUP_GAIN : probe_gains[c->cycle_index];
+}
+
+static double pacing_rate(struct rudp_conn *c) // バイト/マイクロ秒
+{
+    double bw = bandwidth(c);
+
+    if (bw == 0) { // 推定値がない間はハンドシェイクのRTTで初期ウィンドウを送る
+        bw = (double)RUDP_INIT_CWND * RUDP_PAYLOAD / (c->srtt_us ? c->srtt_us : 1000);
+    }
+    return bw * pacing_gain(c);
+}
+
+static unsigned int cwnd(struct rudp_conn *c) // 送信中に留めてよいパケット数
+{
+    double bw = bandwidth(c);
+    double gain = (c->state == RUDP_STARTUP) ? RUDP_STARTUP_GAIN : RUDP_CWND_GAIN;
+    double packets;
+
+    if (bw == 0 || c->min_rtt_us == 0) {
+        return RUDP_INIT_CWND;
+    }
+    packets = gain * bw * c->min_rtt_us / RUDP_PAYLOAD;
+    if (packets < RUDP_MIN_CWND) {
+        return RUDP_MIN_CWND;
+    }
+    return (packets > RUDP_WINDOW) ? RUDP_WINDOW : (unsigned int)packets;
+}
+
+static void update_rtt(struct rudp_conn *c, unsigned long long rtt, unsigned long long now)
+{
+    unsigned long long diff;
+
+    if (c->srtt_us == 0) {
+        c->srtt_us = rtt;
+        c->rttvar_us = rtt / 2;
+    } else {
+        diff = (rtt > c->srtt_us) ? rtt - c->srtt_us : c->srtt_us - rtt;
+        c->rttvar_us = (3 * c->rttvar_us + diff) / 4;
+        c->srtt_us = (7 * c->srtt_us + rtt) / 8;
+    }
+    if (c->min_rtt_us == 0 || rtt <= c->min_rtt_us || now - c->min_rtt_stamp > RUDP_MIN_RTT_WINDOW_US) {
+        c->min_rtt_us = rtt;
+        c->min_rtt_stamp = now;
+    }
+}
+
+static unsigned long long rto(struct rudp_conn *c)
+{
+    unsigned long long value = c->srtt_us + 4 * c->rttvar_us;
+
+    if (value < RUDP_MIN_RTO_US) {
+        value = RUDP_MIN_RTO_US;
+    }
+    value <<= (c->rto_backoff < 5) ? c->rto_backoff : 5;
+    return (value > RUDP_MAX_RTO_US) ? RUDP_MAX_RTO_US : value;
+}
+
+static void on_delivered(struct rudp_conn *c, struct send_slot *s, unsigned long long now)
+{
+    double rate;
+    unsigned long long interval;
+    unsigned long long window = 10 * (c->min_rtt_us ? c->min_rtt_us : 100000);
+
+    c->delivered += s->length + sizeof(struct rudp_header);
+    c->delivered_us = now;
+    if (s->sent_us > c->latest_acked_sent_us) {
+        c->latest_acked_sent_us = s->sent_us;
+    }
+
+    // 配達レート = このパケットの送信後に配達された量 / その間の時間
+    interval = now - s->delivered_us;
+    if (s->delivered_us != 0 && interval > 0) {
+        rate = (double)(c->delivered - s->delivered) / interval;
+        if (now - c->bw_stamp > window) { // 約10RTTごとに古い区間を捨てる
+            c->bw_max[1] = c->bw_max[0];
+            c->bw_max[0] = 0;
+            c->bw_stamp = now;
+        }
+        if ((!s->app_limited || rate > bandwidth(c)) && rate > c->bw_max[0]) {
+            c->bw_max[0] = rate;
+        }
+    }
+
+    if (s->delivered >= c->next_round_delivered) { // 1往復ごとの判定
+        c->next_round_delivered = c->delivered;
+        if (c->state == RUDP_STARTUP) {
+            if (bandwidth(c) >= c->full_bw * 1.25) {
+                c->full_bw = bandwidth(c);
+                c->full_bw_rounds = 0;
+            } else if (++c->full_bw_rounds >= 3) {
+                c->state = RUDP_PROBE;
+                c->cycle_index = 1; // 起動時に溜めたキューを減らす段階から始める
+                c->cycle_stamp = now;
+            }
+        }
+    }
+    if (c->state == RUDP_PROBE && now - c->cycle_stamp > c->min_rtt_us) {
+        c->cycle_index = (c->cycle_index + 1) % (int)(sizeof(probe_gains) / sizeof(probe_gains[0]));
+        c->cycle_stamp = now;
+    }
+}
+
+static void mark_acked(struct rudp_conn *c, unsigned int seq, unsigned long long now)
+{
+    struct send_slot *s = &c->snd[SLOT(seq)];
+
+    if (!s->sent || s->acked) {
+        return;
+    }
+    s->acked = true;
+    if (s->lost) { // 損失と判定した後に届いた
+        s->lost = false;
+        c->lost_count--;
+    } else {
+        c->inflight--;
+    }
+    on_delivered(c, s, now);
+}
+
+static void mark_lost(struct rudp_conn *c, struct send_slot *s)
+{
+    s->lost = true;
+    c->inflight--;
+    c->lost_count++;
+}
+
+static void detect_loss(struct rudp_conn *c) // 後から送ったパケットが先に確認された場合、一定の猶予を過ぎたものを損失とみなす
+{
+    unsigned long long reorder = c->min_rtt_us / 4;
+    unsigned int seq;
+    struct send_slot *s;
+
+    if (reorder < 1000) {
+        reorder = 1000;
+    }
+    for (seq = c->snd_una; SEQ_LT(seq, c->snd_nxt); seq++) {
+        s = &c->snd[SLOT(seq)];
+        if (s->sent && !s->acked && !s->lost && s->sent_us + reorder < c->latest_acked_sent_us) {
+            mark_lost(c, s);
+        }
+    }
+}
+
+static void check_rto(struct rudp_conn *c, unsigned long long now) // 確認応答が途絶えた場合はタイムアウトで再送する
+{
+    unsigned long long limit = rto(c);
+    unsigned int seq;
+    struct send_slot *s;
+    bool expired = false;
+
+    for (seq = c->snd_una; SEQ_LT(seq, c->snd_nxt); seq++) {
+        s = &c->snd[SLOT(seq)];
+        if (s->sent && !s->acked && !s->lost && now - s->sent_us >= limit) {
+            mark_lost(c, s);
+            expired = true;
+        }
+    }
+    if (expired) {
+        c->rto_backoff++;
+    }
+}
+
+static unsigned long long rto_deadline(struct rudp_conn *c)
+{
+    unsigned int seq;
+    struct send_slot *s;
+
+    for (seq = c->snd_una; SEQ_LT(seq, c->snd_nxt); seq++) {
+        s = &c->snd[SLOT(seq)];
+        if (s->sent && !s->acked && !s->lost) {
+            return s->sent_us + rto(c);
+        }
+    }
+    return 0;
+}
+
+/* パケットの受信 */
+
+static void receive_ack(struct rudp_conn *c, const struct rudp_header *h, const char *payload, unsigned long long now)
+{
+    const struct rudp_sack *sack = (const struct rudp_sack *)payload;
+    int blocks = h->length / sizeof(struct rudp_sack);
+    unsigned int seq;
+    unsigned int start;
+    unsigned int end;
+    unsigned int una = c->snd_una;
+    unsigned long long latest = c->latest_acked_sent_us;
+    int i;
+
+    if (SEQ_LT(c->peer_limit, h->limit)) {
+        c->peer_limit = h->limit;
+    }
+    if (h->timestamp != 0 && h->timestamp <= now) {
+        update_rtt(c, now - h->timestamp, now);
+    }
+
+    end = SEQ_LT(c->snd_nxt, h->seq) ? c->snd_nxt : h->seq;
+    for (seq = c->snd_una; SEQ_LT(seq, end); seq++) {
+        mark_acked(c, seq, now);
+    }
+    for (i = 0; i < blocks; i++) {
+        start = SEQ_LT(sack[i].start, c->snd_una) ? c->snd_una : sack[i].start;
+        end = SEQ_LT(c->snd_nxt, sack[i].end) ? c->snd_nxt : sack[i].end;
+        for (seq = start; SEQ_LT(seq, end); seq++) {
+            mark_acked(c, seq, now);
+        }
+    }
+    while (SEQ_LT(c->snd_una, c->snd_nxt) && c->snd[SLOT(c->snd_una)].acked) {
+        memset(&c->snd[SLOT(c->snd_una)], 0, offsetof(struct send_slot, data));
+        c->snd_una++;
+    }
+
+    if (c->snd_una != una) {
+        c->rto_backoff = 0;
+        pthread_cond_broadcast(&c->cond); // 送信バッファが空いた
+    }
+    if (c->latest_acked_sent_us != latest) {
+        detect_loss(c);
+    }
+}
+
+static void receive_data(struct rudp_conn *c, const struct rudp_header *h, const char *payload, unsigned long long now)
+{
+    struct recv_slot *r;
+    unsigned int seq = h->seq;
+
+    c->ack_echo = h->timestamp;
+    if (SEQ_LT(seq, c->rcv_nxt) || SEQ_GE(seq, c->rcv_read + RUDP_WINDOW) || c->rcv[SLOT(seq)].present) {
+        c->ack_now = true; // 重複は確認応答が失われた可能性があるため、すぐに応答する
+        return;
+    }
+    if (h->length > RUDP_PAYLOAD) {
+        return;
+    }
+    r = &c->rcv[SLOT(seq)];
+    r->present = true;
+    r->fin = (h->flags & RUDP_FLAG_FIN) != 0;
+    r->length = h->length;
+    memcpy(r->data, payload, h->length);
+
+    if (SEQ_GE(seq, c->rcv_highest)) {
+        c->rcv_highest = seq + 1;
+    }
+    if (seq == c->rcv_nxt) {
+        while (SEQ_LT(c->rcv_nxt, c->rcv_highest) && c->rcv[SLOT(c->rcv_nxt)].present) {
+            if (c->rcv[SLOT(c->rcv_nxt)].fin) {
+                c->peer_fin = true;
+            }
+            c->rcv_nxt++;
+        }
+        pthread_cond_broadcast(&c->cond);
+    } else {
+        c->ack_now = true; // 欠落がある場合はすぐに選択確認応答を返す
+    }
+    if (r->fin || ++c->ack_pending >= 2) {
+        c->ack_now = true;
+    } else if (c->ack_pending == 1) {
+        c->ack_deadline_us = now + RUDP_ACK_DELAY_US;
+    }
+}
+
+static void receive_packets(struct rudp_conn *c, unsigned long long now)
+{
+    char packet[RUDP_PACKET_MAX + RUDP_MAX_SACK * sizeof(struct rudp_sack)];
+    struct rudp_header *h = (struct rudp_header *)packet;
+    ssize_t length;
+    int i;
+
+    for (i = 0; i < RUDP_RECV_BATCH; i++) {
+        length = recv(c->fd, packet, sizeof(packet), MSG_DONTWAIT);
+        if (length < (ssize_t)sizeof(struct rudp_header)) {
+            if (length == -1 && errno == ECONNREFUSED) { // 相手のソケットが閉じている
+                c->error = ECONNRESET;
+                pthread_cond_broadcast(&c->cond);
+            }
+            if (length == -1 && errno != EINTR && errno != ECONNREFUSED) {
+                return;
+            }
+            continue;
+        }
+        if (h->conn_id != c->conn_id || (size_t)length < sizeof(struct rudp_header) + h->length) {
+            continue;
+        }
+        c->last_recv_us = now;
+        switch (h->type) {
+        case RUDP_DATA:
+            receive_data(c, h, packet + sizeof(struct rudp_header), now);
+            break;
+        case RUDP_ACK:
+            receive_ack(c, h, packet + sizeof(struct rudp_header), now);
+            break;
+        case RUDP_RST:
+            c->error = ECONNRESET;
+            pthread_cond_broadcast(&c->cond);
+            break;
+        default: // SYNACKの重複などは無視する
+            break;
+        }
+    }
+}
+
+/* ワーカー */
+
+static bool sendable(struct rudp_conn *c) // 再送するパケットか、ウィンドウ内の新しいパケットがある
+{
+    if (c->lost_count > 0) {
+        return true;
+    }
+    return c->snd_nxt != c->snd_end && SEQ_LT(c->snd_nxt, c->peer_limit) && c->inflight < cwnd(c);
+}
+
+static void send_due(struct rudp_conn *c, unsigned long long now)
+{
+    unsigned int seq;
+    int i;
+
+    if (c->next_send_us + 1000 < now) { // 休んでいた分をまとめて送らない
+        c->next_send_us = now;
+    }
+    for (i = 0; i < RUDP_BURST && c->next_send_us <= now && sendable(c); i++) {
+        if (c->lost_count > 0) { // 損失したパケットの再送を優先する
+            for (seq = c->snd_una; SEQ_LT(seq, c->snd_nxt) && !c->snd[SLOT(seq)].lost; seq++) {
+            }
+            c->snd[SLOT(seq)].lost = false;
+            c->lost_count--;
+        } else {
+            seq = c->snd_nxt++;
+        }
+        send_data(c, seq, now);
+        c->next_send_us += (unsigned long long)((c->snd[SLOT(seq)].length + sizeof(struct rudp_header)) / pacing_rate(c));
+    }
+}
+
+static bool finished(struct rudp_conn *c, unsigned long long now) // close()後、送ったデータが全て確認されたら終了する
+{
+    if (!c->app_closed) {
+        return false;
+    }
+    if (c->reset_on_close || c->error != 0 || now - c->closed_us > RUDP_LINGER_MS * 1000ULL) {
+        return true;
+    }
+    return c->snd_una == c->snd_end && c->peer_fin && c->ack_pending == 0 && !c->ack_now;
+}
+
+static unsigned long long next_event(struct rudp_conn *c, unsigned long long now)
+{
+    unsigned long long next = now + RUDP_KEEPALIVE_MS * 1000ULL;
+    unsigned long long t;
+
+    if (c->error != 0) { // 失敗した接続は何も送らず、close()で起こされるまで待つ
+        return RUDP_KEEPALIVE_MS * 1000ULL;
+    }
+    if (sendable(c) && c->next_send_us < next) {
+        next = c->next_send_us;
+    }
+    if (c->ack_pending > 0 && c->ack_deadline_us < next) {
+        next = c->ack_deadline_us;
+    }
+    t = rto_deadline(c);
+    if (t != 0 && t < next) {
+        next = t;
+    }
+    if (c->delay_head != NULL && c->delay_head->due_us < next) {
+        next = c->delay_head->due_us;
+    }
+    return (next > now) ? next - now : 0;
+}
+
+static void free_conn(struct rudp_conn *c)
+{
+    struct rudp_conn **p;
+    struct delayed_packet *d;
+
+    pthread_mutex_lock(&table_lock);
+    for (p = &table; *p != NULL; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    while ((d = c->delay_head) != NULL) {
+        c->delay_head = d->next;
+        free(d);
+    }
+    close(c->fd);
+    close(c->wake_fd);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c->snd);
+    free(c->rcv);
+    free(c);
+}
+
+static void *worker(void *arg)
+{
+    struct rudp_conn *c = arg;
+    struct pollfd fds[2];
+    struct timespec timeout;
+    unsigned long long now;
+    unsigned long long wait_us;
+    uint64_t value;
+
+    fds[0].fd = c->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = c->wake_fd;
+    fds[1].events = POLLIN;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        now = now_us();
+        if (finished(c, now)) {
+            break;
+        }
+        wait_us = next_event(c, now);
+        pthread_mutex_unlock(&c->lock);
+
+        timeout.tv_sec = wait_us / 1000000;
+        timeout.tv_nsec = (wait_us % 1000000) * 1000;
+        ppoll(fds, 2, &timeout, NULL);
+        if (fds[1].revents & POLLIN) {
+            if (read(c->wake_fd, &value, sizeof(value))) {
+            }
+        }
+
+        pthread_mutex_lock(&c->lock);
+        now = now_us();
+        if (fds[0].revents & (POLLIN | POLLERR)) {
+            receive_packets(c, now);
+        }
+        if (c->error != 0) {
+            continue;
+        }
+        if (now - c->last_recv_us > RUDP_PEER_TIMEOUT_MS * 1000ULL) {
+            c->error = ETIMEDOUT;
+            pthread_cond_broadcast(&c->cond);
+            continue;
+        }
+        check_rto(c, now);
+        send_due(c, now);
+        if (c->ack_now || (c->ack_pending > 0 && now >= c->ack_deadline_us) ||
+            now - c->last_send_us >= RUDP_KEEPALIVE_MS * 1000ULL) {
+            send_ack(c, now);
+        }
+        flush_delayed(c, now);
+    }
+    if (c->reset_on_close && c->error == 0) {
+        send_control(c, RUDP_RST, now);
+        flush_delayed(c, now + inject.delay_us);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    free_conn(c);
+    return NULL;
+}
+
+static void wake(struct rudp_conn *c)
+{
+    uint64_t value = 1;
+
+    if (write(c->wake_fd, &value, sizeof(value))) {
+    }
+}
+
+static struct rudp_conn *create_conn(int fd, unsigned int conn_id, unsigned long long rtt)
+{
+    struct rudp_conn *c;
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    c = calloc(1, sizeof(struct rudp_conn));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->snd = calloc(RUDP_WINDOW, sizeof(struct send_slot));
+    c->rcv = calloc(RUDP_WINDOW, sizeof(struct recv_slot));
+    c->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->snd == NULL || c->rcv == NULL || c->wake_fd == -1) {
+        goto error;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->fd = fd;
+    c->conn_id = conn_id;
+    c->peer_limit = RUDP_WINDOW;
+    c->advertised = RUDP_WINDOW;
+    c->state = RUDP_STARTUP;
+    c->rng = random_seed() | 1;
+    c->last_recv_us = now_us();
+    c->last_send_us = c->last_recv_us;
+    if (rtt != 0) {
+        update_rtt(c, rtt, c->last_recv_us);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, worker, c) != 0) {
+        pthread_attr_destroy(&attr);
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+        goto error;
+    }
+    pthread_attr_destroy(&attr);
+    return c;
+
+error:
+    if (c->wake_fd > 0) {
+        close(c->wake_fd);
+    }
+    free(c->snd);
+    free(c->rcv);
+    free(c);
+    return NULL;
+}
+
+/* 転送路の操作 */
+
+static ssize_t rudp_read(int fd, void *ctx, void *buffer, size_t size, int flags)
+{
+    struct rudp_conn *c = ctx;
+    struct recv_slot *r;
+    unsigned int seq;
+    size_t offset;
+    size_t n;
+    size_t total = 0;
+    ssize_t ret;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    while (c->rcv_read == c->rcv_nxt && c->error == 0 && !c->read_closed) {
+        if (flags & MSG_DONTWAIT) {
+            pthread_mutex_unlock(&c->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->read_closed) {
+        ret = 0;
+    } else if (c->rcv_read == c->rcv_nxt) {
+        errno = c->error;
+        ret = -1;
+    } else {
+        seq = c->rcv_read;
+        offset = c->read_offset;
+        while (total < size && SEQ_LT(seq, c->rcv_nxt) && !c->rcv[SLOT(seq)].fin) { // FINに達したら以降は0を返す
+            r = &c->rcv[SLOT(seq)];
+            n = r->length - offset;
+            if (n > size - total) {
+                n = size - total;
+            }
+            memcpy((char *)buffer + total, r->data + offset, n);
+            total += n;
+            offset += n;
+            if (offset == r->length) {
+                if (!(flags & MSG_PEEK)) {
+                    r->present = false;
+                }
+                seq++;
+                offset = 0;
+            }
+        }
+        if (!(flags & MSG_PEEK)) {
+            c->rcv_read = seq;
+            c->read_offset = offset;
+            if ((int)(c->rcv_read + RUDP_WINDOW - c->advertised) >= RUDP_WINDOW / 4) { // 受信ウィンドウが大きく開いたら通知する
+                c->ack_now = true;
+                wake(c);
+            }
+        }
+        ret = total;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static ssize_t rudp_write(int fd, void *ctx, const void *buffer, size_t size)
+{
+    struct rudp_conn *c = ctx;
+    struct send_slot *s;
+    size_t total = 0;
+    size_t n;
+    ssize_t ret;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    while (c->error == 0 && !c->fin_queued && size > 0) {
+        // 最後のパケットがまだ送信されていなければ詰め込み、小さな書き込みが1パケットずつにならないようにする
+        s = (c->snd_end != c->snd_nxt) ? &c->snd[SLOT(c->snd_end - 1)] : NULL;
+        if (s == NULL || s->sent || s->length == RUDP_PAYLOAD) {
+            if (c->snd_end - c->snd_una >= RUDP_WINDOW) {
+                if (total > 0) {
+                    break;
+                }
+                pthread_cond_wait(&c->cond, &c->lock);
+                continue;
+            }
+            s = &c->snd[SLOT(c->snd_end)];
+            memset(s, 0, offsetof(struct send_slot, data));
+            c->snd_end++;
+        }
+        n = RUDP_PAYLOAD - s->length;
+        if (n > size - total) {
+            n = size - total;
+        }
+        memcpy(s->data + s->length, (const char *)buffer + total, n);
+        s->length += n;
+        total += n;
+        if (total == size) {
+            break;
+        }
+    }
+    if (total > 0) {
+        wake(c);
+        ret = total;
+    } else if (size == 0) {
+        ret = 0;
+    } else {
+        errno = (c->error != 0) ? c->error : EPIPE;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static ssize_t rudp_writev(int fd, void *ctx, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    ssize_t written;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        written = rudp_write(fd, ctx, iov[i].iov_base, iov[i].iov_len);
+        if (written == -1) {
+            return (total > 0) ? total : -1;
+        }
+        total += written;
+        if ((size_t)written < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+static void queue_fin(struct rudp_conn *c)
+{
+    struct send_slot *s;
+
+    while (c->snd_end - c->snd_una >= RUDP_WINDOW && c->error == 0) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->error != 0) {
+        return;
+    }
+    s = &c->snd[SLOT(c->snd_end)];
+    memset(s, 0, offsetof(struct send_slot, data));
+    s->fin = true;
+    c->snd_end++;
+    c->fin_queued = true;
+}
+
+static int rudp_shutdown(int fd, void *ctx, int how)
+{
+    struct rudp_conn *c = ctx;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    if ((how == SHUT_WR || how == SHUT_RDWR) && !c->fin_queued) {
+        if (how == SHUT_RDWR) { // 期限切れなど、別のスレッドから待ちを解除する場合は送信バッファの空きを待たない
+            c->error = (c->error != 0) ? c->error : EPIPE;
+        } else {
+            queue_fin(c);
+        }
+    }
+    if (how == SHUT_RD || how == SHUT_RDWR) {
+        c->read_closed = true;
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    wake(c);
+    return 0;
+}
+
+static int rudp_reset(int fd, void *ctx)
+{
+    struct rudp_conn *c = ctx;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    c->reset_on_close = true;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+static int rudp_close(int fd, void *ctx) // ワーカーが未確認のデータを送り終えてからソケットを閉じて解放する
+{
+    struct rudp_conn *c = ctx;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    if (!c->fin_queued && !c->reset_on_close && c->error == 0) {
+        queue_fin(c);
+    }
+    c->app_closed = true;
+    c->closed_us = now_us();
+    pthread_mutex_unlock(&c->lock);
+    wake(c);
+    return 0;
+}
+
+const struct transport_ops transport_rudp = {
+    .name = "rudp",
+    .connect = NULL,
+    .accept = NULL,
+    .read = rudp_read,
+    .write = rudp_write,
+    .writev = rudp_writev,
+    .sendfile = NULL,
+    .shutdown = rudp_shutdown,
+    .reset = rudp_reset,
+    .close = rudp_close,
+};
+
+/* 接続の確立 */
+
+static int set_reuseaddr(int fd) // 待ち受けポートを接続ごとのソケットと共有できるようにする
+{
+    int on = 1;
+
+    return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+}
+
+int rudp_listen(const char *port_num, int *lfd)
+{
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    int status;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    status = getaddrinfo(NULL, port_num, &hints, &result);
+    if (status != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *lfd = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol);
+    if (*lfd == -1 || set_reuseaddr(*lfd) || bind(*lfd, result->ai_addr, result->ai_addrlen)) {
+        freeaddrinfo(result);
+        return -1;
+    }
+    freeaddrinfo(result);
+    return 0;
+}
+
+static void send_synack(int fd, unsigned int conn_id, unsigned long long timestamp)
+{
+    struct rudp_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.type = RUDP_SYNACK;
+    h.conn_id = conn_id;
+    h.timestamp = timestamp;
+    send(fd, &h, sizeof(h), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/*
+ * 接続要求ごとに、待ち受けと同じアドレスとポートにbindしてピアへconnect()したソケットを用意する（失敗時は-1）。
+ * カーネルはconnect()済みのソケットを優先するので、以降そのピアからのパケットは新しいソケットに届き、
+ * 応答も待ち受けポートから出る。NATの内側のクライアントも、最初に送った宛先から応答を受け取れる。
+ * bindからconnect()までの間に別のクライアントのSYNが新しいソケットに届くと捨てられるが、SYNは再送される。
+ */
+int rudp_accept(int lfd)
+{
+    struct rudp_header h;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    struct rudp_conn *c;
+    ssize_t length;
+    int fd;
+
+    length = recvfrom(lfd, &h, sizeof(h), 0, (struct sockaddr *)&peer, &peer_len);
+    if (length == -1) {
+        return -1;
+    }
+    if (length != sizeof(h) || h.type != RUDP_SYN) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // SYNACKが失われてクライアントが再送した場合は、既存の接続から応答し直す
+    pthread_mutex_lock(&table_lock);
+    for (c = table; c != NULL; c = c->next) {
+        if (c->conn_id == h.conn_id && c->peer_len == peer_len && memcmp(&c->peer, &peer, peer_len) == 0) {
+            send_synack(c->fd, c->conn_id, h.timestamp);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (c != NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (getsockname(lfd, (struct sockaddr *)&local, &local_len)) {
+        return -1;
+    }
+    fd = socket(local.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (set_reuseaddr(fd) || bind(fd, (struct sockaddr *)&local, local_len) ||
+        connect(fd, (struct sockaddr *)&peer, peer_len)) {
+        close(fd);
+        return -1;
+    }
+
+    c = create_conn(fd, h.conn_id, 0);
+    if (c == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(&c->peer, &peer, peer_len);
+    c->peer_len = peer_len;
+    c->syn_timestamp = h.timestamp;
+    if (transport_register(fd, &transport_rudp, c)) {
+        rudp_close(fd, c);
+        return -1;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    c->next = table;
+    table = c;
+    pthread_mutex_unlock(&table_lock);
+
+    send_synack(fd, c->conn_id, h.timestamp);
+    return fd;
+}
+
+int rudp_connect(const char *host_name, const char *port_num, unsigned int timeout_ms, int *fd)
+{
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    struct rudp_header h;
+    struct rudp_header reply;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    struct pollfd pfd;
+    struct rudp_conn *c;
+    unsigned long long start = now_us();
+    unsigned long long now;
+    unsigned int conn_id = random_seed();
+    ssize_t length;
+    int status;
+
+    *fd = -1;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    status = getaddrinfo(host_name, port_num, &hints, &result);
+    if (status != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    *fd = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+    if (*fd == -1) {
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    pfd.fd = *fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        now = now_us();
+        if (now - start >= timeout_ms * 1000ULL) {
+            errno = ETIMEDOUT;
+            goto error;
+        }
+        memset(&h, 0, sizeof(h));
+        h.type = RUDP_SYN;
+        h.conn_id = conn_id;
+        h.timestamp = now;
+        if (inject.delay_us > 0) { // 注入する遅延はハンドシェイクにも適用し、最初のRTTの推定を実際の経路に合わせる
+            usleep(inject.delay_us);
+        }
+        sendto(*fd, &h, sizeof(h), MSG_NOSIGNAL, result->ai_addr, result->ai_addrlen);
+
+        if (poll(&pfd, 1, RUDP_SYN_INTERVAL_MS) <= 0) { // 届かなければ再送する
+            continue;
+        }
+        from_len = sizeof(from);
+        length = recvfrom(*fd, &reply, sizeof(reply), 0, (struct sockaddr *)&from, &from_len);
+        if (length == sizeof(reply) && reply.type == RUDP_SYNACK && reply.conn_id == conn_id) {
+            break;
+        }
+        if (length == -1 && errno == ECONNREFUSED) {
+            goto error;
+        }
+    }
+    freeaddrinfo(result);
+    result = NULL;
+
+    // 以降はSYNACKの送信元（サーバーの待ち受けポート）とだけやり取りする
+    if (connect(*fd, (struct sockaddr *)&from, from_len)) {
+        goto error;
+    }
+    now = now_us();
+    c = create_conn(*fd, conn_id, (reply.timestamp <= now) ? now - reply.timestamp : 0);
+    if (c == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    if (transport_register(*fd, &transport_rudp, c)) {
+        rudp_close(*fd, c); // ワーカーがソケットを閉じる
+        *fd = -1;
+        return -1;
+    }
+    return 0;
+
+error:
+    status = errno;
+    if (result != NULL) {
+        freeaddrinfo(result);
+    }
+    close(*fd);
+    *fd = -1;
+    errno = status;
+    return -1;
+}
@@ -0,0 +1,33 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stdbool.h>
+#include "transport.h"
+
+#define RUDP_PAYLOAD 1400            // 1データパケットのペイロード（IPv6+UDPでも1500バイトのMTUに収まる）
+#define RUDP_WINDOW 2048             // 送受信バッファのパケット数（2の累乗）
+#define RUDP_MAX_SACK 16             // ACKに載せる選択確認応答の範囲数
+#define RUDP_SYN_INTERVAL_MS 250     // 接続要求の再送間隔
+#define RUDP_PEER_TIMEOUT_MS 30000   // 相手から何も届かない場合に切断とみなすまでの時間
+#define RUDP_KEEPALIVE_MS 1000       // 送信するものがない場合にACKを送る間隔
+#define RUDP_LINGER_MS 10000         // close()後に未確認のデータを送り続ける上限
+#define RUDP_MIN_RTO_US 200000
+#define RUDP_MAX_RTO_US 5000000
+
+/*
+ * UDP上の信頼性のある転送路（選択確認応答・ペーシング・損失に強い輻輳制御）
+ * 輻輳制御は配達レートと最小RTTから帯域幅遅延積を推定し、パケット損失では送信レートを下げない
+ * 接続ごとにワーカースレッドが再送・確認応答・ペーシングを行い、read/writeはバッファを介して受け渡す
+ */
+
+extern const struct transport_ops transport_rudp;
+
+int rudp_listen(const char *port_num, int *lfd);
+
+int rudp_accept(int lfd);
+
+int rudp_connect(const char *host_name, const char *port_num, unsigned int timeout_ms, int *fd);
+
+int rudp_set_inject(const char *spec);
+
+#endif // RUDP_H
@@ -0,0 +1,2240 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "wfq.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "deadline.h"
+#include "tuning.h"
+#include "transport.h"
+#include "rudp.h"
+#include "tls.h"
+#include "storage.h"
+#include "crc32c.h"
+#include "sink.h"
+#include "merkle.h"
+#include "transfer.h"
+
+#define ACCEPT_BACKOFF_MAX_MS 1000 // accept()がリソース不足で失敗した際の最大待ち時間
+#define PASSED_COPY_CHUNK (4 * 1024 * 1024) // 受け取ったディスクリプタから一度に複製する量（帯域制限とスケジューラの単位）
+#define HANDOVER_TIMEOUT_MS 10000 // 引き継ぎ中の相手の応答を待つ上限
+#define SESSION_BUFFER_BYTES (2 * STORAGE_BLOCK_SIZE) // 受信中のセッションが保持するバッファ（受信と書き込みの二重バッファ）
+
+struct transfer_server
+{
+    bool debug_mode;
+    bool inline_sessions;
+    char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)]; // 空の場合はTCPで待ち受ける
+    bool unix_bound;   // unix_pathのソケットファイルを作成したか（終了時に削除する）
+    bool udp;          // UDPの信頼性のある転送路で待ち受ける
+    struct admission admission;     // 同時セッション数と受信中バイト数の受付制御
+    struct rate_limiter rate_limiter; // 接続元・セッション・全体の帯域制限
+    struct storage storage;         // 保存先とデバイスごとの書き込みキュー（優先度クラスの重み付き公平キューイング）
+    struct timer_wheel wheel;       // セッションごとの期限を管理する
+    struct deadline_config deadlines;
+    struct socket_tuning tuning;
+    const struct transport_ops *transport; // accept()したソケットに割り当てる転送路（NULLの場合はソケットをそのまま使う）
+    struct latency_hist session_latency[PRIORITY_CLASS_NUM]; // クラスごとのセッション所要時間
+    struct latency_hist queue_wait[PRIORITY_CLASS_NUM];      // クラスごとのスケジューラ待ち時間（セッション合計）
+    int listener_num;
+    int *lfds;
+    int *cpus;         // リスナーごとにaccept loopとworkerを固定するCPU番号（-1の場合は固定しない）
+    pthread_mutex_t lock;
+    int next_listener; // 次にtransfer_server_run()が担当するリスナー
+    int stop_fd;       // transfer_server_stop()で書き込むeventfd
+    char upgrade_path[sizeof(((struct sockaddr_un *)0)->sun_path)]; // 新しいサーバーからの引き継ぎ要求を待ち受けるソケットファイル（空の場合は引き継がない）
+    int upgrade_fd;    // upgrade_pathで待ち受けるソケット（引き継いだ後は-1）
+    pthread_t upgrade_thread;
+    bool upgrade_started;
+    int handover_fd;   // 引き継ぎ先のサーバーとの接続。待機中の接続維持セッションを渡す（srv->lockで保護）
+    int takeover_fd;   // 引き継ぎ元のサーバーとの接続。待機中の接続維持セッションを受け取る
+    pthread_t takeover_thread;
+    bool takeover_started;
+    unsigned long long handed_sessions;   // 引き継ぎ先に渡したセッション数
+    unsigned long long taken_sessions;    // 引き継ぎ元から受け取ったセッション数
+    struct sink_config sink;              // 受信データをファイルの代わりに渡す消費側（kindがSINK_NONEの場合は保存する）
+    unsigned long long sink_acked;        // 消費側が受け取りを確認したセッション数
+    unsigned long long sink_failed;       // 消費側が失敗したセッション数
+    unsigned long long sink_bytes;        // 消費側に渡したバイト数
+    unsigned int hash_threads;            // 照合でハッシュ木を計算するスレッドの数
+    unsigned long long verify_sessions;   // ハッシュ木を返した照合のセッション数
+    unsigned long long verify_bytes;      // 照合で読んだバイト数
+};
+
+struct stream_reader // ストリーミング転送（d_msgの連続とt_msg）の読み込み状態
+{
+    unsigned int chunk_left;     // 読み込み中のd_msgの残りバイト数
+    unsigned long long total;    // 受信したデータの合計
+    unsigned int crc;            // 受信したデータのCRC-32C
+    bool finished;               // t_msgを受け取った
+    struct t_message trailer;
+};
+
+struct client_thread_args
+{
+    struct transfer_server *srv;
+    int cfd;
+};
+
+void transfer_server_config_init(struct server_config *config)
+{
+    memset(config, 0, sizeof(struct server_config));
+    config->port_num = NULL;
+    config->unix_path = NULL;
+    config->base_path = NULL;
+    config->debug_mode = false;
+    config->listener_count = 1;
+    config->inline_sessions = false;
+    config->retry_after_ms = DEFAULT_RETRY_AFTER_MS;
+    config->handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT_MS;
+    config->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    config->min_rate = 0;
+    config->class_weights = NULL;
+    config->storage_roots = NULL;
+    config->storage_root_count = 0;
+    config->placement = PLACEMENT_HASH;
+    config->storage_writers = 1;
+    config->min_free_bytes = 0;
+    config->upgrade_path = NULL;
+    config->sink_exec = NULL;
+    config->sink_unix = NULL;
+    config->sink_buffer_bytes = 0;
+    config->hash_threads = 0;
+    tuning_init(&config->tuning);
+    config->transport = NULL;
+    config->udp = false;
+}
+
+static enum error_code get_file_size(int fd, unsigned long long *file_size)
+{
+    struct stat file_info;
+
+    if (fstat(fd, &file_info) != 0) {
+        set_error(ERROR_SYSTEM, errno);
+        return ERROR_SYSTEM;
+    }
+
+    *file_size = file_info.st_size;
+    return NORMAL;
+}
+
+static char *create_lock_file_name(char *origin_file_name)
+{
+    size_t len = strlen(origin_file_name);
+    char *lock_file_name = (char *)malloc(len + strlen(".lock") + 1);
+    if (lock_file_name == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        return NULL;
+    }
+    strcpy(lock_file_name, origin_file_name);
+    strcat(lock_file_name, ".lock");
+    return lock_file_name;
+}
+
+static int open_lock_file(char *lock_file_name)
+{
+    int lock_fd = -1;
+
+    lock_fd = open(lock_file_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (lock_fd == -1){
+        if (errno == EEXIST) {
+            set_error(ERROR_LOCK_EXISTS, errno);
+            return -2;
+        } else {
+            set_error(ERROR_LOCK_CREATE, errno);
+            return -3;
+        }
+    }
+
+    return lock_fd;
+
+}
+
+static int open_recv_file(char *file_name)
+{
+    int file = -1;
+    file = open(file_name, O_CREAT | O_RDWR | O_TRUNC, 0644); // 以前の内容が残るとサイズ検証に失敗するため切り詰める
+    if (file == -1) {
+        set_error(ERROR_FILE_OPEN, errno);
+        return ERROR_FILE_OPEN;
+    }
+    return file;
+}
+
+static int open_append_file(char *file_name) // 既存の内容を残して開く（ない場合は作成する）
+{
+    int file = -1;
+    file = open(file_name, O_CREAT | O_RDWR, 0644);
+    if (file == -1) {
+        set_error(ERROR_FILE_OPEN, errno);
+        return ERROR_FILE_OPEN;
+    }
+    return file;
+}
+
+static void close_lock_file(char *lock_file_name)
+{
+    if (lock_file_name != NULL) {
+        if (access(lock_file_name, F_OK) == 0) {
+            if (unlink(lock_file_name) == -1) {
+                set_error(ERROR_LOCK_REMOVE, errno);
+            }
+        }
+        free(lock_file_name);
+    }
+}
+
+static enum error_code close_file_descriptor(int fd)
+{
+    if (close(fd) == -1) {
+        set_error(ERROR_SYSTEM, errno);
+        return ERROR_SYSTEM;
+    }
+    return NORMAL;
+}
+
+static enum error_code wait_write(struct storage_device *dev, struct write_request *req) // 前回渡したブロックの書き込み完了を待つ
+{
+    if (!req->pending) {
+        return NORMAL;
+    }
+    storage_wait(dev, req);
+    if (req->result == -1) {
+        set_error(ERROR_RECEIVED, req->s_errno);
+        return ERROR_RECEIVED;
+    }
+    return NORMAL;
+}
+
+static ssize_t read_stream(int socket, struct stream_reader *sr, void *buffer, size_t size) // d_msgのデータ部分だけを返す（t_msgを受け取ると0）
+{
+    struct d_message d_msg;
+    ssize_t recv_bytes;
+    char type;
+
+    while (sr->chunk_left == 0) {
+        if (sr->finished) {
+            return 0;
+        }
+        recv_bytes = recvn(socket, &type, sizeof(type), MSG_PEEK);
+        if (recv_bytes == -2) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (recv_bytes <= 0) {
+            return recv_bytes;
+        }
+        if (type == 'D') {
+            if (receive_d_msg(socket, &d_msg)) {
+                errno = EPROTO;
+                return -1;
+            }
+            sr->chunk_left = d_msg.length;
+        } else if (type == 'T') {
+            if (receive_t_msg(socket, &sr->trailer)) {
+                errno = EPROTO;
+                return -1;
+            }
+            sr->finished = true;
+        } else {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    if (size > sr->chunk_left) {
+        size = sr->chunk_left;
+    }
+    recv_bytes = transport_read(socket, buffer, size, 0);
+    if (recv_bytes > 0) {
+        sr->chunk_left -= recv_bytes;
+        sr->total += recv_bytes;
+        sr->crc = crc32c_update(sr->crc, buffer, recv_bytes);
+    }
+    return recv_bytes;
+}
+
+static enum error_code receive_file(struct transfer_server *srv, int socket, int file, off_t start, struct space_reservation *space, struct stream_reader *sr, struct rate_session *rs, struct session_deadline *dl, int priority, unsigned long long *wait_us, unsigned long long remaining)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes = 0;
+    size_t recv_size;
+    size_t filled;
+    off_t offset = start; // 追記の場合は既存のデータの後ろから書き込む
+    char *blocks = NULL;
+    struct write_request reqs[2];
+    struct storage_device *dev = space->dev;
+    int current = 0;
+    int i;
+
+    // 2つのブロックを交互に使い、一方をデバイスの書き込みスレッドが書いている間にもう一方へ受信する
+    memset(reqs, 0, sizeof(reqs));
+    blocks = malloc(2 * STORAGE_BLOCK_SIZE);
+    if (blocks == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+
+    // remainingがULLONG_MAXの場合はSHUT_WR（ストリーミング転送ではt_msg）まで、それ以外はremainingバイトちょうどを受信する
+    while (remaining > 0 && recv_bytes >= 0) {
+        if ((ret = wait_write(dev, &reqs[current]))) {
+            goto end;
+        }
+        ret = ERROR_SYSTEM;
+
+        filled = 0;
+        while (filled < STORAGE_BLOCK_SIZE && remaining > 0) {
+            recv_size = STORAGE_BLOCK_SIZE - filled;
+            if (remaining < recv_size) {
+                recv_size = (size_t)remaining;
+            }
+            if (sr != NULL) { // ストリーミング転送ではメッセージのヘッダを除いて書き込む
+                recv_bytes = read_stream(socket, sr, blocks + current * STORAGE_BLOCK_SIZE + filled, recv_size);
+            } else {
+                recv_bytes = transport_read(socket, blocks + current * STORAGE_BLOCK_SIZE + filled, recv_size, 0); // 少しずつ届く場合も進捗を記録できるよう、届いた分だけ受け取る
+            }
+            if (recv_bytes <= 0) {
+                break;
+            }
+            filled += recv_bytes;
+            if (remaining != ULLONG_MAX) {
+                remaining -= recv_bytes;
+            }
+            deadline_progress(dl, recv_bytes);
+
+            // サーバー側で読み込みを止めている間は、クライアントが遅いとみなされないようにする
+            deadline_throttle(dl, true);
+            rate_session_consume(&srv->rate_limiter, rs, recv_bytes); // 帯域制限。読み込みを止めるとTCPのウィンドウで送信側も抑制される
+            deadline_throttle(dl, false);
+        }
+        if (filled == 0) {
+            break;
+        }
+
+        // 書き込みは優先度クラスの重みに従って受け付けられる。デバイスのキューが埋まっている間は次の受信も行わない
+        reqs[current].fd = file;
+        reqs[current].data = blocks + current * STORAGE_BLOCK_SIZE;
+        reqs[current].size = filled;
+        reqs[current].offset = offset;
+        reqs[current].reservation = space; // 書き込んだ分は予約から外れる
+        deadline_throttle(dl, true);
+        *wait_us += storage_submit(dev, &reqs[current], priority);
+        deadline_throttle(dl, false);
+        offset += filled;
+        current = 1 - current;
+    }
+    for (i = 0; i < 2; i++) {
+        if ((ret = wait_write(dev, &reqs[i]))) {
+            goto end;
+        }
+    }
+    if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    if (remaining != ULLONG_MAX && remaining > 0) { // 接続維持モードでサイズ分を受信する前に切断された
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+end:
+    for (i = 0; i < 2; i++) { // 失敗した場合も書き込み中のブロックを解放しない
+        storage_wait(dev, &reqs[i]);
+    }
+    free(blocks);
+    return ret;
+}
+
+static enum error_code receive_sparse(struct transfer_server *srv, int socket, int file, struct space_reservation *space, struct rate_session *rs, struct session_deadline *dl, int priority, unsigned long long *wait_us, unsigned long long file_size, unsigned long long data_size) // x_msgで届くデータ領域だけを書き込み、間は穴のまま残す
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct x_message x_msg;
+    unsigned long long data_end = 0; // 最後に書き込んだデータ領域の終わり
+    unsigned long long received = 0;
+
+    for (;;) {
+        if ((ret = receive_x_msg(socket, &x_msg))) {
+            goto end;
+        }
+        if (x_msg.offset == file_size && x_msg.length == 0) { // 終端
+            break;
+        }
+        // 逆順・重なり・範囲外・f_msgで通知した合計を超える領域は受け付けない
+        if (x_msg.length == 0 || x_msg.offset < data_end || x_msg.offset > file_size ||
+            x_msg.length > file_size - x_msg.offset || x_msg.length > data_size - received) {
+            set_error(ERROR_RECEIVED, EPROTO);
+            ret = ERROR_RECEIVED;
+            goto end;
+        }
+        if ((ret = receive_file(srv, socket, file, (off_t)x_msg.offset, space, NULL, rs, dl, priority, wait_us, x_msg.length))) {
+            goto end;
+        }
+        data_end = x_msg.offset + x_msg.length;
+        received += x_msg.length;
+    }
+    if (received != data_size) {
+        set_error(ERROR_DIFF_FILESIZE, 0);
+        ret = ERROR_DIFF_FILESIZE;
+        if (send_e_msg(socket, E_REASON_SIZE_MISMATCH, 0, "The received data extents do not match the announced data size.")) {
+            ret = ERROR_SEND;
+        }
+        goto end;
+    }
+    if (ftruncate(file, (off_t)file_size)) { // 末尾の穴の分はブロックを割り当てずにサイズだけを伸ばす
+        set_error(ERROR_SYSTEM, errno);
+        ret = ERROR_SYSTEM;
+        goto end;
+    }
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code receive_to_sink(struct transfer_server *srv, int socket, struct sink_session *sink, struct stream_reader *sr, struct rate_session *rs, struct session_deadline *dl, unsigned long long remaining, unsigned long long *received)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes = 0;
+    size_t recv_size;
+    char *buffer = NULL;
+
+    buffer = malloc(STORAGE_BLOCK_SIZE);
+    if (buffer == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+
+    // 受信した分をその都度消費側に渡す。消費側が読むまで次の受信をしないため、TCPのウィンドウで送信側も止まる
+    while (remaining > 0) {
+        recv_size = (remaining < STORAGE_BLOCK_SIZE) ? (size_t)remaining : STORAGE_BLOCK_SIZE;
+        if (sr != NULL) {
+            recv_bytes = read_stream(socket, sr, buffer, recv_size);
+        } else {
+            recv_bytes = transport_read(socket, buffer, recv_size, 0);
+        }
+        if (recv_bytes <= 0) {
+            break;
+        }
+        if (remaining != ULLONG_MAX) {
+            remaining -= recv_bytes;
+        }
+        deadline_progress(dl, recv_bytes);
+
+        deadline_throttle(dl, true); // 消費側を待っている間はクライアントが遅いとみなさない
+        rate_session_consume(&srv->rate_limiter, rs, recv_bytes);
+        if (sink_write(sink, buffer, recv_bytes)) { // 消費側が途中で終了した
+            deadline_throttle(dl, false);
+            __atomic_add_fetch(&srv->sink_failed, 1, __ATOMIC_RELAXED);
+            set_error(ERROR_SYSTEM, errno);
+            goto end;
+        }
+        deadline_throttle(dl, false);
+        *received += recv_bytes;
+    }
+    if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    if (remaining != ULLONG_MAX && remaining > 0) {
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+end:
+    free(buffer);
+    return ret;
+}
+
+static enum error_code check_passed_fd(int src_fd, unsigned long long file_size) // 添付されたディスクリプタから読み出せるか確認する
+{
+    struct stat stat_buf;
+    off_t offset;
+    int flags;
+
+    if (src_fd == -1) {
+        set_error(ERROR_ARGUMENT, 0);
+        return ERROR_ARGUMENT;
+    }
+    flags = fcntl(src_fd, F_GETFL);
+    if (fstat(src_fd, &stat_buf) || !S_ISREG(stat_buf.st_mode) || flags == -1 || (flags & O_ACCMODE) == O_WRONLY) {
+        set_error(ERROR_ARGUMENT, errno);
+        return ERROR_ARGUMENT;
+    }
+    offset = lseek(src_fd, 0, SEEK_CUR);
+    if (offset == -1 || (unsigned long long)stat_buf.st_size < (unsigned long long)offset + file_size) {
+        set_error(ERROR_ARGUMENT, errno);
+        return ERROR_ARGUMENT;
+    }
+    return NORMAL;
+}
+
+static ssize_t copy_chunk(int src_fd, off_t *offset, int fd, size_t size)
+{
+    ssize_t copied;
+
+    // 同じファイルシステム上ではカーネル内で複製する。対応していない組み合わせ（memfdから別のファイルシステムなど）はsendfile()で書き込む
+    copied = copy_file_range(src_fd, offset, fd, NULL, size, 0);
+    if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+        copied = sendfile(fd, src_fd, offset, size);
+    }
+    return copied;
+}
+
+static enum error_code copy_passed_file(struct transfer_server *srv, int src_fd, int fd, struct space_reservation *space, struct rate_session *rs, struct session_deadline *dl, int priority, unsigned long long *wait_us, unsigned long long remaining)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct stat stat_buf;
+    struct timespec queued;
+    struct storage_device *dev = space->dev;
+    off_t offset;
+    size_t size;
+    ssize_t copied;
+
+    // 添付されたディスクリプタのファイルオフセットはクライアントと共有しているため、位置を指定して読み、動かさない
+    offset = lseek(src_fd, 0, SEEK_CUR);
+    if (offset == -1 || fstat(src_fd, &stat_buf)) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+
+    if (offset == 0 && (unsigned long long)stat_buf.st_size == remaining && ioctl(fd, FICLONE, src_fd) == 0) { // reflinkできる場合はデータを複製しない
+        deadline_progress(dl, remaining);
+        DEBUG_MACRO(srv->debug_mode, true, "reflinked passed file");
+        ret = NORMAL;
+        goto end;
+    }
+
+    while (remaining > 0) {
+        size = (remaining < PASSED_COPY_CHUNK) ? (size_t)remaining : PASSED_COPY_CHUNK;
+
+        deadline_throttle(dl, true);
+        rate_session_consume(&srv->rate_limiter, rs, size);
+        clock_gettime(CLOCK_MONOTONIC, &queued);
+        wfq_acquire(&dev->scheduler, priority, size); // カーネル内の複製は書き込みスレッドを経由せず、受付の枠だけを使う
+        *wait_us += elapsed_us(&queued);
+        copied = copy_chunk(src_fd, &offset, fd, size);
+        wfq_release(&dev->scheduler);
+        deadline_throttle(dl, false);
+
+        if (copied <= 0) { // 複製中にクライアントが元のファイルを切り詰めた場合も失敗とする
+            set_error(ERROR_RECEIVED, (copied == 0) ? 0 : errno);
+            ret = ERROR_RECEIVED;
+            goto end;
+        }
+        deadline_progress(dl, copied);
+        storage_consume(space, copied);
+        remaining -= copied;
+    }
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code setup_server(struct transfer_server *srv, int *lfd, const char *port_num, bool reuse_port, int cpu)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+
+    int opt_val = 1; // SO_REUSEADDRの設定値
+
+    // getaddrinfo()の準備
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    int status = getaddrinfo(NULL, port_num, &hints, &result);
+    if (status) {
+        ret = ERROR_SYSTEM;
+        set_error(ERROR_SYSTEM, status);
+        goto end;
+    }
+
+    // ソケットの生成とアドレスのバインド
+    // 停止要求と一緒にpoll()で待つため、リスナーはノンブロッキングにする（accept()したソケットには引き継がれない）
+    *lfd = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK, result->ai_protocol);
+    if (*lfd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Created a socket on port %s", port_num);
+
+    if (setsockopt(*lfd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof opt_val)) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Set socket options SO_REUSEADDR");
+
+    if (reuse_port) { // シャーディング時は同じポートに複数のリスナーをバインドする
+        if (setsockopt(*lfd, SOL_SOCKET, SO_REUSEPORT, &opt_val, sizeof opt_val)) {
+            ret = ERROR_SOCKET;
+            set_error(ret, errno);
+            goto end;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, " Set socket options SO_REUSEPORT");
+    }
+
+    if (cpu >= 0) { // 受信処理を行ったCPUと同じリスナーに振り分けられるようにする（失敗しても続行）
+        if (setsockopt(*lfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu) == 0) {
+            DEBUG_MACRO(srv->debug_mode, true, " Set socket options SO_INCOMING_CPU %d", cpu);
+        }
+    }
+
+    if (tuning_apply_before_connect(*lfd, &srv->tuning, true)) { // バッファと輻輳制御はaccept()したソケットに引き継がれる
+        ret = ERROR_SOCKET;
+        goto end;
+    }
+
+    if (bind(*lfd, result->ai_addr, result->ai_addrlen)) {
+        ret = ERROR_BIND;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Bound to port %s", port_num);
+
+    if (listen(*lfd, SOMAXCONN)) {
+        ret = ERROR_LISTEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Listening on port %s", port_num);
+
+    ret = NORMAL;
+end:
+    if (result) {
+        freeaddrinfo(result);
+    }
+    return ret;
+}
+
+static enum error_code setup_unix_server(struct transfer_server *srv, int *lfd)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+    struct stat stat_buf;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, srv->unix_path);
+
+    // 前回の起動で残ったソケットファイルは削除する（ソケット以外のファイルは上書きしない）
+    if (lstat(srv->unix_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode)) {
+        unlink(srv->unix_path);
+    }
+
+    *lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (*lfd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Created a unix socket");
+
+    if (bind(*lfd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ret = ERROR_BIND;
+        set_error(ret, errno);
+        goto end;
+    }
+    srv->unix_bound = true;
+    DEBUG_MACRO(srv->debug_mode, true, " Bound to %s", srv->unix_path);
+
+    if (listen(*lfd, SOMAXCONN)) {
+        ret = ERROR_LISTEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Listening on %s", srv->unix_path);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code setup_udp_server(struct transfer_server *srv, int *lfd, const char *port_num)
+{
+    enum error_code ret = ERROR_SYSTEM;
+
+    if (rudp_listen(port_num, lfd)) {
+        ret = (*lfd == -1) ? ERROR_SOCKET : ERROR_BIND;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Waiting for udp connections on port %s", port_num);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code verify_data_size(unsigned long long file_size, int fd)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    unsigned long long recv_file_size;
+    if ((ret = get_file_size(fd, &recv_file_size))) { // クライアントから受信したファイルサイズの取得
+        goto end;
+    }
+
+    if (file_size != recv_file_size) {
+        set_error(ERROR_DIFF_FILESIZE, 0);
+        ret = ERROR_DIFF_FILESIZE;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+static bool valid_file_name(const char *file_name) // サブディレクトリは許すが、保存先の外を指す名前は受け付けない
+{
+    const char *p = file_name;
+    size_t len;
+
+    if (*p == '\0' || *p == '/') {
+        return false;
+    }
+    while (*p != '\0') { // "/"で区切った各要素が空・"."・".."でないこと
+        len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return false;
+        }
+        p += len;
+        if (*p == '/') {
+            p++;
+            if (*p == '\0') {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int make_parent_dirs(char *full_path, size_t root_len) // 保存先より下の途中のディレクトリを作成する
+{
+    char *p;
+
+    for (p = strchr(full_path + root_len + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(full_path, 0755) == -1 && errno != EEXIST) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+static enum error_code concatenate_path(char *dir_path, char *file_name, char *full_path, int max_size)
+{
+    enum error_code ret = ERROR_SYSTEM;
+
+    // dir_path の末尾が '/' で終わっているか確認
+    size_t dir_len = strlen(dir_path);
+    if (dir_path[dir_len - 1] == '/') { // '/' が既に存在する場合
+        if (dir_len + strlen(file_name) >= (size_t)max_size) {
+            set_error(ERROR_BUFFER_OVERFLOW, errno);
+            ret = ERROR_BUFFER_OVERFLOW; // バッファ不足
+            goto end;
+        }
+        int written = snprintf(full_path, max_size, "%s%s", dir_path, file_name);
+        if (written < 0 || written >= max_size) {
+            set_error(ERROR_SYSTEM, errno); // システムエラー（ここではバッファ不足を含む）
+            ret = ERROR_SYSTEM;
+            goto end;
+        }
+    } else { // '/' を追加する場合
+        if (dir_len + 1 + strlen(file_name) >= (size_t)max_size) {
+            set_error(ERROR_BUFFER_OVERFLOW, errno);
+            ret = ERROR_BUFFER_OVERFLOW; // バッファ不足
+            goto end;
+        }
+        int written = snprintf(full_path, max_size, "%s/%s", dir_path, file_name);
+        if (written < 0 || written >= max_size) {
+            set_error(ERROR_SYSTEM, errno);
+            ret = ERROR_SYSTEM; // システムエラー（ここではバッファ不足を含む）
+            goto end;
+        }
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+static void discard_optimistic_data(struct transfer_server *srv, int cfd, unsigned long long file_size)
+{
+    char drain[BUFFER_SIZE];
+    ssize_t recv_bytes;
+
+    // 応答を待たずに送られてくるデータを読み捨て、未読データによるRSTで拒否応答が失われないようにする
+    // クライアントが送り終えない場合はハンドシェイクの期限で打ち切られる
+    if (file_size > OPTIMISTIC_MAX_SIZE) {
+        file_size = OPTIMISTIC_MAX_SIZE;
+    }
+    while (file_size > 0) {
+        recv_bytes = transport_read(cfd, drain, (file_size < sizeof(drain)) ? file_size : sizeof(drain), 0);
+        if (recv_bytes <= 0) {
+            break;
+        }
+        file_size -= recv_bytes;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, "discarded optimistic data");
+}
+
+static unsigned long long data_bytes(const struct f_message *f_msg) // 受信するデータの量（F_FLAG_SPARSEでは穴を除いた量、F_FLAG_VERIFYでは受信しない）
+{
+    if (f_msg->flags & F_FLAG_VERIFY) {
+        return 0;
+    }
+    return (f_msg->flags & F_FLAG_SPARSE) ? f_msg->offset : f_msg->file_size;
+}
+
+static unsigned long long buffered_bytes(const struct f_message *f_msg) // 受信中にセッションが保持するバッファの量（受付の上限で予約する）
+{
+    unsigned long long bytes = data_bytes(f_msg);
+
+    if (f_msg->flags & F_FLAG_FD_PASS) { // カーネル内で複製し、バッファを持たない
+        return 0;
+    }
+    return (bytes < SESSION_BUFFER_BYTES) ? bytes : SESSION_BUFFER_BYTES;
+}
+
+static enum error_code begin_session(struct transfer_server *srv, int cfd, struct f_message *f_msg, int *src_fd, int *fd, struct sink_session *sink, struct space_reservation *space, int *lock_fd, char **lock_file_path, bool *reserved)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    char full_path[MAX_PATH_LEN] = {0};
+    char reason[BUFFER_SIZE];
+    unsigned long long available;
+    int root;
+    bool rejected = false; // b_msgまたはe_msgで受付を拒否したか
+
+    tuning_quickack(cfd, &srv->tuning);
+    if ((ret = receive_f_msg_fd(cfd, f_msg, src_fd))) { // clientからのf_msgを受信①（UNIXドメインソケットではディスクリプタが添付される場合がある）
+        goto end;
+    }
+    f_msg->file_name[sizeof(f_msg->file_name) - 1] = '\0';
+    DEBUG_MACRO(srv->debug_mode, true, "received f_msg %s:%llu", f_msg->file_name, f_msg->file_size);
+
+    if (!valid_file_name(f_msg->file_name)) {
+        if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, "invalid file name."))) {
+            goto end;
+        }
+        set_error(ERROR_ARGUMENT, 0);
+        rejected = true;
+        ret = ERROR_ARGUMENT;
+        goto end;
+    }
+
+    if (f_msg->flags & F_FLAG_STREAM) { // ストリーミング転送のfile_sizeは目安のため、サイズに依存する送り方とは組み合わせない
+        f_msg->flags &= ~(F_FLAG_OPTIMISTIC | F_FLAG_FD_PASS);
+    }
+    if (f_msg->flags & (F_FLAG_SPARSE | F_FLAG_VERIFY)) { // 拒否した場合に読み捨てる量がfile_sizeと一致しない
+        f_msg->flags &= ~F_FLAG_OPTIMISTIC;
+    }
+    if (((f_msg->flags & F_FLAG_VERIFY) && ((f_msg->flags & ~(F_FLAG_VERIFY | F_FLAG_KEEPALIVE)) || srv->sink.kind != SINK_NONE)) ||
+        ((f_msg->flags & F_FLAG_REPAIR) && !(f_msg->flags & F_FLAG_SPARSE))) { // 照合は保存済みのファイルだけを読み、書き換えは位置を指定したx_msgで行う
+        if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, "verify and repair cannot be combined with other transfer modes or sink mode."))) {
+            goto end;
+        }
+        set_error(ERROR_ARGUMENT, 0);
+        rejected = true;
+        ret = ERROR_ARGUMENT;
+        goto end;
+    }
+    if ((f_msg->flags & F_FLAG_SPARSE) &&
+        ((f_msg->flags & (F_FLAG_STREAM | F_FLAG_APPEND | F_FLAG_FD_PASS)) || srv->sink.kind != SINK_NONE || f_msg->offset > f_msg->file_size)) { // 穴は位置を指定して書き込めるファイルにだけ残せる
+        if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, "sparse transfer cannot be combined with streaming, append, descriptor passing or sink mode."))) {
+            goto end;
+        }
+        set_error(ERROR_ARGUMENT, 0);
+        rejected = true;
+        ret = ERROR_ARGUMENT;
+        goto end;
+    }
+    if ((f_msg->flags & F_FLAG_APPEND) && ((f_msg->flags & (F_FLAG_STREAM | F_FLAG_FD_PASS)) || srv->sink.kind != SINK_NONE)) { // 追記はソケットで受信したサイズの決まったデータをファイルに書く場合だけ
+        if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, "append cannot be combined with streaming, descriptor passing or sink mode."))) {
+            goto end;
+        }
+        set_error(ERROR_ARGUMENT, 0);
+        rejected = true;
+        ret = ERROR_ARGUMENT;
+        goto end;
+    }
+    if (srv->sink.kind != SINK_NONE && (f_msg->flags & F_FLAG_FD_PASS)) { // 消費側にはソケットで受信したデータだけを渡す
+        if ((ret = send_e_msg(cfd, E_REASON_BAD_FD, 0, "descriptor passing is not available in sink mode."))) {
+            goto end;
+        }
+        set_error(ERROR_ARGUMENT, 0);
+        ret = ERROR_ARGUMENT;
+        goto end;
+    }
+    if (!(f_msg->flags & F_FLAG_FD_PASS) && *src_fd != -1) { // 要求されていないディスクリプタは使わない
+        close(*src_fd);
+        *src_fd = -1;
+    }
+    if ((f_msg->flags & F_FLAG_FD_PASS) && (ret = check_passed_fd(*src_fd, f_msg->file_size))) {
+        if (send_e_msg(cfd, E_REASON_BAD_FD, 0, "passed file descriptor is not readable.")) {
+            ret = ERROR_SEND;
+        }
+        goto end;
+    }
+
+    // 受信中バイト数が上限を超える場合はデータ転送前にbusyを返す
+    if (!admission_reserve_bytes(&srv->admission, buffered_bytes(f_msg))) {
+        if ((ret = send_b_msg(cfd, srv->admission.retry_after_ms))) {
+            goto end;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "sended b_msg: inflight bytes limit exceeded");
+        rejected = true;
+        ret = ERROR_BUSY;
+        goto end;
+    }
+    *reserved = true;
+
+    if (srv->sink.kind != SINK_NONE) { // 保存先・容量の予約・ロックファイルは使わず、消費側を用意して受け付ける
+        if (sink_open(&srv->sink, f_msg, sink, reason, sizeof(reason))) {
+            if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, reason))) {
+                goto end;
+            }
+            DEBUG_MACRO(srv->debug_mode, true, "sended e_msg: %s", reason);
+            __atomic_add_fetch(&srv->sink_failed, 1, __ATOMIC_RELAXED);
+            set_error(ERROR_SYSTEM, 0);
+            rejected = true;
+            ret = ERROR_SYSTEM;
+            goto end;
+        }
+        if ((ret = send_a_msg(cfd))) { // serverに対してa_msgを送信③
+            goto end;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "sended a_msg (sink)");
+        ret = NORMAL;
+        goto end;
+    }
+
+    root = storage_place(&srv->storage, f_msg->file_name, space); // ファイル名から保存先のディスクを決める
+    if (concatenate_path(srv->storage.roots[root].path, f_msg->file_name, full_path, sizeof(full_path))) {
+        goto end;
+    }
+    if (f_msg->flags & F_FLAG_VERIFY) { // 保存済みのファイルを読むだけのため、容量の予約やロックファイルは使わない
+        *lock_file_path = create_lock_file_name(full_path);
+        if (*lock_file_path == NULL) {
+            ret = ERROR_SYSTEM;
+            goto end;
+        }
+        if (access(*lock_file_path, F_OK) == 0) { // 受信中のファイルは照合しない
+            free(*lock_file_path);
+            *lock_file_path = NULL;
+            if ((ret = send_e_msg(cfd, E_REASON_LOCK_EXISTS, 0, "lock file exist."))) {
+                goto end;
+            }
+            set_error(ERROR_LOCK_EXISTS, 0);
+            rejected = true;
+            ret = ERROR_LOCK_EXISTS;
+            goto end;
+        }
+        free(*lock_file_path);
+        *lock_file_path = NULL;
+        *fd = open(full_path, O_RDONLY | O_CLOEXEC);
+        if (*fd == -1 && errno != ENOENT) { // ないファイルは空のファイルとして照合し、全体を送り直させる
+            set_error(ERROR_FILE_OPEN, errno);
+            ret = ERROR_FILE_OPEN;
+            if (send_e_msg(cfd, E_REASON_OTHER, 0, "cannot open the stored file.")) {
+                ret = ERROR_SEND;
+            }
+            rejected = true;
+            goto end;
+        }
+        ret = NORMAL;
+        goto end;
+    }
+    if (strchr(f_msg->file_name, '/') != NULL && make_parent_dirs(full_path, strlen(srv->storage.roots[root].path))) { // ディレクトリの構造ごと送られたファイル
+        set_error(ERROR_FILE_OPEN, errno);
+        ret = ERROR_FILE_OPEN;
+        if (send_e_msg(cfd, E_REASON_OTHER, 0, "cannot create the parent directory.")) {
+            ret = ERROR_SEND;
+        }
+        rejected = true;
+        goto end;
+    }
+
+    // 書き込めないことが分かっているデータは受信しない。空き容量から受信中のセッションの予約分を除いて判断する
+    // 追記と書き換えは既存の内容を残すため、上書きで空く領域を数えない
+    // 穴を除いた転送は穴にブロックを割り当てないため、データ領域の分だけを予約する
+    if (storage_reserve(&srv->storage, root, (f_msg->flags & (F_FLAG_APPEND | F_FLAG_REPAIR)) ? NULL : full_path, data_bytes(f_msg), space, &available)) {
+        snprintf(reason, sizeof(reason), "insufficient storage: %llu bytes requested, %llu bytes available.", data_bytes(f_msg), available);
+        if ((ret = send_e_msg(cfd, E_REASON_NO_SPACE, available, reason))) {
+            goto end;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "sended e_msg: %s", reason);
+        set_error(ERROR_NO_SPACE, ENOSPC);
+        rejected = true;
+        ret = ERROR_NO_SPACE;
+        goto end;
+    }
+
+    *lock_file_path = create_lock_file_name(full_path);
+    if (*lock_file_path == NULL) {
+        ret = ERROR_SYSTEM;
+        goto end;
+    }
+
+    // ロックファイルのオープン
+    *lock_fd = open_lock_file(*lock_file_path);
+    if (*lock_fd < 0) { // ロックファイルのエラー処理
+        switch (*lock_fd) {
+        case -2:
+            if ((ret = send_e_msg(cfd, E_REASON_LOCK_EXISTS, 0, "lock file exist."))) { // serverに対してa_msgを送信③
+                goto end;
+            }
+            ret = ERROR_LOCK_EXISTS;
+            break;
+
+        case -3:
+            if ((ret = send_e_msg(cfd, E_REASON_LOCK_CREATE, 0, "lock file create error."))) { // serverに対してa_msgを送信③
+                goto end;
+            }
+            ret = ERROR_LOCK_CREATE;
+            break;
+
+        default:
+            if ((ret = send_e_msg(cfd, E_REASON_OTHER, 0, "error occurred related to the lock file."))) { // serverに対してa_msgを送信③
+               goto end;
+            }
+            ret = ERROR_SYSTEM;
+            break;
+        }
+        rejected = true;
+        goto end;
+    }
+
+    // 受信ファイルのオープン
+    *fd = (f_msg->flags & (F_FLAG_APPEND | F_FLAG_REPAIR)) ? open_append_file(full_path) : open_recv_file(full_path); // 書き換えは照合で一致した範囲を残す
+    if (*fd < 0) { // 受信ファイルのエラー処理
+        ret = ERROR_FILE_OPEN;
+        goto end;
+    }
+    if (f_msg->flags & F_FLAG_APPEND) { // 送信側が知っている位置とサーバー側のサイズが異なる場合は、サーバー側のサイズを返して送り直させる
+        if ((ret = get_file_size(*fd, &available))) {
+            goto end;
+        }
+        if (available != f_msg->offset) {
+            snprintf(reason, sizeof(reason), "append offset %llu does not match the stored size %llu.", f_msg->offset, available);
+            close(*fd);
+            *fd = -1;
+            close(*lock_fd);
+            *lock_fd = -1;
+            close_lock_file(*lock_file_path);
+            *lock_file_path = NULL;
+            if ((ret = send_e_msg(cfd, E_REASON_OFFSET, available, reason))) {
+                goto end;
+            }
+            DEBUG_MACRO(srv->debug_mode, true, "sended e_msg: %s", reason);
+            set_error(ERROR_DIFF_FILESIZE, 0);
+            rejected = true;
+            ret = ERROR_DIFF_FILESIZE;
+            goto end;
+        }
+    }
+
+    if ((ret = send_a_msg(cfd))) { // serverに対してa_msgを送信③
+        goto end;
+    }
+
+    DEBUG_MACRO(srv->debug_mode, true, "sended a_msg");
+
+    ret = NORMAL;
+end:
+    if (rejected && (f_msg->flags & F_FLAG_OPTIMISTIC)) {
+        discard_optimistic_data(srv, cfd, f_msg->file_size);
+    }
+    return ret;
+}
+
+static enum error_code finish_sink(struct transfer_server *srv, int cfd, struct sink_session *sink, struct session_deadline *dl, unsigned long long file_size, unsigned long long received) // 渡したサイズを検証し、消費側の受け取り確認を待つ
+{
+    enum error_code ret = ERROR_SYSTEM;
+    char reason[BUFFER_SIZE];
+    int finished;
+
+    if (received != file_size) { // 消費側には確定させない
+        sink_abort(sink);
+        set_error(ERROR_DIFF_FILESIZE, 0);
+        ret = ERROR_DIFF_FILESIZE;
+        if (send_e_msg(cfd, E_REASON_SIZE_MISMATCH, 0, "The specified file size does not match the received file size.")) {
+            ret = ERROR_SEND;
+        }
+        goto end;
+    }
+    deadline_watch_fd(dl, -1); // sink_finish()が閉じるため外す（確認待ちはSINK_ACK_TIMEOUT_MSで打ち切られる）
+    deadline_throttle(dl, true); // 消費側の確認を待つ間はクライアントが遅いとみなさない
+    finished = sink_finish(sink, reason, sizeof(reason));
+    deadline_throttle(dl, false);
+    if (finished) {
+        DEBUG_MACRO(srv->debug_mode, true, "sink failed: %s", reason);
+        __atomic_add_fetch(&srv->sink_failed, 1, __ATOMIC_RELAXED);
+        set_error(ERROR_SYSTEM, 0);
+        ret = ERROR_SYSTEM;
+        if (send_e_msg(cfd, E_REASON_OTHER, 0, reason)) {
+            ret = ERROR_SEND;
+        }
+        goto end;
+    }
+    __atomic_add_fetch(&srv->sink_acked, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&srv->sink_bytes, received, __ATOMIC_RELAXED);
+    DEBUG_MACRO(srv->debug_mode, true, "sink acknowledged %llu bytes", received);
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code put_session(struct transfer_server *srv, int cfd, const struct f_message *f_msg, int src_fd, int fd, struct sink_session *sink, struct space_reservation *space, int lock_fd, char *lock_file_path, struct rate_session *rs, struct session_deadline *dl)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    unsigned long long file_size = f_msg->file_size;
+    unsigned long long start = (f_msg->flags & F_FLAG_APPEND) ? f_msg->offset : 0; // 追記の場合はbegin_session()でサーバー側のサイズと一致することを確認済み
+    int priority = f_msg->priority;
+    unsigned char flags = f_msg->flags;
+    unsigned long long wait_us = 0;
+    unsigned long long received = 0;
+    struct stream_reader sr;
+
+    memset(&sr, 0, sizeof(sr));
+    if (sink->fd != -1) { // 消費側に直接渡す④
+        deadline_watch_fd(dl, sink->fd); // 期限切れの時は消費側への書き込みも止める
+        ret = receive_to_sink(srv, cfd, sink, (flags & F_FLAG_STREAM) ? &sr : NULL, rs, dl,
+                              (flags & (F_FLAG_STREAM | F_FLAG_KEEPALIVE)) == F_FLAG_KEEPALIVE ? file_size : ULLONG_MAX, &received);
+    } else if (src_fd != -1) { // ディスクリプタを受け取った場合はソケットを経由せずに複製する④
+        ret = copy_passed_file(srv, src_fd, fd, space, rs, dl, priority, &wait_us, file_size);
+    } else if (flags & F_FLAG_SPARSE) { // データ領域だけを受け取り、穴は書き込まない④
+        ret = receive_sparse(srv, cfd, fd, space, rs, dl, priority, &wait_us, file_size, f_msg->offset);
+    } else if (flags & F_FLAG_STREAM) { // サイズの分からないデータはt_msgまで受け取る④
+        ret = receive_file(srv, cfd, fd, 0, space, &sr, rs, dl, priority, &wait_us, ULLONG_MAX);
+    } else { // clientから送られるファイルを受け取り、保存する④
+        ret = receive_file(srv, cfd, fd, (off_t)start, space, NULL, rs, dl, priority, &wait_us, (flags & F_FLAG_KEEPALIVE) ? file_size : ULLONG_MAX);
+    }
+    if (ret) {
+        goto end;
+    }
+
+    latency_hist_record(&srv->queue_wait[priority], wait_us);
+    DEBUG_MACRO(srv->debug_mode, true, "received file : class %d, scheduler wait %llu us", priority, wait_us);
+
+    if (flags & F_FLAG_STREAM) { // 終端のt_msgで送られたサイズとCRC-32Cを検証し、以降はそのサイズでファイルを検証する
+        if (!sr.finished) { // t_msgの前に切断された
+            set_error(ERROR_RECEIVED, 0);
+            ret = ERROR_RECEIVED;
+            goto end;
+        }
+        if (sr.total != sr.trailer.total_size || sr.crc != sr.trailer.crc32c) {
+            DEBUG_MACRO(srv->debug_mode, true, "stream mismatch: %llu bytes crc %08x, trailer %llu bytes crc %08x",
+                        sr.total, sr.crc, sr.trailer.total_size, sr.trailer.crc32c);
+            if (sr.total != sr.trailer.total_size) {
+                ret = ERROR_DIFF_FILESIZE;
+                if (send_e_msg(cfd, E_REASON_SIZE_MISMATCH, 0, "The stream trailer size does not match the received data size.")) {
+                    ret = ERROR_SEND;
+                }
+            } else {
+                ret = ERROR_CHECKSUM;
+                if (send_e_msg(cfd, E_REASON_CHECKSUM, 0, "The stream trailer checksum does not match the received data.")) {
+                    ret = ERROR_SEND;
+                }
+            }
+            set_error(ret, 0);
+            goto end;
+        }
+        file_size = sr.total;
+        DEBUG_MACRO(srv->debug_mode, true, "stream verified: %llu bytes crc %08x", sr.total, sr.crc);
+    }
+
+    if (sink->fd != -1) {
+        if ((ret = finish_sink(srv, cfd, sink, dl, file_size, received))) {
+            goto end;
+        }
+    } else if ((ret = verify_data_size(start + file_size, fd))) { // ファイルのデータサイズ検証⑥ サイズに問題なければ、a_msgをclientに送信
+        if (ret == ERROR_DIFF_FILESIZE) {
+            if (send_e_msg(cfd, E_REASON_SIZE_MISMATCH, 0, "The specified file size does not match the received file size.")) {
+                ret = ERROR_SEND;
+            }
+        }
+        goto end;
+    }
+
+    DEBUG_MACRO(srv->debug_mode, true, "verified file size :%llu", start + file_size);
+
+    if ((ret = send_a_msg(cfd))) { // a_msgをclientに送信 ⑦
+        goto end;
+    }
+
+    DEBUG_MACRO(srv->debug_mode, true, "sended a_msg");
+
+    ret = NORMAL;
+
+end:
+    deadline_watch_fd(dl, -1);
+    sink_abort(sink); // 受け取りを確認した後は何もしない
+    if (fd != -1 && close_file_descriptor(fd) && ret == NORMAL) { // 処理結果を上書きしないようにする
+        ret = ERROR_SYSTEM;
+    }
+    if (lock_fd >= 0) { // 接続維持や追記でセッションが続いてもロックファイルのディスクリプタを溜めない
+        close(lock_fd);
+    }
+    close_lock_file(lock_file_path);
+    return ret;
+}
+
+static enum error_code verify_session(struct transfer_server *srv, int cfd, int fd, struct session_deadline *dl) // 保存済みのファイルのハッシュ木を計算し、根と葉を返す④
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct merkle_tree tree;
+    unsigned long long file_size = 0;
+    int built;
+
+    merkle_init(&tree);
+    if (fd != -1 && (ret = get_file_size(fd, &file_size))) {
+        goto end;
+    }
+    deadline_throttle(dl, true); // サーバー側で読んでいる間はクライアントが遅いとみなさない
+    built = merkle_build(&tree, fd, file_size, srv->hash_threads);
+    deadline_throttle(dl, false);
+    if (built) {
+        set_error(ERROR_FILE_OPEN, errno);
+        ret = ERROR_FILE_OPEN;
+        if (send_e_msg(cfd, E_REASON_OTHER, 0, "cannot hash the stored file.")) {
+            ret = ERROR_SEND;
+        }
+        goto end;
+    }
+    if ((ret = send_m_msg(cfd, tree.file_size, tree.leaf_num, tree.root, tree.leaves))) { // 葉は4MiBあたり32バイトのため、差分を探す往復を省いて全て送る
+        goto end;
+    }
+    __atomic_add_fetch(&srv->verify_sessions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&srv->verify_bytes, file_size, __ATOMIC_RELAXED);
+    DEBUG_MACRO(srv->debug_mode, true, "sended m_msg: %llu bytes, %llu leaves", tree.file_size, tree.leaf_num);
+    ret = NORMAL;
+end:
+    merkle_free(&tree);
+    if (fd != -1) {
+        close(fd);
+    }
+    return ret;
+}
+
+static void get_peer_address(int cfd, char *addr, size_t size) // 接続元のアドレスを文字列で取得（ポート番号は含めない）
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    addr[0] = '\0';
+    if (getpeername(cfd, (struct sockaddr *)&peer, &peer_len)) {
+        return;
+    }
+    if (peer.ss_family == AF_UNIX) { // 同一ホストの接続元はユーザーごとに帯域を制限する
+        if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+            snprintf(addr, size, "uid:%u", (unsigned int)cred.uid);
+        }
+    } else if (peer.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr, addr, size);
+    } else if (peer.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr, addr, size);
+    }
+}
+
+static bool hand_over_session(struct transfer_server *srv, int cfd) // 待機中のセッションを引き継ぎ先のサーバーに渡す（渡せない場合はfalse）
+{
+    bool handed = false;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->handover_fd != -1 && send_h_msg(srv->handover_fd, HANDOVER_SESSION, 0, 0, cfd) == NORMAL) {
+        srv->handed_sessions++;
+        handed = true;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    clear_error();
+    return handed;
+}
+
+static bool wait_next_session(struct transfer_server *srv, int cfd, struct session_deadline *dl) // 接続維持モードで次のf_msgを待つ（届いた場合はtrue）
+{
+    struct pollfd fds[2];
+    char peek;
+
+    // TLSなどの転送路は内部にバッファを持つため、届いたかどうかは読み込みで確認する
+    if (transport_of(cfd) == &transport_socket) {
+        fds[0].fd = cfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = srv->stop_fd;
+        fds[1].events = POLLIN;
+        while (poll(fds, 2, -1) == -1) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && (fds[1].revents & POLLIN)) { // 停止要求
+            deadline_end(dl); // 渡した後に期限切れのshutdown()が行われないようにする
+            if (dl->expired == EXPIRED_NONE && hand_over_session(srv, cfd)) {
+                DEBUG_MACRO(srv->debug_mode, true, "keepalive connection handed over");
+            } else {
+                DEBUG_MACRO(srv->debug_mode, true, "keepalive connection closed on stop");
+            }
+            return false;
+        }
+    }
+    if (transport_read(cfd, &peek, sizeof(peek), MSG_PEEK) <= 0) {
+        DEBUG_MACRO(srv->debug_mode, true, "keepalive connection closed");
+        return false;
+    }
+    return true;
+}
+
+static void *handle_client(void *thread_args)
+{
+    struct client_thread_args *args = (struct client_thread_args *)thread_args;
+
+    struct transfer_server *srv = args->srv;
+    int cfd = args->cfd;
+
+    struct f_message f_msg = {0};
+    char *lock_file_path = NULL;
+
+    int fd = -1; // 受信ファイルのディスクリプタ
+    int lock_fd = -1; // ロックファイルディスクリプタ
+    int src_fd = -1;  // クライアントから受け取った送信元ファイルのディスクリプタ
+    struct sink_session sink; // 消費側に渡す場合の接続先
+    struct space_reservation space = {0}; // 受信ファイルを書き込むデバイスと予約した容量
+    bool reserved = false; // 受信中バイト数を予約したか
+    struct rate_session rs;
+    struct session_deadline dl; // 受信開始・無通信・最低スループットの期限
+    char peer_addr[PEER_ADDR_MAX_LEN] = {0};
+    char tls_desc[TLS_INFO_MAX_LEN];
+    struct timespec started;
+
+    sink_session_init(&sink);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    DEBUG_MACRO(srv->debug_mode, true, "NEW Client connected");
+
+    if (srv->unix_path[0] == '\0' && !srv->udp && tuning_apply_connected(cfd, &srv->tuning, false, srv->debug_mode, true)) { // UNIXドメインソケットとUDPにTCPの調整項目はない
+        DEBUG_MACRO(srv->debug_mode, true, "socket tuning failed");
+    }
+    get_peer_address(cfd, peer_addr, sizeof(peer_addr));
+    rate_session_begin(&srv->rate_limiter, &rs, peer_addr);
+    deadline_begin(&dl, &srv->wheel, &srv->deadlines, cfd);
+    if (srv->transport != NULL && !srv->udp && transport_attach(cfd, srv->transport, true, NULL)) { // 転送路のハンドシェイクも受信開始の期限内に行う
+        DEBUG_MACRO(srv->debug_mode, true, "%s transport setup failed: %s", srv->transport->name, strerror(errno));
+        goto end;
+    }
+    if (tls_info(cfd, tls_desc, sizeof(tls_desc)) == 0) {
+        DEBUG_MACRO(srv->debug_mode, true, "tls established %s", tls_desc);
+    }
+
+    for (;;) {
+        if (begin_session(srv, cfd, &f_msg, &src_fd, &fd, &sink, &space, &lock_fd, &lock_file_path, &reserved)) {
+            goto end;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "==== begin session success ====");
+        deadline_set_phase(&dl, PHASE_TRANSFER);
+
+        if (f_msg.priority >= PRIORITY_CLASS_NUM) {
+            f_msg.priority = DEFAULT_PRIORITY_CLASS;
+        }
+        if (f_msg.flags & F_FLAG_VERIFY) { // データは受け取らない
+            if (verify_session(srv, cfd, fd, &dl)) {
+                goto end;
+            }
+        } else if (put_session(srv, cfd, &f_msg, src_fd, fd, &sink, &space, lock_fd, lock_file_path, &rs, &dl)) {
+            goto end;
+        }
+        if (src_fd != -1) {
+            close(src_fd);
+            src_fd = -1;
+        }
+        latency_hist_record(&srv->session_latency[f_msg.priority], elapsed_us(&started));
+        DEBUG_MACRO(srv->debug_mode, true, "==== put session success ====");
+
+        admission_release_bytes(&srv->admission, buffered_bytes(&f_msg));
+        reserved = false;
+        storage_release(&space);
+        fd = -1;
+        lock_fd = -1;
+        lock_file_path = NULL;
+
+        if (!(f_msg.flags & F_FLAG_KEEPALIVE)) {
+            break;
+        }
+        // 接続維持モードでは同じ接続で次のf_msgを待つ。クライアントが接続を閉じた場合は終了
+        deadline_set_phase(&dl, PHASE_IDLE);
+        if (!wait_next_session(srv, cfd, &dl)) { // 停止中は引き継ぎ先に渡すか閉じる
+            break;
+        }
+        deadline_set_phase(&dl, PHASE_HANDSHAKE);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+
+end:
+    deadline_end(&dl); // 期限切れのshutdown()が閉じた後のディスクリプタに行われないよう、close()より前に外す
+    if (dl.expired != EXPIRED_NONE) {
+        DEBUG_MACRO(srv->debug_mode, true, "session closed: %s", deadline_reason_string(dl.expired));
+    }
+    rate_session_end(&srv->rate_limiter, &rs);
+    if (reserved) {
+        admission_release_bytes(&srv->admission, buffered_bytes(&f_msg));
+    }
+    storage_release(&space); // 途中で失敗した場合も書き込まなかった分の予約を返す
+    sink_abort(&sink);
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+    transport_close(cfd);
+    clear_error(); // 呼び出し元のスレッドでセッションを処理した場合に、次の接続へエラーを持ち越さない
+    admission_leave_session(&srv->admission); // これ以降srvに触れない（transfer_server_destroy()が解放する）
+    if (args != NULL) {
+        free(args);
+    }
+
+    return NULL;
+
+}
+
+static void reject_client(struct transfer_server *srv, int cfd)
+{
+    char drain[BUFFER_SIZE];
+
+    send_b_msg(cfd, srv->admission.retry_after_ms); // 過負荷のためbusyを返して即座に切断する
+    transport_shutdown(cfd, SHUT_WR);
+    // 既に届いているf_msgを読み捨て、未読データによるRSTでbusy応答が失われないようにする
+    while (transport_read(cfd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+    }
+    transport_close(cfd);
+}
+
+static int accept_client(struct transfer_server *srv, int lfd, int *spare_fd, unsigned int *backoff_ms)
+{
+    int cfd;
+
+    cfd = srv->udp ? rudp_accept(lfd) : accept(lfd, NULL, NULL); // UDPでは接続要求以外のパケットもEAGAINになる
+    if (cfd != -1) {
+        *backoff_ms = 0;
+        return cfd;
+    }
+
+    switch (errno) {
+    case EAGAIN: // 他のスレッドが先に受け付けた
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO: // 接続単位のエラーは即座に再試行
+        break;
+    case EMFILE:
+    case ENFILE: // ディスクリプタ枯渇時は予備のディスクリプタを解放して受け付け、busyを返して切断する
+        if (*spare_fd != -1) {
+            close(*spare_fd);
+            *spare_fd = -1;
+            cfd = srv->udp ? rudp_accept(lfd) : accept(lfd, NULL, NULL);
+            if (cfd != -1) {
+                reject_client(srv, cfd);
+            }
+            *spare_fd = open("/dev/null", O_RDONLY);
+        }
+        /* fall through */
+    default: // リソース不足などは指数バックオフで待ってから再試行
+        *backoff_ms = (*backoff_ms == 0) ? 10 : *backoff_ms * 2;
+        if (*backoff_ms > ACCEPT_BACKOFF_MAX_MS) {
+            *backoff_ms = ACCEPT_BACKOFF_MAX_MS;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "accept failed: %s, backoff %u ms", strerror(errno), *backoff_ms);
+        usleep(*backoff_ms * 1000);
+        break;
+    }
+    return -1;
+}
+
+static void start_session(struct transfer_server *srv, int cfd, const pthread_attr_t *attr) // 受け付けた接続のセッションを開始する
+{
+    struct client_thread_args *args;
+    pthread_t tid;
+    int s;
+
+    if (!admission_enter_session(&srv->admission)) { // 同時セッション数の上限を超えた場合はスレッドを生成せずに拒否
+        DEBUG_MACRO(srv->debug_mode, true, "reject: session limit exceeded");
+        reject_client(srv, cfd);
+        return;
+    }
+
+    args = malloc(sizeof(struct client_thread_args));
+    if (args == NULL) { // メモリ不足の場合もサーバーは停止せずに接続を拒否する
+        admission_leave_session(&srv->admission);
+        reject_client(srv, cfd);
+        return;
+    }
+
+    args->srv = srv;
+    args->cfd = cfd;
+
+    if (srv->inline_sessions) { // 呼び出し元のスレッドでセッションを処理する
+        handle_client(args);
+        return;
+    }
+
+    s = pthread_create(&tid, attr, handle_client, (void *)args);
+    if (s != 0) { // スレッド生成に失敗した場合も接続を拒否して受け付けを継続
+        DEBUG_MACRO(srv->debug_mode, true, "reject: pthread_create failed %s", strerror(s));
+        free(args);
+        admission_leave_session(&srv->admission);
+        reject_client(srv, cfd);
+    }
+}
+
+static enum error_code communication_data(struct transfer_server *srv, int lfd, int cpu)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    int cfd = -1;
+    int spare_fd = -1;
+    unsigned int backoff_ms = 0;
+    pthread_attr_t attr;
+    cpu_set_t cpu_set;
+    struct pollfd fds[2];
+    int s;
+
+    s = pthread_attr_init(&attr);
+    if (s != 0) {
+        set_error(ERROR_SYSTEM, s);
+        return ERROR_SYSTEM;
+    }
+    if (cpu >= 0) { // workerスレッドもaccept loopと同じCPUに固定する
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        s = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+        if (s != 0) {
+            set_error(ERROR_SYSTEM, s);
+            ret = ERROR_SYSTEM;
+            goto end;
+        }
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    spare_fd = open("/dev/null", O_RDONLY); // EMFILE時に接続を拒否するための予備ディスクリプタ
+
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = srv->stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            set_error(ERROR_ACCEPT, errno);
+            ret = ERROR_ACCEPT;
+            goto end;
+        }
+        if (fds[1].revents & POLLIN) { // 停止要求
+            DEBUG_MACRO(srv->debug_mode, true, "stop requested");
+            break;
+        }
+
+        cfd = accept_client(srv, lfd, &spare_fd, &backoff_ms);
+        if (cfd == -1) {
+            continue;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "accept");
+        start_session(srv, cfd, &attr);
+    }
+
+    ret = NORMAL;
+end:
+    pthread_attr_destroy(&attr);
+    if (spare_fd != -1) {
+        close(spare_fd);
+    }
+    return ret;
+}
+
+static int usable_cpus(void) // tasksetやcpusetで制限されている場合は、その範囲のCPUの数
+{
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+        return CPU_COUNT(&allowed);
+    }
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static enum error_code assign_cpus(struct transfer_server *srv, int count) // プロセスが使用可能なCPUの一覧を取得し、リスナーに順番に割り当てる
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_num = 0;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        set_error(ERROR_SYSTEM, errno);
+        return ERROR_SYSTEM;
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[cpu_num++] = i;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        srv->cpus[i] = cpus[i % cpu_num];
+    }
+    return NORMAL;
+}
+
+static enum error_code setup_listeners(struct transfer_server *srv, const char *port_num, int count)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    int i;
+
+    if (srv->unix_path[0] != '\0') { // UNIXドメインソケットはSO_REUSEPORTで分散できないため、1つのリスナーを共有する
+        srv->cpus[0] = -1;
+        return setup_unix_server(srv, &srv->lfds[0]);
+    }
+    if (srv->udp) { // 接続要求は1つのソケットで受け、接続ごとに専用のソケットを割り当てる
+        srv->cpus[0] = -1;
+        return setup_udp_server(srv, &srv->lfds[0], port_num);
+    }
+    if (count == 1) { // シャーディングしない場合はCPUを固定しない
+        srv->cpus[0] = -1;
+        return setup_server(srv, &srv->lfds[0], port_num, false, -1);
+    }
+
+    if ((ret = assign_cpus(srv, count))) {
+        goto end;
+    }
+    for (i = 0; i < count; i++) {
+        if ((ret = setup_server(srv, &srv->lfds[i], port_num, true, srv->cpus[i]))) { // CPUごとにSO_REUSEPORTのリスナーを生成
+            goto end;
+        }
+    }
+    DEBUG_MACRO(srv->debug_mode, true, "==== setup %d sharded listeners success ====", count);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static int start_library_thread(pthread_t *thread, void *(*routine)(void *), void *arg) // シグナルを受け取らないスレッドを生成する
+{
+    sigset_t all;
+    sigset_t old_set;
+    int s;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old_set);
+    s = pthread_create(thread, NULL, routine, arg);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return s;
+}
+
+static void set_handover_timeout(int fd, unsigned int timeout_ms) // 0の場合は無期限に待つ
+{
+    struct timeval timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static enum error_code receive_handover(int fd, enum handover_kind kind, struct h_message *h_msg, int *passed_fd) // 指定した種類のh_msgを受け取る
+{
+    enum error_code ret;
+
+    if ((ret = receive_h_msg(fd, h_msg, passed_fd))) {
+        return ret;
+    }
+    if (h_msg->kind != kind || ((kind == HANDOVER_LISTENER || kind == HANDOVER_SESSION) && *passed_fd == -1)) {
+        if (*passed_fd != -1) {
+            close(*passed_fd);
+            *passed_fd = -1;
+        }
+        set_error(ERROR_RECEIVED, EPROTO);
+        return ERROR_RECEIVED;
+    }
+    return NORMAL;
+}
+
+static enum error_code hand_over_listeners(struct transfer_server *srv, int conn) // 新しいサーバーにリスナーを渡し、受け付けを止める
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct h_message h_msg;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    int passed_fd = -1;
+    int i;
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || (cred.uid != geteuid() && cred.uid != 0)) { // 別のユーザーのプロセスには渡さない
+        set_error(ERROR_ACCEPT, EPERM);
+        ret = ERROR_ACCEPT;
+        goto end;
+    }
+    set_handover_timeout(conn, HANDOVER_TIMEOUT_MS);
+    if ((ret = receive_handover(conn, HANDOVER_REQUEST, &h_msg, &passed_fd))) {
+        goto end;
+    }
+    for (i = 0; i < srv->listener_num; i++) {
+        if ((ret = send_h_msg(conn, HANDOVER_LISTENER, srv->listener_num, i, srv->lfds[i]))) {
+            goto end;
+        }
+    }
+    // 新しいサーバーの準備ができるまでは受け付けを続ける（失敗した場合はこのまま稼働する）
+    if ((ret = receive_handover(conn, HANDOVER_READY, &h_msg, &passed_fd))) {
+        goto end;
+    }
+
+    // リスナーのキューは共有しているため、受け付けを止めても届いた接続は新しいサーバーが受け付ける
+    close(srv->upgrade_fd);
+    srv->upgrade_fd = -1;
+    unlink(srv->upgrade_path);
+    srv->unix_bound = false; // UNIXドメインソケットのファイルは引き継ぎ先が削除する
+    if ((ret = send_h_msg(conn, HANDOVER_DONE, 0, 0, -1))) {
+        goto end;
+    }
+    set_handover_timeout(conn, 0);
+    pthread_mutex_lock(&srv->lock);
+    srv->handover_fd = conn;
+    pthread_mutex_unlock(&srv->lock);
+    transfer_server_stop(srv);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static void *upgrade_loop(void *arg) // 新しいサーバーからの引き継ぎ要求を待つ
+{
+    struct transfer_server *srv = (struct transfer_server *)arg;
+    struct pollfd fds[2];
+    int conn;
+
+    fds[0].fd = srv->upgrade_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = srv->stop_fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        conn = accept4(srv->upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            continue;
+        }
+        if (hand_over_listeners(srv, conn) == NORMAL) {
+            DEBUG_MACRO(srv->debug_mode, true, "handed over %d listeners, draining sessions", srv->listener_num);
+            break;
+        }
+        DEBUG_MACRO(srv->debug_mode, true, "handover failed, continue serving");
+        close(conn);
+        clear_error();
+    }
+    return NULL;
+}
+
+static void *takeover_loop(void *arg) // 引き継ぎ元のサーバーから待機中の接続維持セッションを受け取る
+{
+    struct transfer_server *srv = (struct transfer_server *)arg;
+    struct h_message h_msg;
+    pthread_attr_t attr;
+    int cfd;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (receive_handover(srv->takeover_fd, HANDOVER_SESSION, &h_msg, &cfd) == NORMAL) { // 引き継ぎ元が終了すると切断される
+        __atomic_add_fetch(&srv->taken_sessions, 1, __ATOMIC_RELAXED);
+        DEBUG_MACRO(srv->debug_mode, true, "took over keepalive connection");
+        start_session(srv, cfd, &attr);
+    }
+    clear_error();
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+static enum error_code take_over_listeners(struct transfer_server *srv, bool *taken) // 稼働中のサーバーがupgrade_pathで待ち受けていればリスナーを引き継ぐ
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+    struct h_message h_msg;
+    socklen_t length;
+    int passed_fd = -1;
+    int type;
+    int domain;
+    int i, j;
+
+    *taken = false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, srv->upgrade_path);
+
+    srv->takeover_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv->takeover_fd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (connect(srv->takeover_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        if (errno == ENOENT || errno == ECONNREFUSED) { // 稼働中のサーバーがない場合は自分でリスナーを用意する
+            close(srv->takeover_fd);
+            srv->takeover_fd = -1;
+            ret = NORMAL;
+            goto end;
+        }
+        ret = ERROR_CONNECT;
+        set_error(ret, errno);
+        goto end;
+    }
+    set_handover_timeout(srv->takeover_fd, HANDOVER_TIMEOUT_MS);
+    if ((ret = send_h_msg(srv->takeover_fd, HANDOVER_REQUEST, 0, 0, -1))) {
+        goto end;
+    }
+
+    for (i = 0; srv->lfds == NULL || i < srv->listener_num; i++) {
+        if ((ret = receive_handover(srv->takeover_fd, HANDOVER_LISTENER, &h_msg, &passed_fd))) {
+            goto end;
+        }
+        if (h_msg.index != (unsigned int)i || h_msg.count == 0 || h_msg.count > CPU_SETSIZE ||
+            (srv->lfds != NULL && h_msg.count != (unsigned int)srv->listener_num)) {
+            close(passed_fd);
+            ret = ERROR_RECEIVED;
+            set_error(ret, EPROTO);
+            goto end;
+        }
+        if (srv->lfds == NULL) { // リスナー数は引き継ぎ元に合わせる
+            srv->lfds = malloc(h_msg.count * sizeof(int));
+            srv->cpus = malloc(h_msg.count * sizeof(int));
+            if (srv->lfds == NULL || srv->cpus == NULL) {
+                close(passed_fd);
+                ret = ERROR_SYSTEM;
+                set_error(ret, errno);
+                goto end;
+            }
+            for (j = 0; j < (int)h_msg.count; j++) {
+                srv->lfds[j] = -1;
+            }
+            srv->listener_num = (int)h_msg.count;
+        }
+        srv->lfds[i] = passed_fd;
+        srv->cpus[i] = -1;
+
+        // 待ち受けの設定が異なるリスナーは引き継がない
+        length = sizeof(type);
+        getsockopt(passed_fd, SOL_SOCKET, SO_TYPE, &type, &length);
+        length = sizeof(domain);
+        getsockopt(passed_fd, SOL_SOCKET, SO_DOMAIN, &domain, &length);
+        if (type != (srv->udp ? SOCK_DGRAM : SOCK_STREAM) || (domain == AF_UNIX) != (srv->unix_path[0] != '\0')) {
+            ret = ERROR_ARGUMENT;
+            set_error(ret, EINVAL);
+            goto end;
+        }
+    }
+
+    if (srv->listener_num > 1) { // シャーディングしている場合は自分のCPUの割り当てに合わせ直す
+        if ((ret = assign_cpus(srv, srv->listener_num))) {
+            goto end;
+        }
+        for (i = 0; i < srv->listener_num; i++) {
+            setsockopt(srv->lfds[i], SOL_SOCKET, SO_INCOMING_CPU, &srv->cpus[i], sizeof(int));
+        }
+    }
+    if (srv->unix_path[0] != '\0') { // 引き継いだソケットファイルは終了時に自分が削除する
+        srv->unix_bound = true;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Took over %d listeners from %s", srv->listener_num, srv->upgrade_path);
+    *taken = true;
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code finish_takeover(struct transfer_server *srv) // 受け付けを開始できることを通知し、引き継ぎ元が受け付けを止めるのを待つ
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct h_message h_msg;
+    int passed_fd = -1;
+    int s;
+
+    if ((ret = send_h_msg(srv->takeover_fd, HANDOVER_READY, 0, 0, -1))) {
+        goto end;
+    }
+    if ((ret = receive_handover(srv->takeover_fd, HANDOVER_DONE, &h_msg, &passed_fd))) {
+        goto end;
+    }
+    set_handover_timeout(srv->takeover_fd, 0); // 以降は引き継ぎ元のセッションが終わるまで待機中のセッションが届く
+
+    s = start_library_thread(&srv->takeover_thread, takeover_loop, srv);
+    if (s != 0) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, s);
+        goto end;
+    }
+    srv->takeover_started = true;
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+static enum error_code setup_upgrade_listener(struct transfer_server *srv) // 次に起動するサーバーからの引き継ぎ要求を待ち受ける
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+    struct stat stat_buf;
+    int s;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, srv->upgrade_path);
+
+    // 接続できなかったソケットファイルは前回の起動で残ったもの（ソケット以外のファイルは上書きしない）
+    if (lstat(srv->upgrade_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode)) {
+        unlink(srv->upgrade_path);
+    }
+    srv->upgrade_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->upgrade_fd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (bind(srv->upgrade_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ret = ERROR_BIND;
+        set_error(ret, errno);
+        close(srv->upgrade_fd);
+        srv->upgrade_fd = -1;
+        goto end;
+    }
+    chmod(srv->upgrade_path, 0600);
+    if (listen(srv->upgrade_fd, 1)) {
+        ret = ERROR_LISTEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    s = start_library_thread(&srv->upgrade_thread, upgrade_loop, srv);
+    if (s != 0) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, s);
+        goto end;
+    }
+    srv->upgrade_started = true;
+    DEBUG_MACRO(srv->debug_mode, true, " Waiting for upgrade on %s", srv->upgrade_path);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code transfer_server_create(struct transfer_server **srv_ptr, const struct server_config *config)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct transfer_server *srv = NULL;
+    char cwd[MAX_PATH_LEN];
+    const char *cwd_ptr = cwd;
+    const char *const *roots = &cwd_ptr;
+    unsigned int root_count = 1;
+    bool taken = false;
+    int count;
+    int i;
+
+    *srv_ptr = NULL;
+    if ((config->port_num == NULL && config->unix_path == NULL) || (config->udp && config->port_num == NULL) || config->listener_count < 0) {
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
+        goto end;
+    }
+
+    srv = calloc(1, sizeof(struct transfer_server));
+    if (srv == NULL) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    srv->stop_fd = -1;
+    srv->upgrade_fd = -1;
+    srv->handover_fd = -1;
+    srv->takeover_fd = -1;
+    srv->debug_mode = config->debug_mode;
+    srv->inline_sessions = config->inline_sessions;
+    srv->udp = config->udp && config->unix_path == NULL;
+
+    if (config->unix_path != NULL) {
+        if (*config->unix_path == '\0' || strlen(config->unix_path) >= sizeof(srv->unix_path)) {
+            ret = ERROR_ARGUMENT;
+            set_error(ret, 0);
+            goto end;
+        }
+        strcpy(srv->unix_path, config->unix_path);
+    }
+    if (config->upgrade_path != NULL) {
+        if (*config->upgrade_path == '\0' || strlen(config->upgrade_path) >= sizeof(srv->upgrade_path)) {
+            ret = ERROR_ARGUMENT;
+            set_error(ret, 0);
+            goto end;
+        }
+        strcpy(srv->upgrade_path, config->upgrade_path);
+    }
+    if (config->sink_exec != NULL || config->sink_unix != NULL) { // 消費側はコマンドかソケットのどちらか1つ
+        const char *target = (config->sink_exec != NULL) ? config->sink_exec : config->sink_unix;
+
+        if ((config->sink_exec != NULL && config->sink_unix != NULL) || *target == '\0' || strlen(target) >= sizeof(srv->sink.target) ||
+            (config->sink_unix != NULL && strlen(target) >= sizeof(((struct sockaddr_un *)0)->sun_path))) {
+            ret = ERROR_ARGUMENT;
+            set_error(ret, 0);
+            goto end;
+        }
+        srv->sink.kind = (config->sink_exec != NULL) ? SINK_EXEC : SINK_UNIX;
+        strcpy(srv->sink.target, target);
+        srv->sink.buffer_bytes = (config->sink_buffer_bytes != 0) ? config->sink_buffer_bytes : SINK_DEFAULT_BUFFER;
+    }
+    srv->hash_threads = (config->hash_threads != 0) ? config->hash_threads : merkle_default_threads();
+
+    if (config->storage_root_count > 0) { // 複数の保存先はファイル名で振り分ける
+        roots = config->storage_roots;
+        root_count = config->storage_root_count;
+    } else if (config->base_path != NULL && *config->base_path != '\0') {
+        roots = &config->base_path;
+    } else if (getcwd(cwd, sizeof(cwd)) == NULL) { // 保存先の指定がない場合はカレントディレクトリ
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (storage_init(&srv->storage, roots, root_count, config->placement)) {
+        ret = (errno == ENAMETOOLONG) ? ERROR_BUFFER_OVERFLOW : ERROR_FILE_OPEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    srv->storage.min_free = config->min_free_bytes;
+
+    admission_init(&srv->admission, config->max_sessions, config->max_inflight_bytes, config->retry_after_ms);
+    rate_limiter_init(&srv->rate_limiter, config->peer_rate, config->session_rate, config->total_rate);
+    if (storage_start(&srv->storage, config->storage_writers, config->sched_slots, config->class_weights)) {
+        ret = (errno == EINVAL) ? ERROR_ARGUMENT : ERROR_SYSTEM;
+        set_error(ret, (errno == EINVAL) ? 0 : errno);
+        goto end;
+    }
+    DEBUG_MACRO(srv->debug_mode, true, " Storage %u roots on %u devices", srv->storage.root_num, srv->storage.device_num);
+    for (i = 0; i < PRIORITY_CLASS_NUM; i++) {
+        latency_hist_init(&srv->session_latency[i]);
+        latency_hist_init(&srv->queue_wait[i]);
+    }
+    pthread_mutex_init(&srv->lock, NULL);
+
+    srv->tuning = config->tuning;
+    srv->transport = config->transport;
+    srv->deadlines.handshake_timeout_ms = config->handshake_timeout_ms;
+    srv->deadlines.idle_timeout_ms = config->idle_timeout_ms;
+    srv->deadlines.min_rate = config->min_rate;
+    timer_wheel_init(&srv->wheel, DEFAULT_TICK_MS);
+    i = timer_wheel_start(&srv->wheel);
+    if (i != 0) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, i);
+        goto end;
+    }
+
+    srv->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (srv->stop_fd == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    // 稼働中のサーバーがあればリスナーを引き継ぎ、ポートを閉じずに入れ替わる
+    if (srv->upgrade_path[0] != '\0' && (ret = take_over_listeners(srv, &taken))) {
+        goto end;
+    }
+
+    if (!taken) {
+        count = config->listener_count;
+        if (count == 0) {
+            count = usable_cpus(); // assign_cpus()が割り当てるCPUと同じ数にし、同じCPUに重ねない
+        }
+        if (srv->unix_path[0] != '\0' || srv->udp) {
+            count = 1;
+        }
+        srv->lfds = malloc(count * sizeof(int));
+        srv->cpus = malloc(count * sizeof(int));
+        if (srv->lfds == NULL || srv->cpus == NULL) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+        for (i = 0; i < count; i++) {
+            srv->lfds[i] = -1;
+        }
+        srv->listener_num = count;
+
+        if ((ret = setup_listeners(srv, config->port_num, count))) {
+            goto end;
+        }
+    } else if ((ret = finish_takeover(srv))) {
+        goto end;
+    }
+    if (srv->upgrade_path[0] != '\0' && (ret = setup_upgrade_listener(srv))) {
+        goto end;
+    }
+
+    *srv_ptr = srv;
+    srv = NULL;
+    ret = NORMAL;
+end:
+    if (srv != NULL) {
+        transfer_server_destroy(srv);
+    }
+    return ret;
+}
+
+int transfer_server_listener_count(const struct transfer_server *srv)
+{
+    return srv->listener_num;
+}
+
+enum error_code transfer_server_run(struct transfer_server *srv) // transfer_server_stop()が呼ばれるまで呼び出し元のスレッドで受け付けを行う
+{
+    int index;
+    int cpu;
+    cpu_set_t cpu_set;
+
+    // 呼び出しごとに次のリスナーを担当する（リスナー数を超えた分は同じリスナーを共有する）
+    pthread_mutex_lock(&srv->lock);
+    index = srv->next_listener++ % srv->listener_num;
+    pthread_mutex_unlock(&srv->lock);
+
+    cpu = srv->cpus[index];
+    if (cpu >= 0) { // シャーディング時はaccept loopを担当CPUに固定
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        DEBUG_MACRO(srv->debug_mode, true, "listener started on cpu %d", cpu);
+    }
+
+    return communication_data(srv, srv->lfds[index], cpu);
+}
+
+void transfer_server_stop(struct transfer_server *srv) // シグナルハンドラからも呼び出せる
+{
+    uint64_t value = 1;
+
+    if (write(srv->stop_fd, &value, sizeof(value)) == -1) {
+        set_error(ERROR_SYSTEM, errno);
+    }
+}
+
+void transfer_server_destroy(struct transfer_server *srv) // 全てのtransfer_server_run()が戻った後に呼び出す
+{
+    int i;
+
+    if (srv == NULL) {
+        return;
+    }
+    if (srv->stop_fd != -1) { // 待機中の接続維持セッションと引き継ぎ要求の待ち受けを終わらせる
+        transfer_server_stop(srv);
+    }
+    if (srv->upgrade_started) {
+        pthread_join(srv->upgrade_thread, NULL);
+    }
+    if (srv->takeover_started) {
+        shutdown(srv->takeover_fd, SHUT_RDWR);
+        pthread_join(srv->takeover_thread, NULL);
+    }
+    if (srv->takeover_fd != -1) {
+        close(srv->takeover_fd);
+    }
+    admission_wait_idle(&srv->admission); // 処理中のセッションが終わるまで待つ
+    if (srv->handover_fd != -1) { // 引き継ぎ先は切断を引き継ぎの完了として扱う
+        close(srv->handover_fd);
+    }
+    if (srv->upgrade_fd != -1) {
+        close(srv->upgrade_fd);
+        unlink(srv->upgrade_path);
+    }
+    timer_wheel_stop(&srv->wheel);
+    storage_stop(&srv->storage);
+    if (srv->lfds != NULL) {
+        for (i = 0; i < srv->listener_num; i++) {
+            if (srv->lfds[i] != -1) {
+                close(srv->lfds[i]);
+            }
+        }
+    }
+    if (srv->unix_bound) { // 自分がバインドしたソケットファイルだけを削除する
+        unlink(srv->unix_path);
+    }
+    if (srv->stop_fd != -1) {
+        close(srv->stop_fd);
+    }
+    free(srv->lfds);
+    free(srv->cpus);
+    free(srv);
+}
+
+void transfer_server_dump_stats(struct transfer_server *srv, FILE *fp)
+{
+    char time_stamp[50];
+    char name[32];
+    int i;
+
+    get_time(time_stamp, sizeof(time_stamp));
+    fprintf(fp, "%s\n", time_stamp);
+
+    pthread_mutex_lock(&srv->admission.lock);
+    fprintf(fp, "sessions active=%u max=%u inflight_bytes=%llu max=%llu\n",
+            srv->admission.active_sessions, srv->admission.max_sessions, srv->admission.inflight_bytes, srv->admission.max_inflight_bytes);
+    pthread_mutex_unlock(&srv->admission.lock);
+
+    for (i = 0; i < PRIORITY_CLASS_NUM; i++) {
+        fprintf(fp, "class %d weight=%u\n", i, srv->storage.devices[0].scheduler.weight[i]);
+        snprintf(name, sizeof(name), "  session_latency[%d]", i);
+        latency_hist_dump(fp, name, &srv->session_latency[i]);
+        snprintf(name, sizeof(name), "  queue_wait[%d]", i);
+        latency_hist_dump(fp, name, &srv->queue_wait[i]);
+    }
+    storage_dump(&srv->storage, fp);
+    fprintf(fp, "handover handed_sessions=%llu taken_sessions=%llu\n",
+            __atomic_load_n(&srv->handed_sessions, __ATOMIC_RELAXED), __atomic_load_n(&srv->taken_sessions, __ATOMIC_RELAXED));
+    if (srv->sink.kind != SINK_NONE) {
+        fprintf(fp, "sink %s acked=%llu failed=%llu bytes=%llu\n", (srv->sink.kind == SINK_EXEC) ? "exec" : "unix",
+                __atomic_load_n(&srv->sink_acked, __ATOMIC_RELAXED), __atomic_load_n(&srv->sink_failed, __ATOMIC_RELAXED),
+                __atomic_load_n(&srv->sink_bytes, __ATOMIC_RELAXED));
+    }
+    fprintf(fp, "verify sessions=%llu bytes=%llu threads=%u\n",
+            __atomic_load_n(&srv->verify_sessions, __ATOMIC_RELAXED), __atomic_load_n(&srv->verify_bytes, __ATOMIC_RELAXED), srv->hash_threads);
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "crc32c.h"
+#include "sink.h"
+
+extern char **environ;
+
+void sink_session_init(struct sink_session *ss)
+{
+    ss->fd = -1;
+    ss->pid = 0;
+    ss->total = 0;
+    ss->crc = 0;
+}
+
+static void set_buffer(int fd, int option, unsigned long long size) // 消費側との間に溜める量を制限する
+{
+    int value = (size > (unsigned long long)(1 << 30)) ? (1 << 30) : (int)size;
+
+    setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value));
+}
+
+static void set_write_timeout(int fd) // 消費側が止まってもワーカースレッドとロックを占有し続けないようにする
+{
+    struct timeval tv = {SINK_WRITE_TIMEOUT_MS / 1000, (SINK_WRITE_TIMEOUT_MS % 1000) * 1000};
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static char **build_env(const struct f_message *f_msg, char *name_env, size_t name_size, char *size_env, size_t size_size, char *priority_env, size_t priority_size)
+{
+    char **envp;
+    size_t count = 0;
+    size_t i;
+    size_t n = 0;
+
+    while (environ[count] != NULL) {
+        count++;
+    }
+    envp = malloc((count + 4) * sizeof(char *));
+    if (envp == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        envp[n++] = environ[i];
+    }
+    // ファイル名はクライアントが決めるため、コマンドに埋め込まず環境変数で渡す
+    snprintf(name_env, name_size, "TRANSFER_FILE_NAME=%.*s", FILENAME_MAX_LEN, f_msg->file_name);
+    envp[n++] = name_env;
+    if (!(f_msg->flags & F_FLAG_STREAM)) { // ストリーミング転送のサイズは分からない
+        snprintf(size_env, size_size, "TRANSFER_FILE_SIZE=%llu", f_msg->file_size);
+        envp[n++] = size_env;
+    }
+    snprintf(priority_env, priority_size, "TRANSFER_PRIORITY=%u", (unsigned int)f_msg->priority);
+    envp[n++] = priority_env;
+    envp[n] = NULL;
+    return envp;
+}
+
+static int open_exec(const struct sink_config *config, const struct f_message *f_msg, struct sink_session *ss)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[] = {"/bin/sh", "-c", (char *)config->target, NULL};
+    char name_env[FILENAME_MAX_LEN + 32];
+    char size_env[64];
+    char priority_env[32];
+    char **envp = NULL;
+    int sv[2] = {-1, -1};
+    int s;
+    int ret = -1;
+
+    // パイプではなくソケットにすると、消費側が先に終了してもMSG_NOSIGNALでSIGPIPEを避けられる
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+        return -1;
+    }
+    set_buffer(sv[0], SO_SNDBUF, config->buffer_bytes);
+    set_write_timeout(sv[0]);
+    set_buffer(sv[1], SO_RCVBUF, config->buffer_bytes);
+
+    envp = build_env(f_msg, name_env, sizeof(name_env), size_env, sizeof(size_env), priority_env, sizeof(priority_env));
+    if (envp == NULL) {
+        goto end;
+    }
+    if ((s = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = s;
+        goto end;
+    }
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1); // 他のセッションのソケットを子プロセスに持たせない
+    s = posix_spawn(&ss->pid, "/bin/sh", &actions, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    if (s != 0) {
+        ss->pid = 0;
+        errno = s;
+        goto end;
+    }
+    ss->fd = sv[0];
+    sv[0] = -1;
+    ret = 0;
+end:
+    if (sv[0] != -1) {
+        close(sv[0]);
+    }
+    close(sv[1]);
+    free(envp);
+    return ret;
+}
+
+static int receive_reply(int fd, char *reason, size_t reason_size) // 消費側の応答を受け取る（a_msg以外は-1とreason）
+{
+    struct a_message a_msg;
+    struct e_message e_msg;
+    struct b_message b_msg;
+    char type = 0;
+    int ret = -1;
+
+    if (recvn(fd, &type, sizeof(type), MSG_PEEK) != sizeof(type)) {
+        snprintf(reason, reason_size, "consumer closed without acknowledgement.");
+        return -1;
+    }
+    if (type == 'A' && receive_a_msg(fd, &a_msg) == NORMAL) {
+        ret = 0;
+    } else if (type == 'E' && receive_e_msg(fd, &e_msg) == NORMAL) {
+        e_msg.error_message[sizeof(e_msg.error_message) - 1] = '\0';
+        snprintf(reason, reason_size, "consumer rejected: %s", e_msg.error_message);
+    } else if (type == 'B' && receive_b_msg(fd, &b_msg) == NORMAL) {
+        snprintf(reason, reason_size, "consumer busy.");
+    } else {
+        snprintf(reason, reason_size, "consumer sent an invalid acknowledgement.");
+    }
+    clear_error();
+    return ret;
+}
+
+static int open_unix(const struct sink_config *config, const struct f_message *f_msg, struct sink_session *ss, char *reason, size_t reason_size)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = {SINK_ACK_TIMEOUT_MS / 1000, (SINK_ACK_TIMEOUT_MS % 1000) * 1000};
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        snprintf(reason, reason_size, "consumer socket: %s", strerror(errno));
+        return -1;
+    }
+    set_buffer(fd, SO_SNDBUF, config->buffer_bytes);
+    set_write_timeout(fd);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // 消費側の応答を待つ上限
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config->target, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        snprintf(reason, reason_size, "consumer unavailable: %s", strerror(errno));
+        goto fail;
+    }
+    // 失敗した転送を消費側が完了と取り違えないよう、t_msgで終わるストリーミング転送で渡す
+    if (send_f_msg(fd, f_msg->file_size, f_msg->file_name, f_msg->priority, F_FLAG_STREAM)) {
+        clear_error();
+        snprintf(reason, reason_size, "consumer unavailable: %s", strerror(errno));
+        goto fail;
+    }
+    if (receive_reply(fd, reason, reason_size)) { // 消費側が受け付けない場合はクライアントにも拒否を返す
+        goto fail;
+    }
+    ss->fd = fd;
+    return 0;
+fail:
+    close(fd);
+    return -1;
+}
+
+int sink_open(const struct sink_config *config, const struct f_message *f_msg, struct sink_session *ss, char *reason, size_t reason_size) // 受信するファイルごとに消費側を用意する
+{
+    sink_session_init(ss);
+    switch (config->kind) {
+    case SINK_EXEC:
+        if (open_exec(config, f_msg, ss)) {
+            snprintf(reason, reason_size, "consumer could not be started: %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    case SINK_UNIX:
+        return open_unix(config, f_msg, ss, reason, reason_size);
+    default:
+        snprintf(reason, reason_size, "no consumer configured.");
+        return -1;
+    }
+}
+
+int sink_write(struct sink_session *ss, const void *data, size_t size) // 消費側が読み取るまで戻らない（SINK_WRITE_TIMEOUT_MSを超えた場合は-1）
+{
+    const char *p = data;
+    ssize_t sent;
+    unsigned int length;
+
+    if (ss->pid == 0) { // ソケットの消費側にはd_msgで渡す
+        ss->crc = crc32c_update(ss->crc, data, size);
+        ss->total += size;
+        for (; size > 0; p += length, size -= length) {
+            length = (size > STREAM_CHUNK_MAX) ? STREAM_CHUNK_MAX : (unsigned int)size;
+            if (send_d_msg(ss->fd, p, length)) {
+                clear_error();
+                return -1;
+            }
+        }
+        return 0;
+    }
+    while (size > 0) {
+        sent = send(ss->fd, p, size, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static int wait_exit(pid_t pid, int *status) // 期限までに終了しない場合は強制終了する（タイムアウトは-1）
+{
+    struct pollfd pfd;
+    int pidfd;
+    int ret = 0;
+
+    pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd != -1) {
+        pfd.fd = pidfd;
+        pfd.events = POLLIN;
+        while ((ret = poll(&pfd, 1, SINK_ACK_TIMEOUT_MS)) == -1 && errno == EINTR) {
+        }
+        close(pidfd);
+        if (ret == 0) {
+            kill(pid, SIGKILL);
+            ret = -1;
+        } else {
+            ret = 0;
+        }
+    }
+    while (waitpid(pid, status, 0) == -1 && errno == EINTR) {
+    }
+    return ret;
+}
+
+static int finish_exec(struct sink_session *ss, char *reason, size_t reason_size)
+{
+    int status = 0;
+
+    if (wait_exit(ss->pid, &status)) {
+        snprintf(reason, reason_size, "consumer did not exit within %d ms.", SINK_ACK_TIMEOUT_MS);
+        return -1;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    }
+    if (WIFSIGNALED(status)) {
+        snprintf(reason, reason_size, "consumer killed by signal %d.", WTERMSIG(status));
+    } else {
+        snprintf(reason, reason_size, "consumer exited with status %d.", WEXITSTATUS(status));
+    }
+    return -1;
+}
+
+static int finish_unix(struct sink_session *ss, char *reason, size_t reason_size)
+{
+    if (send_t_msg(ss->fd, ss->total, ss->crc)) {
+        clear_error();
+        snprintf(reason, reason_size, "consumer closed before the end of data.");
+        return -1;
+    }
+    return receive_reply(ss->fd, reason, reason_size); // 消費側が保存を終えるとa_msgが届く
+}
+
+int sink_finish(struct sink_session *ss, char *reason, size_t reason_size) // データの終わりを知らせ、消費側の確認を待つ（確認できない場合は-1とreason）
+{
+    int ret;
+
+    if (ss->pid > 0) {
+        close(ss->fd); // 標準入力の終わりを知らせる。消費側が孫プロセスに標準入力を渡していても終了を待てるようにする
+        ss->fd = -1;
+        ret = finish_exec(ss, reason, reason_size);
+        ss->pid = 0;
+        return ret;
+    }
+    ret = finish_unix(ss, reason, reason_size);
+    close(ss->fd);
+    ss->fd = -1;
+    return ret;
+}
+
+void sink_abort(struct sink_session *ss) // 途中で失敗したデータを消費側に確定させない
+{
+    int status;
+
+    if (ss->fd != -1) {
+        close(ss->fd); // ソケットの消費側はt_msgの前に切断されたことで失敗を知る
+        ss->fd = -1;
+    }
+    if (ss->pid > 0) {
+        kill(ss->pid, SIGKILL);
+        while (waitpid(ss->pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        ss->pid = 0;
+    }
+}
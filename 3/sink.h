@@ -0,0 +1,51 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "socket_msg.h"
+
+#define SINK_TARGET_MAX_LEN 1024           // 消費側のコマンドまたはソケットファイルの最大長
+#define SINK_DEFAULT_BUFFER (1024 * 1024)  // 消費側との間に溜めるデータの上限の既定値
+#define SINK_ACK_TIMEOUT_MS 60000          // データを渡し終えてから消費側の確認を待つ上限
+#define SINK_WRITE_TIMEOUT_MS 60000        // 消費側が読み取らない状態で書き込みを待つ上限
+
+/*
+ * 受信したデータをファイルに保存せず、消費側のプロセスまたはUNIXドメインソケットへ直接渡す
+ * 間に溜めるのはソケットバッファの分だけで、消費側が遅い場合はサーバーも受信を止めて送信側を待たせる
+ * 消費側の受け取り確認（プロセスは終了コード0、ソケットはa_msg）を得てからクライアントにa_msgを返す
+ */
+
+enum sink_kind {
+    SINK_NONE, // ファイルに保存する
+    SINK_EXEC, // ファイルごとにコマンドを起動し、標準入力に流す（名前は環境変数TRANSFER_FILE_NAMEで渡す）
+    SINK_UNIX  // ファイルごとにソケットへ接続し、ストリーミング転送のクライアントとして送る（-uで待ち受ける別のサーバーも消費側になれる）
+};
+
+struct sink_config
+{
+    enum sink_kind kind;
+    char target[SINK_TARGET_MAX_LEN]; // SINK_EXECは/bin/sh -cで実行するコマンド、SINK_UNIXはソケットファイル
+    unsigned long long buffer_bytes;  // 消費側との間のソケットバッファの大きさ
+};
+
+struct sink_session
+{
+    int fd;    // 消費側へ書き込むソケット（-1の場合は接続していない）
+    pid_t pid; // SINK_EXECで起動したプロセス（0の場合は起動していない）
+    unsigned long long total; // SINK_UNIXでt_msgに載せる、渡したデータの合計
+    unsigned int crc;         // SINK_UNIXでt_msgに載せる、渡したデータのCRC-32C
+};
+
+void sink_session_init(struct sink_session *ss);
+
+int sink_open(const struct sink_config *config, const struct f_message *f_msg, struct sink_session *ss, char *reason, size_t reason_size);
+
+int sink_write(struct sink_session *ss, const void *data, size_t size);
+
+int sink_finish(struct sink_session *ss, char *reason, size_t reason_size);
+
+void sink_abort(struct sink_session *ss);
+
+#endif // SINK_H
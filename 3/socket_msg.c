@@ -2,13 +2,15 @@
 #include <sys/socket.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "socket_msg.h"
 #include "error.h"
 #include "common.h"
+#include "transport.h"
 
 /* f message */
 
-enum error_code send_f_msg(int socket, unsigned long long file_size, char *file_name)
+enum error_code send_f_msg(int socket, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags)
 {
     enum error_code ret = ERROR_SYSTEM;
     struct f_message f_msg;
@@ -18,6 +20,8 @@ enum error_code send_f_msg(int socket, unsigned long long file_size, char *file_
     f_msg.file_size = file_size;
     strncpy(f_msg.file_name, file_name, sizeof(f_msg.file_name) - 1); // '\0'終端になるように
     f_msg.file_name[sizeof(f_msg.file_name) - 1] = '\0';
+    f_msg.priority = priority;
+    f_msg.flags = flags;
 
     if (sendn(socket, &f_msg, sizeof(struct f_message)) == -1 ) {
         ret = ERROR_SEND;
@@ -30,6 +34,56 @@ end:
     return ret;
 }
 
+enum error_code send_f_msg_append(int socket, unsigned long long offset, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags) // offsetの位置からの追記を要求する
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct f_message f_msg;
+
+    memset(&f_msg, 0, sizeof(struct f_message));
+    f_msg.message_type = 'F';
+    f_msg.file_size = file_size;
+    strncpy(f_msg.file_name, file_name, sizeof(f_msg.file_name) - 1);
+    f_msg.file_name[sizeof(f_msg.file_name) - 1] = '\0';
+    f_msg.priority = priority;
+    f_msg.flags = flags | F_FLAG_APPEND;
+    f_msg.offset = offset;
+
+    if (sendn(socket, &f_msg, sizeof(struct f_message)) == -1) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code send_f_msg_sparse(int socket, unsigned long long file_size, unsigned long long data_size, const char *file_name, unsigned char priority, unsigned char flags) // 穴を除いたdata_size分だけを送ることを通知する
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct f_message f_msg;
+
+    memset(&f_msg, 0, sizeof(struct f_message));
+    f_msg.message_type = 'F';
+    f_msg.file_size = file_size;
+    strncpy(f_msg.file_name, file_name, sizeof(f_msg.file_name) - 1);
+    f_msg.file_name[sizeof(f_msg.file_name) - 1] = '\0';
+    f_msg.priority = priority;
+    f_msg.flags = flags | F_FLAG_SPARSE;
+    f_msg.offset = data_size;
+
+    if (sendn(socket, &f_msg, sizeof(struct f_message)) == -1) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
 enum error_code receive_f_msg(int socket, struct f_message *f_msg)
 {
     enum error_code ret = ERROR_SYSTEM;
@@ -46,10 +100,147 @@ enum error_code receive_f_msg(int socket, struct f_message *f_msg)
         set_error(ERROR_RECEIVED, errno);
         ret = ERROR_RECEIVED;
         goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct f_message)) { // 途中で切断された
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+static ssize_t send_with_fd(int socket, const void *buffer, size_t size, int pass_fd) // ディスクリプタは最初の1バイトと一緒に届くよう、メッセージの先頭に添付する
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t send_bytes;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+
+    do {
+        send_bytes = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (send_bytes == -1 && errno == EINTR);
+    if (send_bytes == -1 ||
+        (send_bytes < (ssize_t)size && sendn(socket, (const char *)buffer + send_bytes, size - send_bytes) == -1)) {
+        return -1;
+    }
+    return size;
+}
+
+static ssize_t receive_with_fd(int socket, void *buffer, size_t size, int *passed_fd) // 戻り値はrecvn()と同じ（添付がない場合は*passed_fdが-1）
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))]; // 2つ目以降のディスクリプタは切り捨てられ、カーネルが閉じる
+    ssize_t recv_bytes;
+    ssize_t rest_bytes;
+
+    *passed_fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        recv_bytes = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (recv_bytes == -1 && errno == EINTR);
+
+    if (recv_bytes > 0) {
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+                memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        if (recv_bytes < (ssize_t)size) { // 残りは通常の受信で読む
+            rest_bytes = recvn(socket, (char *)buffer + recv_bytes, size - recv_bytes, 0);
+            recv_bytes = (rest_bytes < 0) ? rest_bytes : recv_bytes + rest_bytes;
+        }
+    } else if (recv_bytes == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        recv_bytes = -2;
+    }
+    if (recv_bytes < 0 && *passed_fd != -1) {
+        close(*passed_fd);
+        *passed_fd = -1;
+    }
+    return recv_bytes;
+}
+
+enum error_code send_f_msg_fd(int socket, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags, int pass_fd)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct f_message f_msg;
+
+    memset(&f_msg, 0, sizeof(struct f_message));
+    f_msg.message_type = 'F';
+    f_msg.file_size = file_size;
+    strncpy(f_msg.file_name, file_name, sizeof(f_msg.file_name) - 1);
+    f_msg.file_name[sizeof(f_msg.file_name) - 1] = '\0';
+    f_msg.priority = priority;
+    f_msg.flags = flags | F_FLAG_FD_PASS;
+
+    if (send_with_fd(socket, &f_msg, sizeof(struct f_message), pass_fd) == -1) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_f_msg_fd(int socket, struct f_message *f_msg, int *passed_fd) // 添付されたディスクリプタも受け取る（ない場合は-1）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    *passed_fd = -1;
+    if (transport_of(socket) != &transport_socket) { // ディスクリプタを渡せるのはソケットだけ
+        return receive_f_msg(socket, f_msg);
+    }
+    recv_bytes = receive_with_fd(socket, f_msg, sizeof(struct f_message), passed_fd);
+
+    if (recv_bytes == -2) {
+        send_reset_packet(socket);
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct f_message)) { // 途中で切断された
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
     }
     ret = NORMAL;
 
 end:
+    if (ret != NORMAL && *passed_fd != -1) {
+        close(*passed_fd);
+        *passed_fd = -1;
+    }
     return ret;
 }
 
@@ -99,13 +290,15 @@ end:
 
 /* e message */
 
-enum error_code send_e_msg(int socket, char *msg)
+enum error_code send_e_msg(int socket, enum e_reason reason, unsigned long long available_bytes, char *msg)
 {
     enum error_code ret = ERROR_SYSTEM;
     struct e_message e_msg;
     memset(&e_msg, 0, sizeof(struct e_message));
 
     e_msg.message_type = 'E';
+    e_msg.reason = (unsigned char)reason;
+    e_msg.available_bytes = available_bytes;
 
     strncpy(e_msg.error_message, msg, sizeof(e_msg.error_message) - 1); // '\0'終端になるように
     e_msg.error_message[sizeof(e_msg.error_message) - 1] = '\0';
@@ -142,4 +335,422 @@ enum error_code receive_e_msg(int socket, struct e_message *e_msg)
 
 end:
     return ret;
-}
\ No newline at end of file
+}
+
+/* d message */
+
+enum error_code send_d_msg(int socket, const void *data, unsigned int length) // ヘッダとデータをまとめて送る
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct d_message d_msg;
+    struct iovec iov[2];
+    ssize_t send_bytes;
+    int iov_num = 2;
+
+    memset(&d_msg, 0, sizeof(struct d_message));
+    d_msg.message_type = 'D';
+    d_msg.length = length;
+
+    iov[0].iov_base = &d_msg;
+    iov[0].iov_len = sizeof(struct d_message);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+    while (iov_num > 0) {
+        send_bytes = transport_writev(socket, &iov[2 - iov_num], iov_num);
+        if (send_bytes <= 0) {
+            if (send_bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            ret = ERROR_SEND;
+            set_error(ERROR_SEND, errno);
+            goto end;
+        }
+        while (iov_num > 0 && (size_t)send_bytes >= iov[2 - iov_num].iov_len) { // 書き終えた要素を進める
+            send_bytes -= iov[2 - iov_num].iov_len;
+            iov_num--;
+        }
+        if (iov_num > 0) {
+            iov[2 - iov_num].iov_base = (char *)iov[2 - iov_num].iov_base + send_bytes;
+            iov[2 - iov_num].iov_len -= send_bytes;
+        }
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_d_msg(int socket, struct d_message *d_msg) // ヘッダだけを受け取る（データは呼び出し元が読む）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, d_msg, sizeof(struct d_message), 0);
+
+    if (recv_bytes == -2) {
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct d_message) || d_msg->message_type != 'D' || d_msg->length > STREAM_CHUNK_MAX) {
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* x message */
+
+enum error_code send_x_msg(int socket, unsigned long long offset, unsigned long long length) // ヘッダだけを送る（データは呼び出し元が送る）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct x_message x_msg;
+    memset(&x_msg, 0, sizeof(struct x_message));
+
+    x_msg.message_type = 'X';
+    x_msg.offset = offset;
+    x_msg.length = length;
+
+    if (sendn(socket, &x_msg, sizeof(struct x_message)) == -1 ) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_x_msg(int socket, struct x_message *x_msg) // ヘッダだけを受け取る（範囲の検証は呼び出し元が行う）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, x_msg, sizeof(struct x_message), 0);
+
+    if (recv_bytes == -2) {
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct x_message) || x_msg->message_type != 'X') {
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* m message */
+
+enum error_code send_m_msg(int socket, unsigned long long file_size, unsigned long long leaf_num, const unsigned char *root, const void *leaves) // 根と全ての葉を送る
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct m_message m_msg;
+    memset(&m_msg, 0, sizeof(struct m_message));
+
+    m_msg.message_type = 'M';
+    m_msg.file_size = file_size;
+    m_msg.chunk_size = MERKLE_CHUNK_SIZE;
+    m_msg.leaf_num = leaf_num;
+    memcpy(m_msg.root, root, MERKLE_HASH_LEN);
+
+    if (sendn(socket, &m_msg, sizeof(struct m_message)) == -1 ||
+        (leaf_num > 0 && sendn(socket, leaves, leaf_num * MERKLE_HASH_LEN) == -1)) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_m_msg(int socket, struct m_message *m_msg) // ヘッダだけを受け取る（葉は呼び出し元が読む）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, m_msg, sizeof(struct m_message), 0);
+
+    if (recv_bytes == -2) {
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct m_message) || m_msg->message_type != 'M' || m_msg->chunk_size != MERKLE_CHUNK_SIZE ||
+               m_msg->leaf_num != (m_msg->file_size + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE) { // 葉の数はサイズから決まる
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* t message */
+
+enum error_code send_t_msg(int socket, unsigned long long total_size, unsigned int crc32c)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct t_message t_msg;
+    memset(&t_msg, 0, sizeof(struct t_message));
+
+    t_msg.message_type = 'T';
+    t_msg.total_size = total_size;
+    t_msg.crc32c = crc32c;
+
+    if (sendn(socket, &t_msg, sizeof(struct t_message)) == -1 ) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_t_msg(int socket, struct t_message *t_msg)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, t_msg, sizeof(struct t_message), 0);
+
+    if (recv_bytes == -2) {
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct t_message) || t_msg->message_type != 'T') {
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* b message */
+
+enum error_code send_b_msg(int socket, unsigned int retry_after_ms)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct b_message b_msg;
+    memset(&b_msg, 0, sizeof(struct b_message));
+
+    b_msg.message_type = 'B';
+    b_msg.retry_after_ms = retry_after_ms;
+
+    if (sendn(socket, &b_msg, sizeof(struct b_message)) == -1 ) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_b_msg(int socket, struct b_message *b_msg)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, b_msg, sizeof(struct b_message), 0);
+
+    if (recv_bytes == -2) {
+        send_reset_packet(socket);
+        set_error(ERROR_TIMEOUT, errno);
+        ret = ERROR_TIMEOUT;
+        goto end;
+    } else if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* j message */
+
+enum error_code send_j_msg(int socket, char *host_name, char *port_num, char *file_path, char *file_name, unsigned char priority)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct j_message j_msg;
+    memset(&j_msg, 0, sizeof(struct j_message));
+
+    j_msg.message_type = 'J';
+    strncpy(j_msg.host_name, host_name, sizeof(j_msg.host_name) - 1); // '\0'終端になるように
+    strncpy(j_msg.port_num, port_num, sizeof(j_msg.port_num) - 1);
+    strncpy(j_msg.file_path, file_path, sizeof(j_msg.file_path) - 1);
+    strncpy(j_msg.file_name, file_name, sizeof(j_msg.file_name) - 1);
+    j_msg.priority = priority;
+
+    if (sendn(socket, &j_msg, sizeof(struct j_message)) == -1 ) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_j_msg(int socket, struct j_message *j_msg)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, j_msg, sizeof(struct j_message), 0);
+
+    if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct j_message) || j_msg->message_type != 'J') { // 切断または不正なメッセージ
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    j_msg->host_name[sizeof(j_msg->host_name) - 1] = '\0';
+    j_msg->port_num[sizeof(j_msg->port_num) - 1] = '\0';
+    j_msg->file_path[sizeof(j_msg->file_path) - 1] = '\0';
+    j_msg->file_name[sizeof(j_msg->file_name) - 1] = '\0';
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* r message */
+
+enum error_code send_r_msg(int socket, int error_code, int s_errno)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct r_message r_msg;
+    memset(&r_msg, 0, sizeof(struct r_message));
+
+    r_msg.message_type = 'R';
+    r_msg.error_code = error_code;
+    r_msg.s_errno = s_errno;
+
+    if (sendn(socket, &r_msg, sizeof(struct r_message)) == -1 ) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_r_msg(int socket, struct r_message *r_msg)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = recvn(socket, r_msg, sizeof(struct r_message), 0);
+
+    if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct r_message)) {
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+/* h message */
+
+enum error_code send_h_msg(int socket, enum handover_kind kind, unsigned int count, unsigned int index, int pass_fd) // pass_fdが-1の場合は添付しない
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct h_message h_msg;
+    ssize_t send_bytes;
+    memset(&h_msg, 0, sizeof(struct h_message));
+
+    h_msg.message_type = 'H';
+    h_msg.kind = (unsigned char)kind;
+    h_msg.count = count;
+    h_msg.index = index;
+
+    if (pass_fd == -1) {
+        send_bytes = sendn(socket, &h_msg, sizeof(struct h_message));
+    } else {
+        send_bytes = send_with_fd(socket, &h_msg, sizeof(struct h_message), pass_fd);
+    }
+    if (send_bytes == -1) {
+        ret = ERROR_SEND;
+        set_error(ERROR_SEND, errno);
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    return ret;
+}
+
+enum error_code receive_h_msg(int socket, struct h_message *h_msg, int *passed_fd)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    ssize_t recv_bytes;
+
+    recv_bytes = receive_with_fd(socket, h_msg, sizeof(struct h_message), passed_fd);
+
+    if (recv_bytes < 0) {
+        set_error(ERROR_RECEIVED, errno);
+        ret = ERROR_RECEIVED;
+        goto end;
+    } else if (recv_bytes < (ssize_t)sizeof(struct h_message) || h_msg->message_type != 'H') { // 切断または不正なメッセージ
+        set_error(ERROR_RECEIVED, 0);
+        ret = ERROR_RECEIVED;
+        goto end;
+    }
+    ret = NORMAL;
+
+end:
+    if (ret != NORMAL && *passed_fd != -1) {
+        close(*passed_fd);
+        *passed_fd = -1;
+    }
+    return ret;
+}
@@ -4,6 +4,31 @@
 #define FILENAME_MAX_LEN 200 // ファイル名の最大長
 #define MAX_PATH_LEN 1024
 #define BUFFER_SIZE 1024   	 // ファイル転送に使用するバッファサイズ
+#define PORT_FIELD_LEN 8         // j_msgのポート番号フィールド長
+
+#define F_FLAG_KEEPALIVE 0x01    // 転送後も接続を維持する。サーバーはSHUT_WRではなくfile_sizeで終端を判断する
+#define F_FLAG_OPTIMISTIC 0x02   // ③のa_msgを待たずにデータを送る。サーバーは受付を拒否した場合file_size分を読み捨てる
+#define OPTIMISTIC_MAX_SIZE (64 * 1024) // F_FLAG_OPTIMISTICを付けられるファイルサイズの上限（拒否時に読み捨てる量を抑える）
+#define F_FLAG_FD_PASS 0x04      // データを送らず、f_msgにSCM_RIGHTSで添付したディスクリプタの現在位置からfile_size分をサーバーが複製する（UNIXドメインソケットのみ）
+#define F_FLAG_STREAM 0x08       // サイズを決めずにd_msgの連続で送り、t_msgで終える。file_sizeは容量を予約する目安（0でよい）
+#define STREAM_CHUNK_MAX (1024 * 1024) // d_msg 1つあたりのデータの上限
+#define F_FLAG_APPEND 0x10       // 既存のファイルのoffsetの位置にfile_size分を追記する。サーバー側のサイズがoffsetと異なる場合は拒否する
+#define F_FLAG_SPARSE 0x20       // 穴を除いたデータ領域だけをx_msgの連続で送る。file_sizeは穴を含むサイズ、offsetはデータ領域の合計
+#define F_FLAG_VERIFY 0x40       // データを送らず、保存済みのファイルのハッシュ木をm_msgで受け取る（ファイルがない場合は空のファイルとして扱う）
+#define F_FLAG_REPAIR 0x80       // F_FLAG_SPARSEと組み合わせ、既存のファイルを切り詰めずにx_msgの範囲だけを書き換えてfile_sizeに合わせる
+#define MERKLE_CHUNK_SIZE (4 * 1024 * 1024) // ハッシュ木の葉1つが覆う範囲
+#define MERKLE_HASH_LEN 32       // SHA-256
+
+enum e_reason { // e_msgで受付や受信を拒否した理由
+    E_REASON_OTHER,
+    E_REASON_LOCK_EXISTS,    // 同名のファイルを受信中
+    E_REASON_LOCK_CREATE,    // ロックファイルを作成できない
+    E_REASON_NO_SPACE,       // 保存先の空き容量が足りない（available_bytesに受け付けられるサイズ）
+    E_REASON_BAD_FD,         // 添付されたディスクリプタから読み出せない
+    E_REASON_SIZE_MISMATCH,  // 受信したサイズがf_msgのサイズと一致しない
+    E_REASON_CHECKSUM,       // ストリーミング転送で受信したデータのCRC-32Cがt_msgと一致しない
+    E_REASON_OFFSET          // 追記の位置がサーバー側のファイルサイズと一致しない（available_bytesにサーバー側のサイズ）
+};
 
 #pragma pack(push, 1) 
 
@@ -12,6 +37,9 @@ struct f_message
     char message_type;
     unsigned long long file_size;
     char file_name[FILENAME_MAX_LEN];
+    unsigned char priority; // 優先度クラス（0が最優先）
+    unsigned char flags;    // F_FLAG_*
+    unsigned long long offset; // F_FLAG_APPENDの場合は書き込みを始める位置、F_FLAG_SPARSEの場合は送るデータ領域の合計
 };
 
 struct a_message
@@ -22,21 +50,135 @@ struct a_message
 struct e_message
 {
     char message_type;
+    unsigned char reason;              // enum e_reason
+    unsigned long long available_bytes; // E_REASON_NO_SPACEの場合、保存先が受け付けられるサイズ
     char error_message[BUFFER_SIZE];
 };
 
+struct d_message // ストリーミング転送のデータ。直後にlengthバイトのデータが続く
+{
+    char message_type;
+    unsigned int length;
+};
+
+struct t_message // ストリーミング転送の終端
+{
+    char message_type;
+    unsigned long long total_size; // 送ったデータの合計
+    unsigned int crc32c;           // 送ったデータ全体のCRC-32C
+};
+
+struct x_message // 穴を除いた転送のデータ領域。直後にlengthバイトのデータが続く（offset順に送り、offset=file_size、length=0で終える）
+{
+    char message_type;
+    unsigned long long offset; // ファイル内の位置
+    unsigned long long length;
+};
+
+struct m_message // ハッシュ木の根。直後にleaf_num個の葉（MERKLE_HASH_LENバイトずつ）が続く
+{
+    char message_type;
+    unsigned long long file_size;  // サーバー側のファイルのサイズ
+    unsigned int chunk_size;       // MERKLE_CHUNK_SIZE
+    unsigned long long leaf_num;
+    unsigned char root[MERKLE_HASH_LEN];
+};
+
+struct b_message
+{
+    char message_type;
+    unsigned int retry_after_ms; // 再試行までの待ち時間（ミリ秒）
+};
+
+/* エージェントとの間のメッセージ（UNIXドメインソケット） */
+
+struct j_message // 転送ジョブの依頼
+{
+    char message_type;
+    char host_name[FILENAME_MAX_LEN];
+    char port_num[PORT_FIELD_LEN];
+    char file_path[MAX_PATH_LEN];     // 送信するファイルの絶対パス
+    char file_name[FILENAME_MAX_LEN]; // サーバーに通知するファイル名
+    unsigned char priority;
+};
+
+struct r_message // 転送ジョブの結果
+{
+    char message_type;
+    int error_code; // enum error_code
+    int s_errno;
+};
+
+/* 稼働中のサーバーから新しいサーバーへの引き継ぎ（UNIXドメインソケット、ディスクリプタはSCM_RIGHTSで添付） */
+
+enum handover_kind {
+    HANDOVER_REQUEST = 'Q',  // 新しいサーバー→稼働中のサーバー: 引き継ぎの要求
+    HANDOVER_LISTENER = 'L', // リスナーを1つ添付（countはリスナーの総数、indexは番号）
+    HANDOVER_READY = 'Y',    // 新しいサーバーが受け付けを開始できる（稼働中のサーバーは受け付けを止める）
+    HANDOVER_DONE = 'D',     // 稼働中のサーバーが受け付けを止め、引き継ぎ用のソケットファイルを明け渡した
+    HANDOVER_SESSION = 'S'   // 待機中の接続維持セッションを1つ添付
+};
+
+struct h_message
+{
+    char message_type;
+    unsigned char kind;   // enum handover_kind
+    unsigned int count;
+    unsigned int index;
+};
+
 #pragma pack(pop) 
 
-enum error_code send_f_msg(int socket, unsigned long long file_size, char *file_name);
+enum error_code send_f_msg(int socket, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags);
 
 enum error_code receive_f_msg(int socket, struct f_message *f_msg);
 
+enum error_code send_f_msg_append(int socket, unsigned long long offset, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags);
+
+enum error_code send_f_msg_sparse(int socket, unsigned long long file_size, unsigned long long data_size, const char *file_name, unsigned char priority, unsigned char flags);
+
+enum error_code send_f_msg_fd(int socket, unsigned long long file_size, const char *file_name, unsigned char priority, unsigned char flags, int pass_fd);
+
+enum error_code receive_f_msg_fd(int socket, struct f_message *f_msg, int *passed_fd);
+
 enum error_code send_a_msg(int socket);
 
 enum error_code receive_a_msg(int socket, struct a_message *a_msg);
 
-enum error_code send_e_msg(int socket, char *e_msg);
+enum error_code send_e_msg(int socket, enum e_reason reason, unsigned long long available_bytes, char *e_msg);
 
 enum error_code receive_e_msg(int socket, struct e_message *e_msg);
 
+enum error_code send_d_msg(int socket, const void *data, unsigned int length);
+
+enum error_code receive_d_msg(int socket, struct d_message *d_msg);
+
+enum error_code send_t_msg(int socket, unsigned long long total_size, unsigned int crc32c);
+
+enum error_code receive_t_msg(int socket, struct t_message *t_msg);
+
+enum error_code send_x_msg(int socket, unsigned long long offset, unsigned long long length);
+
+enum error_code receive_x_msg(int socket, struct x_message *x_msg);
+
+enum error_code send_m_msg(int socket, unsigned long long file_size, unsigned long long leaf_num, const unsigned char *root, const void *leaves);
+
+enum error_code receive_m_msg(int socket, struct m_message *m_msg);
+
+enum error_code send_b_msg(int socket, unsigned int retry_after_ms);
+
+enum error_code receive_b_msg(int socket, struct b_message *b_msg);
+
+enum error_code send_j_msg(int socket, char *host_name, char *port_num, char *file_path, char *file_name, unsigned char priority);
+
+enum error_code receive_j_msg(int socket, struct j_message *j_msg);
+
+enum error_code send_r_msg(int socket, int error_code, int s_errno);
+
+enum error_code receive_r_msg(int socket, struct r_message *r_msg);
+
+enum error_code send_h_msg(int socket, enum handover_kind kind, unsigned int count, unsigned int index, int pass_fd);
+
+enum error_code receive_h_msg(int socket, struct h_message *h_msg, int *passed_fd);
+
 #endif // SOCKET_MSG_H
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+void latency_hist_init(struct latency_hist *hist)
+{
+    memset(hist, 0, sizeof(struct latency_hist));
+    pthread_mutex_init(&hist->lock, NULL);
+}
+
+void latency_hist_record(struct latency_hist *hist, unsigned long long us)
+{
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKET_NUM - 1 && (1ULL << bucket) <= us) {
+        bucket++;
+    }
+
+    pthread_mutex_lock(&hist->lock);
+    hist->count++;
+    hist->sum_us += us;
+    if (us > hist->max_us) {
+        hist->max_us = us;
+    }
+    hist->buckets[bucket]++;
+    pthread_mutex_unlock(&hist->lock);
+}
+
+static unsigned long long percentile(const unsigned long long *buckets, unsigned long long count, double ratio)
+{
+    unsigned long long target = (unsigned long long)(count * ratio);
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKET_NUM; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return 1ULL << i; // バケットの上限値を返す
+        }
+    }
+    return 1ULL << (LATENCY_BUCKET_NUM - 1);
+}
+
+void latency_hist_dump(FILE *fp, const char *name, struct latency_hist *hist)
+{
+    struct latency_hist snapshot;
+
+    pthread_mutex_lock(&hist->lock);
+    memcpy(&snapshot, hist, sizeof(snapshot));
+    pthread_mutex_unlock(&hist->lock);
+
+    if (snapshot.count == 0) {
+        fprintf(fp, "%-24s count=0\n", name);
+        return;
+    }
+    fprintf(fp, "%-24s count=%llu avg=%lluus p50<=%lluus p90<=%lluus p99<=%lluus max=%lluus\n",
+            name, snapshot.count, snapshot.sum_us / snapshot.count,
+            percentile(snapshot.buckets, snapshot.count, 0.50),
+            percentile(snapshot.buckets, snapshot.count, 0.90),
+            percentile(snapshot.buckets, snapshot.count, 0.99),
+            snapshot.max_us);
+}
+
+unsigned long long elapsed_us(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - from->tv_sec) * 1000000ULL + (now.tv_nsec - from->tv_nsec) / 1000;
+}
@@ -0,0 +1,27 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_BUCKET_NUM 40 // 2^nマイクロ秒ごとのバケット
+
+struct latency_hist
+{
+    pthread_mutex_t lock;
+    unsigned long long count;
+    unsigned long long sum_us;
+    unsigned long long max_us;
+    unsigned long long buckets[LATENCY_BUCKET_NUM];
+};
+
+void latency_hist_init(struct latency_hist *hist);
+
+void latency_hist_record(struct latency_hist *hist, unsigned long long us);
+
+void latency_hist_dump(FILE *fp, const char *name, struct latency_hist *hist);
+
+unsigned long long elapsed_us(const struct timespec *from);
+
+#endif // STATS_H
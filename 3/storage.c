@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include "storage.h"
+
+static unsigned int hash_name(const char *name) // FNV-1a
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    // 近い文字列の値が偏らないように混ぜる（murmur3のfinalizer）
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int compare_point(const void *a, const void *b)
+{
+    const struct ring_point *x = a;
+    const struct ring_point *y = b;
+
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+int storage_init(struct storage *st, const char *const *roots, unsigned int root_num, enum placement placement) // 保存先を確認し、デバイスごとにまとめる（失敗時は-1）
+{
+    struct stat stat_buf;
+    char key[MAX_PATH_LEN + 16];
+    unsigned int i, j;
+
+    memset(st, 0, sizeof(struct storage));
+    if (root_num == 0 || root_num > STORAGE_MAX_ROOTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    st->placement = placement;
+    for (i = 0; i < root_num; i++) {
+        if (strlen(roots[i]) >= MAX_PATH_LEN || *roots[i] == '\0') {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (stat(roots[i], &stat_buf)) {
+            return -1;
+        }
+        if (!S_ISDIR(stat_buf.st_mode)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        strcpy(st->roots[i].path, roots[i]);
+
+        for (j = 0; j < st->device_num && st->devices[j].dev != stat_buf.st_dev; j++) { // 同じデバイス上の保存先はキューを共有する
+        }
+        if (j == st->device_num) {
+            st->devices[j].dev = stat_buf.st_dev;
+            strcpy(st->devices[j].path, roots[i]);
+            st->device_num++;
+        }
+        st->roots[i].device = j;
+
+        // 点の位置は保存先のパスから決め、指定の順番を変えても振り分けが変わらないようにする
+        for (j = 0; j < STORAGE_VNODES; j++) {
+            snprintf(key, sizeof(key), "%s#%u", roots[i], j);
+            st->ring[st->ring_num].hash = hash_name(key);
+            st->ring[st->ring_num].root = i;
+            st->ring_num++;
+        }
+    }
+    st->root_num = root_num;
+    pthread_mutex_init(&st->placing_lock, NULL);
+    qsort(st->ring, st->ring_num, sizeof(struct ring_point), compare_point);
+    return 0;
+}
+
+int storage_parse_placement(const char *name, enum placement *placement)
+{
+    if (strcmp(name, "hash") == 0) {
+        *placement = PLACEMENT_HASH;
+    } else if (strcmp(name, "space") == 0) {
+        *placement = PLACEMENT_SPACE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int place_by_hash(struct storage *st, const char *file_name)
+{
+    unsigned int hash = hash_name(file_name);
+    unsigned int low = 0;
+    unsigned int high = st->ring_num;
+    unsigned int mid;
+
+    while (low < high) { // ハッシュ値以上の最初の点を探す（なければ先頭に戻る）
+        mid = (low + high) / 2;
+        if (st->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return st->ring[(low == st->ring_num) ? 0 : low].root;
+}
+
+static unsigned long long device_free(struct storage *st, struct storage_device *dev) // 予約済みの容量と残しておく容量を除いた空き容量（dev->lockを取得して呼ぶ）
+{
+    struct statvfs vfs;
+    unsigned long long free_bytes;
+
+    if (statvfs(dev->path, &vfs)) {
+        return 0;
+    }
+    free_bytes = (unsigned long long)vfs.f_bavail * vfs.f_frsize;
+    if (free_bytes <= dev->reserved + st->min_free) {
+        return 0;
+    }
+    return free_bytes - dev->reserved - st->min_free;
+}
+
+static int place_by_space(struct storage *st, const char *file_name) // placing_lockを取得して呼ぶ
+{
+    char path[MAX_PATH_LEN * 2];
+    struct storage_device *dev;
+    struct stat stat_buf;
+    unsigned long long best_free = 0;
+    unsigned long long free_bytes;
+    int best = 0;
+    unsigned int i;
+
+    for (i = 0; i < st->root_num; i++) { // 上書きで同名のファイルが複数の保存先に残らないようにする
+        if (snprintf(path, sizeof(path), "%s/%s", st->roots[i].path, file_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &stat_buf) == 0) {
+            return i;
+        }
+    }
+    for (i = 0; i < st->root_num; i++) { // 受信中のセッションが書き込む予定の容量も差し引いて比べる
+        dev = storage_device_of(st, i);
+        pthread_mutex_lock(&dev->lock);
+        free_bytes = device_free(st, dev);
+        pthread_mutex_unlock(&dev->lock);
+        if (free_bytes > best_free) {
+            best_free = free_bytes;
+            best = i;
+        }
+    }
+    return best;
+}
+
+int storage_place(struct storage *st, const char *file_name, struct space_reservation *res) // ファイルを保存する保存先の番号を返す（振り分けはstorage_release()まで保持する）
+{
+    struct placing_entry **bucket;
+    struct placing_entry *entry;
+    int root;
+
+    if (st->root_num == 1) {
+        return 0;
+    }
+    if (st->placement != PLACEMENT_SPACE) { // ハッシュは名前だけで決まる
+        return place_by_hash(st, file_name);
+    }
+
+    // まだファイルのない名前は空き容量で決まるため、受信中の同じ名前は先に決めた保存先に揃え、そこのロックファイルで排他する
+    bucket = &st->placing[hash_name(file_name) % STORAGE_PLACING_BUCKETS];
+    pthread_mutex_lock(&st->placing_lock);
+    for (entry = *bucket; entry != NULL && strcmp(entry->name, file_name) != 0; entry = entry->next) {
+    }
+    if (entry != NULL) {
+        entry->refcount++;
+        root = entry->root;
+    } else {
+        root = place_by_space(st, file_name);
+        entry = calloc(1, sizeof(struct placing_entry));
+        if (entry != NULL) { // メモリ不足の場合は記録せずに振り分ける
+            snprintf(entry->name, sizeof(entry->name), "%s", file_name);
+            entry->root = root;
+            entry->refcount = 1;
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    pthread_mutex_unlock(&st->placing_lock);
+    res->st = st;
+    res->placed = entry;
+    return root;
+}
+
+static void unplace(struct space_reservation *res)
+{
+    struct storage *st = res->st;
+    struct placing_entry **link;
+
+    pthread_mutex_lock(&st->placing_lock);
+    if (--res->placed->refcount == 0) {
+        for (link = &st->placing[hash_name(res->placed->name) % STORAGE_PLACING_BUCKETS]; *link != NULL; link = &(*link)->next) {
+            if (*link == res->placed) {
+                *link = res->placed->next;
+                break;
+            }
+        }
+        free(res->placed);
+    }
+    pthread_mutex_unlock(&st->placing_lock);
+    res->placed = NULL;
+}
+
+struct storage_device *storage_device_of(struct storage *st, int root)
+{
+    return &st->devices[st->roots[root].device];
+}
+
+int storage_reserve(struct storage *st, int root, const char *path, unsigned long long size, struct space_reservation *res, unsigned long long *available) // 書き込む容量を予約する（空きが足りない場合は-1、availableに受け付けられるサイズ）
+{
+    struct storage_device *dev = storage_device_of(st, root);
+    struct stat stat_buf;
+    unsigned long long free_bytes;
+
+    pthread_mutex_lock(&dev->lock);
+    free_bytes = device_free(st, dev);
+    if (path != NULL && lstat(path, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) && stat_buf.st_nlink == 1) { // 上書きするファイルは切り詰めた時点で領域が空く
+        free_bytes += (unsigned long long)stat_buf.st_blocks * 512;
+    }
+    *available = free_bytes;
+    if (size > free_bytes) {
+        dev->rejected++;
+        pthread_mutex_unlock(&dev->lock);
+        errno = ENOSPC;
+        return -1;
+    }
+    dev->reserved += size;
+    pthread_mutex_unlock(&dev->lock);
+    res->dev = dev;
+    res->bytes = size;
+    return 0;
+}
+
+static void consume_locked(struct space_reservation *res, unsigned long long size)
+{
+    if (size > res->bytes) { // 申告より多く書き込んだ分は予約と関係なく空き容量から減る
+        size = res->bytes;
+    }
+    res->bytes -= size;
+    res->dev->reserved -= size;
+}
+
+void storage_consume(struct space_reservation *res, unsigned long long size) // 書き込みを終えた分を予約から外す
+{
+    if (res->dev == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&res->dev->lock);
+    consume_locked(res, size);
+    pthread_mutex_unlock(&res->dev->lock);
+}
+
+void storage_release(struct space_reservation *res) // セッションの終了時に残りの予約と振り分けを返す
+{
+    if (res->placed != NULL) {
+        unplace(res);
+    }
+    if (res->dev == NULL) {
+        return;
+    }
+    storage_consume(res, res->bytes);
+    res->dev = NULL;
+}
+
+static void *writer(void *arg) // デバイスの書き込みキューを順に処理する
+{
+    struct storage_device *dev = arg;
+    struct write_request *req;
+    struct timespec started;
+    ssize_t written;
+    size_t total;
+    int s_errno;
+
+    for (;;) {
+        pthread_mutex_lock(&dev->lock);
+        while (dev->head == NULL && !dev->stopping) {
+            pthread_cond_wait(&dev->ready, &dev->lock);
+        }
+        req = dev->head;
+        if (req == NULL) {
+            pthread_mutex_unlock(&dev->lock);
+            break;
+        }
+        dev->head = req->next;
+        if (dev->head == NULL) {
+            dev->tail = NULL;
+        }
+        dev->depth--;
+        pthread_mutex_unlock(&dev->lock);
+
+        latency_hist_record(&dev->queue_wait, elapsed_us(&req->queued));
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        total = 0;
+        s_errno = 0;
+        while (total < req->size) { // 同じファイルへの要求が別のスレッドで同時に処理されても位置がずれないよう、位置を指定して書き込む
+            written = pwrite(req->fd, req->data + total, req->size - total, req->offset + total);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                s_errno = (written == -1) ? errno : ENOSPC;
+                break;
+            }
+            total += written;
+        }
+        latency_hist_record(&dev->write_latency, elapsed_us(&started));
+
+        pthread_mutex_lock(&dev->lock);
+        req->result = (s_errno == 0) ? (ssize_t)total : -1;
+        req->s_errno = s_errno;
+        req->pending = false;
+        dev->bytes += total;
+        dev->requests++;
+        if (req->reservation != NULL) {
+            consume_locked(req->reservation, total);
+        }
+        if (s_errno != 0) {
+            dev->errors++;
+        }
+        pthread_cond_broadcast(&dev->done);
+        pthread_mutex_unlock(&dev->lock);
+        wfq_release(&dev->scheduler); // 次の要求を受け付ける
+    }
+    return NULL;
+}
+
+int storage_start(struct storage *st, unsigned int writers, unsigned int depth, const char *class_weights) // デバイスごとに書き込みスレッドを起動する（失敗時は-1）
+{
+    struct storage_device *dev;
+    sigset_t all;
+    sigset_t old_set;
+    unsigned int i, j;
+    int s = 0;
+
+    if (writers == 0) {
+        writers = 1;
+    }
+    if (depth == 0) {
+        depth = STORAGE_QUEUE_DEPTH;
+    }
+    for (i = 0; i < st->device_num; i++) {
+        dev = &st->devices[i];
+        pthread_mutex_init(&dev->lock, NULL);
+        pthread_cond_init(&dev->ready, NULL);
+        pthread_cond_init(&dev->done, NULL);
+        latency_hist_init(&dev->queue_wait);
+        latency_hist_init(&dev->write_latency);
+        wfq_init(&dev->scheduler, (depth > writers) ? depth : writers);
+        if (class_weights != NULL && wfq_set_weights(&dev->scheduler, class_weights)) {
+            errno = EINVAL;
+            return -1;
+        }
+        dev->threads = calloc(writers, sizeof(pthread_t));
+        if (dev->threads == NULL) {
+            return -1;
+        }
+        // 書き込みスレッドはシグナルを受け取らない（SIGUSR1などは呼び出し元の専用スレッドが処理する）
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old_set);
+        for (j = 0; j < writers && s == 0; j++) {
+            s = pthread_create(&dev->threads[j], NULL, writer, dev);
+            if (s == 0) {
+                dev->thread_num++;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+        if (s != 0) {
+            errno = s;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void storage_stop(struct storage *st) // キューに残った要求を書き終えてから書き込みスレッドを止める
+{
+    struct storage_device *dev;
+    unsigned int i, j;
+
+    for (i = 0; i < st->device_num; i++) {
+        dev = &st->devices[i];
+        if (dev->threads == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&dev->lock);
+        dev->stopping = true;
+        pthread_cond_broadcast(&dev->ready);
+        pthread_mutex_unlock(&dev->lock);
+        for (j = 0; j < dev->thread_num; j++) {
+            pthread_join(dev->threads[j], NULL);
+        }
+        free(dev->threads);
+        dev->threads = NULL;
+    }
+}
+
+unsigned long long storage_submit(struct storage_device *dev, struct write_request *req, int priority) // 書き込みを要求して戻る（受付を待った時間を返す）
+{
+    struct timespec queued;
+    unsigned long long wait_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &queued);
+    wfq_acquire(&dev->scheduler, priority, req->size);
+    wait_us = elapsed_us(&queued);
+
+    clock_gettime(CLOCK_MONOTONIC, &req->queued);
+    req->pending = true;
+    req->next = NULL;
+    pthread_mutex_lock(&dev->lock);
+    if (dev->tail != NULL) {
+        dev->tail->next = req;
+    } else {
+        dev->head = req;
+    }
+    dev->tail = req;
+    dev->depth++;
+    if (dev->depth > dev->max_depth) {
+        dev->max_depth = dev->depth;
+    }
+    pthread_cond_signal(&dev->ready);
+    pthread_mutex_unlock(&dev->lock);
+    return wait_us;
+}
+
+void storage_wait(struct storage_device *dev, struct write_request *req) // 要求の完了を待つ（結果はreq->resultとreq->s_errno）
+{
+    pthread_mutex_lock(&dev->lock);
+    while (req->pending) {
+        pthread_cond_wait(&dev->done, &dev->lock);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+void storage_dump(struct storage *st, FILE *fp)
+{
+    struct storage_device *dev;
+    char name[32];
+    unsigned int i;
+
+    for (i = 0; i < st->root_num; i++) {
+        fprintf(fp, "root %u %s device=%u\n", i, st->roots[i].path, st->roots[i].device);
+    }
+    for (i = 0; i < st->device_num; i++) {
+        dev = &st->devices[i];
+        pthread_mutex_lock(&dev->lock);
+        fprintf(fp, "device %u dev=%u:%u writers=%u depth=%u max_depth=%u slots=%u requests=%llu bytes=%llu errors=%llu reserved=%llu free=%llu rejected=%llu\n",
+                i, major(dev->dev), minor(dev->dev), dev->thread_num, dev->depth, dev->max_depth, dev->scheduler.slots,
+                dev->requests, dev->bytes, dev->errors, dev->reserved, device_free(st, dev), dev->rejected);
+        pthread_mutex_unlock(&dev->lock);
+        snprintf(name, sizeof(name), "  queue_wait");
+        latency_hist_dump(fp, name, &dev->queue_wait);
+        snprintf(name, sizeof(name), "  write_latency");
+        latency_hist_dump(fp, name, &dev->write_latency);
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "socket_msg.h"
+#include "wfq.h"
+#include "stats.h"
+#include "placement.h"
+
+#define STORAGE_VNODES 64             // ハッシュリング上の保存先1つあたりの点の数（偏りを減らす）
+#define STORAGE_QUEUE_DEPTH 4         // デバイスごとに受け付ける書き込み要求数の既定値
+#define STORAGE_BLOCK_SIZE (256 * 1024) // 受信データをまとめて書き込み要求にする単位
+#define STORAGE_PLACING_BUCKETS 256   // 空き容量で振り分けて受信中の名前を引くハッシュ表の大きさ
+
+/*
+ * 保存先の管理。ファイル名から保存先ディレクトリを決め、同じデバイス上の保存先は1つの書き込みキューを共有する
+ * デバイスごとに専用の書き込みスレッドがあり、セッションは受信したブロックを要求として渡して次の受信に進む
+ * 要求の受付は優先度クラスの重み付き公平キューイングで行い、デバイスが詰まった場合はそのデバイスのセッションだけが待つ
+ */
+
+struct placing_entry // 空き容量で振り分けた受信中の名前と保存先（同じ名前の同時アップロードを同じ保存先のロックで排他する）
+{
+    char name[FILENAME_MAX_LEN];
+    int root;
+    unsigned int refcount;
+    struct placing_entry *next;
+};
+
+struct space_reservation // セッションが書き込む予定の容量（書き込んだ分は実際の空き容量に反映されるため予約から外す）
+{
+    struct storage_device *dev;
+    unsigned long long bytes; // まだ書き込んでいない予約量
+    struct storage *st;           // placedを登録した保存先の管理
+    struct placing_entry *placed; // storage_place()で登録した振り分け（NULLの場合はなし）
+};
+
+struct write_request
+{
+    int fd;
+    const char *data;
+    size_t size;
+    off_t offset;
+    ssize_t result;      // 書き込んだバイト数（失敗時は-1）
+    int s_errno;
+    bool pending;        // 書き込みスレッドに渡して完了を待っている
+    struct space_reservation *reservation; // 書き込んだ分を差し引く予約（NULLの場合は差し引かない）
+    struct timespec queued;
+    struct write_request *next;
+};
+
+struct storage_device
+{
+    dev_t dev;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;          // 書き込みスレッドを起こす
+    pthread_cond_t done;           // 要求の完了を通知する
+    struct write_request *head;
+    struct write_request *tail;
+    bool stopping;
+    pthread_t *threads;
+    unsigned int thread_num;
+    struct wfq scheduler;          // 書き込み要求の受付（枠の数がキューの深さ）
+    unsigned int depth;            // キューで待っている要求数
+    unsigned int max_depth;
+    unsigned long long bytes;
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long reserved;   // 受信中のセッションが予約している容量
+    unsigned long long rejected;   // 容量不足で受付を拒否したセッション数
+    char path[MAX_PATH_LEN];       // statvfs()で空き容量を調べるディレクトリ（最初の保存先）
+    struct latency_hist queue_wait;    // 要求してから書き込み開始まで
+    struct latency_hist write_latency; // 1要求の書き込みの所要時間
+};
+
+struct storage_root
+{
+    char path[MAX_PATH_LEN];
+    unsigned int device;
+};
+
+struct ring_point
+{
+    unsigned int hash;
+    unsigned int root;
+};
+
+struct storage
+{
+    enum placement placement;
+    unsigned long long min_free;   // 予約後も残しておく空き容量
+    unsigned int root_num;
+    struct storage_root roots[STORAGE_MAX_ROOTS];
+    unsigned int device_num;
+    struct storage_device devices[STORAGE_MAX_ROOTS];
+    unsigned int ring_num;
+    struct ring_point ring[STORAGE_MAX_ROOTS * STORAGE_VNODES];
+    pthread_mutex_t placing_lock;
+    struct placing_entry *placing[STORAGE_PLACING_BUCKETS];
+};
+
+int storage_init(struct storage *st, const char *const *roots, unsigned int root_num, enum placement placement);
+
+int storage_start(struct storage *st, unsigned int writers, unsigned int depth, const char *class_weights);
+
+void storage_stop(struct storage *st);
+
+int storage_parse_placement(const char *name, enum placement *placement);
+
+int storage_place(struct storage *st, const char *file_name, struct space_reservation *res);
+
+struct storage_device *storage_device_of(struct storage *st, int root);
+
+int storage_reserve(struct storage *st, int root, const char *path, unsigned long long size, struct space_reservation *res, unsigned long long *available);
+
+void storage_consume(struct space_reservation *res, unsigned long long size);
+
+void storage_release(struct space_reservation *res);
+
+unsigned long long storage_submit(struct storage_device *dev, struct write_request *req, int priority);
+
+void storage_wait(struct storage_device *dev, struct write_request *req);
+
+void storage_dump(struct storage *st, FILE *fp);
+
+#endif // STORAGE_H
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "ratelimit.h"
+#include "tuning.h"
+#include "transport.h"
+#include "tls.h"
+#include "client.h"
+
+#define DEFAULT_IDLE_TIMEOUT_MS 15000 // サーバーの--idle-timeout（既定20秒）で切られる前に待機接続を張り直す
+#define MAX_IDLE_CONNECTIONS 64       // サーバーごとに保持する待機接続の上限
+#define MAINTENANCE_INTERVAL_SEC 1
+
+struct pooled_conn
+{
+    int cfd;
+    struct timespec last_used;
+    struct pooled_conn *next;
+};
+
+struct server_pool
+{
+    char host_name[FILENAME_MAX_LEN];
+    char port_num[PORT_FIELD_LEN];
+    pthread_mutex_t lock;
+    struct pooled_conn *idle; // 待機中の接続（新しいものが先頭）
+    unsigned int idle_num;
+    struct server_pool *next;
+};
+
+struct producer_thread_args
+{
+    int afd;
+};
+
+static bool debug_mode = false;
+static unsigned int warm_num = 1; // サーバーごとに事前に接続しておく数
+static unsigned int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+static unsigned long long send_rate = 0; // エージェント全体の送信帯域の上限（バイト/秒）
+static struct token_bucket send_bucket;
+static struct client_option option;
+static struct socket_tuning tuning; // --tcpで指定されたソケットの調整項目
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct server_pool *pools = NULL;
+static bool tls = false;          // 保持する接続をTLSで暗号化する
+static const char *tls_ca = NULL; // NULLの場合はシステムの認証局を使う
+static bool tls_verify = true;
+
+enum long_option {
+    OPT_RATE = 256,
+    OPT_CONNECT_TIMEOUT,
+    OPT_REPLY_TIMEOUT,
+    OPT_TCP,
+    OPT_OPTIMISTIC,
+    OPT_TLS,
+    OPT_TLS_CA,
+    OPT_TLS_INSECURE
+};
+
+static const struct option long_options[] = {
+    {"rate", required_argument, NULL, OPT_RATE},                       // 送信帯域の上限（バイト/秒）
+    {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT}, // 接続のタイムアウト（ミリ秒）
+    {"reply-timeout", required_argument, NULL, OPT_REPLY_TIMEOUT},     // サーバーから何も届かない状態で待つ上限（ミリ秒、0で無制限）
+    {"tcp", required_argument, NULL, OPT_TCP},                         // ソケットの調整項目（例: sndbuf=8M,cc=bbr,cork）
+    {"optimistic", no_argument, NULL, OPT_OPTIMISTIC},                 // 小さなファイルは受付応答を待たずにデータを送る
+    {"tls", no_argument, NULL, OPT_TLS},                               // サーバーとの接続をTLSで暗号化する
+    {"tls-ca", required_argument, NULL, OPT_TLS_CA},                   // サーバー証明書を検証する認証局の証明書（--tlsを含む）
+    {"tls-insecure", no_argument, NULL, OPT_TLS_INSECURE},             // サーバー証明書を検証しない（--tlsを含む、試験用）
+    {NULL, 0, NULL, 0}
+};
+
+int parse_option(int argc, char **argv, char *agent_path, char *host_name, char *port_num)
+{
+    int opt;
+    char *end_ptr;
+    unsigned long value;
+    if (argc < 2) {
+        return 1;
+    }
+    while ((opt = getopt_long(argc, argv, "a:h:p:n:i:d", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            debug_mode = true;
+            break;
+        case 'a':
+            strncpy(agent_path, optarg, MAX_PATH_LEN - 1);
+            break;
+        case 'h':
+            strncpy(host_name, optarg, FILENAME_MAX_LEN - 1);
+            break;
+        case 'p':
+            strncpy(port_num, optarg, PORT_FIELD_LEN - 1);
+            break;
+        case 'n':
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value > MAX_IDLE_CONNECTIONS) {
+                return 1;
+            }
+            warm_num = (unsigned int)value;
+            break;
+        case 'i':
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0) {
+                return 1;
+            }
+            idle_timeout_ms = (unsigned int)value;
+            break;
+        case OPT_RATE:
+            if (parse_size(optarg, &send_rate)) {
+                return 1;
+            }
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0) {
+                return 1;
+            }
+            option.connect_timeout_ms = (unsigned int)value;
+            break;
+        case OPT_REPLY_TIMEOUT:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*optarg == '\0' || *end_ptr != '\0' || value > UINT_MAX) {
+                return 1;
+            }
+            option.reply_timeout_ms = (unsigned int)value;
+            break;
+        case OPT_TCP:
+            if (tuning_parse(&tuning, optarg)) {
+                return 1;
+            }
+            break;
+        case OPT_OPTIMISTIC:
+            option.optimistic = true;
+            break;
+        case OPT_TLS:
+            tls = true;
+            break;
+        case OPT_TLS_CA:
+            tls = true;
+            tls_ca = optarg;
+            break;
+        case OPT_TLS_INSECURE:
+            tls = true;
+            tls_verify = false;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (*agent_path == '\0') {
+        return 1;
+    }
+    return 0;
+}
+
+struct server_pool *find_pool(char *host_name, char *port_num)
+{
+    struct server_pool *pool;
+
+    pthread_mutex_lock(&pools_lock);
+    for (pool = pools; pool != NULL; pool = pool->next) {
+        if (strcmp(pool->host_name, host_name) == 0 && strcmp(pool->port_num, port_num) == 0) {
+            goto end;
+        }
+    }
+
+    pool = calloc(1, sizeof(struct server_pool));
+    if (pool == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+    strncpy(pool->host_name, host_name, sizeof(pool->host_name) - 1);
+    strncpy(pool->port_num, port_num, sizeof(pool->port_num) - 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->next = pools;
+    pools = pool;
+    DEBUG_MACRO(debug_mode, false, "new server pool %s:%s", host_name, port_num);
+
+end:
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+bool is_fresh(const struct pooled_conn *conn) // サーバー側でタイムアウトする前の接続か
+{
+    struct timespec now;
+    long long idle_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    idle_ms = (long long)(now.tv_sec - conn->last_used.tv_sec) * 1000 + (now.tv_nsec - conn->last_used.tv_nsec) / 1000000;
+    return idle_ms < idle_timeout_ms;
+}
+
+enum error_code acquire_connection(struct server_pool *pool, int *cfd, bool *reused)
+{
+    struct pooled_conn *conn;
+
+    *reused = false;
+    pthread_mutex_lock(&pool->lock);
+    while ((conn = pool->idle) != NULL) {
+        pool->idle = conn->next;
+        pool->idle_num--;
+        if (is_fresh(conn)) {
+            *cfd = conn->cfd;
+            *reused = true;
+            free(conn);
+            break;
+        }
+        transport_close(conn->cfd);
+        free(conn);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (*reused) {
+        return NORMAL;
+    }
+    // 待機接続がなければその場で接続する
+    return connect_server(cfd, pool->host_name, pool->port_num, &option);
+}
+
+void release_connection(struct server_pool *pool, int cfd) // 転送に成功した接続を待機接続として戻す
+{
+    struct pooled_conn *conn;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_num >= MAX_IDLE_CONNECTIONS) {
+        pthread_mutex_unlock(&pool->lock);
+        transport_close(cfd);
+        return;
+    }
+    conn = malloc(sizeof(struct pooled_conn));
+    if (conn == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        transport_close(cfd);
+        return;
+    }
+    conn->cfd = cfd;
+    clock_gettime(CLOCK_MONOTONIC, &conn->last_used);
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pool->idle_num++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+enum error_code run_job(struct j_message *j_msg, int *s_errno)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct client_option job_option = option;
+    struct server_pool *pool;
+    unsigned long long file_size = 0;
+    bool reused = false;
+    int cfd = -1;
+    int attempt;
+
+    job_option.priority = j_msg->priority;
+    job_option.keepalive = true;
+
+    pool = find_pool(j_msg->host_name, j_msg->port_num);
+    if (pool == NULL) {
+        goto end;
+    }
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        clear_error();
+        if ((ret = acquire_connection(pool, &cfd, &reused))) {
+            goto end;
+        }
+
+        ret = begin_session(j_msg->file_path, j_msg->file_name, cfd, &file_size, &job_option);
+        if (ret == NORMAL) {
+            if ((ret = put_session(cfd, j_msg->file_path, file_size, &job_option)) == NORMAL) {
+                release_connection(pool, cfd);
+                goto end;
+            }
+            transport_close(cfd);
+            goto end; // データ送信後の失敗は再試行しない
+        }
+        transport_close(cfd);
+
+        // 再利用した接続がサーバー側で閉じられていた場合だけ、新しい接続で1回再試行する
+        if (!reused || (ret != ERROR_SEND && ret != ERROR_RECEIVED && ret != ERROR_TIMEOUT)) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "pooled connection to %s:%s was stale, retrying", j_msg->host_name, j_msg->port_num);
+    }
+
+end:
+    get_error(s_errno);
+    return ret;
+}
+
+void *producer_thread(void *thread_args) // 1つのプロデューサー接続から順にジョブを受け取り実行する
+{
+    struct producer_thread_args *args = (struct producer_thread_args *)thread_args;
+    struct j_message j_msg;
+    enum error_code ret;
+    int s_errno = 0;
+
+    for (;;) {
+        if (receive_j_msg(args->afd, &j_msg)) { // プロデューサーが接続を閉じた
+            break;
+        }
+        DEBUG_MACRO(debug_mode, false, "received j_msg %s -> %s:%s", j_msg.file_path, j_msg.host_name, j_msg.port_num);
+
+        ret = run_job(&j_msg, &s_errno);
+        DEBUG_MACRO(debug_mode, false, "job finished %s : %d", j_msg.file_name, ret);
+
+        if (send_r_msg(args->afd, ret, s_errno)) {
+            break;
+        }
+    }
+
+    close(args->afd);
+    free(args);
+    return NULL;
+}
+
+void warm_pool(struct server_pool *pool) // 古い待機接続を閉じ、足りない分を事前に接続しておく
+{
+    struct pooled_conn **link;
+    struct pooled_conn *conn;
+    unsigned int idle_num;
+    int cfd;
+
+    pthread_mutex_lock(&pool->lock);
+    for (link = &pool->idle; *link != NULL;) {
+        conn = *link;
+        if (is_fresh(conn)) {
+            link = &conn->next;
+            continue;
+        }
+        *link = conn->next;
+        pool->idle_num--;
+        transport_close(conn->cfd);
+        free(conn);
+    }
+    idle_num = pool->idle_num;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (; idle_num < warm_num; idle_num++) {
+        clear_error();
+        if (connect_server(&cfd, pool->host_name, pool->port_num, &option)) {
+            DEBUG_MACRO(debug_mode, false, "warm connect to %s:%s failed", pool->host_name, pool->port_num);
+            break;
+        }
+        release_connection(pool, cfd);
+    }
+}
+
+void *maintenance_thread(void *arg)
+{
+    struct server_pool *pool;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pools_lock);
+        pool = pools;
+        pthread_mutex_unlock(&pools_lock);
+
+        for (; pool != NULL; pool = pool->next) { // プールは追加のみで削除しないため、ロックなしでたどれる
+            warm_pool(pool);
+        }
+        sleep(MAINTENANCE_INTERVAL_SEC);
+    }
+    return NULL;
+}
+
+enum error_code setup_agent(int *lfd, char *agent_path)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+
+    *lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*lfd == -1) {
+        ret = ERROR_SOCKET;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(agent_path) >= sizeof(addr.sun_path)) {
+        ret = ERROR_BUFFER_OVERFLOW;
+        set_error(ret, 0);
+        goto end;
+    }
+    strcpy(addr.sun_path, agent_path);
+    unlink(agent_path); // 前回起動時のソケットファイルが残っている場合は削除
+
+    if (bind(*lfd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ret = ERROR_BIND;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (listen(*lfd, SOMAXCONN)) {
+        ret = ERROR_LISTEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    DEBUG_MACRO(debug_mode, false, "agent listening on %s", agent_path);
+
+    ret = NORMAL;
+end:
+    return ret;
+}
+
+enum error_code accept_producers(int lfd)
+{
+    struct producer_thread_args *args;
+    pthread_t tid;
+    int afd;
+    int s;
+
+    for (;;) {
+        afd = accept(lfd, NULL, NULL);
+        if (afd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(10 * 1000); // リソース不足の場合は少し待ってから再試行
+            }
+            continue;
+        }
+
+        args = malloc(sizeof(struct producer_thread_args));
+        if (args == NULL) {
+            close(afd);
+            continue;
+        }
+        args->afd = afd;
+
+        s = pthread_create(&tid, NULL, producer_thread, args);
+        if (s != 0) {
+            free(args);
+            close(afd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NORMAL;
+}
+
+int main(int argc, char *argv[])
+{
+    enum error_code ret = ERROR_SYSTEM;
+    char agent_path[MAX_PATH_LEN] = {0};
+    char host_name[FILENAME_MAX_LEN] = {0};
+    char port_num[PORT_FIELD_LEN] = {0};
+    pthread_t tid;
+    int lfd = -1;
+    int s;
+
+    client_option_init(&option);
+    tuning_init(&tuning);
+    option.tuning = &tuning;
+
+    if (parse_option(argc, argv, agent_path, host_name, port_num)) { // オプション解析
+        ret = ERROR_ARGUMENT;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    token_bucket_init(&send_bucket, send_rate);
+    option.debug_mode = debug_mode;
+    option.bucket = &send_bucket;
+    option.keepalive = true;
+
+    if (tls) {
+        if (tls_client_setup(tls_ca, tls_verify)) {
+            ret = ERROR_FILE_OPEN;
+            set_error(ret, errno);
+            goto end;
+        }
+        option.transport = &transport_tls;
+    }
+
+    if ((ret = setup_agent(&lfd, agent_path))) {
+        goto end;
+    }
+
+    // デバッグ時はログを標準エラー出力に出すため、フォアグラウンドで動作する
+    if (!debug_mode && daemon(1, 0) != 0) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+
+    if (*host_name != '\0' && *port_num != '\0') { // 起動時に指定されたサーバーへは事前に接続しておく
+        if (find_pool(host_name, port_num) == NULL) {
+            ret = ERROR_SYSTEM;
+            goto end;
+        }
+    }
+
+    s = pthread_create(&tid, NULL, maintenance_thread, NULL);
+    if (s != 0) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, s);
+        goto end;
+    }
+    pthread_detach(tid);
+
+    ret = accept_producers(lfd);
+
+end:
+    if (lfd != -1) {
+        close(lfd);
+        unlink(agent_path);
+    }
+    print_error();
+    return ret;
+}
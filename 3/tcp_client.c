@@ -1,28 +1,113 @@
 #include <stdio.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <netdb.h>
-#include <sys/stat.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <getopt.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include "error.h"
 #include "common.h"
 #include "socket_msg.h"
+#include "ratelimit.h"
+#include "wfq.h"
+#include "tuning.h"
+#include "client.h"
+#include "rudp.h"
+#include "tls.h"
+#include "watch.h"
+#include "tree.h"
+
+#define FOLLOW_BATCH_MAX (1024 * 1024) // --followで1回の追記で送る上限
+#define FOLLOW_BATCH_DELAY_MS 20       // 書き込みの通知を受けてから、続く書き込みをまとめるために待つ時間
+#define FOLLOW_POLL_MS 1000            // 通知が届かない場合もこの間隔でサイズを確認する
+#define FOLLOW_RETRY_MAX 5             // 連続して失敗した場合に再接続する回数
 
 static bool debug_mode = false;
+static unsigned long long send_rate = 0; // 送信帯域の上限（バイト/秒、0の場合は無制限）
+static struct token_bucket send_bucket;
+static struct client_option option;
+static struct socket_tuning tuning; // --tcpで指定されたソケットの調整項目
+static char agent_path[MAX_PATH_LEN] = {0}; // -a指定時はエージェントに転送を依頼する
+static char unix_path[MAX_PATH_LEN] = {0};  // -u指定時は同一ホストのサーバーにUNIXドメインソケットで接続する
+static bool pass_fd = false;                // データを送らず、ファイルのディスクリプタをサーバーに渡す（-uが必要）
+static bool udp = false;                    // TCPの代わりに信頼性のあるUDPの転送路で接続する
+static bool tls = false;                    // TLSで暗号化する
+static const char *tls_ca = NULL;           // NULLの場合はシステムの認証局を使う
+static bool tls_verify = true;
+static const char *remote_name = NULL;      // サーバーに保存する名前（NULLの場合は-fの名前）
+static bool follow = false;                 // ファイルを監視し、追記された分だけを送り続ける
+static bool watch = false;                  // ディレクトリを監視し、変更されたファイルを送り続ける
+static unsigned int debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS; // --watchで変更が落ち着くまで待つ時間
+static unsigned int jobs = TREE_DEFAULT_JOBS; // -fにディレクトリを指定した場合に並行して使う接続の数
+
+struct connect_target // --watchやディレクトリの送信で、送るファイルがある時に接続する先
+{
+    char *server_ip;
+    char *port_num;
+};
+
+enum long_option {
+    OPT_RATE = 256,
+    OPT_PRIORITY,
+    OPT_CONNECT_TIMEOUT,
+    OPT_REPLY_TIMEOUT,
+    OPT_TCP,
+    OPT_OPTIMISTIC,
+    OPT_PASS_FD,
+    OPT_UDP,
+    OPT_UDP_INJECT,
+    OPT_TLS,
+    OPT_TLS_CA,
+    OPT_TLS_INSECURE,
+    OPT_NAME,
+    OPT_FOLLOW,
+    OPT_WATCH,
+    OPT_DEBOUNCE,
+    OPT_JOBS,
+    OPT_VERIFY,
+    OPT_REPAIR
+};
+
+static const struct option long_options[] = {
+    {"rate", required_argument, NULL, OPT_RATE},         // 送信帯域の上限（バイト/秒）
+    {"priority", required_argument, NULL, OPT_PRIORITY}, // 優先度クラス（0:interactive 1:normal 2:bulk）
+    {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT}, // 接続のタイムアウト（ミリ秒）
+    {"reply-timeout", required_argument, NULL, OPT_REPLY_TIMEOUT},     // サーバーから何も届かない状態で待つ上限（ミリ秒、0で無制限）
+    {"tcp", required_argument, NULL, OPT_TCP},                         // ソケットの調整項目（例: sndbuf=8M,cc=bbr,cork）
+    {"optimistic", no_argument, NULL, OPT_OPTIMISTIC},                 // 小さなファイルは受付応答を待たずにデータを送る
+    {"pass-fd", no_argument, NULL, OPT_PASS_FD},                       // ディスクリプタを渡してサーバー側で複製させる（-uと併用）
+    {"udp", no_argument, NULL, OPT_UDP},                               // 信頼性のあるUDPの転送路で接続する（損失の多い長距離回線向け）
+    {"udp-inject", required_argument, NULL, OPT_UDP_INJECT},           // UDPの送信に損失と遅延を注入する（例: loss=1,delay=50）
+    {"tls", no_argument, NULL, OPT_TLS},                               // TLSで暗号化する（証明書はシステムの認証局で検証する）
+    {"tls-ca", required_argument, NULL, OPT_TLS_CA},                   // サーバー証明書を検証する認証局の証明書（--tlsを含む）
+    {"tls-insecure", no_argument, NULL, OPT_TLS_INSECURE},             // サーバー証明書を検証しない（--tlsを含む、試験用）
+    {"name", required_argument, NULL, OPT_NAME},                       // サーバーに保存する名前（-f -で標準入力を送る場合は必須）
+    {"follow", no_argument, NULL, OPT_FOLLOW},                         // ファイルを監視し、追記された分をサーバー側のファイルに追記し続ける
+    {"watch", no_argument, NULL, OPT_WATCH},                           // -fのディレクトリを監視し、変更されたファイルを相対パスの名前で送り続ける
+    {"debounce", required_argument, NULL, OPT_DEBOUNCE},               // --watchで最後の変更から送り始めるまで待つ時間（ミリ秒）
+    {"jobs", required_argument, NULL, OPT_JOBS},                       // -fにディレクトリを指定した場合に並行して使う接続の数
+    {"verify", no_argument, NULL, OPT_VERIFY},                         // 送信後にハッシュ木で照合し、異なるチャンクだけを送り直す
+    {"repair", no_argument, NULL, OPT_REPAIR},                         // 全体を送らずに照合し、異なるチャンクだけを送る
+    {NULL, 0, NULL, 0}
+};
 
 int parse_option(int argc, char **argv, char *host_name ,char *port_num, char *file_name)
 {
     int opt;
+    char *end_ptr;
+    unsigned long value;
     if (argc < 2) {
         return 1;
     }
-    while ((opt = getopt(argc, argv, "h:p:f:d")) != -1) {
+    while ((opt = getopt_long(argc, argv, "h:p:f:a:u:d", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd':
             debug_mode = true;
@@ -36,287 +121,550 @@ int parse_option(int argc, char **argv, char *host_name ,char *port_num, char *f
         case 'f':
             strcpy(file_name, optarg);
             break;
+        case 'a':
+            strncpy(agent_path, optarg, sizeof(agent_path) - 1);
+            break;
+        case 'u':
+            strncpy(unix_path, optarg, sizeof(unix_path) - 1);
+            break;
+        case OPT_RATE:
+            if (parse_size(optarg, &send_rate)) {
+                return 1;
+            }
+            break;
+        case OPT_PRIORITY:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value >= PRIORITY_CLASS_NUM) {
+                return 1;
+            }
+            option.priority = (unsigned char)value;
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0) {
+                return 1;
+            }
+            option.connect_timeout_ms = (unsigned int)value;
+            break;
+        case OPT_REPLY_TIMEOUT:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*optarg == '\0' || *end_ptr != '\0' || value > UINT_MAX) {
+                return 1;
+            }
+            option.reply_timeout_ms = (unsigned int)value;
+            break;
+        case OPT_TCP:
+            if (tuning_parse(&tuning, optarg)) {
+                return 1;
+            }
+            break;
+        case OPT_OPTIMISTIC:
+            option.optimistic = true;
+            break;
+        case OPT_PASS_FD:
+            pass_fd = true;
+            break;
+        case OPT_UDP:
+            udp = true;
+            break;
+        case OPT_UDP_INJECT:
+            if (rudp_set_inject(optarg)) {
+                return 1;
+            }
+            break;
+        case OPT_TLS:
+            tls = true;
+            break;
+        case OPT_TLS_CA:
+            tls = true;
+            tls_ca = optarg;
+            break;
+        case OPT_TLS_INSECURE:
+            tls = true;
+            tls_verify = false;
+            break;
+        case OPT_NAME:
+            if (strlen(optarg) >= FILENAME_MAX_LEN) {
+                return 1;
+            }
+            remote_name = optarg;
+            break;
+        case OPT_FOLLOW:
+            follow = true;
+            break;
+        case OPT_WATCH:
+            watch = true;
+            break;
+        case OPT_DEBOUNCE:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0 || value > 3600000) {
+                return 1;
+            }
+            debounce_ms = (unsigned int)value;
+            break;
+        case OPT_JOBS:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0 || value > TREE_MAX_JOBS) {
+                return 1;
+            }
+            jobs = (unsigned int)value;
+            break;
+        case OPT_VERIFY:
+            option.verify = true;
+            break;
+        case OPT_REPAIR:
+            option.repair = true;
+            break;
         default:
             return 1;
         }
     }
+    if (*agent_path != '\0' && *unix_path != '\0') { // エージェントはTCPの接続のみを保持する
+        return 1;
+    }
+    if (pass_fd && *unix_path == '\0') { // ディスクリプタはUNIXドメインソケットでしか渡せない
+        return 1;
+    }
+    if (udp && (*unix_path != '\0' || *agent_path != '\0')) {
+        return 1;
+    }
+    if (tls && (udp || pass_fd || *agent_path != '\0')) { // エージェント経由の場合はエージェント側で指定する
+        return 1;
+    }
+    if (strcmp(file_name, "-") == 0 && (remote_name == NULL || pass_fd || *agent_path != '\0')) { // 標準入力はその場で送るしかない
+        return 1;
+    }
+    if (follow && (pass_fd || *agent_path != '\0' || strcmp(file_name, "-") == 0)) { // 追記は接続を維持してソケットで送る
+        return 1;
+    }
+    if (watch && (follow || pass_fd || *agent_path != '\0' || strcmp(file_name, "-") == 0 || remote_name != NULL)) { // 名前はディレクトリからの相対パスで決まる
+        return 1;
+    }
+    if ((option.verify || option.repair) && (follow || watch || pass_fd || *agent_path != '\0' || strcmp(file_name, "-") == 0)) { // 照合には手元のファイルを読み直す必要がある
+        return 1;
+    }
     return 0;
 }
 
-enum error_code get_file_size(const char *file_name, unsigned long long *file_size)
+static bool is_stream_input(const char *file_name) // 標準入力やパイプなど、送る前にサイズが分からない入力か
 {
     struct stat stat_buf;
 
-    if (stat(file_name, &stat_buf) == 0) {
-        *file_size = stat_buf.st_size;
-        return NORMAL;
+    if (strcmp(file_name, "-") == 0) {
+        return true;
     }
+    return stat(file_name, &stat_buf) == 0 && !S_ISREG(stat_buf.st_mode) && !S_ISDIR(stat_buf.st_mode);
+}
 
-    set_error(ERROR_SYSTEM, errno);
-    return ERROR_SYSTEM;
+static bool is_directory(const char *file_name)
+{
+    struct stat stat_buf;
+
+    return strcmp(file_name, "-") != 0 && stat(file_name, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
 }
 
-enum error_code close_file_descriptor(int fd)
+enum error_code stream_file(int cfd, const char *file_name) // 入力を最後まで読みながら送る
 {
-    if (close(fd) == -1) {
-        set_error(ERROR_SYSTEM, errno);
-        return ERROR_SYSTEM;
+    enum error_code ret = ERROR_SYSTEM;
+    unsigned long long total = 0;
+    int fd = STDIN_FILENO;
+
+    if (strcmp(file_name, "-") != 0) {
+        fd = open(file_name, O_RDONLY);
+        if (fd == -1) {
+            ret = ERROR_FILE_OPEN;
+            set_error(ret, errno);
+            return ret;
+        }
     }
-    return NORMAL;
+    ret = stream_session(cfd, fd, remote_name, &total, &option);
+    if (ret == NORMAL) {
+        DEBUG_MACRO(debug_mode, false, "streamed %llu bytes from %s", total, file_name);
+    }
+    if (fd != STDIN_FILENO && close(fd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+    }
+    return ret;
 }
 
-enum error_code send_file(int socket, char *file_name)
+enum error_code sparse_file(int cfd, const char *file_name, bool *sparse) // 穴のあるファイルはデータ領域だけを送る（穴がなければ*sparseをfalseにして何もしない）
 {
-	enum error_code ret = ERROR_SYSTEM;
-    int fd = -1;
-    ssize_t read_bytes;
-    char buffer[BUFFER_SIZE];
+    enum error_code ret = NORMAL;
+    struct stat stat_buf;
+    int fd;
+
+    *sparse = false;
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1) { // 開けない場合は通常の送信でエラーを報告する
+        return NORMAL;
+    }
+    if (is_sparse_file(fd) && fstat(fd, &stat_buf) == 0) {
+        *sparse = true;
+        ret = sparse_session(cfd, fd, remote_name, stat_buf.st_size, &option);
+    }
+    close(fd);
+    return ret;
+}
+
+enum error_code verify_file(int cfd, const char *file_name, bool repair) // サーバー側のファイルをハッシュ木で照合する（repairの場合は異なるチャンクを送り直す）
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct stat stat_buf;
+    int fd;
 
     fd = open(file_name, O_RDONLY);
     if (fd == -1) {
         ret = ERROR_FILE_OPEN;
-        set_error(ERROR_FILE_OPEN, errno);
+        set_error(ret, errno);
         return ret;
     }
-    while ((read_bytes = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        if (sendn(socket, buffer, read_bytes) == -1) {
-            ret = ERROR_SEND;
-            set_error(ERROR_SEND, errno);
-            goto end;
-        } 
+    if (fstat(fd, &stat_buf) == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+    } else {
+        ret = verify_session(cfd, fd, remote_name, stat_buf.st_size, repair, &option);
     }
-    ret = NORMAL;
-end:
-    ret = close_file_descriptor(fd);
+    close(fd);
     return ret;
 }
 
-enum error_code send_shutdown(int cfd)
-{   
-	enum error_code ret = ERROR_SYSTEM;
-    if (shutdown(cfd, SHUT_WR)) {
+enum error_code open_connection(char *server_ip, char *port_num, int *cfd) // 指定された転送路でサーバーに接続する
+{
+    if (*unix_path != '\0') {
+        return connect_unix_server(cfd, unix_path, &option);
+    } else if (udp) {
+        return connect_udp_server(cfd, server_ip, port_num, &option);
+    }
+    return connect_server(cfd, server_ip, port_num, &option);
+}
+
+static enum error_code connect_to_target(int *cfd, void *arg)
+{
+    struct connect_target *target = arg;
+
+    return open_connection(target->server_ip, target->port_num, cfd);
+}
+
+static void wait_change(int ifd, bool *gone) // 書き込みの通知を待ち、続く書き込みもまとめて送れるよう少し待つ
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct pollfd pfd = {ifd, POLLIN, 0};
+    ssize_t len;
+    char *p;
+
+    if (poll(&pfd, 1, FOLLOW_POLL_MS) <= 0) {
+        return;
+    }
+    len = read(ifd, events, sizeof(events));
+    for (p = events; len > 0 && p < events + len; p += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event *)p;
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) { // ローテーションされた場合は残りを送って終了する
+            *gone = true;
+        }
+    }
+    poll(NULL, 0, FOLLOW_BATCH_DELAY_MS);
+}
+
+enum error_code follow_file(char *server_ip, char *port_num, char *file_name) // 追記された分だけをサーバー側のファイルに追記し続ける
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct stat stat_buf;
+    unsigned long long offset = 0; // サーバー側のサイズ（最初の追記で食い違っていればサーバーから知らされる）
+    unsigned long long server_size;
+    unsigned long long batch;
+    unsigned int failures = 0;
+    bool gone = false;
+    int fd = -1;
+    int ifd = -1;
+    int cfd = -1;
+
+    option.keepalive = true; // 追記ごとに接続し直さない
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        ret = ERROR_FILE_OPEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd == -1 || inotify_add_watch(ifd, file_name, IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
         ret = ERROR_SYSTEM;
-        set_error(ERROR_SYSTEM, errno);
+        set_error(ret, errno);
         goto end;
     }
 
+    for (;;) {
+        if (fstat(fd, &stat_buf)) { // 読み直さず、サイズだけで追記された範囲を決める
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+        if ((unsigned long long)stat_buf.st_size < offset) { // 切り詰められたファイルはサーバー側と対応が取れない
+            ret = ERROR_DIFF_FILESIZE;
+            set_error(ret, 0);
+            goto end;
+        }
+        if ((unsigned long long)stat_buf.st_size == offset) {
+            if (gone) {
+                break;
+            }
+            wait_change(ifd, &gone);
+            continue;
+        }
+
+        if (cfd == -1 && (ret = open_connection(server_ip, port_num, &cfd))) {
+            cfd = -1;
+            goto retry;
+        }
+        batch = stat_buf.st_size - offset;
+        if (batch > FOLLOW_BATCH_MAX) {
+            batch = FOLLOW_BATCH_MAX;
+        }
+        ret = append_session(cfd, fd, remote_name, offset, batch, &server_size, &option);
+        if (ret == NORMAL) {
+            DEBUG_MACRO(debug_mode, false, "appended %llu bytes at %llu", batch, offset);
+            offset += batch;
+            failures = 0;
+            continue;
+        }
+        close_file_descriptor(cfd); // 失敗した接続はサーバーが閉じるため、次の追記では接続し直す
+        cfd = -1;
+        if (server_size != ULLONG_MAX && server_size <= (unsigned long long)stat_buf.st_size) { // 前回の途中までサーバーに届いていた
+            DEBUG_MACRO(debug_mode, false, "resume from server size %llu", server_size);
+            clear_error();
+            offset = server_size;
+            continue;
+        }
+retry:
+        if (++failures > FOLLOW_RETRY_MAX) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "append failed (%d), retry %u", ret, failures);
+        clear_error();
+        poll(NULL, 0, (failures - 1) * 200); // 待機中に切断された接続は待たずに繋ぎ直す
+    }
     ret = NORMAL;
 end:
+    if (cfd != -1 && close_file_descriptor(cfd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+    }
+    if (ifd != -1) {
+        close(ifd);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
     return ret;
 }
 
-enum error_code connect_server(int *cfd, char *server_ip, char *port_num)
+enum error_code submit_job(char *server_ip, char *port_num, char *file_name) // エージェントに転送を依頼し、結果を待つ
 {
-	enum error_code ret = ERROR_SYSTEM;
-    struct addrinfo hints;
-    struct addrinfo *result = NULL;
-
-    struct timeval timeout; // SO_RCVTIMEOの設定値
-    timeout.tv_sec = 20;
-    timeout.tv_usec = 0;
-
-    // getaddrinfo()の準備
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_NUMERICSERV;
-
-    int status = getaddrinfo(server_ip, port_num, &hints, &result);
-    if (status != 0) {
-        set_error(ERROR_SYSTEM, status);
+    enum error_code ret = ERROR_SYSTEM;
+    struct sockaddr_un addr;
+    struct r_message r_msg = {0};
+    char file_path[PATH_MAX];
+    int afd = -1;
+
+    if (realpath(file_name, file_path) == NULL) { // エージェントのカレントディレクトリに依存しないよう絶対パスで渡す
+        ret = ERROR_FILE_OPEN;
+        set_error(ret, errno);
         goto end;
     }
 
-    *cfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (*cfd == -1) {
+    afd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (afd == -1) {
         ret = ERROR_SOCKET;
         set_error(ret, errno);
         goto end;
     }
-
-    DEBUG_MACRO(debug_mode, false, " Created a socket %s:%s", server_ip, port_num);
-
-    if (connect(*cfd, result->ai_addr, result->ai_addrlen)) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(agent_path) >= sizeof(addr.sun_path)) { // 切り詰めて別のソケットに接続しないようにする
+        ret = ERROR_BUFFER_OVERFLOW;
+        set_error(ret, 0);
+        goto end;
+    }
+    strcpy(addr.sun_path, agent_path);
+    if (connect(afd, (struct sockaddr *)&addr, sizeof(addr))) {
         ret = ERROR_CONNECT;
         set_error(ret, errno);
         goto end;
     }
+    DEBUG_MACRO(debug_mode, false, "connected to agent %s", agent_path);
 
-    DEBUG_MACRO(debug_mode, false, "connected to %s:%s", server_ip, port_num);
-
-    if (setsockopt(*cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout)) {
-        ret = ERROR_SOCKET;
-        set_error(ret, errno);
+    if ((ret = send_j_msg(afd, server_ip, port_num, file_path, (char *)remote_name, option.priority))) {
         goto end;
     }
+    DEBUG_MACRO(debug_mode, false, "sended j_msg %s -> %s:%s", file_path, server_ip, port_num);
 
-    DEBUG_MACRO(debug_mode, false, "socket option configured %s:%s", server_ip, port_num);
+    if ((ret = receive_r_msg(afd, &r_msg))) {
+        goto end;
+    }
+    DEBUG_MACRO(debug_mode, false, "received r_msg %d", r_msg.error_code);
 
+    if (r_msg.error_code != NORMAL) { // エージェント側のエラーをそのまま報告する
+        ret = (enum error_code)r_msg.error_code;
+        set_error(ret, r_msg.s_errno);
+        goto end;
+    }
     ret = NORMAL;
 end:
-    if (result) {
-        freeaddrinfo(result);
-    }    
+    if (afd != -1) {
+        close(afd);
+    }
     return ret;
-
 }
 
-enum error_code begin_session(char *file_name, int cfd)
+int main(int argc, char *argv[])
 {
 	enum error_code ret = ERROR_SYSTEM;
-    unsigned long long file_size;
-    ssize_t recv_bytes;
-    char msg_type = {0}; // debug用
+    char server_ip[FILENAME_MAX_LEN] = {0};
+    char file_name[FILENAME_MAX_LEN] = {0};
+    char port_num[PORTNUM_MAX_LEN] = {0};
+    unsigned long long file_size = 0;
+    struct connect_target target = {server_ip, port_num};
+    const char *prefix;
+    bool sparse = false;
+    int cfd = -1;
 
-    struct a_message a_msg = {0};
-    struct e_message e_msg = {0};
+    client_option_init(&option);
+    tuning_init(&tuning);
+    option.tuning = &tuning;
 
-    if ((ret = get_file_size(file_name, &file_size))) { // 送信するファイルサイズの確認
+    if (parse_option(argc, argv, server_ip, port_num, file_name)) { // オプション解析
+        ret = ERROR_ARGUMENT;
+        set_error(ret, errno);
         goto end;
     }
 
-    if ((ret = send_f_msg(cfd, file_size, file_name))) { // f_msgとしてファイルのname+sizeを送信①
+    DEBUG_MACRO(debug_mode, false, "==== parse_option success ====");
+
+    prefix = remote_name; // ディレクトリを送る場合、--nameはサーバーでの保存先のディレクトリになる
+    if (remote_name == NULL) {
+        remote_name = file_name;
+    }
+    if (is_stream_input(file_name) && (pass_fd || *agent_path != '\0' || option.verify || option.repair)) { // パイプはディスクリプタを渡しても複製できず、エージェントも読めない
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
+        goto end;
+    }
+    if (!watch && is_directory(file_name) && (pass_fd || follow || *agent_path != '\0')) { // ディレクトリは接続ごとのスレッドで直接送る
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
         goto end;
     }
 
-    DEBUG_MACRO(debug_mode, false, "sended f_msg %s, file size = %llu", file_name, file_size);
-
-    recv_bytes = recvn(cfd, &msg_type, sizeof(char), MSG_PEEK);
-
-    if (recv_bytes < 0) {
-        if (recv_bytes == -2) {
-            send_reset_packet(cfd);
-            set_error(ERROR_TIMEOUT, errno);
-            ret = ERROR_TIMEOUT;
-        } else {
-            set_error(ERROR_RECEIVED, errno);
-            ret = ERROR_RECEIVED;
+    if (*agent_path != '\0') { // エージェントが保持している接続で転送する
+        if ((ret = submit_job(server_ip, port_num, file_name))) {
+            goto end;
         }
+        DEBUG_MACRO(debug_mode, false, "==== submit job success ====");
         goto end;
     }
 
-    switch (msg_type) { // serverからの応答メッセージのタイプを確認⑥
-    case 'A':
-        if ((ret = receive_a_msg(cfd, &a_msg))) { // a_msgをserverから受信
+    if (option.verify) { // 送信と照合を同じ接続で続ける
+        option.keepalive = true;
+    }
+    token_bucket_init(&send_bucket, send_rate);
+    option.debug_mode = debug_mode;
+    option.bucket = &send_bucket;
+
+    if (tls) {
+        if (tls_client_setup(tls_ca, tls_verify)) {
+            ret = ERROR_FILE_OPEN;
+            set_error(ret, errno);
             goto end;
         }
-        DEBUG_MACRO(debug_mode, false, "received a_msg");
-        break;
-    case 'E':
-        if ((ret = receive_e_msg(cfd, &e_msg))) { // e_msgをserverから受信
+        option.transport = &transport_tls;
+    }
+
+    if (watch) { // 変更があった時だけ接続するため、接続も任せる
+        if ((ret = watch_directory(file_name, debounce_ms, connect_to_target, &target, &option))) {
             goto end;
         }
-        set_error(ERROR_LOCK_EXISTS, errno);
-        ret = ERROR_LOCK_EXISTS;
-        DEBUG_MACRO(debug_mode, false, "received e_msg : LOCK FILE EXIST ERORR");
-        goto end;
-    default:
-        ret = ERROR_RECEIVED;
+        DEBUG_MACRO(debug_mode, false, "==== watch success ====");
         goto end;
     }
 
-    ret = NORMAL;
-end:
-    return ret;
-}
-
-enum error_code put_session(int cfd, char *file_name)
-{
-	enum error_code ret = ERROR_SYSTEM;
-    struct a_message a_msg = {0};
-    struct e_message e_msg = {0};
-    ssize_t recv_bytes;
-    char msg_type = {0}; // debug用
+    if (is_directory(file_name)) { // ディレクトリ以下のファイルを複数の接続で並行して送る
+        if ((ret = upload_tree(file_name, prefix, jobs, connect_to_target, &target, &option))) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "==== tree upload success ====");
+        goto end;
+    }
 
-    if ((ret = send_file(cfd, file_name))) { // ファイル転送処理 ④
+    if (follow) { // 接続が切れた場合は繋ぎ直すため、接続も任せる
+        if ((ret = follow_file(server_ip, port_num, file_name))) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "==== follow success ====");
         goto end;
     }
-    
-    DEBUG_MACRO(debug_mode, false, "sended file :%s", file_name);
-    
-    if ((ret = send_shutdown(cfd))) { // SHUT_WRをserverに送信 ⑤
+
+    if ((ret = open_connection(server_ip, port_num, &cfd))) {
         goto end;
     }
-    
-    DEBUG_MACRO(debug_mode, false, "sended shutdown packet");
 
-    recv_bytes = recvn(cfd, &msg_type, sizeof(char), MSG_PEEK);
+    DEBUG_MACRO(debug_mode, false, "==== connect server success ====");
 
-    if (recv_bytes < 0) {
-        if (recv_bytes == -2) {
-            send_reset_packet(cfd);
-            set_error(ERROR_TIMEOUT, errno);
-            ret = ERROR_TIMEOUT;
-        } else {
-            set_error(ERROR_RECEIVED, errno);
-            ret = ERROR_RECEIVED;
+    if (is_stream_input(file_name)) {
+        if ((ret = stream_file(cfd, file_name))) {
+            goto end;
         }
+        DEBUG_MACRO(debug_mode, false, "==== stream session success ====");
         goto end;
     }
 
-    switch (msg_type) { // serverからの応答メッセージのタイプを確認⑥
-    case 'A':
-        if ((ret = receive_a_msg(cfd, &a_msg))) { // a_msgをserverから受信
+    if (option.repair) { // 中断した転送などのやり直しでは、異なるチャンクだけを送る
+        if ((ret = verify_file(cfd, file_name, true))) {
             goto end;
         }
-        DEBUG_MACRO(debug_mode, false, "received a_msg");
-        break;
-    case 'E':
-        if ((ret = receive_e_msg(cfd, &e_msg))) { // e_msgをserverから受信
-            goto end;
-        }
-        ret = ERROR_DIFF_FILESIZE;
-        DEBUG_MACRO(debug_mode, false, "received e_msg: DATA SIZE DIFFERENT ERROR");
-        goto end;
-    default:
-        ret = ERROR_RECEIVED;
+        DEBUG_MACRO(debug_mode, false, "==== repair session success ====");
         goto end;
     }
 
-    ret = NORMAL;
-
-end:
-    return ret;
-}
-
-int main(int argc, char *argv[])
-{
-	enum error_code ret = ERROR_SYSTEM;
-    char server_ip[FILENAME_MAX_LEN] = {0};
-    char file_name[FILENAME_MAX_LEN] = {0};
-    char port_num[PORTNUM_MAX_LEN] = {0};
-    int cfd = -1;
-
-    if (parse_option(argc, argv, server_ip, port_num, file_name)) { // オプション解析
-        ret = ERROR_ARGUMENT;
-        set_error(ret, errno);
+    if (pass_fd) {
+        if ((ret = pass_session(cfd, file_name, remote_name, &option))) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "==== pass session success ====");
         goto end;
     }
 
-    DEBUG_MACRO(debug_mode, false, "==== parse_option success ====");
-
-    if ((ret = connect_server(&cfd, server_ip, port_num))) {
+    if ((ret = sparse_file(cfd, file_name, &sparse))) {
         goto end;
     }
+    if (sparse) {
+        DEBUG_MACRO(debug_mode, false, "==== sparse session success ====");
+    } else {
+        if ((ret = begin_session(file_name, remote_name, cfd, &file_size, &option))) {
+            goto end;
+        }
 
-    DEBUG_MACRO(debug_mode, false, "==== connect server success ====");
-
-    if ((ret = begin_session(file_name, cfd))) {
-        goto end;
-    }
+        DEBUG_MACRO(debug_mode, false, "==== begin session success ====");
 
-    DEBUG_MACRO(debug_mode, false, "==== begin session success ====");
+        if ((ret = put_session(cfd, file_name, file_size, &option))) {
+            goto end;
+        }
 
-    if ((ret = put_session(cfd, file_name))) {
-        goto end;
+        DEBUG_MACRO(debug_mode, false, "==== put session success ====");
     }
 
-    DEBUG_MACRO(debug_mode, false, "==== put session success ====");
+    if (option.verify) {
+        if ((ret = verify_file(cfd, file_name, true))) {
+            goto end;
+        }
+        DEBUG_MACRO(debug_mode, false, "==== verify session success ====");
+    }
 
     ret = NORMAL;
 
 end:
-    ret = close_file_descriptor(cfd);
+    if (cfd != -1 && close_file_descriptor(cfd) && ret == NORMAL) { // 処理中のエラーコードを上書きしないようにする
+        ret = ERROR_SYSTEM;
+    }
     print_error();
     return ret;
 }
\ No newline at end of file
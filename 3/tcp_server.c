@@ -1,451 +1,340 @@
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <netdb.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <signal.h>
 #include "error.h"
 #include "common.h"
 #include "socket_msg.h"
+#include "transfer.h"
+#include "storage.h"
+#include "rudp.h"
+#include "tls.h"
+#include "merkle.h"
 
 static bool debug_mode = false;
+static struct server_config config; // コマンドラインで指定されたサーバー設定
+static struct transfer_server *server = NULL;
+static const char *tls_cert = NULL; // 指定した場合はTLSで待ち受ける
+static const char *tls_key = NULL;
+static const char *storage_roots[STORAGE_MAX_ROOTS]; // -sを複数指定した場合の保存先
+
+enum long_option {
+    OPT_PEER_RATE = 256,
+    OPT_SESSION_RATE,
+    OPT_TOTAL_RATE,
+    OPT_CLASS_WEIGHTS,
+    OPT_SCHED_SLOTS,
+    OPT_HANDSHAKE_TIMEOUT,
+    OPT_IDLE_TIMEOUT,
+    OPT_MIN_RATE,
+    OPT_TCP,
+    OPT_UDP,
+    OPT_UDP_INJECT,
+    OPT_TLS_CERT,
+    OPT_TLS_KEY,
+    OPT_PLACEMENT,
+    OPT_DISK_WRITERS,
+    OPT_MIN_FREE,
+    OPT_UPGRADE_SOCKET,
+    OPT_SINK_EXEC,
+    OPT_SINK_UNIX,
+    OPT_SINK_BUFFER,
+    OPT_HASH_THREADS
+};
 
-struct client_thread_args
-{
-    int cfd;
-    char *server_base_path;
-    bool debug_mode_enabled;
+static const struct option long_options[] = {
+    {"peer-rate", required_argument, NULL, OPT_PEER_RATE},       // 接続元アドレスごとの上限（バイト/秒）
+    {"session-rate", required_argument, NULL, OPT_SESSION_RATE}, // セッションごとの上限（バイト/秒）
+    {"total-rate", required_argument, NULL, OPT_TOTAL_RATE},     // サーバー全体の上限（バイト/秒）
+    {"class-weights", required_argument, NULL, OPT_CLASS_WEIGHTS}, // 優先度クラスの重み（例: 8,4,1）
+    {"sched-slots", required_argument, NULL, OPT_SCHED_SLOTS},     // デバイスごとに受け付ける書き込み要求数
+    {"handshake-timeout", required_argument, NULL, OPT_HANDSHAKE_TIMEOUT}, // 接続から最初のf_msg受信までの期限（ミリ秒、0で無効）
+    {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},   // データや接続維持の次のf_msgが届かない状態の期限（ミリ秒、0で無効）
+    {"min-rate", required_argument, NULL, OPT_MIN_RATE},           // 受信の最低スループット（バイト/秒、0で無効）
+    {"tcp", required_argument, NULL, OPT_TCP},                     // ソケットの調整項目（例: rcvbuf=8M,cc=bbr,auto=1G）
+    {"udp", no_argument, NULL, OPT_UDP},                           // -pのUDPポートで信頼性のある転送路を待ち受ける
+    {"udp-inject", required_argument, NULL, OPT_UDP_INJECT},       // UDPの送信に損失と遅延を注入する（例: loss=1,delay=50）
+    {"tls-cert", required_argument, NULL, OPT_TLS_CERT},           // TLSで待ち受ける証明書（PEM、中間証明書を含めてよい）
+    {"tls-key", required_argument, NULL, OPT_TLS_KEY},             // 証明書の秘密鍵（PEM）
+    {"placement", required_argument, NULL, OPT_PLACEMENT},         // 複数の-sへの振り分け方（hash: ファイル名 space: 空き容量）
+    {"disk-writers", required_argument, NULL, OPT_DISK_WRITERS},   // デバイスごとの書き込みスレッド数
+    {"min-free", required_argument, NULL, OPT_MIN_FREE},           // 受信後も保存先に残す空き容量（例: 1G）
+    {"upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET}, // 稼働中のサーバーとリスナーを引き継ぎ合うソケットファイル
+    {"sink-exec", required_argument, NULL, OPT_SINK_EXEC},         // 保存せずにファイルごとにコマンドを起動し、標準入力に流す
+    {"sink-unix", required_argument, NULL, OPT_SINK_UNIX},         // 保存せずにUNIXドメインソケットの消費側へ流す
+    {"sink-buffer", required_argument, NULL, OPT_SINK_BUFFER},     // 消費側との間に溜めるデータの上限（例: 4M）
+    {"hash-threads", required_argument, NULL, OPT_HASH_THREADS},   // 照合でハッシュ木を計算するスレッドの数（既定はCPU数）
+    {NULL, 0, NULL, 0}
 };
 
 int parse_option(int argc, char **argv, char *port_num, char *full_file_path)
 {
     int opt;
+    char *end_ptr;
+    unsigned long long value;
     if (argc < 2) {
         return -1;
     }
-    while ((opt = getopt(argc, argv, "p:s:d")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:u:s:n:c:b:w:d", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd':
             debug_mode = true;
+            config.debug_mode = true;
+            break;
+        case 'n':
+            config.listener_count = (int)strtol(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || config.listener_count < 0) {
+                return -1;
+            }
+            break;
+        case 'c':
+            errno = 0;
+            value = strtoul(optarg, &end_ptr, 10);
+            if (errno != 0 || end_ptr == optarg || *end_ptr != '\0' || *optarg == '-' || value > UINT_MAX) {
+                return -1;
+            }
+            config.max_sessions = (unsigned int)value;
+            break;
+        case 'b':
+            if (parse_size(optarg, &config.max_inflight_bytes)) {
+                return -1;
+            }
+            break;
+        case 'w':
+            errno = 0;
+            value = strtoul(optarg, &end_ptr, 10);
+            if (errno != 0 || end_ptr == optarg || *end_ptr != '\0' || *optarg == '-' || value > UINT_MAX) {
+                return -1;
+            }
+            config.retry_after_ms = (unsigned int)value;
             break;
         case 'p':
             strcpy(port_num, optarg);
             break;
-        case 's':
-            strcpy(full_file_path, optarg);
+        case 'u': // 同一ホストのクライアント向けにUNIXドメインソケットで待ち受ける
+            config.unix_path = optarg;
+            break;
+        case 's': // 複数指定した場合はディスクごとの保存先としてファイルを振り分ける
+            if (config.storage_root_count >= STORAGE_MAX_ROOTS || strlen(optarg) >= MAX_PATH_LEN) {
+                return -1;
+            }
+            if (config.storage_root_count == 0) {
+                strcpy(full_file_path, optarg);
+            }
+            storage_roots[config.storage_root_count++] = optarg;
+            break;
+        case OPT_PEER_RATE:
+            if (parse_size(optarg, &config.peer_rate)) {
+                return -1;
+            }
+            break;
+        case OPT_SESSION_RATE:
+            if (parse_size(optarg, &config.session_rate)) {
+                return -1;
+            }
+            break;
+        case OPT_TOTAL_RATE:
+            if (parse_size(optarg, &config.total_rate)) {
+                return -1;
+            }
+            break;
+        case OPT_CLASS_WEIGHTS:
+            config.class_weights = optarg;
+            break;
+        case OPT_SCHED_SLOTS:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0') {
+                return -1;
+            }
+            config.sched_slots = (unsigned int)value;
+            break;
+        case OPT_HANDSHAKE_TIMEOUT:
+            config.handshake_timeout_ms = strtoull(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0') {
+                return -1;
+            }
+            break;
+        case OPT_IDLE_TIMEOUT:
+            config.idle_timeout_ms = strtoull(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0') {
+                return -1;
+            }
+            break;
+        case OPT_MIN_RATE:
+            if (parse_size(optarg, &config.min_rate)) {
+                return -1;
+            }
+            break;
+        case OPT_TCP:
+            if (tuning_parse(&config.tuning, optarg)) {
+                return -1;
+            }
+            break;
+        case OPT_UDP:
+            config.udp = true;
+            break;
+        case OPT_UDP_INJECT:
+            if (rudp_set_inject(optarg)) {
+                return -1;
+            }
+            break;
+        case OPT_TLS_CERT:
+            tls_cert = optarg;
+            break;
+        case OPT_TLS_KEY:
+            tls_key = optarg;
+            break;
+        case OPT_PLACEMENT:
+            if (storage_parse_placement(optarg, &config.placement)) {
+                return -1;
+            }
+            break;
+        case OPT_DISK_WRITERS:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0 || value > 64) {
+                return -1;
+            }
+            config.storage_writers = (unsigned int)value;
+            break;
+        case OPT_MIN_FREE:
+            if (parse_size(optarg, &config.min_free_bytes)) {
+                return -1;
+            }
+            break;
+        case OPT_UPGRADE_SOCKET: // 同じ指定で新しいサーバーを起動すると、古いサーバーは受け付けを渡して処理中のセッションを終えてから終了する
+            config.upgrade_path = optarg;
+            break;
+        case OPT_SINK_EXEC:
+            config.sink_exec = optarg;
+            break;
+        case OPT_SINK_UNIX:
+            config.sink_unix = optarg;
+            break;
+        case OPT_SINK_BUFFER:
+            if (parse_size(optarg, &config.sink_buffer_bytes)) {
+                return -1;
+            }
+            break;
+        case OPT_HASH_THREADS:
+            value = strtoul(optarg, &end_ptr, 10);
+            if (*end_ptr != '\0' || value == 0 || value > MERKLE_MAX_THREADS) {
+                return -1;
+            }
+            config.hash_threads = (unsigned int)value;
             break;
         default:
             return -1;
         }
     }
-    return 0;
-}
-
-enum error_code get_file_size(int fd, unsigned long long *file_size)
-{
-    struct stat file_info;
-
-    if (fstat(fd, &file_info) != 0) {
-        set_error(ERROR_SYSTEM, errno);
-        return ERROR_SYSTEM;
+    if (config.storage_root_count == 1) { // 1つの場合は従来どおりbase_pathとして扱う
+        config.storage_root_count = 0;
+    } else if (config.storage_root_count > 1) {
+        config.storage_roots = storage_roots;
     }
-    
-    *file_size = file_info.st_size;
-    return NORMAL;
-}
-
-char *create_lock_file_name(char *origin_file_name)
-{
-    size_t len = strlen(origin_file_name);
-    char *lock_file_name = (char *)malloc(len + strlen(".lock") + 1);
-    if (lock_file_name == NULL) {
-        set_error(ERROR_SYSTEM, errno);
-        return NULL;
+    if ((tls_cert == NULL) != (tls_key == NULL) || (tls_cert != NULL && config.udp)) { // UDPの転送路にTLSは重ねられない
+        return -1;
     }
-    strcpy(lock_file_name, origin_file_name);
-    strcat(lock_file_name, ".lock");
-    return lock_file_name;
+    return 0;
 }
 
-int open_lock_file(char *lock_file_name)
+void dump_stats(void) // 統計情報をtrans-data-server-stats.pidに書き出す
 {
-    int lock_fd = -1;
+    char file_name[FILENAME_MAX_LEN];
+    FILE *fp;
 
-    lock_fd = open(lock_file_name, O_RDWR | O_CREAT | O_EXCL, 0644);
-
-    if (lock_fd == -1){
-        if (errno == EEXIST) {
-            set_error(ERROR_LOCK_EXISTS, errno);
-            return -2;
-        } else {
-            set_error(ERROR_LOCK_CREATE, errno);
-            return -3;
-        }
+    snprintf(file_name, sizeof(file_name), "%s%lu", "trans-data-server-stats.", (unsigned long)getpid());
+    fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        return;
     }
-
-    return lock_fd;
-
+    transfer_server_dump_stats(server, fp);
+    fclose(fp);
 }
 
-int open_recv_file(char *file_name)
+void *signal_thread(void *arg) // SIGUSR1を受け取ったら統計情報を書き出す
 {
-    int file = -1;
-    file = open(file_name, O_CREAT | O_RDWR, 0644);
-    if (file == -1) {
-        set_error(ERROR_FILE_OPEN, errno);
-        return ERROR_FILE_OPEN;
-    }
-    return file;
-}
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
 
-void close_lock_file(char *lock_file_name)
-{
-    if (lock_file_name != NULL) {
-        if (access(lock_file_name, F_OK) == 0) {
-            if (unlink(lock_file_name) == -1) {
-                set_error(ERROR_LOCK_REMOVE, errno);
-            }
+    for (;;) {
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            dump_stats();
         }
-        free(lock_file_name);
     }
+    return NULL;
 }
 
-enum error_code close_file_descriptor(int fd)
+enum error_code start_signal_thread(void)
 {
-    if (close(fd) == -1) {
-        set_error(ERROR_SYSTEM, errno);
+    static sigset_t set;
+    pthread_t tid;
+    int s;
+
+    // 他のスレッドを生成する前にシグナルをブロックし、専用スレッドだけで受け取る
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    s = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (s != 0) {
+        set_error(ERROR_SYSTEM, s);
         return ERROR_SYSTEM;
     }
-    return NORMAL;
-}
-
-enum error_code receive_file(int socket, int file)
-{
-    enum error_code ret = ERROR_SYSTEM;
-    ssize_t recv_bytes;
-    char buffer[BUFFER_SIZE];
-
-    while ((recv_bytes = recv(socket, buffer, BUFFER_SIZE, MSG_WAITALL)) > 0) {
-        if (write(file, buffer, recv_bytes) < recv_bytes) {
-            set_error(ERROR_RECEIVED, errno);
-            ret = ERROR_RECEIVED;
-            goto end;
-        } 
-    }
-    if (recv_bytes < 0) {
-        set_error(ERROR_RECEIVED, errno);
-        ret = ERROR_RECEIVED;
-        goto end;
-    }
-    ret = NORMAL;
-end:
-    return ret;
-}
-
-enum error_code setup_server(int *lfd, char *port_num)
-{
-    enum error_code ret = ERROR_SYSTEM;
-    struct addrinfo hints;
-    struct addrinfo *result = NULL;
-    
-    struct timeval timeout; // SO_RCVTIMEOの設定値
-    timeout.tv_sec = 20;
-    timeout.tv_usec = 0;
-
-    int opt_val = 1; // SO_REUSEADDRの設定値
-
-    // getaddrinfo()の準備
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-
-    int status = getaddrinfo(NULL, port_num, &hints, &result);
-    if (status) {
-        ret = ERROR_SYSTEM;
-        set_error(ERROR_SYSTEM, status);
-        goto end;
-    }
-
-    // ソケットの生成とアドレスのバインド
-    *lfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (*lfd == -1) {
-        ret = ERROR_SOCKET;
-        set_error(ret, errno);
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, " Created a socket on port %s", port_num);
-
-    if (setsockopt(*lfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout)) {
-        ret = ERROR_SOCKET;
-        set_error(ret, errno);
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, " Set socket options SO_RCVTIMEO");
-
-    if (setsockopt(*lfd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof opt_val)) {
-        ret = ERROR_SOCKET;
-        set_error(ret, errno);
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, " Set socket options SO_REUSEADDR");
-    
-    if (bind(*lfd, result->ai_addr, result->ai_addrlen)) {
-        ret = ERROR_BIND;
-        set_error(ret, errno);
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, " Bound to port %s", port_num);
-
-    if (listen(*lfd, SOMAXCONN)) {
-        ret = ERROR_LISTEN;
-        set_error(ret, errno);
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, " Listening on port %s", port_num);
-    
-    ret = NORMAL;
-end:
-    if (result) {
-        freeaddrinfo(result);
-    }
-    return ret;
-}
-
-enum error_code verify_data_size(unsigned long long file_size, int fd)
-{
-    enum error_code ret = ERROR_SYSTEM;
-    unsigned long long recv_file_size;
-    if ((ret = get_file_size(fd, &recv_file_size))) { // クライアントから受信したファイルサイズの取得
-        goto end;
-    }
-
-    if (file_size != recv_file_size) {
-        goto end;
+    s = pthread_create(&tid, NULL, signal_thread, &set);
+    if (s != 0) {
+        set_error(ERROR_SYSTEM, s);
+        return ERROR_SYSTEM;
     }
-    ret = NORMAL;
-
-end:
-    return ret;
+    pthread_detach(tid);
+    return NORMAL;
 }
 
-enum error_code concatenate_path(char *dir_path, char *file_name, char *full_path, int max_size)
+void *listener_thread(void *arg)
 {
-    enum error_code ret = ERROR_SYSTEM;
-
-    // dir_path の末尾が '/' で終わっているか確認
-    size_t dir_len = strlen(dir_path);
-    if (dir_path[dir_len - 1] == '/') { // '/' が既に存在する場合
-        if (dir_len + strlen(file_name) >= max_size) {
-            set_error(ERROR_BUFFER_OVERFLOW, errno);
-            ret = ERROR_BUFFER_OVERFLOW; // バッファ不足
-            goto end;
-        }
-        int written = snprintf(full_path, max_size, "%s%s", dir_path, file_name);
-        if (written < 0 || written >= max_size) {
-            set_error(ERROR_SYSTEM, errno); // システムエラー（ここではバッファ不足を含む）
-            ret = ERROR_SYSTEM;
-            goto end;
-        }
-    } else { // '/' を追加する場合
-        if (dir_len + 1 + strlen(file_name) >= max_size) {
-            set_error(ERROR_BUFFER_OVERFLOW, errno);
-            ret = ERROR_BUFFER_OVERFLOW; // バッファ不足
-            goto end;
-        }
-        int written = snprintf(full_path, max_size, "%s/%s", dir_path, file_name);
-        if (written < 0 || written >= max_size) {
-            set_error(ERROR_SYSTEM, errno);
-            ret = ERROR_SYSTEM; // システムエラー（ここではバッファ不足を含む）
-            goto end;
-        }
-    }
-    ret = NORMAL;
-
-end:
-    return ret;    
-}
+    (void)arg;
 
-enum error_code begin_session(int cfd, struct f_message *f_msg, int *fd, int *lock_fd, char **file_path, char **lock_file_path)
-{
-    enum error_code ret = ERROR_SYSTEM;
-    char full_path[MAX_PATH_LEN] = {0};
-    
-    if ((ret = receive_f_msg(cfd, f_msg))) { // clientからのf_msgを受信①
-        goto end;
-    }
-    DEBUG_MACRO(debug_mode, true, "received f_msg %s:%llu", f_msg->file_name, f_msg->file_size);
-
-    if (concatenate_path(*file_path, f_msg->file_name, full_path, sizeof(full_path))) {
-        goto end;
-    }
-
-    *lock_file_path = create_lock_file_name(full_path);
-    if (*lock_file_path == NULL) {
-        ret = ERROR_SYSTEM;
-        goto end;
-    }
-
-    // ロックファイルのオープン
-    *lock_fd = open_lock_file(*lock_file_path);
-    if (*lock_fd < 0) { // ロックファイルのエラー処理
-        switch (*lock_fd) {
-        case -2:
-            if ((ret = send_e_msg(cfd, "lock file exist."))) { // serverに対してa_msgを送信③
-                goto end;
-            }
-            ret = ERROR_LOCK_EXISTS;
-            break;
-
-        case -3:
-            if ((ret = send_e_msg(cfd, "lock file create error."))) { // serverに対してa_msgを送信③
-                goto end;
-            }
-            ret = ERROR_LOCK_CREATE;
-            break;
-        
-        default:
-            if ((ret = send_e_msg(cfd, "error occurred related to the lock file."))) { // serverに対してa_msgを送信③
-               goto end;
-            }
-            ret = ERROR_SYSTEM;
-            break;
-        }
-        goto end;
-    }
-
-    // 受信ファイルのオープン
-    *fd = open_recv_file(full_path);
-    if (*fd < 0) { // 受信ファイルのエラー処理
-        ret = ERROR_FILE_OPEN;
-        goto end;
-    }
-
-    if ((ret = send_a_msg(cfd))) { // serverに対してa_msgを送信③
-        goto end;
-    }
-
-    DEBUG_MACRO(debug_mode, true, "sended a_msg");
-
-    ret = NORMAL;
-end:
-    return ret;
+    transfer_server_run(server);
+    return NULL;
 }
 
-enum error_code put_session(int cfd, unsigned long long file_size, int fd, int lock_fd, char *lock_file_path)
+enum error_code run_listeners(void) // リスナーごとにスレッドを用意し、最後の1つはメインスレッドで処理する
 {
     enum error_code ret = ERROR_SYSTEM;
+    int count = transfer_server_listener_count(server);
+    pthread_t *tids = NULL;
+    int started = 0;
+    int i, s;
 
-    if (receive_file(cfd, fd)) { // clientから送られるファイルを受け取り、保存する④
-        goto end;
-    }
-
-    DEBUG_MACRO(debug_mode, true, "received file :\n");
-    
-    if ((ret = verify_data_size(file_size, fd))) { // ファイルのデータサイズ検証⑥ サイズに問題なければ、a_msgをclientに送信
-        if (ret != ERROR_DIFF_FILESIZE) {
-            if ((ret = send_e_msg(cfd, "The specified file size does not match the received file size."))) {
-                goto end;
-            }
-        }
-        goto end; 
-    }
-
-    DEBUG_MACRO(debug_mode, true, "verified file size :%llu", file_size);
-
-    if ((ret = send_a_msg(cfd))) { // a_msgをclientに送信 ⑦
-        goto end;
-    }
-
-    DEBUG_MACRO(debug_mode, true, "sended a_msg");
-
-    ret = NORMAL;
-
-end:
-    ret = close_file_descriptor(fd);
-    close_lock_file(lock_file_path);
-    return ret;
-}
-
-void *handle_client(void *thread_args) 
-{
-    struct client_thread_args *args = (struct client_thread_args *)thread_args;
-
-    int cfd = args->cfd;
-    char *file_path = args->server_base_path;
-    bool current_debug_mode = args->debug_mode_enabled;
-
-    struct f_message f_msg = {0};
-    char *lock_file_path = NULL;
-
-    int fd = -1; // 受信ファイルのディスクリプタ
-    int lock_fd = -1; // ロックファイルディスクリプタ
-
-    DEBUG_MACRO(current_debug_mode, true, "NEW Client connected");
-    
-    if (begin_session(cfd, &f_msg, &fd, &lock_fd, &file_path, &lock_file_path)) {
-        goto end;
-    }
-    DEBUG_MACRO(current_debug_mode, true, "==== begin session success ====");
-
-    if (put_session(cfd, f_msg.file_size, fd, lock_fd, lock_file_path)) {
+    tids = calloc(count, sizeof(pthread_t));
+    if (tids == NULL) {
+        set_error(ERROR_SYSTEM, errno);
         goto end;
     }
-    DEBUG_MACRO(debug_mode, true, "==== put session success ====");
-
-end:
-    if (args != NULL) {
-        free(args);
-    }
-
-    return NULL;
-    
-}
 
-enum error_code communication_data(int lfd, char *file_path)
-{
-    enum error_code ret = ERROR_SYSTEM;
-    int cfd = -1;
-
-    for (;;) {
-        cfd = accept(lfd, NULL, NULL);
-        if (cfd == -1) {
-            continue;
-        }
-        DEBUG_MACRO(debug_mode, true, "accept");
-
-        struct client_thread_args *args = malloc(sizeof(struct client_thread_args));
-        if (args == NULL) {
-            set_error(ERROR_SYSTEM, errno);
-            ret = ERROR_SYSTEM;
-            goto end;
-        }
-
-        args->cfd = cfd;
-        args->server_base_path = file_path;
-        args->debug_mode_enabled = debug_mode;
-
-        pthread_t tid;
-        int s;
-
-        s = pthread_create(&tid, NULL, handle_client, (void *)args);
+    for (started = 0; started < count - 1; started++) {
+        s = pthread_create(&tids[started], NULL, listener_thread, NULL);
         if (s != 0) {
             set_error(ERROR_SYSTEM, s);
             ret = ERROR_SYSTEM;
+            transfer_server_stop(server); // 起動済みのリスナーを終わらせてから待つ
             goto end;
         }
-        pthread_detach(tid);
     }
 
+    ret = transfer_server_run(server);
 end:
-    ret = close_file_descriptor(cfd);
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
     return ret;
 }
 
@@ -454,7 +343,6 @@ int main(int argc, char *argv[])
     enum error_code ret = ERROR_SYSTEM;
     char port_num[PORTNUM_MAX_LEN] = {0};
     char file_path[MAX_PATH_LEN] = {0};
-    int lfd = -1;
 
     // nochdir = 1を指定して、daemon()がカレントディレクトリを変更しないようにする
     if (daemon(1, 0) != 0) { 
@@ -465,6 +353,8 @@ int main(int argc, char *argv[])
 
     DEBUG_MACRO(debug_mode, true, "==== daemonized success ====");
 
+    transfer_server_config_init(&config);
+
     if (parse_option(argc, argv, port_num, file_path)) { // オプション解析
         ret = ERROR_ARGUMENT;
         set_error(ret, errno);
@@ -472,16 +362,29 @@ int main(int argc, char *argv[])
     }
     DEBUG_MACRO(debug_mode, true, "==== parse_option success ====");
 
-    if (*file_path == '\0') { // -sオプションがない場合、filepathにはカレントディレクトリを指定
-        getcwd(file_path, sizeof(file_path));
+    config.port_num = port_num;
+    config.base_path = file_path; // 空の場合はカレントディレクトリ
+
+    if (tls_cert != NULL) {
+        if (tls_server_setup(tls_cert, tls_key)) {
+            ret = ERROR_FILE_OPEN;
+            set_error(ret, errno);
+            goto end;
+        }
+        config.transport = &transport_tls;
+        DEBUG_MACRO(debug_mode, true, "==== tls setup success ====");
     }
 
-    if ((ret = setup_server(&lfd, port_num))) { // サーバー設定処理
+    if ((ret = transfer_server_create(&server, &config))) { // サーバー設定処理
         goto end;
     }
     DEBUG_MACRO(debug_mode, true, "==== setup server success ====");
- 
-    if ((ret = communication_data(lfd, file_path))) { // データ通信処理
+
+    if ((ret = start_signal_thread())) {
+        goto end;
+    }
+
+    if ((ret = run_listeners())) { // データ通信処理
         goto end;
     }
     DEBUG_MACRO(debug_mode, true, "==== communication data success ====");
@@ -489,7 +392,7 @@ int main(int argc, char *argv[])
     ret = NORMAL;
     
 end:
-    ret = close_file_descriptor(lfd);
+    transfer_server_destroy(server);
     print_error();
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# 信頼性のあるUDPの転送路に損失と遅延を注入し、ループバックで送った内容が一致することとかかった時間を確かめる
+# 使い方: tests/rudp_loss.sh [注入の指定（既定: loss=1,delay=25）] [サイズ（MB、既定: 20）]
+# 3/でmakeした後に実行する
+
+INJECT=${1:-loss=1,delay=25}
+SIZE_MB=${2:-20}
+PORT=${RUDP_TEST_PORT:-47391}
+BIN=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+STATUS=1
+
+stop_server()
+{
+    pkill -f "tcp_server -p $PORT " 2> /dev/null
+}
+
+trap 'stop_server; rm -rf "$WORK"' EXIT
+
+mkdir "$WORK/store"
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/data"
+
+# サーバーはデーモンになるので、終了はポート番号を含むコマンドラインで探して止める
+"$BIN/tcp_server" -p $PORT -s "$WORK/store" --udp --udp-inject "$INJECT" > /dev/null 2>&1 < /dev/null
+sleep 1
+
+START=$(date +%s%N)
+"$BIN/tcp_client" -h 127.0.0.1 -p $PORT -f "$WORK/data" --name data --udp --udp-inject "$INJECT"
+RESULT=$?
+END=$(date +%s%N)
+
+if [ $RESULT -ne 0 ]; then
+    echo "rudp_loss: upload failed (rc=$RESULT, inject=$INJECT)"
+elif ! cmp -s "$WORK/data" "$WORK/store/data"; then
+    echo "rudp_loss: stored file differs (inject=$INJECT)"
+else
+    MS=$(((END - START) / 1000000))
+    echo "rudp_loss: ${SIZE_MB}MB inject=$INJECT ${MS}ms"
+    STATUS=0
+fi
+exit $STATUS
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../admission.h"
+
+/*
+ * 受け付け制御の試験。同時セッション数の上限、受信中バイト数の予約と解放、全セッション終了の待ち合わせを確かめる
+ */
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed (errno=%d)\n", __FILE__, __LINE__, #cond, errno); \
+        return 1; \
+    } \
+} while (0)
+
+static int test_sessions(void) // 上限に達するとbusyになり、1つ抜けると再び入れる
+{
+    struct admission adm;
+    int i;
+
+    admission_init(&adm, 2, 0, DEFAULT_RETRY_AFTER_MS);
+    CHECK(admission_enter_session(&adm));
+    CHECK(admission_enter_session(&adm));
+    CHECK(!admission_enter_session(&adm));
+    admission_leave_session(&adm);
+    CHECK(admission_enter_session(&adm));
+    CHECK(adm.active_sessions == 2);
+    admission_leave_session(&adm);
+    admission_leave_session(&adm);
+    admission_leave_session(&adm); // 余分に抜けても負にならない
+    CHECK(adm.active_sessions == 0);
+
+    admission_init(&adm, 0, 0, DEFAULT_RETRY_AFTER_MS); // 0は無制限
+    for (i = 0; i < 1000; i++) {
+        CHECK(admission_enter_session(&adm));
+    }
+    return 0;
+}
+
+static int test_bytes(void) // 上限を超える予約は拒否するが、他に受信中のものがなければ1件は受け付ける
+{
+    struct admission adm;
+
+    admission_init(&adm, 0, 100, DEFAULT_RETRY_AFTER_MS);
+    CHECK(admission_reserve_bytes(&adm, 60));
+    CHECK(!admission_reserve_bytes(&adm, 50));
+    CHECK(admission_reserve_bytes(&adm, 40));
+    CHECK(adm.inflight_bytes == 100);
+    admission_release_bytes(&adm, 60);
+    admission_release_bytes(&adm, 40);
+    CHECK(adm.inflight_bytes == 0);
+
+    CHECK(admission_reserve_bytes(&adm, 500)); // 単独なら上限より大きくても受け付ける
+    CHECK(!admission_reserve_bytes(&adm, 1));
+    admission_release_bytes(&adm, 1000); // 予約より多く解放しても0で止まる
+    CHECK(adm.inflight_bytes == 0);
+
+    admission_init(&adm, 0, 0, DEFAULT_RETRY_AFTER_MS);
+    CHECK(admission_reserve_bytes(&adm, 1ULL << 40));
+    CHECK(admission_reserve_bytes(&adm, 1ULL << 40));
+    return 0;
+}
+
+static void *leave_thread(void *arg)
+{
+    usleep(50 * 1000);
+    admission_leave_session(arg);
+    return NULL;
+}
+
+static int test_wait_idle(void) // 最後のセッションが抜けるとadmission_wait_idle()が戻る
+{
+    struct admission adm;
+    pthread_t thread;
+
+    admission_init(&adm, 0, 0, DEFAULT_RETRY_AFTER_MS);
+    admission_wait_idle(&adm); // セッションがなければすぐに戻る
+    CHECK(admission_enter_session(&adm));
+    CHECK(pthread_create(&thread, NULL, leave_thread, &adm) == 0);
+    admission_wait_idle(&adm);
+    CHECK(adm.active_sessions == 0);
+    pthread_join(thread, NULL);
+    return 0;
+}
+
+int main(void)
+{
+    if (test_sessions() || test_bytes() || test_wait_idle()) {
+        return 1;
+    }
+    printf("test_admission: ok\n");
+    return 0;
+}
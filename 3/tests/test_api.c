@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../transfer.h"
+
+/*
+ * 組み込み用のlibtransfer.aだけとリンクし、transfer.hの関数でサーバーを動かしてメモリ上のデータを送る
+ * ライブラリ内部と同じ名前を定義しても、内部のシンボルはローカルになっているため衝突しない
+ */
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed (errno=%d)\n", __FILE__, __LINE__, #cond, errno); \
+        return 1; \
+    } \
+} while (0)
+
+int sendn = 0;     // ライブラリ内部のsendn()と同じ名前
+int set_error = 0; // ライブラリ内部のset_error()と同じ名前
+
+static void *server_thread(void *arg)
+{
+    transfer_server_run(arg);
+    return NULL;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/test_api.XXXXXX";
+    char unix_path[64];
+    char stored[64];
+    char received[32];
+    const char data[] = "embedded upload";
+    struct server_config config;
+    struct transfer_server *srv;
+    struct transfer_dest dest;
+    struct transfer_result result;
+    pthread_t thread;
+    FILE *fp;
+    size_t length;
+
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(unix_path, sizeof(unix_path), "%s/sock", dir);
+    snprintf(stored, sizeof(stored), "%s/data", dir);
+
+    transfer_server_config_init(&config);
+    config.unix_path = unix_path;
+    config.base_path = dir;
+    config.listener_count = 1;
+    CHECK(transfer_server_create(&srv, &config) == NORMAL);
+    CHECK(pthread_create(&thread, NULL, server_thread, srv) == 0);
+
+    transfer_dest_init(&dest, NULL, NULL);
+    dest.unix_path = unix_path;
+    result = transfer_upload_buffer(&dest, data, sizeof(data) - 1, "data");
+    CHECK(result.code == NORMAL && result.bytes == sizeof(data) - 1);
+
+    fp = fopen(stored, "r");
+    CHECK(fp != NULL);
+    length = fread(received, 1, sizeof(received), fp);
+    fclose(fp);
+    CHECK(length == sizeof(data) - 1 && memcmp(received, data, length) == 0);
+
+    result = transfer_upload_buffer(&dest, data, sizeof(data) - 1, "../escape"); // サーバーが拒否する名前
+    CHECK(result.code != NORMAL);
+
+    transfer_server_stop(srv);
+    pthread_join(thread, NULL);
+    transfer_server_destroy(srv);
+    unlink(stored);
+    rmdir(dir);
+    printf("test_api: ok (sendn=%d, set_error=%d)\n", sendn, set_error);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "../timerwheel.h"
+#include "../deadline.h"
+
+/*
+ * セッションの期限の試験。短いティックのホイールを動かし、期限切れでソケットがshutdown()されること、
+ * 受信の進捗とサーバー側の待ちが期限を延ばすこと、終了後は発火しないことを確かめる
+ */
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed (errno=%d)\n", __FILE__, __LINE__, #cond, errno); \
+        return 1; \
+    } \
+} while (0)
+
+#define TICK_MS 10
+#define IDLE_MS 150
+#define WAIT_LIMIT_MS 3000
+
+static struct timer_wheel wheel;
+
+static enum deadline_reason wait_expired(struct session_deadline *d) // 期限切れになるかWAIT_LIMIT_MSが過ぎるまで待つ
+{
+    enum deadline_reason reason = EXPIRED_NONE;
+    int waited;
+
+    for (waited = 0; waited < WAIT_LIMIT_MS; waited += TICK_MS) {
+        reason = __atomic_load_n(&d->expired, __ATOMIC_RELAXED);
+        if (reason != EXPIRED_NONE) {
+            break;
+        }
+        usleep(TICK_MS * 1000);
+    }
+    return reason;
+}
+
+static int is_shut(int fd) // shutdown(SHUT_RDWR)された側は読み込みがすぐにEOFになる
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+static int test_handshake(void) // f_msgが届かなければ期限切れになり、cfdと中継先がshutdown()される
+{
+    struct deadline_config config = { 50, IDLE_MS, 0 };
+    struct session_deadline d;
+    int sv[2];
+    int aux[2];
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, aux) == 0);
+    deadline_begin(&d, &wheel, &config, sv[0]);
+    deadline_watch_fd(&d, aux[0]);
+    CHECK(wait_expired(&d) == EXPIRED_HANDSHAKE);
+    CHECK(is_shut(sv[0]));
+    CHECK(is_shut(aux[0]));
+    deadline_end(&d);
+    close(sv[0]);
+    close(sv[1]);
+    close(aux[0]);
+    close(aux[1]);
+    return 0;
+}
+
+static int test_idle(void) // 受信が続く間と、サーバー側で待っている間は期限切れにならない
+{
+    struct deadline_config config = { 0, IDLE_MS, 0 };
+    struct session_deadline d;
+    int sv[2];
+    int i;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    deadline_begin(&d, &wheel, &config, sv[0]);
+    deadline_set_phase(&d, PHASE_TRANSFER);
+    for (i = 0; i < 20; i++) { // 合計でIDLE_MSの数倍
+        usleep(IDLE_MS / 5 * 1000);
+        deadline_progress(&d, 1);
+    }
+    CHECK(d.expired == EXPIRED_NONE && d.bytes == 20);
+
+    deadline_throttle(&d, true);
+    usleep(IDLE_MS * 3 * 1000);
+    CHECK(d.expired == EXPIRED_NONE);
+    deadline_throttle(&d, false);
+    CHECK(d.throttled_ticks >= timer_wheel_ticks(&wheel, IDLE_MS));
+
+    CHECK(wait_expired(&d) == EXPIRED_IDLE);
+    CHECK(is_shut(sv[0]));
+    deadline_end(&d);
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
+
+static int test_end(void) // 終了した期限は発火しない
+{
+    struct deadline_config config = { 30, 30, 0 };
+    struct session_deadline d;
+    int sv[2];
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    deadline_begin(&d, &wheel, &config, sv[0]);
+    deadline_end(&d);
+    CHECK(!d.timer.pending);
+    usleep(200 * 1000);
+    CHECK(d.expired == EXPIRED_NONE);
+    CHECK(!is_shut(sv[0]));
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
+
+int main(void)
+{
+    int failed;
+
+    timer_wheel_init(&wheel, TICK_MS);
+    if (timer_wheel_start(&wheel)) {
+        fprintf(stderr, "timer_wheel_start failed\n");
+        return 1;
+    }
+    failed = test_handshake() || test_idle() || test_end();
+    timer_wheel_stop(&wheel);
+    if (failed) {
+        return 1;
+    }
+    printf("test_deadline: ok\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "../transport.h"
+#include "../common.h"
+#include "../client.h"
+#include "../socket_msg.h"
+
+/*
+ * 転送路の抽象化の試験。インメモリ転送の端点を作り、transport_*()とsendn()/recvn()、
+ * クライアントのセッション処理（f_msg→a_msg→データ→SHUT_WR→a_msg）をソケットなしで動かす
+ */
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed (errno=%d)\n", __FILE__, __LINE__, #cond, errno); \
+        return 1; \
+    } \
+} while (0)
+
+#define SESSION_FILE_SIZE (MEMORY_PIPE_CAPACITY * 3 + 123) // バッファを何度も一杯にする大きさ
+
+static int test_read_write(void) // 読み書き、MSG_PEEK、MSG_DONTWAIT、writev、SHUT_WRによるEOF
+{
+    int fds[2];
+    char buffer[16];
+    struct iovec iov[2];
+
+    CHECK(transport_memory_pair(fds) == 0);
+    CHECK(transport_of(fds[0]) == &transport_memory);
+    CHECK(transport_of(fds[1]) == &transport_memory);
+
+    CHECK(transport_read(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT) == -1 && errno == EAGAIN);
+    CHECK(sendn(fds[0], "hello", 5) == 5);
+    CHECK(transport_read(fds[1], buffer, 1, MSG_PEEK) == 1 && buffer[0] == 'h');
+    CHECK(recvn(fds[1], buffer, 5, 0) == 5 && memcmp(buffer, "hello", 5) == 0);
+
+    iov[0].iov_base = "ab";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = "cde";
+    iov[1].iov_len = 3;
+    CHECK(transport_writev(fds[1], iov, 2) == 5);
+    CHECK(recvn(fds[0], buffer, 5, 0) == 5 && memcmp(buffer, "abcde", 5) == 0);
+
+    CHECK(transport_shutdown(fds[0], SHUT_WR) == 0);
+    CHECK(transport_read(fds[1], buffer, sizeof(buffer), 0) == 0);
+    CHECK(transport_write(fds[0], "x", 1) == -1 && errno == EPIPE);
+    CHECK(transport_write(fds[1], "y", 1) == 1); // 逆方向は閉じていない
+    CHECK(recvn(fds[0], buffer, 1, 0) == 1 && buffer[0] == 'y');
+
+    CHECK(transport_close(fds[0]) == 0);
+    CHECK(transport_of(fds[0]) == &transport_socket); // 閉じた番号は登録が外れている
+    CHECK(transport_write(fds[1], "z", 1) == -1 && errno == EPIPE);
+    CHECK(transport_close(fds[1]) == 0);
+    return 0;
+}
+
+static int test_reset(void) // reset後のclose()で相手にECONNRESETが返る
+{
+    int fds[2];
+    char c;
+
+    CHECK(transport_memory_pair(fds) == 0);
+    CHECK(transport_reset(fds[0]) == 0);
+    CHECK(transport_close(fds[0]) == 0);
+    CHECK(transport_read(fds[1], &c, 1, 0) == -1 && errno == ECONNRESET);
+    CHECK(transport_close(fds[1]) == 0);
+    return 0;
+}
+
+static int close_count;
+
+static int counting_close(int fd, void *ctx) // 登録したctxが渡ってくることを確かめる
+{
+    if (ctx == &close_count) {
+        close_count++;
+    }
+    return close(fd);
+}
+
+static int test_high_fd(void) // 大きな番号のディスクリプタも登録できる（登録表を広げる）
+{
+    struct transport_ops ops = transport_socket;
+    struct rlimit limit;
+    int sv[2];
+    int high;
+    char c;
+
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    if (limit.rlim_cur <= ENDPOINT_PAGE_SIZE * 2) {
+        printf("test_high_fd: skipped (RLIMIT_NOFILE=%llu)\n", (unsigned long long)limit.rlim_cur);
+        return 0;
+    }
+    high = (limit.rlim_cur > 70000) ? 70000 : (int)limit.rlim_cur - 1; // 可能なら以前の上限65536を超える番号を使う
+
+    ops.name = "counting";
+    ops.close = counting_close;
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(dup2(sv[0], high) == high);
+    close(sv[0]);
+    CHECK(transport_register(high, &ops, &close_count) == 0);
+    CHECK(transport_of(high) == &ops);
+    CHECK(sendn(high, "q", 1) == 1);
+    CHECK(recvn(sv[1], &c, 1, 0) == 1 && c == 'q');
+    CHECK(transport_close(high) == 0);
+    CHECK(close_count == 1);
+    CHECK(transport_of(high) == &transport_socket);
+    close(sv[1]);
+    return 0;
+}
+
+struct session_args
+{
+    int fd;
+    const char *path;
+    enum error_code ret;
+};
+
+static void *client_thread(void *arg) // 一時ファイルをクライアントのセッション処理で送る（memoryにはsendfileがないため読み込みで代替される）
+{
+    struct session_args *args = arg;
+    struct client_option opt;
+    unsigned long long file_size;
+    FILE *fp;
+
+    client_option_init(&opt);
+    args->ret = get_file_size(args->path, &file_size);
+    if (args->ret == NORMAL) {
+        args->ret = request_session(args->fd, "data", file_size, &opt);
+    }
+    if (args->ret == NORMAL) {
+        fp = fopen(args->path, "r");
+        args->ret = (fp != NULL) ? put_session_fd(args->fd, fileno(fp), file_size, &opt) : ERROR_SYSTEM;
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+    return NULL;
+}
+
+static int test_session(void) // サーバー側を手で書き、クライアントのセッション処理を端点越しに動かす
+{
+    char path[] = "/tmp/test_transport.XXXXXX";
+    struct session_args args;
+    struct f_message f_msg;
+    pthread_t thread;
+    char *data;
+    char *received;
+    char extra;
+    size_t i;
+    int fds[2];
+    int fd;
+
+    data = malloc(SESSION_FILE_SIZE);
+    received = malloc(SESSION_FILE_SIZE);
+    CHECK(data != NULL && received != NULL);
+    for (i = 0; i < SESSION_FILE_SIZE; i++) {
+        data[i] = (char)(i * 31 + 7);
+    }
+    fd = mkstemp(path);
+    CHECK(fd != -1);
+    CHECK(write(fd, data, SESSION_FILE_SIZE) == SESSION_FILE_SIZE);
+    close(fd);
+
+    CHECK(transport_memory_pair(fds) == 0);
+    args.fd = fds[0];
+    args.path = path;
+    CHECK(pthread_create(&thread, NULL, client_thread, &args) == 0);
+
+    CHECK(receive_f_msg(fds[1], &f_msg) == NORMAL);
+    CHECK(f_msg.file_size == SESSION_FILE_SIZE && strcmp(f_msg.file_name, "data") == 0);
+    CHECK(send_a_msg(fds[1]) == NORMAL);
+    CHECK(recvn(fds[1], received, SESSION_FILE_SIZE, 0) == SESSION_FILE_SIZE);
+    CHECK(recvn(fds[1], &extra, 1, 0) == 0); // クライアントがSHUT_WRした
+    CHECK(send_a_msg(fds[1]) == NORMAL);
+
+    pthread_join(thread, NULL);
+    CHECK(args.ret == NORMAL);
+    CHECK(memcmp(data, received, SESSION_FILE_SIZE) == 0);
+
+    transport_close(fds[0]);
+    transport_close(fds[1]);
+    unlink(path);
+    free(data);
+    free(received);
+    return 0;
+}
+
+int main(void)
+{
+    if (test_read_write() || test_reset() || test_high_fd() || test_session()) {
+        return 1;
+    }
+    printf("test_transport: ok\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "timerwheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel *w, unsigned int tick_ms)
+{
+    memset(w, 0, sizeof(struct timer_wheel));
+    pthread_mutex_init(&w->lock, NULL);
+    w->tick_ms = (tick_ms == 0) ? DEFAULT_TICK_MS : tick_ms;
+    w->now = 0;
+    w->running = false;
+}
+
+unsigned long long timer_wheel_now(struct timer_wheel *w)
+{
+    return __atomic_load_n(&w->now, __ATOMIC_RELAXED);
+}
+
+unsigned long long timer_wheel_ticks(struct timer_wheel *w, unsigned long long ms) // ミリ秒をティック数に切り上げる
+{
+    return (ms + w->tick_ms - 1) / w->tick_ms;
+}
+
+static void link_timer(struct timer_wheel *w, struct wheel_timer *t) // 残り時間に応じた階層のスロットに挿入する O(1)
+{
+    unsigned long long delta;
+    struct wheel_timer **head;
+    int level;
+
+    if (t->expires <= w->now) { // 過去の期限は次のティックで処理する
+        t->expires = w->now + 1;
+    }
+    delta = t->expires - w->now;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        t->expires = w->now + delta;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    head = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->prev = NULL;
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = t;
+    }
+    *head = t;
+    t->pending = true;
+}
+
+static void unlink_timer(struct timer_wheel *w, struct wheel_timer *t)
+{
+    int level;
+
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else { // 先頭の場合はどのスロットかを探す
+        for (level = 0; level < WHEEL_LEVELS; level++) {
+            struct wheel_timer **head = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+            if (*head == t) {
+                *head = t->next;
+                break;
+            }
+        }
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->prev = NULL;
+    t->next = NULL;
+    t->pending = false;
+}
+
+static void cascade(struct timer_wheel *w, int level) // 上位階層のスロットを下位階層に振り分け直す
+{
+    struct wheel_timer **head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct wheel_timer *t = *head;
+    struct wheel_timer *next;
+
+    *head = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        link_timer(w, t);
+    }
+}
+
+static void advance(struct timer_wheel *w) // 1ティック進め、期限を迎えたタイマーのコールバックを呼ぶ
+{
+    struct wheel_timer **head;
+    struct wheel_timer *t;
+    struct wheel_timer *next;
+    unsigned long long expires;
+    int level;
+
+    __atomic_store_n(&w->now, w->now + 1, __ATOMIC_RELAXED);
+    for (level = 1; level < WHEEL_LEVELS; level++) { // 下位階層が一周したら上位階層から繰り下げる
+        if ((w->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) {
+            break;
+        }
+        cascade(w, level);
+    }
+
+    head = &w->slots[0][w->now & WHEEL_MASK];
+    t = *head;
+    *head = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        t->prev = NULL;
+        t->next = NULL;
+        t->pending = false;
+        expires = t->callback(t, w->now);
+        if (expires != 0) {
+            t->expires = expires;
+            link_timer(w, t);
+        }
+    }
+}
+
+static void add_ms(struct timespec *ts, unsigned long long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *wheel_thread(void *arg)
+{
+    struct timer_wheel *w = (struct timer_wheel *)arg;
+    struct timespec start;
+    struct timespec next;
+    struct timespec now;
+    unsigned long long target;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        next = start;
+        add_ms(&next, (timer_wheel_now(w) + 1) * w->tick_ms);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+
+        // 開始時刻からの経過時間でティックを決め、処理が遅れた分はまとめて進める
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        target = ((unsigned long long)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000) / w->tick_ms;
+
+        pthread_mutex_lock(&w->lock);
+        if (!w->running) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        while (w->now < target) {
+            advance(w);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+int timer_wheel_start(struct timer_wheel *w)
+{
+    sigset_t all;
+    sigset_t old_set;
+    int s;
+
+    w->running = true;
+    sigfillset(&all); // 期限を処理するスレッドにはシグナルを配送しない
+    pthread_sigmask(SIG_BLOCK, &all, &old_set);
+    s = pthread_create(&w->thread, NULL, wheel_thread, w);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (s != 0) {
+        w->running = false;
+    }
+    return s;
+}
+
+void timer_wheel_stop(struct timer_wheel *w)
+{
+    pthread_mutex_lock(&w->lock);
+    if (!w->running) {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    w->running = false;
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+}
+
+void timer_wheel_add(struct timer_wheel *w, struct wheel_timer *t, unsigned long long expires, wheel_callback callback, void *arg)
+{
+    pthread_mutex_lock(&w->lock);
+    if (t->pending) {
+        unlink_timer(w, t);
+    }
+    t->expires = expires;
+    t->callback = callback;
+    t->arg = arg;
+    link_timer(w, t);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void timer_wheel_del(struct timer_wheel *w, struct wheel_timer *t) // 戻った後はコールバックが実行中でないことが保証される
+{
+    pthread_mutex_lock(&w->lock);
+    if (t->pending) {
+        unlink_timer(w, t);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS) // 1階層あたりのスロット数
+#define WHEEL_LEVELS 4                // 64^4ティックまでの期限を扱う
+#define DEFAULT_TICK_MS 100
+
+struct wheel_timer;
+
+// 期限切れ時にホイールのロックを保持したまま呼ばれる。次の期限（ティック）を返すと再登録され、0を返すと登録を解除する
+typedef unsigned long long (*wheel_callback)(struct wheel_timer *t, unsigned long long now);
+
+struct wheel_timer
+{
+    unsigned long long expires; // 期限（ティック）
+    wheel_callback callback;
+    void *arg;
+    bool pending;               // ホイールに登録されているか
+    struct wheel_timer *prev;
+    struct wheel_timer *next;
+};
+
+struct timer_wheel
+{
+    pthread_mutex_t lock;
+    unsigned int tick_ms;
+    unsigned long long now; // 現在のティック
+    struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    bool running;
+    pthread_t thread;
+};
+
+void timer_wheel_init(struct timer_wheel *w, unsigned int tick_ms);
+
+int timer_wheel_start(struct timer_wheel *w);
+
+void timer_wheel_stop(struct timer_wheel *w);
+
+unsigned long long timer_wheel_now(struct timer_wheel *w);
+
+unsigned long long timer_wheel_ticks(struct timer_wheel *w, unsigned long long ms);
+
+void timer_wheel_add(struct timer_wheel *w, struct wheel_timer *t, unsigned long long expires, wheel_callback callback, void *arg);
+
+void timer_wheel_del(struct timer_wheel *w, struct wheel_timer *t);
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include "tls.h"
+
+// kTLSで扱える暗号スイート（AES-GCMを優先し、AES-NIがない環境向けにChaCha20-Poly1305も許可する）
+#define TLS13_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS12_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+struct tls_conn
+{
+    SSL *ssl;
+    bool ktls_tx; // 送信の暗号化をカーネルが行う
+    bool ktls_rx; // 受信の復号をカーネルが行う
+    bool reset_on_close;
+};
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+
+/*
+ * OpenSSLはソケットにwrite()やsendmsg()で書き込むため、MSG_NOSIGNALを付けられない
+ * 書き込みの間だけSIGPIPEをブロックし、発生した場合は捨ててEPIPEとして扱う
+ */
+static bool block_sigpipe(sigset_t *old_set)
+{
+    sigset_t set;
+    sigset_t pending;
+
+    sigpending(&pending);
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, old_set);
+    return sigismember(&pending, SIGPIPE); // 既に保留中のものは呼び出し元のために残す
+}
+
+static void restore_sigpipe(const sigset_t *old_set, bool was_pending)
+{
+    sigset_t set;
+    struct timespec zero = {0, 0};
+    int saved_errno = errno;
+
+    if (!was_pending) {
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        while (sigtimedwait(&set, NULL, &zero) == -1 && errno == EINTR) {
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, old_set, NULL);
+    errno = saved_errno;
+}
+
+static void set_errno(SSL *ssl, int ret) // OpenSSLのエラーをerrnoに変換する
+{
+    int saved_errno = errno;
+
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE: // SO_RCVTIMEOの期限切れかノンブロッキング
+        errno = EAGAIN;
+        break;
+    case SSL_ERROR_SYSCALL:
+        errno = (saved_errno != 0) ? saved_errno : ECONNRESET;
+        break;
+    case SSL_ERROR_SSL:
+        if (ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING) { // close_notifyなしの切断（切り詰めの可能性）
+            errno = ECONNRESET;
+        } else {
+            errno = EPROTO;
+        }
+        break;
+    default:
+        errno = EPROTO;
+        break;
+    }
+    ERR_clear_error();
+}
+
+static SSL_CTX *create_ctx(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(method);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+        !SSL_CTX_set_ciphersuites(ctx, TLS13_CIPHERSUITES) ||
+        !SSL_CTX_set_cipher_list(ctx, TLS12_CIPHERS)) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS); // ハンドシェイク後にカーネルへ鍵を渡す（非対応の場合は無視される）
+    SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+    return ctx;
+}
+
+int tls_server_setup(const char *cert_file, const char *key_file) // 証明書と秘密鍵を読み込む（失敗時は-1）
+{
+    SSL_CTX *ctx;
+
+    if (access(cert_file, R_OK) || access(key_file, R_OK)) {
+        return -1;
+    }
+    ctx = create_ctx(TLS_server_method());
+    if (ctx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_clear_error();
+        SSL_CTX_free(ctx);
+        errno = EINVAL;
+        return -1;
+    }
+    SSL_CTX_set_num_tickets(ctx, 0); // セッションを再開しないため、チケットの送信で最初の読み込みが遅れないようにする
+    SSL_CTX_free(server_ctx);
+    server_ctx = ctx;
+    return 0;
+}
+
+int tls_client_setup(const char *ca_file, bool verify) // ca_fileがNULLの場合はシステムの証明書を使う（失敗時は-1）
+{
+    SSL_CTX *ctx;
+    int ok;
+
+    if (ca_file != NULL && access(ca_file, R_OK)) {
+        return -1;
+    }
+    ctx = create_ctx(TLS_client_method());
+    if (ctx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (verify) {
+        ok = (ca_file != NULL) ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(ctx);
+        if (ok != 1) {
+            ERR_clear_error();
+            SSL_CTX_free(ctx);
+            errno = EINVAL;
+            return -1;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+    SSL_CTX_free(client_ctx);
+    client_ctx = ctx;
+    return 0;
+}
+
+static int set_peer_name(SSL *ssl, const char *peer_name) // 証明書のホスト名かIPアドレスを検証する
+{
+    X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+    struct in6_addr addr;
+
+    if (inet_pton(AF_INET, peer_name, &addr) == 1 || inet_pton(AF_INET6, peer_name, &addr) == 1) {
+        return X509_VERIFY_PARAM_set1_ip_asc(param, peer_name) == 1 ? 0 : -1;
+    }
+    if (SSL_set_tlsext_host_name(ssl, peer_name) != 1) {
+        return -1;
+    }
+    return X509_VERIFY_PARAM_set1_host(param, peer_name, 0) == 1 ? 0 : -1;
+}
+
+static int handshake(int fd, SSL_CTX *ssl_ctx, const char *peer_name, bool is_server, void **ctx)
+{
+    struct tls_conn *conn;
+    sigset_t old_set;
+    bool pending;
+    int ret;
+
+    if (ssl_ctx == NULL) { // tls_*_setup()が呼ばれていない
+        errno = EINVAL;
+        return -1;
+    }
+    conn = calloc(1, sizeof(struct tls_conn));
+    if (conn == NULL) {
+        return -1;
+    }
+    conn->ssl = SSL_new(ssl_ctx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, fd) != 1 ||
+        (peer_name != NULL && set_peer_name(conn->ssl, peer_name))) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    ERR_clear_error();
+    pending = block_sigpipe(&old_set);
+    errno = 0;
+    ret = is_server ? SSL_accept(conn->ssl) : SSL_connect(conn->ssl);
+    if (ret != 1) {
+        if (!is_server && SSL_get_verify_result(conn->ssl) != X509_V_OK) { // 証明書を検証できなかった
+            ERR_clear_error();
+            errno = EKEYREJECTED;
+        } else {
+            set_errno(conn->ssl, ret);
+        }
+    }
+    restore_sigpipe(&old_set, pending);
+    if (ret != 1) {
+        goto error;
+    }
+
+    conn->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) == 1;
+    conn->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) == 1;
+    *ctx = conn;
+    return 0;
+
+error:
+    ret = errno;
+    SSL_free(conn->ssl);
+    free(conn);
+    errno = ret;
+    return -1;
+}
+
+static int tls_connect(int fd, const char *peer_name, void **ctx)
+{
+    return handshake(fd, client_ctx, peer_name, false, ctx);
+}
+
+static int tls_accept(int fd, void **ctx)
+{
+    return handshake(fd, server_ctx, NULL, true, ctx);
+}
+
+static ssize_t tls_read(int fd, void *ctx, void *buffer, size_t size, int flags)
+{
+    struct tls_conn *conn = ctx;
+    size_t read_bytes = 0;
+    int file_flags = -1;
+    int ret;
+
+    if ((flags & MSG_DONTWAIT) && SSL_pending(conn->ssl) == 0) { // レコードの途中で待たないよう、この読み込みだけノンブロッキングにする
+        file_flags = fcntl(fd, F_GETFL);
+        if (file_flags != -1) {
+            fcntl(fd, F_SETFL, file_flags | O_NONBLOCK);
+        }
+    }
+    ERR_clear_error();
+    errno = 0;
+    ret = (flags & MSG_PEEK) ? SSL_peek_ex(conn->ssl, buffer, size, &read_bytes) : SSL_read_ex(conn->ssl, buffer, size, &read_bytes);
+    if (ret != 1) {
+        if (SSL_get_error(conn->ssl, ret) == SSL_ERROR_ZERO_RETURN) { // 相手がclose_notifyを送った
+            ERR_clear_error();
+            read_bytes = 0;
+        } else {
+            set_errno(conn->ssl, ret);
+            read_bytes = (size_t)-1;
+        }
+    }
+    if (file_flags != -1) {
+        ret = errno;
+        fcntl(fd, F_SETFL, file_flags);
+        errno = ret;
+    }
+    return (ssize_t)read_bytes;
+}
+
+static ssize_t tls_write(int fd, void *ctx, const void *buffer, size_t size)
+{
+    struct tls_conn *conn = ctx;
+    sigset_t old_set;
+    bool pending;
+    size_t written = 0;
+    int ret;
+
+    (void)fd;
+    if (size == 0) {
+        return 0;
+    }
+    ERR_clear_error();
+    pending = block_sigpipe(&old_set);
+    errno = 0;
+    ret = SSL_write_ex(conn->ssl, buffer, size, &written);
+    if (ret != 1) {
+        set_errno(conn->ssl, ret);
+    }
+    restore_sigpipe(&old_set, pending);
+    return (ret == 1) ? (ssize_t)written : -1;
+}
+
+static ssize_t tls_writev(int fd, void *ctx, const struct iovec *iov, int iovcnt) // 小さな要素はまとめて1レコードで送る
+{
+    char buffer[16 * 1024];
+    size_t used = 0;
+    ssize_t total = 0;
+    ssize_t written;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len <= sizeof(buffer) - used) {
+            memcpy(buffer + used, iov[i].iov_base, iov[i].iov_len);
+            used += iov[i].iov_len;
+            continue;
+        }
+        if (used > 0) {
+            written = tls_write(fd, ctx, buffer, used);
+            if (written == -1) {
+                return (total > 0) ? total : -1;
+            }
+            total += written;
+            used = 0;
+        }
+        written = tls_write(fd, ctx, iov[i].iov_base, iov[i].iov_len);
+        if (written == -1) {
+            return (total > 0) ? total : -1;
+        }
+        total += written;
+    }
+    if (used > 0) {
+        written = tls_write(fd, ctx, buffer, used);
+        if (written == -1) {
+            return (total > 0) ? total : -1;
+        }
+        total += written;
+    }
+    return total;
+}
+
+static ssize_t tls_sendfile(int fd, void *ctx, int in_fd, off_t *offset, size_t size) // kTLSの場合のみページキャッシュから直接送る
+{
+    struct tls_conn *conn = ctx;
+    sigset_t old_set;
+    bool pending;
+    off_t position;
+    ossl_ssize_t sent;
+
+    (void)fd;
+    if (!conn->ktls_tx) {
+        errno = ENOSYS; // 読み込んでSSL_write()で送る
+        return -1;
+    }
+    position = (offset != NULL) ? *offset : lseek(in_fd, 0, SEEK_CUR);
+    if (position == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    ERR_clear_error();
+    pending = block_sigpipe(&old_set);
+    errno = 0;
+    sent = SSL_sendfile(conn->ssl, in_fd, position, size, 0);
+    if (sent < 0) {
+        if (errno == 0) {
+            errno = EIO;
+        }
+        ERR_clear_error();
+    }
+    restore_sigpipe(&old_set, pending);
+    if (sent < 0) {
+        return -1;
+    }
+    if (offset != NULL) {
+        *offset += sent;
+    } else {
+        lseek(in_fd, sent, SEEK_CUR);
+    }
+    return sent;
+}
+
+static int tls_shutdown(int fd, void *ctx, int how)
+{
+    struct tls_conn *conn = ctx;
+    sigset_t old_set;
+    bool pending;
+
+    // SHUT_RDWRは期限切れなどで別のスレッドから呼ばれるため、SSLには触れずにソケットだけを閉じる
+    if (how == SHUT_WR && !(SSL_get_shutdown(conn->ssl) & SSL_SENT_SHUTDOWN)) {
+        ERR_clear_error();
+        pending = block_sigpipe(&old_set);
+        SSL_shutdown(conn->ssl); // close_notifyを送り、相手がデータの終わりを切り詰めと区別できるようにする
+        ERR_clear_error();
+        restore_sigpipe(&old_set, pending);
+    }
+    return shutdown(fd, how);
+}
+
+static int tls_reset(int fd, void *ctx)
+{
+    struct tls_conn *conn = ctx;
+    struct linger ling;
+
+    conn->reset_on_close = true;
+    memset(&ling, 0, sizeof(ling));
+    ling.l_onoff = 1;
+    ling.l_linger = 0;
+    return setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+}
+
+static int tls_close(int fd, void *ctx)
+{
+    struct tls_conn *conn = ctx;
+    sigset_t old_set;
+    bool pending;
+
+    if (!conn->reset_on_close && !(SSL_get_shutdown(conn->ssl) & SSL_SENT_SHUTDOWN)) {
+        ERR_clear_error();
+        pending = block_sigpipe(&old_set);
+        SSL_shutdown(conn->ssl);
+        ERR_clear_error();
+        restore_sigpipe(&old_set, pending);
+    }
+    SSL_free(conn->ssl);
+    free(conn);
+    return close(fd);
+}
+
+const struct transport_ops transport_tls = {
+    .name = "tls",
+    .connect = tls_connect,
+    .accept = tls_accept,
+    .read = tls_read,
+    .write = tls_write,
+    .writev = tls_writev,
+    .sendfile = tls_sendfile,
+    .shutdown = tls_shutdown,
+    .reset = tls_reset,
+    .close = tls_close,
+};
+
+int tls_info(int fd, char *buffer, size_t size) // 確立したTLSの版と暗号スイート、kTLSの状態を文字列にする
+{
+    struct tls_conn *conn;
+
+    if (transport_of(fd) != &transport_tls) {
+        return -1;
+    }
+    conn = transport_context(fd);
+    snprintf(buffer, size, "%s %s ktls=%s%s", SSL_get_version(conn->ssl), SSL_get_cipher_name(conn->ssl),
+             conn->ktls_tx ? "tx" : "-", conn->ktls_rx ? ",rx" : "");
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "api.h"
+#include "transport.h"
+
+#define TLS_INFO_MAX_LEN 128
+
+/*
+ * TLSの転送路。ハンドシェイクはOpenSSLで行い、カーネルが対応していればレコードの暗号化をkTLS（TLS_TX/TLS_RX）に任せる
+ * 送信側のkTLSが有効な場合、sendfile()は暗号化した状態でもページキャッシュから直接送られる
+ * kTLSが使えない場合はOpenSSLがユーザー空間で暗号化する（AES-NIなどのCPU命令はOpenSSLが選ぶ）
+ * 暗号スイートはkTLSで扱えるAES-GCMを優先する
+ */
+
+extern TRANSFER_API const struct transport_ops transport_tls;
+
+TRANSFER_API int tls_server_setup(const char *cert_file, const char *key_file);
+
+TRANSFER_API int tls_client_setup(const char *ca_file, bool verify);
+
+TRANSFER_API int tls_info(int fd, char *buffer, size_t size);
+
+#endif // TLS_H
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "ratelimit.h"
+#include "wfq.h"
+#include "client.h"
+#include "transfer.h"
+
+void transfer_dest_init(struct transfer_dest *dest, const char *host_name, const char *port_num)
+{
+    memset(dest, 0, sizeof(struct transfer_dest));
+    dest->host_name = host_name;
+    dest->port_num = port_num;
+    dest->unix_path = NULL;
+    dest->pass_fd = false;
+    dest->transport = NULL;
+    dest->udp = false;
+    dest->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    dest->priority = DEFAULT_PRIORITY_CLASS;
+    dest->rate = 0;
+    dest->tuning = NULL;
+    dest->optimistic = false;
+    dest->debug_mode = false;
+}
+
+static int write_memfd(int fd, const void *buffer, size_t size) // memfdに書き込み、先頭に戻す
+{
+    const char *p = buffer;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, p, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        size -= written;
+    }
+    return (lseek(fd, 0, SEEK_SET) == -1) ? -1 : 0;
+}
+
+static void set_result(struct transfer_result *result, enum error_code ret, unsigned long long bytes)
+{
+    result->code = ret;
+    result->s_errno = 0;
+    result->bytes = 0;
+    if (ret != NORMAL) {
+        get_error(&result->s_errno);
+    } else {
+        result->bytes = bytes;
+    }
+    clear_error(); // 呼び出し元のスレッドに前回のエラーが残らないようにする
+}
+
+static enum error_code connect_dest(const struct transfer_dest *dest, struct client_option *opt, struct token_bucket *bucket,
+                                    int *cfd, const char *remote_name) // 宛先の指定を検証して接続する
+{
+    enum error_code ret = ERROR_SYSTEM;
+
+    if ((dest->unix_path == NULL && (dest->host_name == NULL || dest->port_num == NULL)) || remote_name == NULL ||
+        (dest->pass_fd && dest->unix_path == NULL) || (dest->udp && dest->unix_path != NULL) ||
+        strlen(remote_name) >= FILENAME_MAX_LEN) {
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
+        goto end;
+    }
+
+    client_option_init(opt);
+    opt->debug_mode = dest->debug_mode;
+    opt->connect_timeout_ms = dest->connect_timeout_ms;
+    opt->priority = (dest->priority < PRIORITY_CLASS_NUM) ? dest->priority : DEFAULT_PRIORITY_CLASS;
+    opt->tuning = dest->tuning;
+    opt->optimistic = dest->optimistic;
+    opt->transport = dest->transport;
+    if (dest->rate != 0) { // バケットは呼び出しごとに用意し、スレッド間で共有しない
+        token_bucket_init(bucket, dest->rate);
+        opt->bucket = bucket;
+    }
+
+    if (dest->unix_path != NULL) {
+        ret = connect_unix_server(cfd, dest->unix_path, opt);
+    } else if (dest->udp) {
+        ret = connect_udp_server(cfd, dest->host_name, dest->port_num, opt);
+    } else {
+        ret = connect_server(cfd, dest->host_name, dest->port_num, opt);
+    }
+end:
+    return ret;
+}
+
+static enum error_code open_session(const struct transfer_dest *dest, struct client_option *opt, struct token_bucket *bucket,
+                                    int *cfd, const char *remote_name, int src_fd, unsigned long long size) // src_fdが-1でない場合はディスクリプタを渡す
+{
+    enum error_code ret = ERROR_SYSTEM;
+
+    if ((ret = connect_dest(dest, opt, bucket, cfd, remote_name))) {
+        goto end;
+    }
+    if (src_fd != -1) {
+        ret = request_session_fd(*cfd, remote_name, src_fd, size, opt);
+    } else {
+        ret = request_session(*cfd, remote_name, size, opt);
+    }
+end:
+    return ret;
+}
+
+struct transfer_result transfer_upload_fd(const struct transfer_dest *dest, int fd, const char *remote_name)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct transfer_result result;
+    struct client_option opt;
+    struct token_bucket bucket;
+    struct stat stat_buf;
+    off_t offset;
+    unsigned long long size = 0;
+    int cfd = -1;
+
+    // 通常ファイルの現在位置から末尾までを送信する
+    if (fstat(fd, &stat_buf) == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    if (!S_ISREG(stat_buf.st_mode)) { // パイプやソケットはサイズが分からないため、終端まで読みながらストリーミングで送る
+        if (dest->pass_fd) {
+            ret = ERROR_ARGUMENT;
+            set_error(ret, 0);
+            goto end;
+        }
+        if ((ret = connect_dest(dest, &opt, &bucket, &cfd, remote_name))) {
+            goto end;
+        }
+        ret = stream_session(cfd, fd, remote_name, &size, &opt);
+        goto end;
+    }
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) {
+        ret = ERROR_SYSTEM;
+        set_error(ret, errno);
+        goto end;
+    }
+    size = (stat_buf.st_size > offset) ? (unsigned long long)(stat_buf.st_size - offset) : 0;
+
+    if ((ret = open_session(dest, &opt, &bucket, &cfd, remote_name, dest->pass_fd ? fd : -1, size))) {
+        goto end;
+    }
+    if (dest->pass_fd) { // サーバーは共有するファイルオフセットを動かさずに現在位置から複製する
+        ret = finish_session(cfd, false, &opt);
+    } else {
+        ret = put_session_fd(cfd, fd, size, &opt);
+    }
+
+end:
+    if (cfd != -1 && close_file_descriptor(cfd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+    }
+    set_result(&result, ret, size);
+    return result;
+}
+
+struct transfer_result transfer_upload_buffer(const struct transfer_dest *dest, const void *buffer, size_t size, const char *remote_name)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct transfer_result result;
+    struct client_option opt;
+    struct token_bucket bucket;
+    int cfd = -1;
+    int mem_fd = -1;
+
+    if (buffer == NULL && size != 0) {
+        ret = ERROR_ARGUMENT;
+        set_error(ret, 0);
+        goto end;
+    }
+
+    if (dest->pass_fd) { // バッファをmemfdに置き、ディスクリプタを渡す
+        mem_fd = memfd_create("transfer", MFD_CLOEXEC);
+        if (mem_fd == -1) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+        if (size != 0 && write_memfd(mem_fd, buffer, size)) {
+            ret = ERROR_SYSTEM;
+            set_error(ret, errno);
+            goto end;
+        }
+    }
+
+    if ((ret = open_session(dest, &opt, &bucket, &cfd, remote_name, mem_fd, size))) {
+        goto end;
+    }
+    if (mem_fd != -1) {
+        ret = finish_session(cfd, false, &opt);
+    } else {
+        ret = put_session_buffer(cfd, buffer, size, &opt);
+    }
+
+end:
+    if (cfd != -1 && close_file_descriptor(cfd) && ret == NORMAL) {
+        ret = ERROR_SYSTEM;
+    }
+    if (mem_fd != -1) {
+        close(mem_fd);
+    }
+    set_result(&result, ret, size);
+    return result;
+}
+
+enum error_code transfer_last_error(int *s_errno) // このスレッドで最後に失敗した処理のエラー（サーバーの関数の失敗理由を調べる）
+{
+    return get_error(s_errno);
+}
@@ -0,0 +1,106 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "api.h"
+#include "error_code.h"
+#include "tuning.h"
+#include "transport.h"
+#include "placement.h"
+
+/*
+ * libtransfer: プロセス内に組み込んで使うための転送API
+ * エラー状態はスレッドごとに保持されるため、複数のスレッドから同時に呼び出せる
+ * libtransfer.aはこのヘッダーとここから読み込むヘッダーで宣言した関数だけを公開する（api.hを参照）
+ */
+
+/* サーバー */
+
+struct server_config
+{
+    const char *port_num;
+    const char *unix_path;                 // 指定した場合はTCPではなくUNIXドメインソケットで待ち受ける（port_numは無視）
+    const char *upgrade_path;              // 指定した場合は稼働中のサーバーからリスナーを引き継ぎ、次のサーバーへの引き継ぎ要求をこのソケットファイルで待ち受ける
+    const char *sink_exec;                 // 指定した場合は保存せず、ファイルごとにこのコマンドを起動して標準入力に流す（終了コード0で受け取り確認）
+    const char *sink_unix;                 // 指定した場合は保存せず、ファイルごとにこのソケットへストリーミング転送で流す（sink_execとは排他）
+    unsigned long long sink_buffer_bytes;  // 消費側との間に溜めるデータの上限（0の場合はSINK_DEFAULT_BUFFER）
+    unsigned int hash_threads;             // 照合でハッシュ木を計算するスレッドの数（0の場合は使用可能なCPUの数）
+    const char *base_path;                 // 受信ファイルの保存先（NULLの場合はカレントディレクトリ）
+    const char *const *storage_roots;      // 複数の保存先（storage_root_countが0でない場合はbase_pathの代わりに使う）
+    unsigned int storage_root_count;       // STORAGE_MAX_ROOTS以下
+    enum placement placement;              // 複数の保存先への振り分け方
+    unsigned int storage_writers;          // デバイスごとの書き込みスレッド数（0の場合は1）
+    unsigned long long min_free_bytes;     // 受信中のファイルをすべて書き込んだ後も残す空き容量（満たせない受信は開始前に拒否する）
+    bool debug_mode;
+    int listener_count;                    // SO_REUSEPORTで開くリスナー数（0の場合はCPU数）
+    bool inline_sessions;                  // trueの場合はスレッドを生成せず、transfer_server_run()の呼び出し元スレッドでセッションを処理する
+    unsigned int max_sessions;             // 同時セッション数の上限（0の場合は無制限）
+    unsigned long long max_inflight_bytes; // 受信中のセッションがバッファに保持するバイト数の合計の上限（0の場合は無制限）
+    unsigned int retry_after_ms;           // busy応答で通知する再試行までの待ち時間
+    unsigned long long peer_rate;          // 接続元アドレスごとの上限（バイト/秒、0の場合は無制限）
+    unsigned long long session_rate;       // セッションごとの上限（バイト/秒、0の場合は無制限）
+    unsigned long long total_rate;         // サーバー全体の上限（バイト/秒、0の場合は無制限）
+    unsigned int sched_slots;              // デバイスごとに受け付ける書き込み要求数（0の場合はSTORAGE_QUEUE_DEPTH）
+    const char *class_weights;             // 優先度クラスの重み（"8,4,1"の形式、NULLの場合は既定値）
+    unsigned long long handshake_timeout_ms; // 接続から最初のf_msg受信までの期限（0の場合は無効）
+    unsigned long long idle_timeout_ms;      // データや接続維持の次のf_msgが届かない状態の期限（0の場合は無効）
+    unsigned long long min_rate;             // 受信の最低スループット（バイト/秒、0の場合は無効）
+    struct socket_tuning tuning;             // 受信側のソケット調整項目
+    const struct transport_ops *transport;   // accept()したソケットに割り当てる転送路（NULLの場合はソケット）
+    bool udp;                                // port_numのUDPで信頼性のある転送路を待ち受ける（transportは無視）
+};
+
+struct transfer_server;
+
+TRANSFER_API void transfer_server_config_init(struct server_config *config);
+
+TRANSFER_API enum error_code transfer_server_create(struct transfer_server **srv, const struct server_config *config);
+
+TRANSFER_API int transfer_server_listener_count(const struct transfer_server *srv);
+
+TRANSFER_API enum error_code transfer_server_run(struct transfer_server *srv);
+
+TRANSFER_API void transfer_server_stop(struct transfer_server *srv);
+
+TRANSFER_API void transfer_server_destroy(struct transfer_server *srv);
+
+TRANSFER_API void transfer_server_dump_stats(struct transfer_server *srv, FILE *fp);
+
+/* クライアント */
+
+struct transfer_dest
+{
+    const char *host_name;
+    const char *port_num;
+    const char *unix_path;           // 指定した場合は同一ホストのサーバーにUNIXドメインソケットで接続する（host_name, port_numは無視）
+    const struct transport_ops *transport; // 接続後に割り当てる転送路（NULLの場合はソケット）
+    bool udp;                        // TCPの代わりに信頼性のあるUDPの転送路で接続する（transportは無視）
+    bool pass_fd;                    // unix_path指定時、データの代わりにディスクリプタを渡してサーバーに複製させる（バッファはmemfdに置く）
+    unsigned int connect_timeout_ms; // 接続のタイムアウト（ミリ秒）
+    unsigned char priority;          // 優先度クラス（0:interactive 1:normal 2:bulk）
+    unsigned long long rate;         // 送信帯域の上限（バイト/秒、0の場合は無制限）
+    const struct socket_tuning *tuning; // ソケットの調整項目（NULLの場合は設定しない）
+    bool optimistic;                 // OPTIMISTIC_MAX_SIZE以下のデータは受付応答を待たずに送る
+    bool debug_mode;
+};
+
+struct transfer_result
+{
+    enum error_code code;
+    int s_errno;              // codeに対応するerrno（ERROR_BUSYの場合は再試行までのミリ秒）
+    unsigned long long bytes; // 送信したバイト数
+};
+
+TRANSFER_API void transfer_dest_init(struct transfer_dest *dest, const char *host_name, const char *port_num);
+
+TRANSFER_API struct transfer_result transfer_upload_fd(const struct transfer_dest *dest, int fd, const char *remote_name);
+
+TRANSFER_API struct transfer_result transfer_upload_buffer(const struct transfer_dest *dest, const void *buffer, size_t size, const char *remote_name);
+
+/* エラー */
+
+TRANSFER_API enum error_code transfer_last_error(int *s_errno);
+
+#endif // TRANSFER_H
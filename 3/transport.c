@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include "transport.h"
+
+#define SENDFILE_FALLBACK_CHUNK (64 * 1024) // sendfileを持たない転送路で一度に読み込む量
+
+struct endpoint
+{
+    const struct transport_ops *ops; // NULLの場合はソケット
+    void *ctx;
+};
+
+/*
+ * ディスクリプタ番号で引く登録表。ENDPOINT_PAGE_SIZE個ずつのページに分け、ページは一度確保したら動かさない
+ * 番号がページ表に収まらない場合は倍の大きさの表に差し替える。読み込みはロックを取らないため、古い表は解放しない
+ */
+struct endpoint_table
+{
+    size_t page_num;
+    struct endpoint *pages[]; // 登録したことのない範囲はNULL
+};
+
+static struct endpoint_table *endpoint_table;
+static pthread_mutex_t endpoint_lock = PTHREAD_MUTEX_INITIALIZER; // 表の差し替えとページの確保
+
+static struct endpoint *find_endpoint(int fd) // 登録のない範囲ならNULL
+{
+    struct endpoint_table *table;
+    struct endpoint *page;
+    size_t index;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    index = (size_t)fd / ENDPOINT_PAGE_SIZE;
+    table = __atomic_load_n(&endpoint_table, __ATOMIC_ACQUIRE);
+    if (table == NULL || index >= table->page_num) {
+        return NULL;
+    }
+    page = __atomic_load_n(&table->pages[index], __ATOMIC_ACQUIRE);
+    return (page != NULL) ? &page[fd % ENDPOINT_PAGE_SIZE] : NULL;
+}
+
+static struct endpoint *make_endpoint(int fd) // 必要なら表を広げ、ページを確保する（失敗時はNULL）
+{
+    struct endpoint_table *table;
+    struct endpoint_table *grown;
+    struct endpoint *page = NULL;
+    size_t index;
+    size_t page_num;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    index = (size_t)fd / ENDPOINT_PAGE_SIZE;
+    pthread_mutex_lock(&endpoint_lock);
+    table = endpoint_table;
+    if (table == NULL || index >= table->page_num) {
+        page_num = (table != NULL) ? table->page_num : 16;
+        while (page_num <= index) {
+            page_num *= 2;
+        }
+        grown = calloc(1, sizeof(struct endpoint_table) + page_num * sizeof(struct endpoint *));
+        if (grown == NULL) {
+            goto end;
+        }
+        grown->page_num = page_num;
+        if (table != NULL) {
+            memcpy(grown->pages, table->pages, table->page_num * sizeof(struct endpoint *));
+        }
+        __atomic_store_n(&endpoint_table, grown, __ATOMIC_RELEASE); // 古い表は読み込み中のスレッドがいるかもしれないため残す
+        table = grown;
+    }
+    page = table->pages[index];
+    if (page == NULL) {
+        page = calloc(ENDPOINT_PAGE_SIZE, sizeof(struct endpoint));
+        if (page == NULL) {
+            goto end;
+        }
+        __atomic_store_n(&table->pages[index], page, __ATOMIC_RELEASE);
+    }
+end:
+    pthread_mutex_unlock(&endpoint_lock);
+    if (page == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return &page[fd % ENDPOINT_PAGE_SIZE];
+}
+
+static const struct transport_ops *lookup(int fd, void **ctx)
+{
+    struct endpoint *e = find_endpoint(fd);
+    const struct transport_ops *ops = NULL;
+
+    *ctx = NULL;
+    if (e != NULL) {
+        ops = __atomic_load_n(&e->ops, __ATOMIC_ACQUIRE); // ctxはopsより先に書き込まれている
+        *ctx = e->ctx;
+    }
+    return (ops != NULL) ? ops : &transport_socket;
+}
+
+static void store_endpoint(struct endpoint *e, const struct transport_ops *ops, void *ctx)
+{
+    e->ctx = ctx;
+    __atomic_store_n(&e->ops, ops, __ATOMIC_RELEASE); // 期限切れのshutdown()は別スレッドから呼ばれる
+}
+
+int transport_attach(int fd, const struct transport_ops *ops, bool is_server, const char *peer_name) // 下位の接続が確立したディスクリプタに転送路を割り当てる
+{
+    struct endpoint *e;
+    void *ctx = NULL;
+
+    if (ops == &transport_socket) { // 登録がなければソケットとして扱われる
+        return 0;
+    }
+    e = make_endpoint(fd);
+    if (e == NULL) {
+        return -1;
+    }
+    if (is_server && ops->accept != NULL && ops->accept(fd, &ctx)) {
+        return -1;
+    }
+    if (!is_server && ops->connect != NULL && ops->connect(fd, peer_name, &ctx)) {
+        return -1;
+    }
+    store_endpoint(e, ops, ctx);
+    return 0;
+}
+
+int transport_register(int fd, const struct transport_ops *ops, void *ctx) // 独自に接続を確立した転送路（インメモリ、UDP）が登録する
+{
+    struct endpoint *e = make_endpoint(fd);
+
+    if (e == NULL) {
+        return -1;
+    }
+    store_endpoint(e, ops, ctx);
+    return 0;
+}
+
+const struct transport_ops *transport_of(int fd)
+{
+    void *ctx;
+
+    return lookup(fd, &ctx);
+}
+
+void *transport_context(int fd) // 転送路の実装が自分の状態を取り出す
+{
+    void *ctx;
+
+    lookup(fd, &ctx);
+    return ctx;
+}
+
+ssize_t transport_read(int fd, void *buffer, size_t size, int flags)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    return ops->read(fd, ctx, buffer, size, flags);
+}
+
+ssize_t transport_write(int fd, const void *buffer, size_t size)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    return ops->write(fd, ctx, buffer, size);
+}
+
+ssize_t transport_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    return ops->writev(fd, ctx, iov, iovcnt);
+}
+
+static ssize_t copy_through(const struct transport_ops *ops, int fd, void *ctx, int in_fd, off_t *offset, size_t size) // 読み込んでから転送路に書き込む
+{
+    char buffer[SENDFILE_FALLBACK_CHUNK];
+    ssize_t read_bytes;
+    ssize_t written;
+    size_t total = 0;
+
+    if (size > sizeof(buffer)) {
+        size = sizeof(buffer);
+    }
+    read_bytes = (offset != NULL) ? pread(in_fd, buffer, size, *offset) : read(in_fd, buffer, size);
+    if (read_bytes <= 0) {
+        return read_bytes;
+    }
+    // 読み込んだ分は全て書き込む。途中で失敗した場合は書き込めた分だけ読み込み位置を進める
+    while (total < (size_t)read_bytes) {
+        written = ops->write(fd, ctx, buffer + total, read_bytes - total);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (offset == NULL) {
+                lseek(in_fd, (off_t)total - read_bytes, SEEK_CUR);
+            }
+            if (total == 0) {
+                return -1;
+            }
+            break;
+        }
+        total += written;
+    }
+    if (offset != NULL) {
+        *offset += total;
+    }
+    return total;
+}
+
+ssize_t transport_sendfile(int fd, int in_fd, off_t *offset, size_t size)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+    ssize_t sent;
+
+    if (ops->sendfile != NULL) {
+        sent = ops->sendfile(fd, ctx, in_fd, offset, size);
+        if (sent != -1 || (errno != EINVAL && errno != ENOSYS)) { // パイプなどsendfile()できない入力は読み込みで代替する
+            return sent;
+        }
+    }
+    return copy_through(ops, fd, ctx, in_fd, offset, size);
+}
+
+int transport_shutdown(int fd, int how)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    return ops->shutdown(fd, ctx, how);
+}
+
+int transport_reset(int fd)
+{
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    return ops->reset(fd, ctx);
+}
+
+int transport_close(int fd) // 登録を外してから閉じる（閉じた番号はすぐに再利用されるため）
+{
+    struct endpoint *e = find_endpoint(fd);
+    void *ctx;
+    const struct transport_ops *ops = lookup(fd, &ctx);
+
+    if (e != NULL) {
+        __atomic_store_n(&e->ops, NULL, __ATOMIC_RELEASE);
+        e->ctx = NULL;
+    }
+    return ops->close(fd, ctx);
+}
+
+/* ソケット */
+
+static ssize_t socket_read(int fd, void *ctx, void *buffer, size_t size, int flags)
+{
+    (void)ctx;
+    return recv(fd, buffer, size, flags);
+}
+
+static ssize_t socket_write(int fd, void *ctx, const void *buffer, size_t size)
+{
+    (void)ctx;
+    return send(fd, buffer, size, MSG_NOSIGNAL);
+}
+
+static ssize_t socket_writev(int fd, void *ctx, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    (void)ctx;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t socket_sendfile(int fd, void *ctx, int in_fd, off_t *offset, size_t size)
+{
+    (void)ctx;
+    return sendfile(fd, in_fd, offset, size);
+}
+
+static int socket_shutdown(int fd, void *ctx, int how)
+{
+    (void)ctx;
+    return shutdown(fd, how);
+}
+
+static int socket_reset(int fd, void *ctx)
+{
+    struct linger ling;
+
+    (void)ctx;
+    memset(&ling, 0, sizeof(ling));
+    ling.l_onoff = 1;
+    ling.l_linger = 0;
+    return setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+}
+
+static int socket_close(int fd, void *ctx)
+{
+    (void)ctx;
+    return close(fd);
+}
+
+const struct transport_ops transport_socket = {
+    .name = "socket",
+    .connect = NULL,
+    .accept = NULL,
+    .read = socket_read,
+    .write = socket_write,
+    .writev = socket_writev,
+    .sendfile = socket_sendfile,
+    .shutdown = socket_shutdown,
+    .reset = socket_reset,
+    .close = socket_close,
+};
+
+/* インメモリ転送（ソケットを使わずにセッション処理を動かすためのもの） */
+
+struct memory_pipe // 一方向のリングバッファ
+{
+    char *data;
+    size_t head;
+    size_t len;
+    bool write_closed; // 書き込み側がSHUT_WRした（読み込み側はEOF）
+    bool read_closed;  // 読み込み側がSHUT_RDした（書き込み側はEPIPE）
+};
+
+struct memory_channel
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct memory_pipe pipes[2]; // pipes[i]はi番目の端点が読み込む
+    int refcount;
+    bool reset;
+};
+
+struct memory_end
+{
+    struct memory_channel *channel;
+    int side;
+    bool reset_on_close;
+};
+
+static ssize_t memory_read(int fd, void *ctx, void *buffer, size_t size, int flags)
+{
+    struct memory_end *end = ctx;
+    struct memory_channel *c = end->channel;
+    struct memory_pipe *in = &c->pipes[end->side];
+    size_t n;
+    size_t first;
+    ssize_t ret;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    while (in->len == 0 && !in->write_closed && !in->read_closed && !c->reset) {
+        if (flags & MSG_DONTWAIT) {
+            pthread_mutex_unlock(&c->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->reset) {
+        errno = ECONNRESET;
+        ret = -1;
+    } else if (in->read_closed || in->len == 0) {
+        ret = 0;
+    } else {
+        n = (size < in->len) ? size : in->len;
+        first = MEMORY_PIPE_CAPACITY - in->head;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(buffer, in->data + in->head, first);
+        memcpy((char *)buffer + first, in->data, n - first);
+        if (!(flags & MSG_PEEK)) {
+            in->head = (in->head + n) % MEMORY_PIPE_CAPACITY;
+            in->len -= n;
+            pthread_cond_broadcast(&c->cond);
+        }
+        ret = n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static ssize_t memory_write(int fd, void *ctx, const void *buffer, size_t size)
+{
+    struct memory_end *end = ctx;
+    struct memory_channel *c = end->channel;
+    struct memory_pipe *out = &c->pipes[1 - end->side];
+    size_t n;
+    size_t tail;
+    size_t first;
+    ssize_t ret;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    while (out->len == MEMORY_PIPE_CAPACITY && !out->write_closed && !out->read_closed && !c->reset) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->reset) {
+        errno = ECONNRESET;
+        ret = -1;
+    } else if (out->write_closed || out->read_closed) {
+        errno = EPIPE;
+        ret = -1;
+    } else {
+        n = MEMORY_PIPE_CAPACITY - out->len;
+        if (n > size) {
+            n = size;
+        }
+        tail = (out->head + out->len) % MEMORY_PIPE_CAPACITY;
+        first = MEMORY_PIPE_CAPACITY - tail;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(out->data + tail, buffer, first);
+        memcpy(out->data, (const char *)buffer + first, n - first);
+        out->len += n;
+        pthread_cond_broadcast(&c->cond);
+        ret = n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static ssize_t memory_writev(int fd, void *ctx, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    ssize_t written;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        written = memory_write(fd, ctx, iov[i].iov_base, iov[i].iov_len);
+        if (written == -1) {
+            return (total > 0) ? total : -1;
+        }
+        total += written;
+        if ((size_t)written < iov[i].iov_len) { // 空きがなくなった
+            break;
+        }
+    }
+    return total;
+}
+
+static int memory_shutdown(int fd, void *ctx, int how)
+{
+    struct memory_end *end = ctx;
+    struct memory_channel *c = end->channel;
+
+    (void)fd;
+    pthread_mutex_lock(&c->lock);
+    if (how == SHUT_WR || how == SHUT_RDWR) {
+        c->pipes[1 - end->side].write_closed = true;
+    }
+    if (how == SHUT_RD || how == SHUT_RDWR) {
+        c->pipes[end->side].read_closed = true;
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+static int memory_reset(int fd, void *ctx)
+{
+    struct memory_end *end = ctx;
+
+    (void)fd;
+    end->reset_on_close = true;
+    return 0;
+}
+
+static int memory_close(int fd, void *ctx)
+{
+    struct memory_end *end = ctx;
+    struct memory_channel *c = end->channel;
+    bool last;
+
+    pthread_mutex_lock(&c->lock);
+    if (end->reset_on_close) {
+        c->reset = true;
+    }
+    c->pipes[1 - end->side].write_closed = true;
+    c->pipes[end->side].read_closed = true;
+    last = (--c->refcount == 0);
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    if (last) {
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+        free(c->pipes[0].data);
+        free(c->pipes[1].data);
+        free(c);
+    }
+    free(end);
+    return close(fd);
+}
+
+const struct transport_ops transport_memory = {
+    .name = "memory",
+    .connect = NULL,
+    .accept = NULL,
+    .read = memory_read,
+    .write = memory_write,
+    .writev = memory_writev,
+    .sendfile = NULL,
+    .shutdown = memory_shutdown,
+    .reset = memory_reset,
+    .close = memory_close,
+};
+
+int transport_memory_pair(int fds[2]) // 接続済みの2つの端点を生成する（番号を確保するためにeventfdを使う）
+{
+    struct memory_channel *c;
+    struct memory_end *ends[2] = {NULL, NULL};
+    struct endpoint *slots[2];
+    int i;
+
+    fds[0] = fds[1] = -1;
+    c = calloc(1, sizeof(struct memory_channel));
+    if (c == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->refcount = 2;
+
+    for (i = 0; i < 2; i++) {
+        c->pipes[i].data = malloc(MEMORY_PIPE_CAPACITY);
+        ends[i] = calloc(1, sizeof(struct memory_end));
+        fds[i] = eventfd(0, EFD_CLOEXEC);
+        if (c->pipes[i].data == NULL || ends[i] == NULL || fds[i] == -1) {
+            goto error;
+        }
+        ends[i]->channel = c;
+        ends[i]->side = i;
+    }
+    for (i = 0; i < 2; i++) { // 両方の登録先を確保してから登録する
+        slots[i] = make_endpoint(fds[i]);
+        if (slots[i] == NULL) {
+            goto error;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        store_endpoint(slots[i], &transport_memory, ends[i]);
+    }
+    return 0;
+
+error:
+    for (i = 0; i < 2; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+        free(ends[i]);
+        free(c->pipes[i].data);
+    }
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+    return -1;
+}
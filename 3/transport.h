@@ -0,0 +1,59 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "api.h"
+
+#define ENDPOINT_PAGE_SIZE 4096              // 登録表を広げる単位（ディスクリプタの数）
+#define MEMORY_PIPE_CAPACITY (256 * 1024)    // インメモリ転送の片方向あたりのバッファサイズ
+
+/*
+ * 転送路の抽象化。sendn()/recvn()とメッセージ関数、ファイル転送ループはディスクリプタ番号で
+ * 登録された転送路を経由して読み書きする。登録していないディスクリプタはソケットとして扱う
+ * 各関数はソケットAPIと同じく、失敗時に-1を返してerrnoを設定する
+ */
+struct transport_ops
+{
+    const char *name;
+    int (*connect)(int fd, const char *peer_name, void **ctx); // 下位の接続確立後にクライアント側で呼ぶ（NULLの場合は何もしない、peer_nameは接続先の名前かNULL）
+    int (*accept)(int fd, void **ctx);   // accept()後にサーバー側で呼ぶ（NULLの場合は何もしない）
+    ssize_t (*read)(int fd, void *ctx, void *buffer, size_t size, int flags); // flagsはMSG_PEEK, MSG_DONTWAITのみ
+    ssize_t (*write)(int fd, void *ctx, const void *buffer, size_t size);
+    ssize_t (*writev)(int fd, void *ctx, const struct iovec *iov, int iovcnt);
+    ssize_t (*sendfile)(int fd, void *ctx, int in_fd, off_t *offset, size_t size); // NULLの場合はread()とwrite()で代替する
+    int (*shutdown)(int fd, void *ctx, int how);
+    int (*reset)(int fd, void *ctx);     // close()時に未送信データを破棄して切断する
+    int (*close)(int fd, void *ctx);
+};
+
+extern TRANSFER_API const struct transport_ops transport_socket; // TCPとUNIXドメインソケット
+extern TRANSFER_API const struct transport_ops transport_memory; // transport_memory_pair()で生成するプロセス内の転送路
+
+TRANSFER_API int transport_attach(int fd, const struct transport_ops *ops, bool is_server, const char *peer_name);
+
+TRANSFER_API int transport_register(int fd, const struct transport_ops *ops, void *ctx);
+
+TRANSFER_API const struct transport_ops *transport_of(int fd);
+
+TRANSFER_API void *transport_context(int fd);
+
+TRANSFER_API ssize_t transport_read(int fd, void *buffer, size_t size, int flags);
+
+TRANSFER_API ssize_t transport_write(int fd, const void *buffer, size_t size);
+
+TRANSFER_API ssize_t transport_writev(int fd, const struct iovec *iov, int iovcnt);
+
+TRANSFER_API ssize_t transport_sendfile(int fd, int in_fd, off_t *offset, size_t size);
+
+TRANSFER_API int transport_shutdown(int fd, int how);
+
+TRANSFER_API int transport_reset(int fd);
+
+TRANSFER_API int transport_close(int fd);
+
+TRANSFER_API int transport_memory_pair(int fds[2]);
+
+#endif // TRANSPORT_H
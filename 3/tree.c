@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "client.h"
+#include "tree.h"
+
+struct tree_file
+{
+    char *path;              // ディレクトリからの相対パス
+    unsigned long long size; // 辿った時点のサイズ（並べる順序にだけ使う）
+};
+
+struct file_heap // 見つけてまだ送っていないファイル（大きい順に取り出す二分ヒープ、TREE_QUEUE_FILES個まで）
+{
+    struct tree_file *files;
+    size_t num;
+};
+
+struct walk_dir
+{
+    char *path; // ディレクトリからの相対パス（辿り始めるディレクトリ自身は""）
+    struct walk_dir *next;
+};
+
+/*
+ * 辿るスレッドと送るスレッドで共有する状態。辿るスレッドは見つけたファイルをすぐにキューに入れ、
+ * 送るスレッドはキューの中で最も大きいファイルを取る。キューが一杯の間、辿るスレッドは待つ
+ */
+struct tree_uploader
+{
+    const char *root;
+    const char *prefix;
+    size_t name_max;           // 相対パスの長さの上限（prefixの分を除く）
+    pthread_mutex_t lock;
+    pthread_cond_t cond;       // キューやディレクトリの一覧が変わった
+    struct walk_dir *pending;  // 辿っていないディレクトリ
+    unsigned int busy;         // ディレクトリを読んでいるスレッドの数（0かつpendingが空なら辿り終わり）
+    struct file_heap queue;
+    unsigned long long found;  // 見つけたファイルの数
+    enum error_code walk_ret;  // 辿る途中で最初に起きたエラー（読めないディレクトリなどがあっても残りは辿る）
+    int walk_errno;
+    client_connect_fn connect;
+    void *connect_arg;
+    struct client_option opt;  // 接続維持を有効にした送信設定
+    unsigned long long uploaded;
+    unsigned long long bytes;
+    unsigned long long failed;
+    enum error_code ret;       // 送る途中で最初に起きたエラー
+    int s_errno;
+};
+
+static bool larger(const struct tree_file *a, const struct tree_file *b) // 先に送る方（同じサイズはパスの順）
+{
+    if (a->size != b->size) {
+        return a->size > b->size;
+    }
+    return strcmp(a->path, b->path) < 0;
+}
+
+static void heap_push(struct file_heap *h, char *path, unsigned long long size) // 空きがあることを確かめてから呼ぶ
+{
+    struct tree_file file = {path, size};
+    size_t i = h->num++;
+
+    while (i > 0 && larger(&file, &h->files[(i - 1) / 2])) {
+        h->files[i] = h->files[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->files[i] = file;
+}
+
+static struct tree_file heap_pop(struct file_heap *h) // 空でないことを確かめてから呼ぶ
+{
+    struct tree_file top = h->files[0];
+    struct tree_file last = h->files[--h->num];
+    size_t i = 0;
+    size_t child;
+
+    while ((child = i * 2 + 1) < h->num) {
+        if (child + 1 < h->num && larger(&h->files[child + 1], &h->files[child])) {
+            child++;
+        }
+        if (!larger(&h->files[child], &last)) {
+            break;
+        }
+        h->files[i] = h->files[child];
+        i = child;
+    }
+    h->files[i] = last;
+    return top;
+}
+
+static bool walk_done(const struct tree_uploader *u) // uのlockを取った状態で呼ぶ
+{
+    return u->pending == NULL && u->busy == 0;
+}
+
+static void walker_error(struct tree_uploader *u, enum error_code ret, int s_errno) // uのlockを取った状態で呼ぶ
+{
+    if (u->walk_ret == NORMAL) {
+        u->walk_ret = ret;
+        u->walk_errno = s_errno;
+    }
+}
+
+static void enqueue_file(struct tree_uploader *u, char *path, unsigned long long size) // キューに空きができるまで待ってから入れる（pathの所有権はキューに移る）
+{
+    pthread_mutex_lock(&u->lock);
+    while (u->queue.num == TREE_QUEUE_FILES) {
+        pthread_cond_wait(&u->cond, &u->lock);
+    }
+    heap_push(&u->queue, path, size);
+    u->found++;
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+}
+
+static void scan_dir(struct tree_uploader *u, const char *rel, struct walk_dir **subdirs) // 1つのディレクトリを読み、ファイルはその場でキューに入れる
+{
+    char full[PATH_MAX];
+    struct walk_dir *sub;
+    struct dirent *de;
+    struct stat stat_buf;
+    char *child;
+    DIR *dir;
+    int s_errno;
+    int dfd;
+
+    snprintf(full, sizeof(full), "%s%s%s", u->root, (*rel == '\0') ? "" : "/", rel);
+    dfd = open(full, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1 || (dir = fdopendir(dfd)) == NULL) {
+        s_errno = errno;
+        DEBUG_MACRO(u->opt.debug_mode, false, "cannot read directory %s: %s", full, strerror(s_errno));
+        pthread_mutex_lock(&u->lock);
+        walker_error(u, ERROR_FILE_OPEN, s_errno);
+        pthread_mutex_unlock(&u->lock);
+        if (dfd != -1) {
+            close(dfd);
+        }
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (de->d_type != DT_DIR && de->d_type != DT_REG && de->d_type != DT_UNKNOWN) { // シンボリックリンクなどは送らない
+            continue;
+        }
+        if (fstatat(dfd, de->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW)) { // 読んでいる間に削除された
+            continue;
+        }
+        if (!S_ISDIR(stat_buf.st_mode) && !S_ISREG(stat_buf.st_mode)) {
+            continue;
+        }
+        child = join_path(rel, de->d_name);
+        if (child == NULL) {
+            break;
+        }
+        if (S_ISDIR(stat_buf.st_mode)) {
+            sub = malloc(sizeof(struct walk_dir));
+            if (sub == NULL) {
+                free(child);
+                break;
+            }
+            sub->path = child;
+            sub->next = *subdirs;
+            *subdirs = sub;
+            continue;
+        }
+        if (strlen(child) > u->name_max) { // f_msgに載らない名前は送れない
+            DEBUG_MACRO(u->opt.debug_mode, false, "skip %s: name too long", child);
+            pthread_mutex_lock(&u->lock);
+            walker_error(u, ERROR_ARGUMENT, ENAMETOOLONG);
+            pthread_mutex_unlock(&u->lock);
+            free(child);
+            continue;
+        }
+        enqueue_file(u, child, stat_buf.st_size);
+    }
+    closedir(dir);
+}
+
+static void *walk_thread(void *arg) // 辿っていないディレクトリがなくなり、全てのスレッドが読み終えるまで繰り返す
+{
+    struct tree_uploader *u = arg;
+    struct walk_dir *subdirs;
+    struct walk_dir *dir;
+    struct walk_dir *sub;
+
+    pthread_mutex_lock(&u->lock);
+    for (;;) {
+        while (u->pending == NULL && u->busy > 0) {
+            pthread_cond_wait(&u->cond, &u->lock);
+        }
+        if (u->pending == NULL) { // 他のスレッドも読み終えた
+            break;
+        }
+        dir = u->pending;
+        u->pending = dir->next;
+        u->busy++;
+        pthread_mutex_unlock(&u->lock);
+
+        subdirs = NULL;
+        scan_dir(u, dir->path, &subdirs);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&u->lock);
+        while (subdirs != NULL) {
+            sub = subdirs;
+            subdirs = sub->next;
+            sub->next = u->pending;
+            u->pending = sub;
+        }
+        u->busy--;
+        pthread_cond_broadcast(&u->cond); // 辿り終えた場合は、キューを待っている送信側にも知らせる
+    }
+    pthread_mutex_unlock(&u->lock);
+    return NULL;
+}
+
+static enum error_code upload_one(struct tree_uploader *u, int *cfd, const struct tree_file *file, unsigned long long *size)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    char full[PATH_MAX];
+    char remote_name[FILENAME_MAX_LEN];
+    struct stat stat_buf;
+    int fd;
+
+    snprintf(full, sizeof(full), "%s/%s", u->root, file->path);
+    if (*u->prefix == '\0') {
+        snprintf(remote_name, sizeof(remote_name), "%s", file->path);
+    } else {
+        snprintf(remote_name, sizeof(remote_name), "%s/%s", u->prefix, file->path);
+    }
+    fd = open(full, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        ret = ERROR_FILE_OPEN;
+        set_error(ret, errno);
+        return ret;
+    }
+    if (fstat(fd, &stat_buf)) { // 辿った後に書き換えられていても、開いた時点のサイズで送る
+        ret = ERROR_FILE_OPEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    *size = stat_buf.st_size;
+    if (*cfd == -1 && (ret = u->connect(cfd, u->connect_arg))) {
+        *cfd = -1;
+        goto end;
+    }
+    if (u->opt.repair) { // 全体は送らず、異なるチャンクだけを送り直す
+        ret = verify_session(*cfd, fd, remote_name, *size, true, &u->opt);
+        goto end;
+    }
+    if (is_sparse_file(fd)) { // 仮想マシンのイメージなどは穴を除いて送る
+        ret = sparse_session(*cfd, fd, remote_name, *size, &u->opt);
+    } else if ((ret = request_session(*cfd, remote_name, *size, &u->opt)) == NORMAL) {
+        ret = put_session_fd(*cfd, fd, *size, &u->opt);
+    }
+    if (ret == NORMAL && u->opt.verify) {
+        ret = verify_session(*cfd, fd, remote_name, *size, true, &u->opt);
+    }
+end:
+    close(fd);
+    return ret;
+}
+
+static void *upload_thread(void *arg) // 空くたびに、見つかっている中で最も大きいファイルを取って送る
+{
+    struct tree_uploader *u = arg;
+    struct tree_file file;
+    enum error_code ret;
+    unsigned long long size;
+    unsigned int sent; // 今の接続で送ったファイルの数
+    int s_errno;
+    int cfd = -1;
+
+    for (;;) {
+        pthread_mutex_lock(&u->lock);
+        while (u->queue.num == 0 && !walk_done(u)) {
+            pthread_cond_wait(&u->cond, &u->lock);
+        }
+        if (u->queue.num == 0) { // 辿り終えて、送るものも残っていない
+            pthread_mutex_unlock(&u->lock);
+            break;
+        }
+        file = heap_pop(&u->queue);
+        pthread_cond_broadcast(&u->cond); // キューに空きができた
+        pthread_mutex_unlock(&u->lock);
+
+        sent = (cfd == -1) ? 0 : 1;
+        size = 0;
+        while ((ret = upload_one(u, &cfd, &file, &size)) != NORMAL) {
+            if (cfd != -1) { // サーバーは失敗したセッションの接続を閉じる
+                close_file_descriptor(cfd);
+                cfd = -1;
+            }
+            if (sent == 0 || ret == ERROR_FILE_OPEN) { // 維持していた接続が切れていた場合だけ、新しい接続でやり直す
+                break;
+            }
+            clear_error();
+            sent = 0;
+        }
+        if (ret) {
+            get_error(&s_errno);
+            DEBUG_MACRO(u->opt.debug_mode, false, "upload %s failed (%d)", file.path, ret);
+            clear_error();
+        }
+        pthread_mutex_lock(&u->lock);
+        if (ret == NORMAL) {
+            u->uploaded++;
+            u->bytes += size;
+        } else {
+            u->failed++;
+            if (u->ret == NORMAL) {
+                u->ret = ret;
+                u->s_errno = s_errno;
+            }
+        }
+        pthread_mutex_unlock(&u->lock);
+        free(file.path);
+    }
+    if (cfd != -1) {
+        close_file_descriptor(cfd);
+    }
+    return NULL;
+}
+
+static unsigned int start_threads(void *(*func)(void *), void *arg, unsigned int count, pthread_t *tids) // 作成できたスレッドの数を返す
+{
+    unsigned int created = 0;
+
+    while (created < count && pthread_create(&tids[created], NULL, func, arg) == 0) {
+        created++;
+    }
+    return created;
+}
+
+static void join_threads(pthread_t *tids, unsigned int count)
+{
+    while (count > 0) {
+        pthread_join(tids[--count], NULL);
+    }
+}
+
+enum error_code upload_tree(const char *dir_path, const char *prefix, unsigned int jobs, client_connect_fn connect, void *arg, const struct client_option *opt)
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct tree_uploader u;
+    struct walk_dir *root;
+    struct walk_dir *dir;
+    pthread_t walk_tids[TREE_MAX_JOBS];
+    pthread_t upload_tids[TREE_MAX_JOBS];
+    unsigned int walkers;
+    unsigned int uploaders;
+    struct timespec start;
+    struct timespec now;
+    struct timespec zero = {0, 0};
+    sigset_t set;
+    sigset_t old_set;
+
+    if (prefix == NULL) {
+        prefix = "";
+    }
+    if (jobs == 0) {
+        jobs = TREE_DEFAULT_JOBS;
+    }
+    if (jobs > TREE_MAX_JOBS) {
+        jobs = TREE_MAX_JOBS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&u, 0, sizeof(u));
+    u.root = dir_path;
+    u.prefix = prefix;
+    u.name_max = FILENAME_MAX_LEN - 1 - ((*prefix == '\0') ? 0 : strlen(prefix) + 1);
+    u.connect = connect;
+    u.connect_arg = arg;
+    u.opt = *opt;
+    u.opt.keepalive = true; // 接続ごとに複数のファイルを送る
+    pthread_mutex_init(&u.lock, NULL);
+    pthread_cond_init(&u.cond, NULL);
+    u.queue.files = malloc(TREE_QUEUE_FILES * sizeof(struct tree_file));
+    root = calloc(1, sizeof(struct walk_dir));
+    if (u.queue.files == NULL || root == NULL || (root->path = strdup("")) == NULL) {
+        free(root);
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+    u.pending = root;
+
+    // サーバーが1つのセッションを拒否して接続を閉じても、他の接続の送信を続けられるようSIGPIPEで終了させない
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set); // 作成するスレッドにも引き継がれる
+
+    // ディレクトリの読み取りは待ち時間が長いため、送信と同じ数のスレッドで並行して辿る。送信は最初のファイルが見つかった時点で始まる
+    walkers = start_threads(walk_thread, &u, jobs, walk_tids);
+    if (walkers == 0) { // 辿るスレッドがないとキューが埋まらず、送信側が待ち続ける
+        set_error(ERROR_SYSTEM, EAGAIN);
+    } else {
+        uploaders = start_threads(upload_thread, &u, jobs - 1, upload_tids); // 呼び出したスレッドも1つとして数える
+        upload_thread(&u);
+        join_threads(upload_tids, uploaders);
+        join_threads(walk_tids, walkers);
+    }
+    while (sigtimedwait(&set, NULL, &zero) > 0) {
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (walkers == 0) {
+        goto end;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    DEBUG_MACRO(opt->debug_mode, false, "tree: found %llu files, uploaded %llu (%llu bytes), failed %llu, %ld ms with %u jobs", u.found, u.uploaded, u.bytes, u.failed,
+                (long)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000), jobs);
+
+    if (u.ret != NORMAL) {
+        ret = u.ret;
+        set_error(ret, u.s_errno);
+        goto end;
+    }
+    if (u.walk_ret != NORMAL) { // 辿れなかったファイルがある場合は、送れた分を送った上で失敗にする
+        ret = u.walk_ret;
+        set_error(ret, u.walk_errno);
+        goto end;
+    }
+    ret = NORMAL;
+end:
+    while ((dir = u.pending) != NULL) { // 辿る前に終えた場合の残り
+        u.pending = dir->next;
+        free(dir->path);
+        free(dir);
+    }
+    while (u.queue.num > 0) {
+        free(heap_pop(&u.queue).path);
+    }
+    free(u.queue.files);
+    pthread_cond_destroy(&u.cond);
+    pthread_mutex_destroy(&u.lock);
+    return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include "error.h"
+#include "client.h"
+
+#define TREE_DEFAULT_JOBS 4 // 並行して使う接続の既定の数
+#define TREE_MAX_JOBS 64    // 並行して使う接続の上限
+#define TREE_QUEUE_FILES 4096 // 見つけて送っていないファイルを溜める上限（この範囲で大きい順に送る）
+
+/*
+ * ディレクトリ以下の再帰的な送信。複数のスレッドでディレクトリを辿り、見つけたファイルをすぐにキューに入れる
+ * 接続ごとのスレッドは辿り終えるのを待たずに、空くたびにキューの中で最も大きいファイルを取って送る
+ * キューはTREE_QUEUE_FILES個までで、一杯の間は辿るのを待つ（大きい順に並ぶのはキューに入っている範囲で、メモリは木の大きさによらない）
+ * 大きなファイルが最後に残って1つの接続だけが動き続けることを避け、小さなファイルは空いた接続で隙間を埋める。各接続は接続維持セッションで複数のファイルを送る
+ * サーバーでの名前はディレクトリからの相対パス（prefixを指定した場合はその下）で、サーバーが途中のディレクトリを作る
+ */
+
+enum error_code upload_tree(const char *dir_path, const char *prefix, unsigned int jobs, client_connect_fn connect, void *arg, const struct client_option *opt);
+
+#endif // TREE_H
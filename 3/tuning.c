@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "tuning.h"
+
+void tuning_init(struct socket_tuning *t)
+{
+    memset(t, 0, sizeof(struct socket_tuning));
+    t->sndbuf = 0;
+    t->rcvbuf = 0;
+    t->congestion[0] = '\0';
+    t->nodelay = false;
+    t->notsent_lowat = 0;
+    t->quickack = false;
+    t->cork = false;
+    t->autotune_rate = 0;
+    t->fastopen = false;
+}
+
+int tuning_parse(struct socket_tuning *t, const char *spec) // "sndbuf=4M,cc=bbr,nodelay"の形式
+{
+    char buffer[256];
+    char *token;
+    char *save_ptr;
+    char *value;
+
+    if (strlen(spec) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, spec);
+
+    for (token = strtok_r(buffer, ",", &save_ptr); token != NULL; token = strtok_r(NULL, ",", &save_ptr)) {
+        value = strchr(token, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        }
+
+        if (strcmp(token, "nodelay") == 0 && value == NULL) {
+            t->nodelay = true;
+        } else if (strcmp(token, "quickack") == 0 && value == NULL) {
+            t->quickack = true;
+        } else if (strcmp(token, "cork") == 0 && value == NULL) {
+            t->cork = true;
+        } else if (strcmp(token, "fastopen") == 0 && value == NULL) {
+            t->fastopen = true;
+        } else if (value == NULL) {
+            return -1;
+        } else if (strcmp(token, "sndbuf") == 0) {
+            if (parse_size(value, &t->sndbuf)) {
+                return -1;
+            }
+        } else if (strcmp(token, "rcvbuf") == 0) {
+            if (parse_size(value, &t->rcvbuf)) {
+                return -1;
+            }
+        } else if (strcmp(token, "lowat") == 0) {
+            if (parse_size(value, &t->notsent_lowat)) {
+                return -1;
+            }
+        } else if (strcmp(token, "auto") == 0) {
+            if (parse_size(value, &t->autotune_rate)) {
+                return -1;
+            }
+        } else if (strcmp(token, "cc") == 0) {
+            if (*value == '\0' || strlen(value) >= sizeof(t->congestion)) {
+                return -1;
+            }
+            strcpy(t->congestion, value);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int set_buffer(int fd, int force_name, int name, unsigned long long size) // 権限があればrmem_max/wmem_maxを超えて設定する
+{
+    int value = (size > AUTOTUNE_BUFFER_MAX) ? AUTOTUNE_BUFFER_MAX : (int)size;
+
+    if (setsockopt(fd, SOL_SOCKET, force_name, &value, sizeof(value)) == 0) {
+        return 0;
+    }
+    return setsockopt(fd, SOL_SOCKET, name, &value, sizeof(value));
+}
+
+int tuning_apply_before_connect(int fd, const struct socket_tuning *t, bool is_listener) // 接続確立前に設定する項目（リスナーの場合はaccept()したソケットに引き継がれる）
+{
+    int value;
+
+    if (t == NULL) {
+        return 0;
+    }
+    // 受信バッファはウィンドウスケールの決定に使われるため、SYNの送信前に設定する
+    if (t->sndbuf != 0 && set_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, t->sndbuf)) {
+        set_error(ERROR_SOCKET, errno);
+        return -1;
+    }
+    if (t->rcvbuf != 0 && set_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, t->rcvbuf)) {
+        set_error(ERROR_SOCKET, errno);
+        return -1;
+    }
+    if (t->congestion[0] != '\0' &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion))) {
+        set_error(ERROR_SOCKET, errno);
+        return -1;
+    }
+    if (t->fastopen) {
+        // クライアントはconnect()ではSYNを送らず、最初のsend()のデータ（f_msg）をSYNに載せる
+        value = is_listener ? FASTOPEN_QUEUE_LEN : 1;
+        if (setsockopt(fd, IPPROTO_TCP, is_listener ? TCP_FASTOPEN : TCP_FASTOPEN_CONNECT, &value, sizeof(value))) {
+            set_error(ERROR_SOCKET, errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tuning_apply_connected(int fd, const struct socket_tuning *t, bool is_sender, bool debug_mode, bool is_server)
+{
+    int on = 1;
+    int value;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    unsigned long long bdp;
+
+    if (t == NULL) {
+        return 0;
+    }
+    if (t->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+        set_error(ERROR_SOCKET, errno);
+        return -1;
+    }
+    if (t->notsent_lowat != 0) { // 送信キューに溜める未送信データを抑え、バッファを大きくしても遅延が増えないようにする
+        value = (t->notsent_lowat > INT32_MAX) ? INT32_MAX : (int)t->notsent_lowat;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value))) {
+            set_error(ERROR_SOCKET, errno);
+            return -1;
+        }
+    }
+
+    if (t->autotune_rate != 0) { // ハンドシェイクで測定したRTTから帯域幅遅延積を求め、その2倍をバッファとする
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt != 0) {
+            bdp = t->autotune_rate * info.tcpi_rtt / 1000000;
+            bdp *= 2;
+            if (bdp < AUTOTUNE_BUFFER_MIN) {
+                bdp = AUTOTUNE_BUFFER_MIN;
+            }
+            if (is_sender) {
+                set_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, bdp);
+            } else {
+                set_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, bdp);
+            }
+            len = sizeof(value);
+            getsockopt(fd, SOL_SOCKET, is_sender ? SO_SNDBUF : SO_RCVBUF, &value, &len);
+            DEBUG_MACRO(debug_mode, is_server, "autotune: rtt %u us, buffer %llu, effective %d", info.tcpi_rtt, bdp, value);
+        }
+    }
+    return 0;
+}
+
+void tuning_quickack(int fd, const struct socket_tuning *t) // TCP_QUICKACKは一時的なため、応答を待つ直前に毎回設定する
+{
+    int on = 1;
+
+    if (t != NULL && t->quickack) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+}
+
+void tuning_cork(int fd, const struct socket_tuning *t, bool on) // 解除時に溜まっていたデータが送信される
+{
+    int value = on ? 1 : 0;
+
+    if (t != NULL && t->cork) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+#include "api.h"
+
+#define CONGESTION_NAME_LEN 16 // TCP_CA_NAME_MAX
+#define AUTOTUNE_BUFFER_MIN (64 * 1024)
+#define AUTOTUNE_BUFFER_MAX (256 * 1024 * 1024)
+#define FASTOPEN_QUEUE_LEN 256 // Cookie検証前のSYNデータを受け付ける接続数
+
+/*
+ * ソケットの調整項目。--tcpオプションにカンマ区切りで指定する
+ *   sndbuf=4M,rcvbuf=4M  送受信バッファ（0の場合はカーネルの自動調整に任せる）
+ *   cc=bbr               輻輳制御アルゴリズム
+ *   nodelay              制御メッセージをNagleで遅延させない
+ *   lowat=128K           TCP_NOTSENT_LOWAT（未送信データの上限）
+ *   quickack             応答待ちの前に遅延ACKを無効化する
+ *   cork                 データ転送中はTCP_CORKでセグメントをまとめる
+ *   auto=1G              接続後に測定したRTT×指定帯域（バイト/秒）でバッファを決める
+ *   fastopen             TCP Fast Open（f_msgをSYNに載せる。net.ipv4.tcp_fastopenの設定が必要）
+ */
+struct socket_tuning
+{
+    unsigned long long sndbuf;
+    unsigned long long rcvbuf;
+    char congestion[CONGESTION_NAME_LEN];
+    bool nodelay;
+    unsigned long long notsent_lowat;
+    bool quickack;
+    bool cork;
+    unsigned long long autotune_rate; // 0の場合は自動調整しない
+    bool fastopen;
+};
+
+TRANSFER_API void tuning_init(struct socket_tuning *t);
+
+TRANSFER_API int tuning_parse(struct socket_tuning *t, const char *spec);
+
+TRANSFER_API int tuning_apply_before_connect(int fd, const struct socket_tuning *t, bool is_listener);
+
+TRANSFER_API int tuning_apply_connected(int fd, const struct socket_tuning *t, bool is_sender, bool debug_mode, bool is_server);
+
+TRANSFER_API void tuning_quickack(int fd, const struct socket_tuning *t);
+
+TRANSFER_API void tuning_cork(int fd, const struct socket_tuning *t, bool on);
+
+#endif // TUNING_H
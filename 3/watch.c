@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "error.h"
+#include "common.h"
+#include "socket_msg.h"
+#include "crc32c.h"
+#include "client.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR)
+#define WATCH_READ_SIZE (256 * 1024) // ハッシュを計算する際に一度に読む量
+
+struct watch_entry
+{
+    char *path;                 // 監視するディレクトリからの相対パス（サーバーでの名前）
+    bool synced;                // 以下が最後に送った内容を表す
+    unsigned long long size;
+    struct timespec mtime;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    bool hashed;                // hashが送った内容のものである（初めて送る時は読まないため、更新時刻だけが変わった時に求める）
+    bool dirty;                 // 次にまとめて送る対象
+    struct watch_entry *next;       // 同じバケットの次
+    struct watch_entry *next_dirty; // 送る対象の次
+};
+
+struct watcher
+{
+    const char *root;
+    int ifd;
+    char **dirs;                // 監視記述子ごとのディレクトリの相対パス（監視するディレクトリ自身は""）
+    int dir_num;
+    int root_wd;
+    bool root_gone;             // 監視するディレクトリが削除・移動された
+    struct watch_entry *buckets[WATCH_BUCKETS];
+    struct watch_entry *dirty_head;
+    unsigned int dirty_num;
+    struct client_option opt;   // 接続維持を有効にした送信設定
+    client_connect_fn connect;
+    void *connect_arg;
+    int cfd;                    // まとめて送る間だけ接続する（-1の場合は未接続）
+    unsigned long long uploaded;
+    unsigned long long skipped;
+    unsigned long long failed;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct watch_entry *find_entry(struct watcher *w, const char *path) // ない場合は作成する
+{
+    unsigned int bucket = crc32c_update(0, path, strlen(path)) % WATCH_BUCKETS;
+    struct watch_entry *e;
+
+    for (e = w->buckets[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    e = calloc(1, sizeof(struct watch_entry));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->path = strdup(path);
+    if (e->path == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->next = w->buckets[bucket];
+    w->buckets[bucket] = e;
+    return e;
+}
+
+static void mark_dirty(struct watcher *w, const char *path)
+{
+    struct watch_entry *e;
+
+    if (strlen(path) >= FILENAME_MAX_LEN) { // f_msgに載らない名前は送れない
+        DEBUG_MACRO(w->opt.debug_mode, false, "skip %s: name too long", path);
+        return;
+    }
+    e = find_entry(w, path);
+    if (e == NULL || e->dirty) {
+        return;
+    }
+    e->dirty = true;
+    e->next_dirty = w->dirty_head;
+    w->dirty_head = e;
+    w->dirty_num++;
+}
+
+static int add_dir(struct watcher *w, const char *rel) // ディレクトリ以下を監視に加え、含まれるファイルを送る対象にする
+{
+    char full[PATH_MAX];
+    struct dirent *de;
+    struct stat stat_buf;
+    char **dirs;
+    char *child;
+    DIR *dir;
+    int wd;
+
+    snprintf(full, sizeof(full), "%s%s%s", w->root, (*rel == '\0') ? "" : "/", rel);
+    wd = inotify_add_watch(w->ifd, full, WATCH_EVENTS); // 先に監視してから読むことで、読んでいる間に作られたファイルも逃さない
+    if (wd == -1) {
+        return -1;
+    }
+    if (wd >= w->dir_num) {
+        dirs = realloc(w->dirs, (wd + 64) * sizeof(char *));
+        if (dirs == NULL) {
+            return -1;
+        }
+        memset(dirs + w->dir_num, 0, (wd + 64 - w->dir_num) * sizeof(char *));
+        w->dirs = dirs;
+        w->dir_num = wd + 64;
+    }
+    free(w->dirs[wd]); // 同じディレクトリを監視し直した場合は同じ監視記述子が返る
+    w->dirs[wd] = strdup(rel);
+    if (*rel == '\0') {
+        w->root_wd = wd;
+    }
+
+    dir = opendir(full);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        child = join_path(rel, de->d_name);
+        if (child == NULL) {
+            break;
+        }
+        if (de->d_type == DT_UNKNOWN) { // d_typeを返さないファイルシステム
+            snprintf(full, sizeof(full), "%s/%s", w->root, child);
+            if (lstat(full, &stat_buf) == 0) {
+                de->d_type = S_ISDIR(stat_buf.st_mode) ? DT_DIR : S_ISREG(stat_buf.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+        }
+        if (de->d_type == DT_DIR) {
+            add_dir(w, child);
+        } else if (de->d_type == DT_REG) { // シンボリックリンクなどは送らない
+            mark_dirty(w, child);
+        }
+        free(child);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void handle_events(struct watcher *w)
+{
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    char *path;
+
+    len = read(w->ifd, events, sizeof(events));
+    for (p = events; len > 0 && p < events + len; p += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event *)p;
+        if (ev->mask & IN_Q_OVERFLOW) { // 通知が溢れた場合は全体を調べ直す（変わっていないファイルは状態の比較で送らない）
+            DEBUG_MACRO(w->opt.debug_mode, false, "inotify queue overflow, rescan");
+            add_dir(w, "");
+            continue;
+        }
+        if (ev->wd < 0 || ev->wd >= w->dir_num || w->dirs[ev->wd] == NULL) {
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) { // ディレクトリが削除された
+            if (ev->wd == w->root_wd) {
+                w->root_gone = true;
+            }
+            free(w->dirs[ev->wd]);
+            w->dirs[ev->wd] = NULL;
+            continue;
+        }
+        if (ev->len == 0) {
+            continue;
+        }
+        path = join_path(w->dirs[ev->wd], ev->name);
+        if (path == NULL) {
+            continue;
+        }
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) { // 新しいディレクトリは中身ごと加える
+            add_dir(w, path);
+        } else if (!(ev->mask & IN_ISDIR) && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) { // 書き込み中のファイルは閉じられてから送る
+            mark_dirty(w, path);
+        }
+        free(path);
+    }
+}
+
+static int hash_file(int fd, unsigned char *hash) // ファイル全体のSHA-256
+{
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    ssize_t read_bytes;
+    int ret = -1;
+
+    buffer = malloc(WATCH_READ_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        goto end;
+    }
+    while ((read_bytes = read(fd, buffer, WATCH_READ_SIZE)) != 0) {
+        if (read_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto end;
+        }
+        EVP_DigestUpdate(ctx, buffer, read_bytes);
+    }
+    if (EVP_DigestFinal_ex(ctx, hash, NULL) != 1 || lseek(fd, 0, SEEK_SET) == -1) {
+        goto end;
+    }
+    ret = 0;
+end:
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+    return ret;
+}
+
+static enum error_code upload_entry(struct watcher *w, struct watch_entry *e, int fd, unsigned long long size)
+{
+    enum error_code ret = ERROR_SYSTEM;
+
+    if (w->cfd == -1 && (ret = w->connect(&w->cfd, w->connect_arg))) {
+        w->cfd = -1;
+        return ret;
+    }
+    if ((ret = request_session(w->cfd, e->path, size, &w->opt))) {
+        goto end;
+    }
+    ret = put_session_fd(w->cfd, fd, size, &w->opt); // 小さなファイルは--optimisticなら③の応答を待たずに続けて送る
+end:
+    if (ret) { // サーバーは失敗したセッションの接続を閉じるため、残りは接続し直して送る
+        close_file_descriptor(w->cfd);
+        w->cfd = -1;
+    }
+    return ret;
+}
+
+static bool same_stat(const struct stat *a, const struct stat *b) // サイズと更新時刻が同じ
+{
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static bool sync_entry(struct watcher *w, struct watch_entry *e) // 変更されていれば送る（失敗した場合はfalse）
+{
+    char full[PATH_MAX];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    struct stat stat_buf;
+    struct stat after;
+    enum error_code ret;
+    bool hashed = false;
+    int fd;
+
+    snprintf(full, sizeof(full), "%s/%s", w->root, e->path);
+    fd = open(full, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) { // 送る前に削除・移動された
+        return true;
+    }
+    if (fstat(fd, &stat_buf) || !S_ISREG(stat_buf.st_mode)) {
+        close(fd);
+        return true;
+    }
+    if (e->synced && e->size == (unsigned long long)stat_buf.st_size &&
+        e->mtime.tv_sec == stat_buf.st_mtim.tv_sec && e->mtime.tv_nsec == stat_buf.st_mtim.tv_nsec) { // 読まずに同じと判断する
+        w->skipped++;
+        close(fd);
+        return true;
+    }
+    if (e->synced && e->size == (unsigned long long)stat_buf.st_size) { // サイズが同じ場合だけ、更新時刻だけが変わったのかを内容で確かめる
+        if (hash_file(fd, hash)) {
+            close(fd);
+            return false;
+        }
+        hashed = true;
+        if (e->hashed && memcmp(e->hash, hash, sizeof(hash)) == 0) {
+            e->mtime = stat_buf.st_mtim;
+            w->skipped++;
+            close(fd);
+            return true;
+        }
+    }
+
+    ret = upload_entry(w, e, fd, stat_buf.st_size);
+    if (ret == NORMAL && (fstat(fd, &after) || !same_stat(&stat_buf, &after))) { // 読み始めてから送り終えるまでに書き換えられた
+        DEBUG_MACRO(w->opt.debug_mode, false, "%s changed while uploading, retry", e->path);
+        e->synced = false; // 送った内容も求めたハッシュも、今の内容と一致するとは限らない
+        close(fd);
+        return false;
+    }
+    close(fd);
+    if (ret) {
+        DEBUG_MACRO(w->opt.debug_mode, false, "upload %s failed (%d)", e->path, ret);
+        clear_error();
+        w->failed++;
+        return false;
+    }
+    DEBUG_MACRO(w->opt.debug_mode, false, "uploaded %s (%llu bytes)", e->path, (unsigned long long)stat_buf.st_size);
+    e->synced = true;
+    e->size = stat_buf.st_size;
+    e->mtime = stat_buf.st_mtim;
+    e->hashed = hashed; // サイズと更新時刻が送る間変わらなかったため、ハッシュは送った内容のもの
+    if (hashed) {
+        memcpy(e->hash, hash, sizeof(hash));
+    }
+    w->uploaded++;
+    return true;
+}
+
+static void flush_dirty(struct watcher *w) // 送る対象をまとめて1つの接続で送る
+{
+    struct watch_entry *list = w->dirty_head;
+    struct watch_entry *retry = NULL;
+    struct watch_entry *e;
+
+    w->dirty_head = NULL;
+    w->dirty_num = 0;
+    while (list != NULL) {
+        e = list;
+        list = e->next_dirty;
+        e->dirty = false;
+        if (!sync_entry(w, e)) { // 失敗したファイルは次の送信でやり直す
+            e->next_dirty = retry;
+            retry = e;
+        }
+    }
+    if (w->cfd != -1) { // 次の変更まで接続を保持しない
+        close_file_descriptor(w->cfd);
+        w->cfd = -1;
+    }
+    while (retry != NULL) {
+        e = retry;
+        retry = e->next_dirty;
+        mark_dirty(w, e->path);
+    }
+    DEBUG_MACRO(w->opt.debug_mode, false, "sync: uploaded %llu, skipped %llu, failed %llu", w->uploaded, w->skipped, w->failed);
+}
+
+static void free_watcher(struct watcher *w)
+{
+    struct watch_entry *e;
+    struct watch_entry *next;
+    int i;
+
+    for (i = 0; i < WATCH_BUCKETS; i++) {
+        for (e = w->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+    for (i = 0; i < w->dir_num; i++) {
+        free(w->dirs[i]);
+    }
+    free(w->dirs);
+    if (w->ifd != -1) {
+        close(w->ifd);
+    }
+    if (w->cfd != -1) {
+        close_file_descriptor(w->cfd);
+    }
+}
+
+enum error_code watch_directory(const char *dir_path, unsigned int debounce_ms, client_connect_fn connect, void *arg, const struct client_option *opt) // 監視するディレクトリが削除されるまで戻らない
+{
+    enum error_code ret = ERROR_SYSTEM;
+    struct watcher *w;
+    struct pollfd pfd;
+    long long first_change = 0; // 送る対象ができた時刻
+    long long last_change = 0;  // 最後に通知を受けた時刻
+    long long deadline;
+    int timeout;
+
+    w = calloc(1, sizeof(struct watcher));
+    if (w == NULL) {
+        set_error(ERROR_SYSTEM, errno);
+        return ERROR_SYSTEM;
+    }
+    w->root = dir_path;
+    w->opt = *opt;
+    w->opt.keepalive = true; // まとめて送る間は1つの接続を使い続ける
+    w->connect = connect;
+    w->connect_arg = arg;
+    w->cfd = -1;
+    if (debounce_ms == 0) {
+        debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+    }
+
+    w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->ifd == -1) {
+        set_error(ERROR_SYSTEM, errno);
+        goto end;
+    }
+    if (add_dir(w, "")) { // 最初は全体を送る対象にする
+        ret = ERROR_FILE_OPEN;
+        set_error(ret, errno);
+        goto end;
+    }
+    first_change = last_change = now_ms();
+
+    pfd.fd = w->ifd;
+    pfd.events = POLLIN;
+    while (!w->root_gone) {
+        timeout = -1;
+        if (w->dirty_num > 0) { // 変更が途切れるか、待ち始めてから上限が経てば送る
+            deadline = last_change + debounce_ms;
+            if (deadline > first_change + (long long)debounce_ms * WATCH_MAX_DELAY_FACTOR) {
+                deadline = first_change + (long long)debounce_ms * WATCH_MAX_DELAY_FACTOR;
+            }
+            timeout = (deadline > now_ms()) ? (int)(deadline - now_ms()) : 0;
+        }
+        if (poll(&pfd, 1, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            set_error(ERROR_SYSTEM, errno);
+            goto end;
+        }
+        if (pfd.revents & POLLIN) {
+            if (w->dirty_num == 0) {
+                first_change = now_ms();
+            }
+            handle_events(w);
+            last_change = now_ms();
+            continue;
+        }
+        if (w->dirty_num > 0) {
+            flush_dirty(w);
+            first_change = last_change = now_ms();
+        }
+    }
+    ret = NORMAL;
+end:
+    free_watcher(w);
+    free(w);
+    return ret;
+}
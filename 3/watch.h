@@ -0,0 +1,19 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "error.h"
+#include "client.h"
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 500 // 最後の変更からアップロードを始めるまで待つ時間
+#define WATCH_MAX_DELAY_FACTOR 10     // 変更が続く場合も、最初の変更からdebounceのこの倍数が経てば送る
+#define WATCH_BUCKETS 4096            // 送信済みのファイルの状態を引くハッシュ表の大きさ
+
+/*
+ * ディレクトリの監視。inotifyでディレクトリ以下の書き込み完了と移動を受け取り、変更が落ち着いてから
+ * 変更されたファイルだけを1つの接続維持セッションでまとめて送る。サーバーでの名前は監視するディレクトリからの相対パス
+ * サイズと更新時刻が前回送った時と同じファイルは読まずに、更新時刻だけが変わったファイルは内容のSHA-256が同じなら送らない
+ */
+
+enum error_code watch_directory(const char *dir_path, unsigned int debounce_ms, client_connect_fn connect, void *arg, const struct client_option *opt);
+
+#endif // WATCH_H
@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wfq.h"
+
+static const unsigned int default_weight[PRIORITY_CLASS_NUM] = {8, 4, 1};
+
+void wfq_init(struct wfq *q, unsigned int slots)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    q->slots = (slots == 0) ? 1 : slots;
+    q->busy = 0;
+    q->virtual_time = 0;
+    memcpy(q->weight, default_weight, sizeof(q->weight));
+    memset(q->last_finish, 0, sizeof(q->last_finish));
+    q->waiters = NULL;
+}
+
+int wfq_set_weights(struct wfq *q, const char *weights) // "8,4,1"の形式でクラスごとの重みを指定
+{
+    unsigned int parsed[PRIORITY_CLASS_NUM];
+    const char *p = weights;
+    char *end_ptr;
+    int i;
+
+    for (i = 0; i < PRIORITY_CLASS_NUM; i++) {
+        parsed[i] = (unsigned int)strtoul(p, &end_ptr, 10);
+        if (end_ptr == p || parsed[i] == 0) {
+            return -1;
+        }
+        if (i < PRIORITY_CLASS_NUM - 1) {
+            if (*end_ptr != ',') {
+                return -1;
+            }
+            p = end_ptr + 1;
+        } else if (*end_ptr != '\0') {
+            return -1;
+        }
+    }
+    memcpy(q->weight, parsed, sizeof(q->weight));
+    return 0;
+}
+
+static double finish_tag(struct wfq *q, int priority, size_t cost)
+{
+    double start = q->last_finish[priority];
+
+    if (start < q->virtual_time) { // アイドルだったクラスが過去の分を取り戻さないようにする
+        start = q->virtual_time;
+    }
+    q->last_finish[priority] = start + (double)cost / q->weight[priority];
+    return q->last_finish[priority];
+}
+
+void wfq_acquire(struct wfq *q, int priority, size_t cost)
+{
+    struct wfq_waiter self;
+    struct wfq_waiter **link;
+
+    if (priority < 0 || priority >= PRIORITY_CLASS_NUM) {
+        priority = DEFAULT_PRIORITY_CLASS;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    self.finish = finish_tag(q, priority, cost);
+
+    if (q->busy < q->slots && q->waiters == NULL) { // 空きがあれば即座に処理する
+        q->busy++;
+        q->virtual_time = self.finish; // 自己クロック方式(SCFQ)：処理中の作業の終了時刻を仮想時刻とする
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    // 仮想終了時刻の順に待ち行列へ挿入し、releaseで順番が来るまで待つ
+    self.granted = false;
+    pthread_cond_init(&self.cond, NULL);
+    for (link = &q->waiters; *link != NULL && (*link)->finish <= self.finish; link = &(*link)->next) {
+    }
+    self.next = *link;
+    *link = &self;
+
+    while (!self.granted) {
+        pthread_cond_wait(&self.cond, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_destroy(&self.cond);
+}
+
+void wfq_release(struct wfq *q)
+{
+    struct wfq_waiter *next;
+
+    pthread_mutex_lock(&q->lock);
+    next = q->waiters;
+    if (next != NULL) { // 空いた枠を仮想終了時刻が最も小さい待ちに譲る
+        q->waiters = next->next;
+        q->virtual_time = next->finish;
+        next->granted = true;
+        pthread_cond_signal(&next->cond);
+    } else if (q->busy > 0) {
+        q->busy--;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,38 @@
+#ifndef WFQ_H
+#define WFQ_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PRIORITY_CLASS_NUM 3     // 0:interactive 1:normal 2:bulk
+#define DEFAULT_PRIORITY_CLASS 1
+
+struct wfq_waiter
+{
+    double finish; // 仮想終了時刻（小さいものから処理する）
+    bool granted;
+    pthread_cond_t cond;
+    struct wfq_waiter *next;
+};
+
+struct wfq
+{
+    pthread_mutex_t lock;
+    unsigned int slots; // 同時に処理できる作業数
+    unsigned int busy;
+    double virtual_time;
+    unsigned int weight[PRIORITY_CLASS_NUM];
+    double last_finish[PRIORITY_CLASS_NUM];
+    struct wfq_waiter *waiters; // 仮想終了時刻の昇順
+};
+
+void wfq_init(struct wfq *q, unsigned int slots);
+
+int wfq_set_weights(struct wfq *q, const char *weights);
+
+void wfq_acquire(struct wfq *q, int priority, size_t cost);
+
+void wfq_release(struct wfq *q);
+
+#endif // WFQ_H